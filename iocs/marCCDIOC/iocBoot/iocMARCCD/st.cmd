@@ -20,7 +20,22 @@ asynOctetSetOutputEos("marServer", 0, "\n")
 #asynSetTraceMask("marServer",0,255)
 asynSetTraceIOMask("marServer",0,2)
 
-marCCDConfig("$(PORT)", "marServer", 0, 0)
+# The last argument is an optional file that caches the server mode and geometry across restarts
+marCCDConfig("$(PORT)", "marServer", 0, 0, 0, 0, "marCCDConfig.cache")
+# Uncomment to publish frames to the shared memory ring /marccd, 16 slots of 32 MB, overwriting when full
+#marCCDShmRingConfig("$(PORT)", "marccd", 16, 32, 0)
+# Uncomment to stream frames to TCP clients on port 5700 of 127.0.0.1, queueing up to 4 frames per client.
+# Give the address of an interface as the last argument to serve other hosts.
+#marCCDStreamConfig("$(PORT)", 5700, 4, "127.0.0.1")
+# Uncomment to end exposures from a SCHED_FIFO thread at priority 80; needs CAP_SYS_NICE or an rtprio limit
+#marCCDTimerConfig("$(PORT)", 80)
+# Uncomment to pin the reader thread and the workers to the CPUs of NUMA node 0; "marCCDThreads" lists them
+#marCCDThreadConfig("marCCDTask", -1, "0-7")
+#marCCDThreadConfig("marCCDWorker*", -1, "0-7")
+# Uncomment to record the conversation with the marccd server, for replay with marCCDReplayServer
+#marCCDProtocolLogStart("marCCD.plog")
+# Uncomment to serve Prometheus metrics at http://127.0.0.1:9110/metrics
+#marCCDMetricsConfig("$(PORT)", "", 9110)
 dbLoadRecords("$(ADCORE)/db/ADBase.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
 dbLoadRecords("$(ADCORE)/db/NDFile.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
 dbLoadRecords("$(ADMARCCD)/db/marCCD.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1,MARSERVER_PORT=marServer")
@@ -31,6 +46,17 @@ dbLoadRecords("$(ADCORE)/db/NDPluginBase.template","P=$(PREFIX),R=image1:,PORT=I
 # Make NELEMENTS in the following be a little bigger than 2048*2048
 dbLoadRecords("$(ADCORE)/db/NDStdArrays.template", "P=$(PREFIX),R=image1:,PORT=Image1,ADDR=0,TIMEOUT=1,TYPE=Int16,FTVL=SHORT,NELEMENTS=4200000")
 
+# Create a standard arrays plugin for the azimuthally integrated profiles on address 1
+NDStdArraysConfigure("Radial1", 5, 0, "$(PORT)", 1, 0)
+dbLoadRecords("$(ADCORE)/db/NDPluginBase.template","P=$(PREFIX),R=radial1:,PORT=Radial1,ADDR=0,TIMEOUT=1,NDARRAY_PORT=$(PORT),NDARRAY_ADDR=1")
+dbLoadRecords("$(ADCORE)/db/NDStdArrays.template", "P=$(PREFIX),R=radial1:,PORT=Radial1,ADDR=0,TIMEOUT=1,TYPE=Float64,FTVL=DOUBLE,NELEMENTS=$(NCHANS)")
+
+# Create a standard arrays plugin for the binned previews on address 2
+NDStdArraysConfigure("Preview1", 5, 0, "$(PORT)", 2, 0)
+dbLoadRecords("$(ADCORE)/db/NDPluginBase.template","P=$(PREFIX),R=preview1:,PORT=Preview1,ADDR=0,TIMEOUT=1,NDARRAY_PORT=$(PORT),NDARRAY_ADDR=2")
+# Make NELEMENTS in the following be a little bigger than 1024*1024, for 2x2 binning of 2048*2048
+dbLoadRecords("$(ADCORE)/db/NDStdArrays.template", "P=$(PREFIX),R=preview1:,PORT=Preview1,ADDR=0,TIMEOUT=1,TYPE=Int16,FTVL=SHORT,NELEMENTS=1100000")
+
 # Load all other plugins using commonPlugins.cmd
 < $(ADCORE)/iocBoot/commonPlugins.cmd
 set_requestfile_path("$(ADMARCCD)/marCCDApp/Db")
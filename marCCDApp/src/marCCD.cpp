@@ -20,12 +20,12 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <tiffio.h>
 
 #include <epicsTime.h>
 #include <epicsThread.h>
 #include <epicsEvent.h>
-#include <epicsTimer.h>
 #include <epicsMutex.h>
 #include <epicsStdlib.h>
 #include <epicsString.h>
@@ -38,6 +38,22 @@
 #include <asynOctetSyncIO.h>
 
 #include "ADDriver.h"
+#include "marCCDTrace.h"
+#include "marCCDWorkers.h"
+#include "marCCDRadial.h"
+#include "marCCDSpots.h"
+#include "marCCDBin.h"
+#include "marCCDShmRing.h"
+#include "marCCDStream.h"
+#include "marCCDCodec.h"
+#include "marCCDCorrect.h"
+#include "marCCDRemap.h"
+#include "marCCDTiff.h"
+#include "marCCDTimer.h"
+#include "marCCDThreads.h"
+#include "marCCDProtocolLog.h"
+#include "marCCDMetrics.h"
+#include "marCCDJobs.h"
 
 /** Messages to/from server */
 #define MAX_MESSAGE_SIZE 256
@@ -46,6 +62,20 @@
 /** Time between checking to see if TIFF file is complete */
 #define FILE_READ_DELAY .01
 #define MARCCD_POLL_DELAY .01
+/** Time between checks for a free slot in the shared memory ring */
+#define MARCCD_SHM_POLL_DELAY .001
+#define MARCCD_IMAGE_QUEUE_SIZE 16  /**< Frames queued for getImageDataTask whose file names and times are kept */
+#define MARCCD_ABORT_TIMEOUT 10.  /**< Longest time to wait for the server and image task to go idle after an abort */
+#define MARCCD_CONNECT_MIN_DELAY 0.5  /**< First delay between attempts to connect to the server */
+#define MARCCD_CONNECT_MAX_DELAY 30.  /**< The delay doubles after each failed attempt up to this */
+/** Maximum number of worker threads for processing frames */
+#define MAX_WORKER_THREADS 16
+
+/** asyn addresses for the NDArray callbacks */
+#define MARCCD_ADDR_FRAME   0   /**< Frames read from the TIFF files */
+#define MARCCD_ADDR_RADIAL  1   /**< Azimuthally integrated profiles */
+#define MARCCD_ADDR_PREVIEW 2   /**< Binned previews of the frames */
+#define MARCCD_NUM_ADDR     3
 
 /** Task numbers */
 #define TASK_ACQUIRE     0
@@ -90,6 +120,8 @@ typedef enum {
     marCCDFrameRaw,
     marCCDFrameDoubleCorrelation
 } marCCDFrameType_t;
+static const char *frameTypeStrings[] =
+    {"Normal", "Background", "Raw", "Double correlation"};
 
 typedef enum {
     marCCDImageSingle = ADImageSingle,
@@ -130,6 +162,48 @@ static const char *readoutModeStrings[] =
     {"Standard", "High gain", "Low noise", "HDR"};
 static const int numReadoutModes[] = {0, 0, 4};
 
+typedef enum {
+    marCCDPoolBlock,
+    marCCDPoolDrop,
+    marCCDPoolPreview
+} marCCDPoolPolicy_t;
+
+typedef enum {
+    marCCDRingDumpCallbacks,
+    marCCDRingDumpFiles
+} marCCDRingDumpMode_t;
+
+typedef enum {
+    marCCDVetoOff,
+    marCCDVetoCallbacks,
+    marCCDVetoDelete
+} marCCDVetoMode_t;
+
+typedef enum {
+    marCCDDezingerServer,
+    marCCDDezingerIOC
+} marCCDDezingerMode_t;
+
+typedef enum {
+    marCCDCorrectServer,
+    marCCDCorrectIOC
+} marCCDCorrectMode_t;
+
+/** Header fields that can have a value for each frame */
+typedef enum {
+    marCCDSeqFieldPhi,
+    marCCDSeqFieldDistance,
+    marCCDSeqFieldTwoTheta,
+    marCCDSeqFieldWavelength,
+    marCCDNumSeqFields
+} marCCDSeqField_t;
+
+typedef enum {
+    marCCDReadNormal,
+    marCCDReadDontNeed,
+    marCCDReadDirect
+} marCCDReadMode_t;
+
 #define marCCDGateModeString           "MAR_GATE_MODE"
 #define marCCDReadoutModeString        "MAR_READOUT_MODE"
 #define marCCDServerModeString         "MAR_SERVER_MODE"
@@ -158,10 +232,124 @@ static const int numReadoutModes[] = {0, 0, 4};
 #define marCCDWavelengthString         "MAR_WAVELENGTH"
 #define marCCDFileCommentsString       "MAR_FILE_COMMENTS"
 #define marCCDDatasetCommentsString    "MAR_DATASET_COMMENTS"
+#define marCCDStatusRateString         "MAR_STATUS_RATE"
+#define marCCDRingSizeString           "MAR_RING_SIZE"
+#define marCCDRingMaxMemoryString      "MAR_RING_MAX_MEMORY"
+#define marCCDRingNumFramesString      "MAR_RING_NUM_FRAMES"
+#define marCCDRingDumpModeString       "MAR_RING_DUMP_MODE"
+#define marCCDRingDumpString           "MAR_RING_DUMP"
+#define marCCDPoolPolicyString         "MAR_POOL_POLICY"
+#define marCCDPoolStallsString         "MAR_POOL_STALLS"
+#define marCCDPoolStallTimeString      "MAR_POOL_STALL_TIME"
+#define marCCDPoolDropsString          "MAR_POOL_DROPS"
+#define marCCDPoolPreviewsString       "MAR_POOL_PREVIEWS"
+#define marCCDNumThreadsString         "MAR_NUM_THREADS"
+#define marCCDPixelSizeString          "MAR_PIXEL_SIZE"
+#define marCCDRadialEnableString       "MAR_RADIAL_ENABLE"
+#define marCCDRadialNumBinsString      "MAR_RADIAL_NUM_BINS"
+#define marCCDRadialQMaxString         "MAR_RADIAL_Q_MAX"
+#define marCCDRadialTimeString         "MAR_RADIAL_TIME"
+#define marCCDSpotEnableString         "MAR_SPOT_ENABLE"
+#define marCCDSpotSigmaString          "MAR_SPOT_SIGMA"
+#define marCCDSpotMinPixelsString      "MAR_SPOT_MIN_PIXELS"
+#define marCCDSpotCountString          "MAR_SPOT_COUNT"
+#define marCCDSpotTimeString           "MAR_SPOT_TIME"
+#define marCCDHitThresholdString       "MAR_HIT_THRESHOLD"
+#define marCCDHitCountString           "MAR_HIT_COUNT"
+#define marCCDVetoModeString           "MAR_VETO_MODE"
+#define marCCDVetoCountString          "MAR_VETO_COUNT"
+#define marCCDPreviewBinString         "MAR_PREVIEW_BIN"
+#define marCCDPreviewRateString        "MAR_PREVIEW_RATE"
+#define marCCDShmEnableString          "MAR_SHM_ENABLE"
+#define marCCDShmFramesString          "MAR_SHM_FRAMES"
+#define marCCDShmDropsString           "MAR_SHM_DROPS"
+#define marCCDShmBlockTimeoutString    "MAR_SHM_BLOCK_TIMEOUT"
+#define marCCDStreamEnableString       "MAR_STREAM_ENABLE"
+#define marCCDStreamCodecString        "MAR_STREAM_CODEC"
+#define marCCDStreamClientsString      "MAR_STREAM_CLIENTS"
+#define marCCDStreamDropsString        "MAR_STREAM_DROPS"
+#define marCCDStreamRateString         "MAR_STREAM_RATE"
+#define marCCDBadPixelFileString       "MAR_BAD_PIXEL_FILE"
+#define marCCDBadPixelEnableString     "MAR_BAD_PIXEL_ENABLE"
+#define marCCDBadPixelValueString      "MAR_BAD_PIXEL_VALUE"
+#define marCCDBadPixelCountString      "MAR_BAD_PIXEL_COUNT"
+#define marCCDDezingerModeString       "MAR_DEZINGER_MODE"
+#define marCCDDezingerSigmaString      "MAR_DEZINGER_SIGMA"
+#define marCCDZingerCountString        "MAR_ZINGER_COUNT"
+#define marCCDCorrectTimeString        "MAR_CORRECT_TIME"
+#define marCCDCorrectModeString        "MAR_CORRECT_MODE"
+#define marCCDRemapFileString          "MAR_REMAP_FILE"
+#define marCCDRemapEntriesString       "MAR_REMAP_ENTRIES"
+#define marCCDConnectedString          "MAR_CONNECTED"
+#define marCCDReconnectsString         "MAR_RECONNECTS"
+#define marCCDReadModeString           "MAR_READ_MODE"
+#define marCCDReadaheadString          "MAR_READAHEAD"
+#define marCCDBytesReadString          "MAR_BYTES_READ"
+#define marCCDCacheHitString           "MAR_CACHE_HIT"
+#define marCCDReplayString             "MAR_REPLAY"
+#define marCCDReplayTemplateString     "MAR_REPLAY_TEMPLATE"
+#define marCCDReplayRateString         "MAR_REPLAY_RATE"
+#define marCCDReplayFrameRateString    "MAR_REPLAY_FRAME_RATE"
+#define marCCDReplayDataRateString     "MAR_REPLAY_DATA_RATE"
+#define marCCDReplayBacklogString      "MAR_REPLAY_BACKLOG"
+#define marCCDCallbackLatencyString    "MAR_CALLBACK_LATENCY"
+#define marCCDExposureErrorString      "MAR_EXPOSURE_ERROR"
+#define marCCDExposureErrorMeanString  "MAR_EXPOSURE_ERROR_MEAN"
+#define marCCDExposureErrorStdString   "MAR_EXPOSURE_ERROR_STD"
+#define marCCDExposureErrorMaxString   "MAR_EXPOSURE_ERROR_MAX"
+#define marCCDTimerLatenessString      "MAR_TIMER_LATENESS"
+#define marCCDStartLatencyString       "MAR_START_LATENCY"
+#define marCCDCompressString           "MAR_COMPRESS"
+#define marCCDCompressRatioString      "MAR_COMPRESS_RATIO"
+#define marCCDCompressRateString       "MAR_COMPRESS_RATE"
+#define marCCDAbortString              "MAR_ABORT"
+#define marCCDAbortLatencyString       "MAR_ABORT_LATENCY"
+#define marCCDJobSubmitString          "MAR_JOB_SUBMIT"
+#define marCCDJobFileString            "MAR_JOB_FILE"
+#define marCCDJobRunString             "MAR_JOB_RUN"
+#define marCCDJobClearString           "MAR_JOB_CLEAR"
+#define marCCDJobsQueuedString         "MAR_JOBS_QUEUED"
+#define marCCDJobsDoneString           "MAR_JOBS_DONE"
+#define marCCDJobIdString              "MAR_JOB_ID"
+#define marCCDJobLabelString           "MAR_JOB_LABEL"
+#define marCCDJobStateString           "MAR_JOB_STATE"
+#define marCCDJobMessageString         "MAR_JOB_MESSAGE"
+#define marCCDJobHistoryString         "MAR_JOB_HISTORY"
+#define marCCDHeaderSequenceString     "MAR_HEADER_SEQUENCE"
+#define marCCDHeaderFrameString        "MAR_HEADER_FRAME"
+#define marCCDHeaderPhiString          "MAR_HEADER_PHI"
+#define marCCDSeqPhiString             "MAR_SEQ_PHI"
+#define marCCDSeqDistanceString        "MAR_SEQ_DISTANCE"
+#define marCCDSeqTwoThetaString        "MAR_SEQ_TWO_THETA"
+#define marCCDSeqWavelengthString      "MAR_SEQ_WAVELENGTH"
 
 
 static const char *driverName = "marCCD";
 
+/** A frame in the ring of recently read frames.  The ring owns the pixels, so it does not take
+  * buffers from the NDArrayPool that the driver and the plugins need. */
+typedef struct {
+    void *pData;
+    size_t dataSize;            /**< Bytes allocated for pData */
+    size_t dims[2];
+    NDDataType_t dataType;
+    int uniqueId;
+    double timeStamp;
+    epicsTimeStamp epicsTS;
+    NDAttributeList *pAttributeList;
+} marCCDRingFrame;
+
+/** What getImageData needs to know about a frame that is not in the file.  It is captured when the
+  * frame is read out, because in Overlap mode the next frame has changed the parameters and members
+  * by the time the frame is read. */
+typedef struct {
+    char fullFileName[MAX_FILENAME_LEN];
+    int uniqueId;
+    epicsTimeStamp frameStart;
+    epicsTimeStamp frameEnd;
+    int frameTimeFromFile;      /**< frameStart and frameEnd are not known; use the time the file was closed */
+} marCCDImageFrame;
+
 /** Driver for marCCD (Rayonix) CCD detector; communicates with the marCCD program over a TCP/IP
   * socket with the marccd_server_socket program that they distribute.
   * The marCCD program must be set into Acquire/Remote Control/Start to use this driver. 
@@ -170,18 +358,28 @@ class marCCD : public ADDriver {
 public:
     marCCD(const char *portName, const char *marCCDPort,
            int maxBuffers, size_t maxMemory,
-           int priority, int stackSize);
+           int priority, int stackSize, const char *configCacheFile);
                  
     /* These are the methods that we override from ADDriver */
+    virtual asynStatus lock();
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual);
+    virtual asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements);
+    virtual asynStatus readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn);
     virtual asynStatus readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], 
                             size_t nElements, size_t *nIn);
     virtual void setShutter(int open);
     virtual void report(FILE *fp, int details);
     void marCCDTask();          /**< This should be private but is called from C, must be public */
     void getImageDataTask();    /**< This should be private but is called from C, must be public */
+    void connectTask();         /**< This should be private but is called from C, must be public */
+    asynStatus configShmRing(const char *shmName, int numSlots, int maxSizeMB, int policy);
+    asynStatus configStream(const char *interfaceName, int tcpPort, int queueSize);
+    asynStatus configTimer(int priority);
+    asynStatus configMetrics(const char *interfaceName, int tcpPort);
     epicsEventId stopEventId;   /**< This should be private but is accessed from C, must be public */
+    epicsEventId connectEventId;/**< This should be private but is accessed from C, must be public */
 
 protected:
     int marCCDGateMode;
@@ -213,43 +411,264 @@ protected:
     int marCCDWavelength;
     int marCCDFileComments;
     int marCCDDatasetComments;
-    #define LAST_MARCCD_PARAM marCCDDatasetComments
+    int marCCDStatusRate;
+    int marCCDRingSize;
+    int marCCDRingMaxMemory;
+    int marCCDRingNumFrames;
+    int marCCDRingDumpMode;
+    int marCCDRingDump;
+    int marCCDPoolPolicy;
+    int marCCDPoolStalls;
+    int marCCDPoolStallTime;
+    int marCCDPoolDrops;
+    int marCCDPoolPreviews;
+    int marCCDNumThreads;
+    int marCCDPixelSize;
+    int marCCDRadialEnable;
+    int marCCDRadialNumBins;
+    int marCCDRadialQMax;
+    int marCCDRadialTime;
+    int marCCDSpotEnable;
+    int marCCDSpotSigma;
+    int marCCDSpotMinPixels;
+    int marCCDSpotCount;
+    int marCCDSpotTime;
+    int marCCDHitThreshold;
+    int marCCDHitCount;
+    int marCCDVetoMode;
+    int marCCDVetoCount;
+    int marCCDPreviewBin;
+    int marCCDPreviewRate;
+    int marCCDShmEnable;
+    int marCCDShmBlockTimeout;
+    int marCCDShmFrames;
+    int marCCDShmDrops;
+    int marCCDStreamEnable;
+    int marCCDStreamCodec;
+    int marCCDStreamClients;
+    int marCCDStreamDrops;
+    int marCCDStreamRate;
+    int marCCDBadPixelFile;
+    int marCCDBadPixelEnable;
+    int marCCDBadPixelValue;
+    int marCCDBadPixelCount;
+    int marCCDDezingerMode;
+    int marCCDDezingerSigma;
+    int marCCDZingerCount;
+    int marCCDCorrectTime;
+    int marCCDCorrectMode;
+    int marCCDRemapFile;
+    int marCCDRemapEntries;
+    int marCCDConnected;
+    int marCCDReconnects;
+    int marCCDReadMode;
+    int marCCDReadahead;
+    int marCCDBytesRead;
+    int marCCDCacheHit;
+    int marCCDReplay;
+    int marCCDReplayTemplate;
+    int marCCDReplayRate;
+    int marCCDReplayFrameRate;
+    int marCCDReplayDataRate;
+    int marCCDReplayBacklog;
+    int marCCDCallbackLatency;
+    int marCCDExposureError;
+    int marCCDExposureErrorMean;
+    int marCCDExposureErrorStd;
+    int marCCDExposureErrorMax;
+    int marCCDTimerLateness;
+    int marCCDStartLatency;
+    int marCCDCompress;
+    int marCCDCompressRatio;
+    int marCCDCompressRate;
+    int marCCDAbort;
+    int marCCDAbortLatency;
+    int marCCDJobSubmit;
+    int marCCDJobFile;
+    int marCCDJobRun;
+    int marCCDJobClear;
+    int marCCDJobsQueued;
+    int marCCDJobsDone;
+    int marCCDJobId;
+    int marCCDJobLabel;
+    int marCCDJobState;
+    int marCCDJobMessage;
+    int marCCDJobHistory;
+    int marCCDHeaderSequence;
+    int marCCDHeaderFrame;
+    int marCCDHeaderPhi;
+    int marCCDSeqPhi;
+    int marCCDSeqDistance;
+    int marCCDSeqTwoTheta;
+    int marCCDSeqWavelength;
+    #define LAST_MARCCD_PARAM marCCDSeqWavelength
 
 private:                                        
     /* These are the methods that are new to this class */
-    asynStatus readTiff(const char *fileName, NDArray *pImage);
+    asynStatus readTiff(const char *fileName, NDArray *pImage, NDArray *pPreview);
     asynStatus writeServer(const char *output);
     asynStatus readServer(char *input, size_t maxChars, double timeout);
     asynStatus writeReadServer(const char *output, char *input, size_t maxChars, double timeout);
     asynStatus writeHeader();
+    double seqValue(int field, int frame, double value);
     int getState();
+    void statusParamCallbacks(int force);
     asynStatus getServerMode();
     asynStatus getConfig();
+    asynStatus connectServer();
+    void loadConfigCache();
+    void saveConfigCache();
+    void allocScratch();
     void collectNormal();
     void collectSeries();
-    void acquireFrame(double exposureTime, int useShutter);
+    void collectReplay();
+    asynStatus acquireFrame(double exposureTime, int useShutter);
     asynStatus readoutFrame(int bufferNumber, const char* fileName, int wait);
-    void saveFile(int correctedFlag, int wait);
-    asynStatus getImageData();
+    asynStatus saveFile(int correctedFlag, int wait);
+    asynStatus waitAbortable(double timeout);
+    asynStatus waitStoppable(double timeout);
+    void requestAbort();
+    void finishAbort(int useServer);
+    int startJob();
+    void finishJob(int state);
+    void jobStatus();
+    asynStatus getImageData(const marCCDImageFrame *pFrame = NULL);
+    void getImageFrame(marCCDImageFrame *pFrame);
+    asynStatus allocBlocking(size_t *dims, NDDataType_t dataType, NDArray **ppImage);
+    NDArray *allocPreview(NDArray *pRaw);
+    int processFrame(NDArray *pImage, NDArray *pPreview);
+    asynStatus dezingerFrame(NDArray *pImage, NDArray *pPreview);
+    asynStatus remapFrame(NDArray *pRaw, NDArray *pImage, NDArray *pPreview);
+    void publishShm(NDArray *pImage);
+    void checkBadPixelMask(int force);
+    void publishStream(NDArray *pImage);
+    NDArray *compressFrame(NDArray *pImage);
+    void ringAdd(NDArray *pImage);
+    void ringClear();
+    asynStatus ringResize(int size);
+    asynStatus ringDump(int dumpMode);
+    asynStatus writeTiff(const char *fileName, const size_t *dims, NDDataType_t dataType, void *pData);
    
     /* Our data */
     int serverMode;
     epicsEventId startEventId;
     epicsEventId imageEventId;
+    epicsEventId abortEventId;  /**< Signalled when abortRequested is set, to wake waitAbortable */
     epicsTimeStamp acqStartTime;
     epicsTimeStamp acqEndTime;
-    epicsTimerId timerId;
+    epicsTimeStamp statusCallbackTime;
+    epicsTimeStamp previewTime;
+    int publishedMarState;
+    int publishedADStatus;
+    marCCDTimer *pTimer;        /**< Ends internal trigger exposures */
+    int exposureCount;          /**< Exposures timed since acquisition started, for the error statistics */
+    double exposureErrorMean;   /**< Running mean of the exposure errors, by Welford's method */
+    double exposureErrorM2;     /**< Sum of the squared differences from the running mean */
+    double exposureErrorMax;
+    int threadGeneration;       /**< marCCDThreadGeneration() when the buffers were last freed */
     char toServer[MAX_MESSAGE_SIZE];
     char fromServer[MAX_MESSAGE_SIZE];
     NDArray *pData;
     asynUser *pasynUserServer;
+    asynUser *pasynUserConnect; /**< For connect and disconnect exceptions from the server port */
+    int connected;              /**< The server mode and configuration have been read since the last disconnect */
+    char *configCacheFile;      /**< File with the configuration from the last connection, NULL if none */
+    char configCache[MAX_MESSAGE_SIZE]; /**< The contents last written to configCacheFile */
+    marCCDRingFrame *ringFrames; /**< Ring of the most recently read frames, oldest first starting at ringHead */
+    int ringAlloc;
+    int ringHead;
+    int ringCount;
+    size_t ringBytes;
+    epicsUInt64 ringAdded;      /**< Number of frames added to the ring since the IOC started */
+    epicsMutexId processMutex;  /**< Serializes the processing of frames, which is done without the driver lock */
+    int maskFrameOk;            /**< The bad pixel mask matches the full size frames */
+    int maskPreviewOk;          /**< The bad pixel mask matches the binned frames of the Preview pool policy */
+    int maskCheckNx;            /**< Frame size for which maskFrameOk and maskPreviewOk were last computed */
+    int maskCheckNy;
+    marCCDWorkers *pWorkers;
+    marCCDRadial *pRadial;
+    marCCDSpotFinder *pSpots;
+    marCCDShmRing *pShmRing;    /**< Shared memory ring, NULL unless marCCDShmRingConfig was called */
+    marCCDStream *pStream;      /**< Streaming server, NULL unless marCCDStreamConfig was called */
+    epicsTimeStamp streamRateTime;
+    marCCDMetrics *pMetrics;    /**< Metrics server, NULL unless marCCDMetricsConfig was called */
+    double streamRateBytes;
+    marCCDCorrect *pCorrect;
+    char dezingerFile[MAX_FILENAME_LEN]; /**< First half of a double correlation frame to dezinger in the IOC */
+    marCCDRemap *pRemap;
+    int iocCorrect;             /**< The frame was read out raw, and is corrected in the IOC */
+    double bytesRead;           /**< Bytes of TIFF files read since acquisition started */
+    double bytesCached;         /**< How many of those were in the page cache before they were read */
+    int replaying;              /**< Frames come from existing files, not from the server */
+    epicsTimeStamp exposureStart; /**< When acquireFrame saw the exposure start */
+    epicsTimeStamp exposureEnd;   /**< When acquireFrame ended the exposure */
+    epicsTimeStamp frameStart;  /**< Exposure start of the frame just read out */
+    epicsTimeStamp frameEnd;    /**< Exposure end of the frame just read out */
+    int frameTimeFromFile;      /**< frameStart and frameEnd are not known; use the time the file was closed */
+    epicsTimeStamp fileTime;    /**< Modification time of the last file readTiff read */
+    int abortRequested;         /**< Acquisition was aborted; every wait returns and the frames in flight are dropped */
+    epicsUInt64 abortTime;      /**< When it was stopped, from epicsMonotonicGet() */
+    int imageTaskQueued;        /**< Frames passed to getImageDataTask that it has not finished */
+    marCCDImageFrame imageQueue[MARCCD_IMAGE_QUEUE_SIZE]; /**< Frames passed to getImageDataTask that it has not started */
+    int imageQueueHead;
+    int imageQueueCount;
+    marCCDJobQueue *pJobs;
+    int headerFrame;            /**< Frame of the acquisition, from 0, that the next header is for */
+    double *seqValues[marCCDNumSeqFields];    /**< Values of the header fields for each frame, NULL if none */
+    size_t seqLength[marCCDNumSeqFields];
 };
 
 
 #define NUM_MARCCD_PARAMS ((int)(&LAST_MARCCD_PARAM - &FIRST_MARCCD_PARAM + 1))
 
+/** Returns the size of a pixel of the types the driver reads */
+static size_t pixelBytes(NDDataType_t dataType)
+{
+    return (dataType == NDUInt16) ? sizeof(epicsUInt16) : sizeof(epicsUInt32);
+}
+
+/** Returns the NDArray data type of the pixels of a TIFF file from their bits per sample and
+  * sample format, or -1 if the driver cannot read them */
+static int tiffDataType(TIFF *tiff)
+{
+    epicsUInt16 bitsPerSample, sampleFormat;
+
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+    if ((bitsPerSample == 16) && (sampleFormat == SAMPLEFORMAT_UINT)) return NDUInt16;
+    if ((bitsPerSample == 32) && (sampleFormat == SAMPLEFORMAT_UINT)) return NDUInt32;
+    if ((bitsPerSample == 32) && (sampleFormat == SAMPLEFORMAT_IEEEFP)) return NDFloat32;
+    return -1;
+}
+
+/** Bins numOutRows bands of rows of a frame, starting at band firstRow, into the preview, with 
+  * the kernel for its pixel type.  The preview has the same type as the frame. */
+static void binArrayRows(NDArray *pImage, NDArray *pPreview, size_t firstRow, size_t numOutRows)
+{
+    size_t nx = pImage->dims[0].size;
+    int bin = pPreview->dims[0].binning;
+    size_t inOffset = firstRow * bin * nx;
+    size_t outOffset = firstRow * pPreview->dims[0].size;
+
+    switch (pImage->dataType) {
+        case NDUInt32:
+            marCCDBinRows((epicsUInt32 *)pImage->pData + inOffset, nx, bin, 
+                          (epicsUInt32 *)pPreview->pData + outOffset, numOutRows);
+            break;
+        case NDFloat32:
+            marCCDBinRows((epicsFloat32 *)pImage->pData + inOffset, nx, bin, 
+                          (epicsFloat32 *)pPreview->pData + outOffset, numOutRows);
+            break;
+        default:
+            marCCDBinRows((epicsUInt16 *)pImage->pData + inOffset, nx, bin, 
+                          (epicsUInt16 *)pPreview->pData + outOffset, numOutRows);
+            break;
+    }
+}
+
 void getImageDataTaskC(marCCD *pmarCCD)
 {
+    marCCDThreadStarted();
     pmarCCD->getImageDataTask();
 }
 
@@ -258,18 +677,25 @@ void getImageDataTaskC(marCCD *pmarCCD)
 void marCCD::getImageDataTask()
 {
     int status;
+    int queued;
+    marCCDImageFrame frame;
   
     this->lock();
     while (1) {
         this->unlock();
         status = epicsEventWait(this->imageEventId);
         this->lock();
+        /* The event is signalled once for each frame, but one pass reads the latest.
+         * The frames before it are taken off the queue too. */
+        queued = this->imageTaskQueued;
+        if (this->imageQueueCount == 0) continue;
+        frame = this->imageQueue[(this->imageQueueHead + this->imageQueueCount - 1) % MARCCD_IMAGE_QUEUE_SIZE];
+        this->imageQueueHead = (this->imageQueueHead + this->imageQueueCount) % MARCCD_IMAGE_QUEUE_SIZE;
+        this->imageQueueCount = 0;
         /* Wait for the correction to complete */
         status = getState();
         while (TEST_TASK_STATUS(status, TASK_CORRECT, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED)) {
-            this->unlock();
-            epicsThreadSleep(MARCCD_POLL_DELAY);
-            this->lock();
+            if (waitAbortable(MARCCD_POLL_DELAY)) break;
             status = getState();
         }
 
@@ -277,73 +703,1180 @@ void marCCD::getImageDataTask()
         status = getState();
         while (TEST_TASK_STATUS(status, TASK_WRITE, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
                TASK_STATE(status) >= 8) {
+            if (waitAbortable(MARCCD_POLL_DELAY)) break;
+            status = getState();
+        }
+        /* The file of an aborted acquisition may never be written */
+        if (!this->abortRequested) getImageData(&frame);
+        this->imageTaskQueued -= queued;
+        /* Polling stops until the next frame, so publish the status that was held back */
+        statusParamCallbacks(1);
+    }
+}
+
+/** Captures the file name, the uniqueId and the exposure times of the frame that was just read out,
+  * from NDFullFileName, NDArrayCounter and frameStart, frameEnd and frameTimeFromFile.
+  * \param[out] pFrame The frame. */
+void marCCD::getImageFrame(marCCDImageFrame *pFrame)
+{
+    getStringParam(NDFullFileName, sizeof(pFrame->fullFileName), pFrame->fullFileName);
+    getIntegerParam(NDArrayCounter, &pFrame->uniqueId);
+    pFrame->frameStart = this->frameStart;
+    pFrame->frameEnd = this->frameEnd;
+    pFrame->frameTimeFromFile = this->frameTimeFromFile;
+}
+
+/** Reads a frame from its TIFF file, processes it and passes it to the plugins.
+  * \param[in] pFrame The frame to read, or NULL to read the frame that was just read out. */
+asynStatus marCCD::getImageData(const marCCDImageFrame *pFrame)
+{
+    // Note: In series mode this function is called even if array callbacks are disabled, because it
+    // is used to determine when the next file has been written
+    asynStatus status;
+    marCCDImageFrame current;
+    const char *fullFileName;
+    size_t dims[2];
+    int itemp;
+    int imageCounter;
+    int arrayCallbacks;
+    int poolPolicy;
+    int drops;
+    int veto = 0;
+    int vetoMode;
+    int previewBin;
+    int badPixelEnable;
+    int typeChanged = 0;
+    double previewRate;
+    size_t previewDims[2];
+    NDDataType_t dataType;
+    epicsTimeStamp now;
+    epicsTimeStamp frameStart, frameEnd;
+    double acquireTime, startTime, endTime, latency;
+    NDArray *pImage, *pRead, *pRaw, *pPreview=NULL, *pCompressed=NULL;
+    NDArray *pPreviewRead, *pPreviewMasked;
+    char statusMessage[MAX_MESSAGE_SIZE];
+    const char *functionName = "getImageData";
+
+    /* Inquire about the image dimensions.  When replaying they were read from the file. */
+    if (!this->replaying) getConfig();
+    if (!pFrame) {
+        getImageFrame(&current);
+        pFrame = &current;
+    }
+    fullFileName = pFrame->fullFileName;
+    imageCounter = pFrame->uniqueId;
+    getIntegerParam(NDArraySizeX, &itemp); dims[0] = itemp;
+    getIntegerParam(NDArraySizeY, &itemp); dims[1] = itemp;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    getIntegerParam(marCCDPoolPolicy, &poolPolicy);
+
+    /* The frame is read with the pixel type of the previous file.  If this file has a different type
+     * readTiff returns asynOverflow and sets NDDataType, and the arrays are allocated again. */
+    readFrame:
+    getIntegerParam(NDDataType, &itemp); dataType = (NDDataType_t)itemp;
+    pPreview = NULL;
+    pImage = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+    if (!pImage && (poolPolicy == marCCDPoolBlock)) {
+        status = allocBlocking(dims, dataType, &pImage);
+        /* The acquisition was aborted while waiting */
+        if (status) return status;
+    }
+    if (pImage) {
+        pRead = pImage;
+    } else {
+        /* There is no free buffer.  Read the file into the scratch buffer so we still know when 
+         * it has been written, then either drop the frame or make a binned preview from it */
+        pRead = this->pData;
+        if (!pRead || (pRead->dataSize < dims[0] * dims[1] * pixelBytes(dataType))) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: error, no NDArray available and scratch buffer too small\n", 
+                driverName, functionName);
+            return asynError;
+        }
+        pRead->dims[0].size = dims[0];
+        pRead->dims[1].size = dims[1];
+        pRead->dataType = dataType;
+    }
+
+    epicsSnprintf(statusMessage, sizeof(statusMessage), "Reading TIFF file %s", fullFileName);
+    setStringParam(ADStatusMessage, statusMessage);
+    callParamCallbacks();
+    /* Make a binned preview of the frame in the same pass, at no more than MAR_PREVIEW_RATE */
+    getIntegerParam(marCCDPreviewBin, &previewBin);
+    getDoubleParam(marCCDPreviewRate, &previewRate);
+    if (pImage && arrayCallbacks && (previewBin > 1)) {
+        epicsTimeGetCurrent(&now);
+        if ((previewRate <= 0.) || 
+            (epicsTimeDiffInSeconds(&now, &this->previewTime) >= 1./previewRate)) {
+            previewDims[0] = dims[0] / previewBin;
+            previewDims[1] = dims[1] / previewBin;
+            pPreview = this->pNDArrayPool->alloc(2, previewDims, dataType, 0, NULL);
+            if (pPreview) {
+                pPreview->dims[0].binning = previewBin;
+                pPreview->dims[1].binning = previewBin;
+                this->previewTime = now;
+            }
+        }
+    }
+    /* The bad pixel mask is applied in processFrame, so the preview of a masked frame is binned
+     * there, after the mask, and not while the frame is read */
+    getIntegerParam(marCCDBadPixelEnable, &badPixelEnable);
+    pPreviewMasked = (badPixelEnable && (dataType == NDUInt16)) ? pPreview : NULL;
+    pPreviewRead = pPreviewMasked ? NULL : pPreview;
+    setDoubleParam(marCCDCorrectTime, 0.);
+    if (this->iocCorrect) {
+        /* The file has the raw frame, which is corrected into pRead */
+        pRaw = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+        if (pRaw) {
+            status = readTiff(fullFileName, pRaw, NULL);
+            if ((status == asynSuccess) && this->dezingerFile[0]) status = dezingerFrame(pRaw, NULL);
+            if (status == asynSuccess) status = remapFrame(pRaw, pRead, pPreviewRead);
+            pRaw->release();
+        } else {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: no NDArray available for the raw frame\n", 
+                driverName, functionName);
+            status = asynError;
+        }
+    } else if (this->dezingerFile[0]) {
+        /* The preview is made from the combined frame */
+        status = readTiff(fullFileName, pRead, NULL);
+        if (pImage && (status == asynSuccess)) status = dezingerFrame(pImage, pPreviewRead);
+    } else {
+        status = readTiff(fullFileName, pRead, pPreviewRead); 
+    }
+    if (pPreview && status) {
+        pPreview->release();
+        pPreview = NULL;
+    }
+    if ((status == asynOverflow) && !typeChanged) {
+        typeChanged = 1;
+        if (pImage) pImage->release();
+        allocScratch();
+        goto readFrame;
+    }
+
+    if (!pImage) {
+        if ((status == asynSuccess) && (poolPolicy == marCCDPoolPreview)) pImage = allocPreview(pRead);
+        if (!pImage) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+                "%s:%s: no free NDArray, dropping frame %d, file %s\n", 
+                driverName, functionName, imageCounter, fullFileName);
+            getIntegerParam(marCCDPoolDrops, &drops);
+            setIntegerParam(marCCDPoolDrops, drops+1);
+            if (this->pMetrics) this->pMetrics->count(marCCDCounterFramesDropped);
+            callParamCallbacks();
+            return status;
+        }
+    }
+    if (this->pMetrics && (status == asynSuccess)) this->pMetrics->count(marCCDCounterFramesRead);
+
+    /* Put the frame number and the exposure start time into the buffer */
+    frameStart = pFrame->frameStart;
+    frameEnd = pFrame->frameEnd;
+    if (pFrame->frameTimeFromFile) {
+        /* The exposure ended when the server closed the file */
+        getDoubleParam(ADAcquireTime, &acquireTime);
+        frameEnd = this->fileTime;
+        frameStart = frameEnd;
+        epicsTimeAddSeconds(&frameStart, -acquireTime);
+    }
+    startTime = frameStart.secPastEpoch + frameStart.nsec / 1.e9;
+    endTime = frameEnd.secPastEpoch + frameEnd.nsec / 1.e9;
+    pImage->uniqueId = imageCounter;
+    pImage->timeStamp = startTime;
+    updateTimeStamp(&pImage->epicsTS);
+
+    /* Get any attributes that have been defined for this driver */        
+    this->getAttributes(pImage->pAttributeList);
+    pImage->pAttributeList->add("ExposureStart", "Exposure start time (s since EPICS epoch)", 
+                                NDAttrFloat64, &startTime);
+    pImage->pAttributeList->add("ExposureEnd", "Exposure end time (s since EPICS epoch)", 
+                                NDAttrFloat64, &endTime);
+    if (pPreview) {
+        pPreview->uniqueId = pImage->uniqueId;
+        pPreview->timeStamp = pImage->timeStamp;
+        pPreview->epicsTS = pImage->epicsTS;
+        this->getAttributes(pPreview->pAttributeList);
+    }
+
+    if (status == asynSuccess) veto = processFrame(pImage, pPreviewMasked);
+
+    /* Keep a copy of the frame, as the plugins get it, in the ring of recent frames */
+    if (status == asynSuccess) ringAdd(pImage);
+    if (veto) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s: frame %d has too few spots, vetoed\n", 
+            driverName, functionName, imageCounter);
+        getIntegerParam(marCCDVetoMode, &vetoMode);
+        if ((vetoMode == marCCDVetoDelete) && (unlink(fullFileName) != 0)) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: error deleting vetoed file %s, errno=%d\n", 
+                driverName, functionName, fullFileName, errno);
+        }
+    }
+
+    if (this->pShmRing && (status == asynSuccess) && !veto) publishShm(pImage);
+    if (this->pStream && (status == asynSuccess) && !veto) publishStream(pImage);
+    /* The plugins get the compressed frame; the ring, shared memory and stream keep the pixels */
+    if (arrayCallbacks && (status == asynSuccess) && !veto) pCompressed = compressFrame(pImage);
+
+    /* The time from the end of the exposure until the frame is passed to the plugins */
+    epicsTimeGetCurrent(&now);
+    latency = epicsTimeDiffInSeconds(&now, &frameEnd);
+    pImage->pAttributeList->add("CallbackLatency", "Exposure end to callback (s)", NDAttrFloat64, &latency);
+    if (pCompressed) {
+        pCompressed->pAttributeList->add("CallbackLatency", "Exposure end to callback (s)", 
+                                         NDAttrFloat64, &latency);
+    }
+    if (pPreview) {
+        pPreview->pAttributeList->add("ExposureStart", "Exposure start time (s since EPICS epoch)", 
+                                      NDAttrFloat64, &startTime);
+        pPreview->pAttributeList->add("ExposureEnd", "Exposure end time (s since EPICS epoch)", 
+                                      NDAttrFloat64, &endTime);
+        pPreview->pAttributeList->add("CallbackLatency", "Exposure end to callback (s)", 
+                                      NDAttrFloat64, &latency);
+    }
+    setDoubleParam(marCCDCallbackLatency, latency * 1000.);
+    if (this->pMetrics && (status == asynSuccess)) this->pMetrics->observe(marCCDStageLatency, latency);
+
+    if (arrayCallbacks && !veto) {
+        /* Call the NDArray callback */
+        /* Must release the lock here, or we can get into a deadlock, because we can
+         * block on the plugin lock, and the plugin can be calling us */
+        this->unlock();
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
+             "%s:%s: calling NDArray callback\n", driverName, functionName);
+        {
+            marCCDTraceSpan span("doCallbacks");
+            epicsUInt64 callbackStart = epicsMonotonicGet();
+            doCallbacksGenericPointer(pCompressed ? pCompressed : pImage, NDArrayData, MARCCD_ADDR_FRAME);
+            if (this->pMetrics) this->pMetrics->observe(marCCDStageCallbacks, (epicsMonotonicGet() - callbackStart) / 1.e9);
+        }
+        if (pPreview) {
+            marCCDTraceSpan span("doCallbacks", "preview");
+            doCallbacksGenericPointer(pPreview, NDArrayData, MARCCD_ADDR_PREVIEW);
+        }
+        this->lock();
+    }
+
+    /* Free the image buffers */
+    if (pCompressed) pCompressed->release();
+    if (pPreview) pPreview->release();
+    pImage->release();
+    if (this->pMetrics) {
+        this->pMetrics->setGauge(marCCDGaugePoolBuffers, this->pNDArrayPool->getNumBuffers());
+        this->pMetrics->setGauge(marCCDGaugePoolFreeBuffers, this->pNDArrayPool->getNumFree());
+        this->pMetrics->setGauge(marCCDGaugePoolMaxBuffers, this->pNDArrayPool->getMaxBuffers());
+        this->pMetrics->setGauge(marCCDGaugePoolBytes, this->pNDArrayPool->getMemorySize());
+        this->pMetrics->setGauge(marCCDGaugePoolMaxBytes, this->pNDArrayPool->getMaxMemory());
+    }
+    return status;
+}
+
+/** Waits for the NDArrayPool to have a free buffer, for up to MAR_TIFF_TIMEOUT seconds.
+  * This is the backpressure policy marCCDPoolBlock; it stalls the acquisition until slow plugins 
+  * release arrays.
+  * \param[in] dims The dimensions of the frame.
+  * \param[in] dataType The pixel type of the frame.
+  * \param[out] ppImage The array, or NULL if the timeout expired.
+  * \return asynError if acquisition was aborted while waiting, asynSuccess otherwise. */
+asynStatus marCCD::allocBlocking(size_t *dims, NDDataType_t dataType, NDArray **ppImage)
+{
+    epicsTimeStamp tStart, tCheck;
+    double timeout, deltaTime=0.;
+    double stallTime;
+    int stalls;
+    int status;
+    asynStatus retStatus = asynSuccess;
+    
+    *ppImage = NULL;
+    getDoubleParam(marCCDTiffTimeout, &timeout);
+    getIntegerParam(marCCDPoolStalls, &stalls);
+    setIntegerParam(marCCDPoolStalls, stalls+1);
+    setStringParam(ADStatusMessage, "Waiting for free NDArray");
+    callParamCallbacks();
+    epicsTimeGetCurrent(&tStart);
+    while (deltaTime <= timeout) {
+        /* Sleep, but return if the acquisition is aborted */
+        status = waitAbortable(FILE_READ_DELAY);
+        epicsTimeGetCurrent(&tCheck);
+        deltaTime = epicsTimeDiffInSeconds(&tCheck, &tStart);
+        if (status) {
+            retStatus = asynError;
+            break;
+        }
+        *ppImage = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+        if (*ppImage) break;
+    }
+    getDoubleParam(marCCDPoolStallTime, &stallTime);
+    setDoubleParam(marCCDPoolStallTime, stallTime + deltaTime);
+    callParamCallbacks();
+    return retStatus;
+}
+
+/** Makes a reduced-resolution copy of a frame when the NDArrayPool does not have room for a full 
+  * size frame.  This is the backpressure policy marCCDPoolPreview.  The smallest binning of 2, 4 or 8
+  * for which an array can be allocated is used.
+  * \param[in] pRaw The full size frame.
+  * \return The binned frame, or NULL if no array could be allocated. */
+NDArray* marCCD::allocPreview(NDArray *pRaw)
+{
+    NDArray *pPreview = NULL;
+    size_t dims[2];
+    int bin;
+    int previews;
+    
+    for (bin=2; bin<=8; bin*=2) {
+        dims[0] = pRaw->dims[0].size / bin;
+        dims[1] = pRaw->dims[1].size / bin;
+        pPreview = this->pNDArrayPool->alloc(2, dims, pRaw->dataType, 0, NULL);
+        if (pPreview) break;
+    }
+    if (!pPreview) return NULL;
+    pPreview->dims[0].binning = bin;
+    pPreview->dims[1].binning = bin;
+    binArrayRows(pRaw, pPreview, 0, dims[1]);
+    getIntegerParam(marCCDPoolPreviews, &previews);
+    setIntegerParam(marCCDPoolPreviews, previews+1);
+    return pPreview;
+}
+
+/** Combines the two halves of a double correlation frame in the IOC.  The first half is read from
+  * dezingerFile, and the second half has already been read into pImage.  This is called with the lock
+  * held; the lock is released while the frames are combined.
+  * \param[in,out] pImage The second half, replaced by the dezingered sum.
+  * \param[out] pPreview If not NULL, the binned preview of the dezingered sum.
+  * \return asynError if the first half could not be read. */
+asynStatus marCCD::dezingerFrame(NDArray *pImage, NDArray *pPreview)
+{
+    asynStatus status;
+    NDArray *pFirst;
+    size_t dims[2];
+    int numThreads;
+    int zingers;
+    double sigma;
+    double correctTime;
+    epicsTimeStamp tStart, tEnd;
+    const char *functionName = "dezingerFrame";
+
+    if (pImage->dataType != NDUInt16) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: dezingering in the IOC is only supported for 16-bit frames\n", 
+            driverName, functionName);
+        return asynError;
+    }
+    dims[0] = pImage->dims[0].size;
+    dims[1] = pImage->dims[1].size;
+    pFirst = this->pNDArrayPool->alloc(2, dims, NDUInt16, 0, NULL);
+    if (!pFirst) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: no NDArray available for the first half of the frame\n", 
+            driverName, functionName);
+        return asynError;
+    }
+    status = readTiff(this->dezingerFile, pFirst, NULL);
+    if (status) {
+        pFirst->release();
+        return status;
+    }
+    getIntegerParam(marCCDNumThreads, &numThreads);
+    getDoubleParam(marCCDDezingerSigma, &sigma);
+    this->unlock();
+    epicsMutexLock(this->processMutex);
+    {
+        marCCDTraceSpan span("dezinger");
+        epicsTimeGetCurrent(&tStart);
+        zingers = this->pCorrect->dezinger((epicsUInt16 *)pFirst->pData, (epicsUInt16 *)pImage->pData, 
+                                           dims[0] * dims[1], sigma, this->pWorkers, numThreads);
+        if (pPreview) binArrayRows(pImage, pPreview, 0, pPreview->dims[1].size);
+        epicsTimeGetCurrent(&tEnd);
+        correctTime = epicsTimeDiffInSeconds(&tEnd, &tStart) * 1000.;
+    }
+    epicsMutexUnlock(this->processMutex);
+    this->lock();
+    pFirst->release();
+    if (zingers < 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: error allocating memory for dezinger\n", 
+            driverName, functionName);
+        return asynError;
+    }
+    setIntegerParam(marCCDZingerCount, zingers);
+    setDoubleParam(marCCDCorrectTime, correctTime);
+    return asynSuccess;
+}
+
+/** Corrects a raw frame in the IOC with the remap table.  This is called with the lock held; the lock 
+  * is released while the frame is corrected.
+  * \param[in] pRaw The raw frame.
+  * \param[out] pImage The corrected frame.
+  * \param[out] pPreview If not NULL, the binned preview of the corrected frame.
+  * \return asynError if there is no remap table or it does not match the frame size. */
+asynStatus marCCD::remapFrame(NDArray *pRaw, NDArray *pImage, NDArray *pPreview)
+{
+    int numThreads;
+    int remapStatus;
+    size_t nx = pRaw->dims[0].size;
+    size_t ny = pRaw->dims[1].size;
+    double correctTime;
+    double tempTime;
+    epicsTimeStamp tStart, tEnd;
+    const char *functionName = "remapFrame";
+
+    if (pRaw->dataType != NDUInt16) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: correction in the IOC is only supported for 16-bit frames\n", 
+            driverName, functionName);
+        return asynError;
+    }
+    getIntegerParam(marCCDNumThreads, &numThreads);
+    this->unlock();
+    epicsMutexLock(this->processMutex);
+    {
+        marCCDTraceSpan span("remap");
+        epicsTimeGetCurrent(&tStart);
+        remapStatus = this->pRemap->apply((epicsUInt16 *)pRaw->pData, (epicsUInt16 *)pImage->pData, 
+                                          nx, ny, this->pWorkers, numThreads);
+        if (pPreview && (remapStatus == 0)) binArrayRows(pImage, pPreview, 0, pPreview->dims[1].size);
+        epicsTimeGetCurrent(&tEnd);
+        correctTime = epicsTimeDiffInSeconds(&tEnd, &tStart) * 1000.;
+    }
+    epicsMutexUnlock(this->processMutex);
+    this->lock();
+    if (remapStatus) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: no remap table loaded, or its size does not match the frame\n", 
+            driverName, functionName);
+        return asynError;
+    }
+    /* The dezinger of the raw frame may already have set the correction time */
+    getDoubleParam(marCCDCorrectTime, &tempTime);
+    setDoubleParam(marCCDCorrectTime, tempTime + correctTime);
+    return asynSuccess;
+}
+
+/** Runs the optional processing stages on a frame that has been read, and does the callbacks 
+  * for the arrays they produce.  This is called with the lock held; the lock is released while 
+  * the frame is processed.
+  * \param[in] pImage The frame.
+  * \param[in] pPreview If not NULL, the preview, which is binned from the frame after the bad pixel mask.
+  * \return 1 if the spot finder found too few spots and the frame is vetoed, 0 otherwise. */
+int marCCD::processFrame(NDArray *pImage, NDArray *pPreview)
+{
+    int arrayCallbacks;
+    int radialEnable;
+    int spotEnable;
+    int badPixelEnable;
+    int badPixelValue;
+    int numThreads;
+    int binX;
+    int minPixels;
+    int hitThreshold;
+    int vetoMode;
+    int spotCount = 0;
+    int veto = 0;
+    int itemp;
+    double pixelSize;
+    double sigma;
+    double qMax = 0.;
+    double radialTime = 0.;
+    double spotTime = 0.;
+    double correctTime = 0.;
+    double tempTime;
+    size_t dims[1];
+    marCCDRadialGeometry geometry;
+    NDArray *pProfile = NULL;
+    epicsTimeStamp tStart, tEnd;
+    const char *functionName = "processFrame";
+
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    getIntegerParam(marCCDRadialEnable, &radialEnable);
+    getIntegerParam(marCCDSpotEnable, &spotEnable);
+    getIntegerParam(marCCDBadPixelEnable, &badPixelEnable);
+    getIntegerParam(marCCDBadPixelValue, &badPixelValue);
+    getIntegerParam(marCCDNumThreads, &numThreads);
+    if (pImage->dataType != NDUInt16) return 0;
+
+    if (spotEnable) {
+        getDoubleParam(marCCDSpotSigma, &sigma);
+        getIntegerParam(marCCDSpotMinPixels, &minPixels);
+        getIntegerParam(marCCDHitThreshold, &hitThreshold);
+        getIntegerParam(marCCDVetoMode, &vetoMode);
+    }
+    if (radialEnable && arrayCallbacks) {
+        memset(&geometry, 0, sizeof(geometry));
+        geometry.nx = pImage->dims[0].size;
+        geometry.ny = pImage->dims[1].size;
+        getDoubleParam(marCCDPixelSize, &pixelSize);
+        getIntegerParam(ADBinX, &binX);
+        geometry.pixelSize = pixelSize * binX;
+        getDoubleParam(marCCDBeamX, &geometry.beamX);
+        getDoubleParam(marCCDBeamY, &geometry.beamY);
+        getDoubleParam(marCCDDetectorDistance, &geometry.distance);
+        getDoubleParam(marCCDWavelength, &geometry.wavelength);
+        getIntegerParam(marCCDRadialNumBins, &geometry.numBins);
+        if (geometry.numBins > 0) {
+            dims[0] = geometry.numBins;
+            pProfile = this->pNDArrayPool->alloc(1, dims, NDFloat64, 0, NULL);
+        }
+    }
+    if (!badPixelEnable && !spotEnable && !pProfile) return 0;
+
+    this->unlock();
+    epicsMutexLock(this->processMutex);
+    if (badPixelEnable) {
+        marCCDTraceSpan span("badPixels");
+        epicsTimeGetCurrent(&tStart);
+        /* checkBadPixelMask has already reported a mask that does not match, those frames are not masked.
+         * The frames made by the Preview pool policy are binned. */
+        if ((pImage->dims[0].binning > 1) ? this->maskPreviewOk : this->maskFrameOk) {
+            this->pCorrect->applyMask((epicsUInt16 *)pImage->pData, pImage->dims[0].size, pImage->dims[1].size,
+                                      (epicsUInt16)badPixelValue, this->pWorkers, numThreads);
+        }
+        if (pPreview) binArrayRows(pImage, pPreview, 0, pPreview->dims[1].size);
+        epicsTimeGetCurrent(&tEnd);
+        correctTime = epicsTimeDiffInSeconds(&tEnd, &tStart) * 1000.;
+    }
+    if (spotEnable) {
+        marCCDTraceSpan span("spots");
+        epicsTimeGetCurrent(&tStart);
+        spotCount = this->pSpots->find((epicsUInt16 *)pImage->pData, pImage->dims[0].size, pImage->dims[1].size,
+                                       sigma, minPixels, this->pWorkers, numThreads);
+        epicsTimeGetCurrent(&tEnd);
+        spotTime = epicsTimeDiffInSeconds(&tEnd, &tStart) * 1000.;
+        if (spotCount < 0) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: error allocating memory for spot finding\n", 
+                driverName, functionName);
+        } else {
+            veto = (vetoMode != marCCDVetoOff) && (spotCount < hitThreshold);
+        }
+    }
+    /* There is no point integrating a frame that will not be passed on */
+    if (pProfile && veto) {
+        pProfile->release();
+        pProfile = NULL;
+    }
+    if (pProfile) {
+        marCCDTraceSpan span("radial");
+        epicsTimeGetCurrent(&tStart);
+        if (this->pRadial->configure(&geometry)) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: invalid geometry for azimuthal integration, check PixelSize, DetectorDistance and Wavelength\n", 
+                driverName, functionName);
+            pProfile->release();
+            pProfile = NULL;
+        } else {
+            this->pRadial->integrate((epicsUInt16 *)pImage->pData, (double *)pProfile->pData, 
+                                     this->pWorkers, numThreads);
+            qMax = this->pRadial->getQMax();
+        }
+        epicsTimeGetCurrent(&tEnd);
+        radialTime = epicsTimeDiffInSeconds(&tEnd, &tStart) * 1000.;
+    }
+    epicsMutexUnlock(this->processMutex);
+
+    if (spotEnable && (spotCount >= 0)) {
+        pImage->pAttributeList->add("SpotCount", "Number of Bragg spots", NDAttrInt32, &spotCount);
+    }
+    if (pProfile) {
+        pProfile->uniqueId = pImage->uniqueId;
+        pProfile->timeStamp = pImage->timeStamp;
+        pProfile->epicsTS = pImage->epicsTS;
+        pProfile->pAttributeList->add("QMax", "Maximum q (1/Angstrom)", NDAttrFloat64, &qMax);
+        marCCDTraceSpan span("doCallbacks", "radial");
+        doCallbacksGenericPointer(pProfile, NDArrayData, MARCCD_ADDR_RADIAL);
+        pProfile->release();
+    }
+    this->lock();
+    if (badPixelEnable) {
+        getDoubleParam(marCCDCorrectTime, &tempTime);
+        setDoubleParam(marCCDCorrectTime, tempTime + correctTime);
+    }
+    if (spotEnable) {
+        setIntegerParam(marCCDSpotCount, spotCount);
+        setDoubleParam(marCCDSpotTime, spotTime);
+        if (spotCount >= hitThreshold) {
+            getIntegerParam(marCCDHitCount, &itemp);
+            setIntegerParam(marCCDHitCount, itemp+1);
+        }
+        if (veto) {
+            getIntegerParam(marCCDVetoCount, &itemp);
+            setIntegerParam(marCCDVetoCount, itemp+1);
+        }
+    }
+    if (radialEnable && arrayCallbacks) {
+        setDoubleParam(marCCDRadialQMax, qMax);
+        setDoubleParam(marCCDRadialTime, radialTime);
+    }
+    return veto;
+}
+
+/** Checks whether the bad pixel mask matches the frames of the current size and, with the Preview pool
+  * policy, the frames binned by 2, 4 and 8.  This is done when the mask, BadPixelEnable, PoolPolicy or the
+  * frame size change rather than for each frame.  Frames that the mask does not match are passed on without
+  * masking, and ADStatusMessage says so.  This is called with the lock held.
+  * \param[in] force Check even if the frame size has not changed since the last check. */
+void marCCD::checkBadPixelMask(int force)
+{
+    int nx, ny;
+    int bin;
+    int badPixelEnable;
+    int poolPolicy;
+    const char *functionName = "checkBadPixelMask";
+
+    getIntegerParam(NDArraySizeX, &nx);
+    getIntegerParam(NDArraySizeY, &ny);
+    if (!force && (nx == this->maskCheckNx) && (ny == this->maskCheckNy)) return;
+    this->maskCheckNx = nx;
+    this->maskCheckNy = ny;
+    getIntegerParam(marCCDBadPixelEnable, &badPixelEnable);
+    getIntegerParam(marCCDPoolPolicy, &poolPolicy);
+    /* processFrame reads these without the lock */
+    epicsMutexLock(this->processMutex);
+    this->maskFrameOk = this->pCorrect->matchesMask(nx, ny);
+    this->maskPreviewOk = 1;
+    for (bin=2; bin<=8; bin*=2) {
+        if (!this->pCorrect->matchesMask(nx/bin, ny/bin)) this->maskPreviewOk = 0;
+    }
+    epicsMutexUnlock(this->processMutex);
+    if (!badPixelEnable) return;
+    if (!this->maskFrameOk) {
+        setStringParam(ADStatusMessage, "Bad pixel mask missing or does not match frame size");
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: no bad pixel mask loaded, or it does not match %dx%d frames, they will not be masked\n",
+            driverName, functionName, nx, ny);
+    } else if ((poolPolicy == marCCDPoolPreview) && !this->maskPreviewOk) {
+        setStringParam(ADStatusMessage, "Bad pixel mask does not match binned pool previews");
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: bad pixel mask does not match the binned frames of %dx%d, they will not be masked\n",
+            driverName, functionName, nx, ny);
+    }
+}
+
+/** Copies a frame into the shared memory ring if MAR_SHM_ENABLE is set.  This is called with the lock
+  * held; the lock is released while the frame is copied.
+  * \param[in] pImage The frame. */
+void marCCD::publishShm(NDArray *pImage)
+{
+    int shmEnable;
+    int binX;
+    int itemp;
+    int shmStatus;
+    double timeout;
+    epicsTimeStamp tStart, tCheck;
+    marCCDShmGeometry geometry;
+    const char *functionName = "publishShm";
+
+    getIntegerParam(marCCDShmEnable, &shmEnable);
+    if (!shmEnable) return;
+    getDoubleParam(marCCDDetectorDistance, &geometry.distance);
+    getDoubleParam(marCCDBeamX, &geometry.beamX);
+    getDoubleParam(marCCDBeamY, &geometry.beamY);
+    getDoubleParam(marCCDWavelength, &geometry.wavelength);
+    getDoubleParam(marCCDPixelSize, &geometry.pixelSize);
+    getIntegerParam(ADBinX, &binX);
+    geometry.pixelSize *= binX;
+    getDoubleParam(marCCDStartPhi, &geometry.startPhi);
+    getDoubleParam(marCCDRotationRange, &geometry.rotationRange);
+    getDoubleParam(marCCDTwoTheta, &geometry.twoTheta);
+    getDoubleParam(marCCDShmBlockTimeout, &timeout);
+
+    /* With the block policy wait for the consumer to free a slot, for up to MAR_SHM_BLOCK_TIMEOUT */
+    epicsTimeGetCurrent(&tStart);
+    while (!this->pShmRing->slotFree()) {
+        epicsTimeGetCurrent(&tCheck);
+        if ((epicsTimeDiffInSeconds(&tCheck, &tStart) > timeout) ||
+            waitAbortable(MARCCD_SHM_POLL_DELAY)) break;
+    }
+    this->unlock();
+    {
+        marCCDTraceSpan span("publishShm");
+        shmStatus = this->pShmRing->publish(pImage, &geometry);
+    }
+    this->lock();
+    if (shmStatus == 0) {
+        getIntegerParam(marCCDShmFrames, &itemp);
+        setIntegerParam(marCCDShmFrames, itemp+1);
+    } else {
+        if (shmStatus < 0) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame %d is too large for the shared memory slots\n", 
+                driverName, functionName, pImage->uniqueId);
+        }
+        getIntegerParam(marCCDShmDrops, &itemp);
+        setIntegerParam(marCCDShmDrops, itemp+1);
+    }
+}
+
+/** Queues a frame for the clients of the streaming server if MAR_STREAM_ENABLE is set, and updates 
+  * the streaming statistics.  This is called with the lock held; the lock is released while the frame
+  * is compressed and queued.
+  * \param[in] pImage The frame. */
+void marCCD::publishStream(NDArray *pImage)
+{
+    int streamEnable;
+    int codec;
+    double bytesSent, deltaTime;
+    epicsTimeStamp now;
+
+    getIntegerParam(marCCDStreamEnable, &streamEnable);
+    if (!streamEnable) return;
+    getIntegerParam(marCCDStreamCodec, &codec);
+    this->unlock();
+    {
+        marCCDTraceSpan span("publishStream");
+        this->pStream->publish(pImage, codec);
+    }
+    this->lock();
+    setIntegerParam(marCCDStreamClients, this->pStream->getNumClients());
+    setIntegerParam(marCCDStreamDrops, (int)this->pStream->getDrops());
+    /* The frames are sent asynchronously, so the rate is averaged over at least 1 second */
+    epicsTimeGetCurrent(&now);
+    deltaTime = epicsTimeDiffInSeconds(&now, &this->streamRateTime);
+    if (deltaTime >= 1.0) {
+        bytesSent = this->pStream->getBytesSent();
+        setDoubleParam(marCCDStreamRate, (bytesSent - this->streamRateBytes) / deltaTime / 1.e6);
+        this->streamRateBytes = bytesSent;
+        this->streamRateTime = now;
+    }
+}
+
+/** Compresses a frame with the codec MAR_COMPRESS before it is passed to the plugins, so that file 
+  * plugins can write the compressed data directly.  The frame is divided among the worker threads
+  * for bitshuffle/LZ4 and Blosc.  This is called with the lock held; the lock is released while the
+  * frame is compressed.
+  * \param[in] pImage The frame.
+  * \return The compressed frame, with codec.name and compressedSize set, or NULL if compression is
+  *         disabled or failed. */
+NDArray* marCCD::compressFrame(NDArray *pImage)
+{
+    int codec;
+    int numThreads;
+    size_t maxSize, compressedSize;
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    double compressTime;
+    NDArray *pCompressed;
+    NDArrayInfo_t arrayInfo;
+    epicsTimeStamp tStart, tEnd;
+    int i;
+    const char *functionName = "compressFrame";
+
+    getIntegerParam(marCCDCompress, &codec);
+    if ((codec == marCCDCodecNone) || !marCCDCodecAvailable(codec)) return NULL;
+    getIntegerParam(marCCDNumThreads, &numThreads);
+    pImage->getInfo(&arrayInfo);
+    maxSize = marCCDCodecBound(codec, arrayInfo.totalBytes, arrayInfo.bytesPerElement);
+    for (i=0; i<pImage->ndims; i++) dims[i] = pImage->dims[i].size;
+    pCompressed = this->pNDArrayPool->alloc(pImage->ndims, dims, pImage->dataType, maxSize, NULL);
+    if (!pCompressed) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+            "%s:%s: no NDArray available, frame %d is passed on uncompressed\n", 
+            driverName, functionName, pImage->uniqueId);
+        return NULL;
+    }
+    this->unlock();
+    epicsMutexLock(this->processMutex);
+    {
+        marCCDTraceSpan span("compress", marCCDCodecName(codec));
+        epicsTimeGetCurrent(&tStart);
+        compressedSize = marCCDCodecCompress(codec, pImage->pData, arrayInfo.totalBytes, arrayInfo.bytesPerElement,
+                                             pCompressed->pData, maxSize, this->pWorkers, numThreads);
+        epicsTimeGetCurrent(&tEnd);
+        compressTime = epicsTimeDiffInSeconds(&tEnd, &tStart);
+    }
+    if (this->pMetrics) this->pMetrics->observe(marCCDStageCompress, compressTime);
+    epicsMutexUnlock(this->processMutex);
+    this->lock();
+    if (compressedSize == 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: error compressing frame %d with %s, it is passed on uncompressed\n", 
+            driverName, functionName, pImage->uniqueId, marCCDCodecName(codec));
+        pCompressed->release();
+        return NULL;
+    }
+    /* Copy the dimensions, time stamps and attributes, but not the data */
+    this->pNDArrayPool->copy(pImage, pCompressed, false);
+    pCompressed->codec.name = marCCDCodecName(codec);
+    if (codec == marCCDCodecBlosc) {
+        pCompressed->codec.level = MARCCD_BLOSC_LEVEL;
+        pCompressed->codec.shuffle = MARCCD_BLOSC_SHUFFLE;
+        pCompressed->codec.compressor = MARCCD_BLOSC_COMPRESSOR;
+    }
+    pCompressed->compressedSize = compressedSize;
+    setDoubleParam(marCCDCompressRatio, (double)arrayInfo.totalBytes / compressedSize);
+    if (compressTime > 0.) setDoubleParam(marCCDCompressRate, arrayInfo.totalBytes / compressTime / 1.e6);
+    return pCompressed;
+}
+
+/** Starts the streaming server that frames are sent to.
+  * \param[in] tcpPort The TCP port to listen on.
+  * \param[in] queueSize The maximum number of frames queued for each client. */
+asynStatus marCCD::configStream(const char *interfaceName, int tcpPort, int queueSize)
+{
+    marCCDStream *pNewStream;
+    const char *functionName = "configStream";
+
+    if (this->pStream) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: streaming server already configured\n", driverName, functionName);
+        return asynError;
+    }
+    pNewStream = new marCCDStream(interfaceName, tcpPort, queueSize);
+    if (pNewStream->start()) {
+        delete pNewStream;
+        return asynError;
+    }
+    epicsTimeGetCurrent(&this->streamRateTime);
+    this->streamRateBytes = 0.;
+    this->pStream = pNewStream;
+    return asynSuccess;
+}
+
+/** Starts the HTTP server for the metrics.
+  * \param[in] interfaceName The IP address to listen on, "" for 127.0.0.1.
+  * \param[in] tcpPort The TCP port to listen on. */
+asynStatus marCCD::configMetrics(const char *interfaceName, int tcpPort)
+{
+    marCCDMetrics *pNewMetrics;
+    const char *functionName = "configMetrics";
+
+    if (this->pMetrics) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: metrics server already configured\n", driverName, functionName);
+        return asynError;
+    }
+    pNewMetrics = new marCCDMetrics(this->portName, interfaceName, tcpPort);
+    if (pNewMetrics->start()) {
+        delete pNewMetrics;
+        return asynError;
+    }
+    this->pMetrics = pNewMetrics;
+    return asynSuccess;
+}
+
+/** Sets the scheduler of the exposure timer thread.
+  * \param[in] priority The SCHED_FIFO priority from 1 to 99, or 0 for the normal scheduler. */
+asynStatus marCCD::configTimer(int priority)
+{
+    const char *functionName = "configTimer";
+
+    if ((priority < 0) || (priority > 99)) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: invalid SCHED_FIFO priority %d\n", driverName, functionName, priority);
+        return asynError;
+    }
+    this->pTimer->setRealTime(priority);
+    return asynSuccess;
+}
+
+/** Creates the shared memory ring that frames are published to.
+  * \param[in] shmName The name of the POSIX shared memory object.
+  * \param[in] numSlots The number of frames in the ring.
+  * \param[in] maxSizeMB The size of each slot in MB.
+  * \param[in] policy 0 to overwrite the oldest frame when the ring is full, 1 to wait for the consumer. */
+asynStatus marCCD::configShmRing(const char *shmName, int numSlots, int maxSizeMB, int policy)
+{
+    marCCDShmRing *pRing;
+    const char *functionName = "configShmRing";
+
+    if (this->pShmRing) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: shared memory ring already configured\n", driverName, functionName);
+        return asynError;
+    }
+    pRing = new marCCDShmRing(shmName, numSlots, (size_t)maxSizeMB * 1024 * 1024, 
+                              policy ? marCCDShmBlock : marCCDShmOverwrite);
+    if (pRing->open()) {
+        delete pRing;
+        return asynError;
+    }
+    this->pShmRing = pRing;
+    return asynSuccess;
+}
+
+/** Copies a frame into the ring of recently read frames, discarding the oldest frames to stay within
+  * MAR_RING_SIZE frames and MAR_RING_MAX_MEMORY.  The copy is made after the frame has been processed,
+  * so the ring has the pixels that were passed to the plugins.  The ring allocates its own memory,
+  * so it never holds buffers of the NDArrayPool.
+  * \param[in] pImage The frame to add. */
+void marCCD::ringAdd(NDArray *pImage)
+{
+    NDArrayInfo_t arrayInfo;
+    marCCDRingFrame *pFrame;
+    double maxMemory;
+    size_t maxBytes;
+    void *pData = NULL;
+    size_t dataSize = 0;
+    int ringSize;
+    const char *functionName = "ringAdd";
+
+    getIntegerParam(marCCDRingSize, &ringSize);
+    if ((ringSize <= 0) || (this->ringAlloc <= 0)) return;
+    if (ringSize > this->ringAlloc) ringSize = this->ringAlloc;
+    getDoubleParam(marCCDRingMaxMemory, &maxMemory);
+    pImage->getInfo(&arrayInfo);
+    maxBytes = (size_t)-1;
+    if (maxMemory > 0.) maxBytes = (size_t)(maxMemory * 1024. * 1024.);
+    if (arrayInfo.totalBytes > maxBytes) return;
+
+    /* Discard the oldest frames until the new one fits.  The buffer of the last one is reused. */
+    while ((this->ringCount > 0) &&
+           ((this->ringCount >= ringSize) || (this->ringBytes + arrayInfo.totalBytes > maxBytes))) {
+        pFrame = &this->ringFrames[this->ringHead];
+        free(pData);
+        pData = pFrame->pData;
+        dataSize = pFrame->dataSize;
+        this->ringBytes -= pFrame->dataSize;
+        pFrame->pData = NULL;
+        pFrame->dataSize = 0;
+        this->ringHead = (this->ringHead + 1) % this->ringAlloc;
+        this->ringCount--;
+    }
+    if (dataSize != arrayInfo.totalBytes) {
+        free(pData);
+        dataSize = arrayInfo.totalBytes;
+        pData = malloc(dataSize);
+    }
+    if (!pData) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: error allocating %lu bytes for the ring\n",
+            driverName, functionName, (unsigned long)arrayInfo.totalBytes);
+        setIntegerParam(marCCDRingNumFrames, this->ringCount);
+        return;
+    }
+    pFrame = &this->ringFrames[(this->ringHead + this->ringCount) % this->ringAlloc];
+    memcpy(pData, pImage->pData, arrayInfo.totalBytes);
+    pFrame->pData = pData;
+    pFrame->dataSize = dataSize;
+    pFrame->dims[0] = pImage->dims[0].size;
+    pFrame->dims[1] = pImage->dims[1].size;
+    pFrame->dataType = pImage->dataType;
+    pFrame->uniqueId = pImage->uniqueId;
+    pFrame->timeStamp = pImage->timeStamp;
+    pFrame->epicsTS = pImage->epicsTS;
+    pFrame->pAttributeList->clear();
+    pImage->pAttributeList->copy(pFrame->pAttributeList);
+    this->ringCount++;
+    this->ringAdded++;
+    this->ringBytes += dataSize;
+    setIntegerParam(marCCDRingNumFrames, this->ringCount);
+}
+
+/** Frees all of the frames in the ring of recently read frames */
+void marCCD::ringClear()
+{
+    marCCDRingFrame *pFrame;
+    int i;
+
+    for (i=0; i<this->ringCount; i++) {
+        pFrame = &this->ringFrames[(this->ringHead + i) % this->ringAlloc];
+        free(pFrame->pData);
+        pFrame->pData = NULL;
+        pFrame->dataSize = 0;
+        pFrame->pAttributeList->clear();
+    }
+    this->ringHead = 0;
+    this->ringCount = 0;
+    this->ringBytes = 0;
+    setIntegerParam(marCCDRingNumFrames, 0);
+}
+
+/** Changes the maximum number of frames in the ring of recently read frames.
+  * Any frames currently in the ring are discarded.
+  * \param[in] size The new maximum number of frames; 0 disables the ring. */
+asynStatus marCCD::ringResize(int size)
+{
+    int i;
+
+    ringClear();
+    for (i=0; i<this->ringAlloc; i++) delete this->ringFrames[i].pAttributeList;
+    free(this->ringFrames);
+    this->ringFrames = NULL;
+    this->ringAlloc = 0;
+    if (size <= 0) return asynSuccess;
+    this->ringFrames = (marCCDRingFrame *)calloc(size, sizeof(marCCDRingFrame));
+    if (!this->ringFrames) return asynError;
+    for (i=0; i<size; i++) this->ringFrames[i].pAttributeList = new NDAttributeList;
+    this->ringAlloc = size;
+    return asynSuccess;
+}
+
+/** Replays the frames in the ring of recently read frames, oldest first, either to the NDArray
+  * callbacks or to TIFF files.  The files are written to NDFilePath with names constructed from
+  * NDFileName and the uniqueId of each frame.  The ring is left unchanged.
+  * Each frame is copied, into an NDArray for the callbacks or a scratch buffer for the files, and
+  * the lock is released while it is passed on.  Frames that acquisition discards from the ring in
+  * the meantime are skipped.
+  * \param[in] dumpMode marCCDRingDumpCallbacks or marCCDRingDumpFiles. */
+asynStatus marCCD::ringDump(int dumpMode)
+{
+    marCCDRingFrame *pFrame;
+    NDArray *pArray;
+    void *pCopy = NULL;
+    size_t copySize = 0;
+    size_t totalBytes;
+    size_t dims[2];
+    NDDataType_t dataType;
+    int uniqueId;
+    epicsUInt64 frame, oldest, last;
+    char filePath[MAX_FILENAME_LEN];
+    char fileName[MAX_FILENAME_LEN];
+    char fullFileName[MAX_FILENAME_LEN];
+    asynStatus status = asynSuccess;
+    const char *functionName = "ringDump";
+
+    getStringParam(NDFilePath, sizeof(filePath), filePath);
+    getStringParam(NDFileName, sizeof(fileName), fileName);
+    last = this->ringAdded;
+    for (frame = this->ringAdded - this->ringCount; frame < last; frame++) {
+        oldest = this->ringAdded - this->ringCount;
+        if (frame < oldest) continue;
+        pFrame = &this->ringFrames[(this->ringHead + (int)(frame - oldest)) % this->ringAlloc];
+        dims[0] = pFrame->dims[0];
+        dims[1] = pFrame->dims[1];
+        dataType = pFrame->dataType;
+        uniqueId = pFrame->uniqueId;
+        totalBytes = dims[0] * dims[1] * pixelBytes(dataType);
+        if (dumpMode == marCCDRingDumpFiles) {
+            if (copySize < totalBytes) {
+                free(pCopy);
+                copySize = totalBytes;
+                pCopy = malloc(copySize);
+                if (!pCopy) {
+                    status = asynError;
+                    break;
+                }
+            }
+            memcpy(pCopy, pFrame->pData, totalBytes);
+            this->unlock();
+            epicsSnprintf(fullFileName, sizeof(fullFileName), "%s%s_ring_%6.6d.tif",
+                          filePath, fileName, uniqueId);
+            if (writeTiff(fullFileName, dims, dataType, pCopy)) status = asynError;
+            this->lock();
+        } else {
+            pArray = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+            if (!pArray) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                     "%s:%s: no NDArray available for frame %d\n",
+                     driverName, functionName, uniqueId);
+                status = asynError;
+                break;
+            }
+            memcpy(pArray->pData, pFrame->pData, totalBytes);
+            pArray->uniqueId = uniqueId;
+            pArray->timeStamp = pFrame->timeStamp;
+            pArray->epicsTS = pFrame->epicsTS;
+            pFrame->pAttributeList->copy(pArray->pAttributeList);
+            /* Must release the lock here, or we can get into a deadlock, because we can
+             * block on the plugin lock, and the plugin can be calling us */
             this->unlock();
-            epicsThreadSleep(MARCCD_POLL_DELAY);
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                 "%s:%s: calling NDArray callback for frame %d\n",
+                 driverName, functionName, uniqueId);
+            {
+                marCCDTraceSpan span("doCallbacks", "ring");
+                doCallbacksGenericPointer(pArray, NDArrayData, MARCCD_ADDR_FRAME);
+            }
+            pArray->release();
             this->lock();
-            status = getState();
         }
-        getImageData();
     }
+    free(pCopy);
+    return status;
 }
 
-asynStatus marCCD::getImageData()
+/** This function writes a frame to an uncompressed TIFF file with a single strip.
+  * It is used to save the frames in the ring, which do not come from the marccd server,
+  * so the file has no marccd header.
+  */
+asynStatus marCCD::writeTiff(const char *fileName, const size_t *dims, NDDataType_t dataType, void *pData)
 {
-    // Note: In series mode this function is called even if array callbacks are disabled, because it
-    // is used to determine when the next file has been written
-    asynStatus status;
-    char fullFileName[MAX_FILENAME_LEN];
-    size_t dims[2];
-    int itemp;
-    int imageCounter;
-    int arrayCallbacks;
-    NDArray *pImage;
-    char statusMessage[MAX_MESSAGE_SIZE];
-    const char *functionName = "getImageData";
-
-    /* Inquire about the image dimensions */
-    getConfig();
-    getStringParam(NDFullFileName, MAX_FILENAME_LEN, fullFileName);
-    getIntegerParam(NDArraySizeX, &itemp); dims[0] = itemp;
-    getIntegerParam(NDArraySizeY, &itemp); dims[1] = itemp;
-    getIntegerParam(NDArrayCounter, &imageCounter);
-    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-    pImage = this->pNDArrayPool->alloc(2, dims, NDUInt16, 0, NULL);
-
-    epicsSnprintf(statusMessage, sizeof(statusMessage), "Reading TIFF file %s", fullFileName);
-    setStringParam(ADStatusMessage, statusMessage);
-    callParamCallbacks();
-    status = readTiff(fullFileName, pImage); 
+    TIFF *tiff;
+    size_t bytesPerElement = pixelBytes(dataType);
+    size_t totalBytes = dims[0] * dims[1] * bytesPerElement;
+    int sampleFormat;
+    tmsize_t size;
+    const char *functionName = "writeTiff";
 
-    if (arrayCallbacks) {
-        /* Put the frame number and time stamp into the buffer */
-        pImage->uniqueId = imageCounter;
-        pImage->timeStamp = this->acqStartTime.secPastEpoch + this->acqStartTime.nsec / 1.e9;
-        updateTimeStamp(&pImage->epicsTS);
+    switch (dataType) {
+        case NDInt8:
+        case NDInt16:
+        case NDInt32:
+            sampleFormat = SAMPLEFORMAT_INT;
+            break;
+        case NDFloat32:
+        case NDFloat64:
+            sampleFormat = SAMPLEFORMAT_IEEEFP;
+            break;
+        default:
+            sampleFormat = SAMPLEFORMAT_UINT;
+            break;
+    }
+    tiff = TIFFOpen(fileName, "w");
+    if (tiff == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s error opening file %s\n",
+            driverName, functionName, fileName);
+        return asynError;
+    }
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, (epicsUInt32)dims[0]);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, (epicsUInt32)dims[1]);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8*bytesPerElement);
+    TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, sampleFormat);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, (epicsUInt32)dims[1]);
+    size = TIFFWriteEncodedStrip(tiff, 0, pData, totalBytes);
+    TIFFClose(tiff);
+    if (size != (tmsize_t)totalBytes) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s error writing file %s\n",
+            driverName, functionName, fileName);
+        return asynError;
+    }
+    return asynSuccess;
+}
 
-        /* Get any attributes that have been defined for this driver */        
-        this->getAttributes(pImage->pAttributeList);
+/** State for binning the preview a band of rows at a time while a frame is decoded */
+typedef struct {
+    NDArray *pImage;
+    NDArray *pPreview;
+    size_t rowsBinned;
+} marCCDPreviewBands;
 
-        /* Call the NDArray callback */
-        /* Must release the lock here, or we can get into a deadlock, because we can
-         * block on the plugin lock, and the plugin can be calling us */
-        this->unlock();
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-             "%s:%s: calling NDArray callback\n", driverName, functionName);
-        doCallbacksGenericPointer(pImage, NDArrayData, 0);
-        this->lock();
-    }
+/** Bins the complete bands of rows decoded so far while they are still in the cache */
+static void binStripsC(void *pvt, size_t totalSize)
+{
+    marCCDPreviewBands *pBands = (marCCDPreviewBands *)pvt;
+    NDArray *pImage = pBands->pImage;
+    NDArray *pPreview = pBands->pPreview;
+    size_t nx = pImage->dims[0].size;
+    int previewBin = pPreview->dims[0].binning;
+    size_t numOutRows;
 
-    /* Free the image buffer */
-    pImage->release();
-    return status;
+    numOutRows = totalSize / (nx * pixelBytes(pImage->dataType)) / previewBin;
+    if (numOutRows > pPreview->dims[1].size) numOutRows = pPreview->dims[1].size;
+    binArrayRows(pImage, pPreview, pBands->rowsBinned, numOutRows - pBands->rowsBinned);
+    pBands->rowsBinned = numOutRows;
 }
 
 /** This function reads TIFF files using libTiff; it is not intended to be general,
  * it is intended to read the TIFF files that marCCDServer creates.  It checks to make sure
  * that the creation time of the file is after a start time passed to it, to force it to
  * wait for a new file to be created.
+ * If pPreview is not NULL the frame is also binned into it by pPreview->dims[0].binning, 
+ * a band of rows at a time as the strips are read.
+ * MAR_READ_MODE selects how the file goes through the page cache: normally, dropped from it
+ * after it is read, or read with O_DIRECT into a buffer from the pool and decoded from memory.
+ * The pixels can be 16 or 32-bit unsigned integers or 32-bit floats.  If the type of the file is
+ * not the type of pImage, NDDataType is set to the type of the file and asynOverflow is returned,
+ * so the caller can allocate arrays of that type and read the file again.
  */
-asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
+asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage, NDArray *pPreview)
 {
     int fd=-1;
     int fileExists=0;
@@ -353,16 +1886,25 @@ asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
     double deltaTime;
     int status=-1;
     const char *functionName = "readTiff";
-    int size;
-    size_t totalSize;
-    int numStrips, strip;
-    char *buffer;
+    ssize_t totalSize;
     TIFF *tiff=NULL;
     epicsUInt32 uval;
     double timeout;
+    marCCDPreviewBands preview;
+    int readMode;
+    int fileType;
+    ssize_t fileSize;
+    size_t cachedSize, directSize;
+    size_t directDims[1];
+    NDArray *pDirect=NULL;
+    char *pAligned;
+    epicsUInt64 readStart, foundTime;
+    marCCDTraceSpan readSpan("readTiff", fileName);
 
     getDoubleParam(marCCDTiffTimeout, &timeout);
+    getIntegerParam(marCCDReadMode, &readMode);
     deltaTime = 0.;
+    readStart = epicsMonotonicGet();
     epicsTimeGetCurrent(&tStart);
     epicsTimeToTime_t(&startTime, &tStart);
     
@@ -371,11 +1913,13 @@ asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
     TIFFSetWarningHandler(NULL);
     
     while (deltaTime <= timeout) {
+        marCCDTraceSpan waitSpan("waitFile");
         fd = open(fileName, O_RDONLY, 0);
-        if ((fd >= 0) && (timeout != 0.)) {
+        /* There is nothing to wait for if timeout==0, which is used for reading existing files */
+        if ((fd >= 0) && (timeout == 0.)) break;
+        if (fd >= 0) {
             fileExists = 1;
-            /* The file exists.  Make sure it is a new file, not an old one.
-             * We don't do this check if timeout==0, which is used for reading flat field files */
+            /* The file exists.  Make sure it is a new file, not an old one. */
             status = fstat(fd, &statBuff);
             if (status){
                 asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
@@ -390,11 +1934,8 @@ asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
             close(fd);
             fd = -1;
         }
-        /* Sleep, but check for stop event, which can be used to abort a long acquisition */
-        unlock();
-        status = epicsEventWaitWithTimeout(this->stopEventId, FILE_READ_DELAY);
-        lock();
-        if (status == epicsEventWaitOK) {
+        /* Sleep, but return if the acquisition is aborted */
+        if (waitAbortable(FILE_READ_DELAY)) {
             return(asynError);
         }
         epicsTimeGetCurrent(&tCheck);
@@ -408,15 +1949,63 @@ asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                 "  file exists but is more than 10 seconds old, possible clock synchronization problem\n");
         } 
+        if (this->pMetrics) this->pMetrics->count(marCCDCounterTiffTimeouts);
         return(asynError);
     }
     close(fd);
+    foundTime = epicsMonotonicGet();
+    if (this->pMetrics) this->pMetrics->observe(marCCDStageFileWait, (foundTime - readStart) / 1.e9);
 
     deltaTime = 0.;
     while (deltaTime <= timeout) {
+        marCCDTraceSpan decodeSpan("decodeTiff");
         /* At this point we know the file exists, but it may not be completely written yet.
-         * If we get errors then try again */
-        tiff = TIFFOpen(fileName, "rc");
+         * If we get errors then try again.
+         * Find out how much of the file is already in the page cache before we read it */
+        fileSize = 0;
+        cachedSize = 0;
+        fd = open(fileName, O_RDONLY, 0);
+        if (fd >= 0) {
+            if (fstat(fd, &statBuff) == 0) {
+                fileSize = statBuff.st_size;
+                cachedSize = marCCDTiffCachedBytes(fd, fileSize);
+#ifdef __APPLE__
+                epicsTimeFromTimespec(&this->fileTime, &statBuff.st_mtimespec);
+#else
+                epicsTimeFromTimespec(&this->fileTime, &statBuff.st_mtim);
+#endif
+            }
+            close(fd);
+            fd = -1;
+        }
+        tiff = NULL;
+        if (readMode == marCCDReadDirect) {
+            /* Read the whole file with O_DIRECT into an aligned buffer from the pool, and decode it from there */
+            directSize = (fileSize + MARCCD_TIFF_DIRECT_ALIGN - 1) & ~(size_t)(MARCCD_TIFF_DIRECT_ALIGN - 1);
+            if (pDirect && (pDirect->dataSize < directSize + MARCCD_TIFF_DIRECT_ALIGN)) {
+                pDirect->release();
+                pDirect = NULL;
+            }
+            if (!pDirect) {
+                directDims[0] = directSize + MARCCD_TIFF_DIRECT_ALIGN;
+                pDirect = this->pNDArrayPool->alloc(1, directDims, NDInt8, 0, NULL);
+            }
+            if (pDirect) {
+                pAligned = (char *)(((size_t)pDirect->pData + MARCCD_TIFF_DIRECT_ALIGN - 1) & 
+                                    ~(size_t)(MARCCD_TIFF_DIRECT_ALIGN - 1));
+                fileSize = marCCDTiffReadDirect(fileName, pAligned, directSize);
+                if (fileSize < 0) {
+                    status = asynError;
+                    goto retry;
+                }
+                tiff = marCCDTiffOpenMemory(fileName, pAligned, fileSize);
+            } else {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                    "%s::%s, no buffer for O_DIRECT, reading %s normally\n",
+                    driverName, functionName, fileName);
+            }
+        }
+        if (!tiff && !pDirect) tiff = TIFFOpen(fileName, "rc");
         if (tiff == NULL) {
             status = asynError;
             goto retry;
@@ -437,23 +2026,36 @@ asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
                 driverName, functionName, uval, (unsigned long)pImage->dims[1].size);
             goto retry;
         }
-        numStrips= TIFFNumberOfStrips(tiff);
-        buffer = (char *)pImage->pData;
-        totalSize = 0;
-        for (strip=0; (strip < numStrips) && (totalSize < pImage->dataSize); strip++) {
-            size = TIFFReadEncodedStrip(tiff, 0, buffer, pImage->dataSize-totalSize);
-            if (size == -1) {
-                /* There was an error reading the file.  Most commonly this is because the file
-                 * was not yet completely written.  Try again. */
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                    "%s::%s, error reading TIFF file %s\n",
+        fileType = tiffDataType(tiff);
+        if (fileType != pImage->dataType) {
+            TIFFClose(tiff);
+            if (pDirect) pDirect->release();
+            if (fileType < 0) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s::%s, unsupported pixel type in file %s\n",
                     driverName, functionName, fileName);
-                goto retry;
+                return(asynError);
             }
-            buffer += size;
-            totalSize += size;
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s::%s, pixel type of %s is %d, not %d\n",
+                driverName, functionName, fileName, fileType, pImage->dataType);
+            setIntegerParam(NDDataType, fileType);
+            return(asynOverflow);
+        }
+        preview.pImage = pImage;
+        preview.pPreview = pPreview;
+        preview.rowsBinned = 0;
+        totalSize = marCCDTiffReadStrips(tiff, pImage->pData, pImage->dataSize, 
+                                         pPreview ? binStripsC : NULL, &preview);
+        if (totalSize < 0) {
+            /* There was an error reading the file.  Most commonly this is because the file
+             * was not yet completely written.  Try again. */
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s::%s, error reading TIFF file %s\n",
+                driverName, functionName, fileName);
+            goto retry;
         }
-        if (totalSize > pImage->dataSize) {
+        if ((size_t)totalSize > pImage->dataSize) {
             status = asynError;
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                 "%s::%s, file size too large =%lu, must be <= %lu\n",
@@ -461,23 +2063,49 @@ asynStatus marCCD::readTiff(const char *fileName, NDArray *pImage)
             goto retry;
         }
         /* Sucesss! */
+        this->bytesRead += fileSize;
+        this->bytesCached += cachedSize;
+        /* Files that already existed, e.g. when replaying, did not come from the server */
+        if (marCCDProtocolLogEnabled && (timeout > 0.)) {
+            TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &uval);
+            marCCDProtocolLogFile(fileName, fileSize, (int)pImage->dims[0].size, (int)pImage->dims[1].size,
+                                  (int)(8 * pixelBytes(pImage->dataType)), (int)uval, foundTime);
+        }
+        if (this->pMetrics) {
+            this->pMetrics->count(marCCDCounterBytesRead, fileSize);
+            this->pMetrics->observe(marCCDStageDecode, (epicsMonotonicGet() - foundTime) / 1.e9);
+        }
         break;
         
         retry:
         if (tiff != NULL) TIFFClose(tiff);
         tiff = NULL;
-        /* Sleep, but check for stop event, which can be used to abort a long acquisition */
-        unlock();
-        status = epicsEventWaitWithTimeout(this->stopEventId, FILE_READ_DELAY);
-        lock();
-        if (status == epicsEventWaitOK) {
+        if (this->pMetrics) this->pMetrics->count(marCCDCounterTiffRetries);
+        /* Sleep, but return if the acquisition is aborted */
+        if (waitAbortable(FILE_READ_DELAY)) {
+            if (pDirect) pDirect->release();
             return(asynError);
         }
         epicsTimeGetCurrent(&tCheck);
         deltaTime = epicsTimeDiffInSeconds(&tCheck, &tStart);
     }
 
-    if (tiff != NULL) TIFFClose(tiff);
+    if (tiff == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s timeout reading file %s\n",
+            driverName, functionName, fileName);
+        if (this->pMetrics) this->pMetrics->count(marCCDCounterTiffTimeouts);
+        if (pDirect) pDirect->release();
+        return(asynError);
+    }
+    TIFFClose(tiff);
+    if (pDirect) pDirect->release();
+    if (readMode == marCCDReadDontNeed) {
+        /* Drop the file from the page cache, now that libtiff has unmapped it */
+        marCCDTiffDropCache(fileName);
+    }
+    setDoubleParam(marCCDBytesRead, this->bytesRead / 1.e6);
+    if (this->bytesRead > 0.) setDoubleParam(marCCDCacheHit, 100. * this->bytesCached / this->bytesRead);
 
     return(asynSuccess);
 }   
@@ -487,13 +2115,18 @@ asynStatus marCCD::writeServer(const char *output)
     size_t nwrite;
     asynStatus status;
     asynUser *pasynUser = this->pasynUserServer;
+    epicsUInt64 sendTime;
     const char *functionName="writeServer";
+    marCCDTraceSpan span("writeServer", output);
 
     /* Flush any stale input, since the next operation is likely to be a read */
     status = pasynOctetSyncIO->flush(pasynUser);
+    sendTime = epicsMonotonicGet();
     status = pasynOctetSyncIO->write(pasynUser, output,
                                      strlen(output), MARCCD_SERVER_TIMEOUT,
                                      &nwrite);
+    marCCDProtocolLogText(marCCDProtocolWrite, status, output, sendTime);
+    if (this->pMetrics) this->pMetrics->count(marCCDCounterCommands);
                                         
     if (status) asynPrint(pasynUser, ASYN_TRACE_ERROR,
                     "%s:%s, status=%d, sent\n%s\n",
@@ -501,7 +2134,7 @@ asynStatus marCCD::writeServer(const char *output)
 
     /* Set output string so it can get back to EPICS */
     setStringParam(ADStringToServer, output);
-    callParamCallbacks();
+    statusParamCallbacks(0);
     
     return(status);
 }
@@ -514,33 +2147,54 @@ asynStatus marCCD::readServer(char *input, size_t maxChars, double timeout)
     asynUser *pasynUser = this->pasynUserServer;
     int eomReason;
     const char *functionName="readServer";
+    marCCDTraceSpan span("readServer");
 
     status = pasynOctetSyncIO->read(pasynUser, input, maxChars, timeout,
                                     &nread, &eomReason);
+    marCCDProtocolLogText(marCCDProtocolRead, status, status ? "" : input, epicsMonotonicGet());
+    span.setDetail(input);
     if (status) asynPrint(pasynUser, ASYN_TRACE_ERROR,
                     "%s:%s, timeout=%f, status=%d received %lu bytes\n%s\n",
                     driverName, functionName, timeout, status, (unsigned long)nread, input);
     /* Set output string so it can get back to EPICS */
     setStringParam(ADStringFromServer, input);
-    callParamCallbacks();
+    statusParamCallbacks(0);
     return(status);
 }
 
 asynStatus marCCD::writeReadServer(const char *output, char *input, size_t maxChars, double timeout)
 {
     asynStatus status;
+    epicsUInt64 start = epicsMonotonicGet();
     
     status = writeServer(output);
     if (status) return status;
     status = readServer(input, maxChars, timeout);
+    if (this->pMetrics && (status == asynSuccess)) {
+        this->pMetrics->count(marCCDCounterRoundTrips);
+        this->pMetrics->observe(marCCDStageRoundTrip, (epicsMonotonicGet() - start) / 1.e9);
+    }
     return status;
 }
 
+/** Returns the value of a header field for a frame, from the array of values for each frame, or
+  * value if the array is shorter */
+double marCCD::seqValue(int field, int frame, double value)
+{
+    if ((frame >= 0) && ((size_t)frame < this->seqLength[field])) return this->seqValues[field][frame];
+    return value;
+}
+
+/** Sends the header of the frame headerFrame to the server.  If MAR_HEADER_SEQUENCE is set each frame
+  * of a rotation sweep has its own start_phi, StartPhi + frame*RotationRange, and the fields with
+  * arrays of values for each frame take the value for this frame. */
 asynStatus marCCD::writeHeader()
 {
     asynStatus status;
     double detectorDistance, beamX, beamY, exposureTime, startPhi, rotationRange, twoTheta, wavelength;
     char rotationAxis[MAX_MESSAGE_SIZE], fileComments[MAX_MESSAGE_SIZE], datasetComments[MAX_MESSAGE_SIZE];
+    int sequence;
+    int frame = this->headerFrame;
     //const char *functionName="writeHeader";
     
     getDoubleParam(marCCDDetectorDistance, &detectorDistance);
@@ -554,6 +2208,15 @@ asynStatus marCCD::writeHeader()
     getDoubleParam(marCCDWavelength, &wavelength);
     getStringParam(marCCDFileComments, sizeof(fileComments), fileComments);
     getStringParam(marCCDDatasetComments, sizeof(datasetComments), datasetComments);
+    getIntegerParam(marCCDHeaderSequence, &sequence);
+    if (sequence) {
+        startPhi         = seqValue(marCCDSeqFieldPhi, frame, startPhi + frame * rotationRange);
+        detectorDistance = seqValue(marCCDSeqFieldDistance, frame, detectorDistance);
+        twoTheta         = seqValue(marCCDSeqFieldTwoTheta, frame, twoTheta);
+        wavelength       = seqValue(marCCDSeqFieldWavelength, frame, wavelength);
+    }
+    setIntegerParam(marCCDHeaderFrame, frame);
+    setDoubleParam(marCCDHeaderPhi, startPhi);
 
     epicsSnprintf(this->toServer, sizeof(this->toServer),
                   "header,"
@@ -593,7 +2256,9 @@ int marCCD::getState()
     ADStatus_t adStatus = ADStatusIdle;
     asynStatus status;
     int acquireStatus, readoutStatus, correctStatus, writingStatus, dezingerStatus, seriesStatus;
+    marCCDTraceSpan span("getState");
     
+    if (this->pMetrics) this->pMetrics->count(marCCDCounterStatePolls);
     status = writeReadServer("get_state", this->fromServer, sizeof(this->fromServer),
                               MARCCD_SERVER_TIMEOUT);
     if (status) return(adStatus);
@@ -624,10 +2289,35 @@ int marCCD::getState()
     if ((acquireStatus | readoutStatus | correctStatus | writingStatus | dezingerStatus) & 
         TASK_STATUS_ERROR) adStatus = ADStatusError;
     setIntegerParam(ADStatus, adStatus);
-    callParamCallbacks();
+    /* Changes of the server state (Idle, Error, Busy) and of ADStatus are published immediately,
+     * other task status changes are coalesced.  The error bit of a task stays set for the rest of
+     * a series, so only the transition to Error is forced, not every poll while it is set. */
+    statusParamCallbacks((marStatus != TASK_STATE(this->publishedMarState)) || 
+                         (adStatus != this->publishedADStatus));
     return(marState);
 }
 
+/** Does callbacks for the status parameters that are updated in the polling loops 
+  * (MAR_STATE and the task status, ADStatus, ADTimeRemaining, ADStringToServer and ADStringFromServer).
+  * The parameter library coalesces the changes, and they are published at most MAR_STATUS_RATE 
+  * times per second.  MAR_STATUS_RATE=0 publishes every change.  The threads that poll the server
+  * call this with force=1 before they go idle, so the last change is not held back indefinitely.
+  * \param[in] force If non-zero the parameters are published immediately. */
+void marCCD::statusParamCallbacks(int force)
+{
+    epicsTimeStamp now;
+    double rate;
+
+    getDoubleParam(marCCDStatusRate, &rate);
+    epicsTimeGetCurrent(&now);
+    if (!force && (rate > 0.) &&
+        (epicsTimeDiffInSeconds(&now, &this->statusCallbackTime) < 1./rate)) return;
+    this->statusCallbackTime = now;
+    getIntegerParam(marCCDState, &this->publishedMarState);
+    getIntegerParam(ADStatus, &this->publishedADStatus);
+    callParamCallbacks();
+}
+
 
 asynStatus marCCD::getServerMode()
 {
@@ -650,7 +2340,7 @@ asynStatus marCCD::getServerMode()
 
 asynStatus marCCD::getConfig()
 {
-    int sizeX, sizeY, binX, binY, imageSize, frameShift;
+    int sizeX, sizeY, binX, binY, imageSize, frameShift, dataType;
     //int gatingMode;
     int readoutMode;
     double stability;
@@ -671,6 +2361,7 @@ asynStatus marCCD::getConfig()
     sscanf(this->fromServer, "%d,%d", &sizeX, &sizeY);
     setIntegerParam(NDArraySizeX, sizeX);
     setIntegerParam(NDArraySizeY, sizeY);
+    checkBadPixelMask(0);
     status = writeReadServer("get_bin", this->fromServer, sizeof(this->fromServer), MARCCD_SERVER_TIMEOUT);
     if (status) return(status);
     sscanf(this->fromServer, "%d,%d", &binX, &binY);
@@ -678,7 +2369,8 @@ asynStatus marCCD::getConfig()
     setIntegerParam(ADBinY, binY);
     setIntegerParam(ADMaxSizeX, sizeX*binX);
     setIntegerParam(ADMaxSizeY, sizeY*binY);
-    imageSize = sizeX * sizeY * sizeof(epicsInt16);
+    getIntegerParam(NDDataType, &dataType);
+    imageSize = sizeX * sizeY * (int)pixelBytes((NDDataType_t)dataType);
     setIntegerParam(NDArraySize, imageSize);
     status = writeReadServer("get_frameshift", this->fromServer, sizeof(this->fromServer),
                               MARCCD_SERVER_TIMEOUT);
@@ -688,64 +2380,453 @@ asynStatus marCCD::getConfig()
                               MARCCD_SERVER_TIMEOUT);
     sscanf(this->fromServer, "%lf", &stability);
     setDoubleParam(marCCDStability, stability);
+    if (this->connected) saveConfigCache();
     callParamCallbacks();
     return(asynSuccess);
 }
 
+/** Reads the server mode, configuration and state after the server port connects. 
+  * This is called with the lock held. */
+asynStatus marCCD::connectServer()
+{
+    asynStatus status;
+    
+    /* Get the server mode (1=marCCD, 2=High speed) */
+    status = getServerMode();
+    if (status) return status;
+    /* Compute the sensor size by reading the image size and the binning */
+    status = getConfig();
+    if (status) return status;
+    /* Read the current state of the server */
+    getState();
+    return asynSuccess;
+}
+
+/** Restores the server mode and detector geometry from the last connection, so that clients see
+  * the correct sizes before the server is connected. */
+void marCCD::loadConfigCache()
+{
+    FILE *fp;
+    char key[40];
+    double value;
+    int sizeX=0, sizeY=0, binX=1, binY=1;
+    int itemp;
+    const char *functionName = "loadConfigCache";
+
+    if (!this->configCacheFile) return;
+    fp = fopen(this->configCacheFile, "r");
+    if (!fp) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+            "%s:%s: cannot open configuration cache %s, the geometry is unknown until the server connects\n",
+            driverName, functionName, this->configCacheFile);
+        return;
+    }
+    while (fscanf(fp, "%39s %lf", key, &value) == 2) {
+        if      (!strcmp(key, "serverMode"))  this->serverMode = (int)value;
+        else if (!strcmp(key, "sizeX"))       sizeX = (int)value;
+        else if (!strcmp(key, "sizeY"))       sizeY = (int)value;
+        else if (!strcmp(key, "binX"))        binX = (int)value;
+        else if (!strcmp(key, "binY"))        binY = (int)value;
+        else if (!strcmp(key, "readoutMode")) setIntegerParam(marCCDReadoutMode, (int)value);
+        else if (!strcmp(key, "frameShift"))  setIntegerParam(marCCDFrameShift, (int)value);
+        else if (!strcmp(key, "stability"))   setDoubleParam(marCCDStability, value);
+    }
+    fclose(fp);
+    setIntegerParam(marCCDServerMode, this->serverMode);
+    setIntegerParam(NDArraySizeX, sizeX);
+    setIntegerParam(NDArraySizeY, sizeY);
+    setIntegerParam(ADBinX, binX);
+    setIntegerParam(ADBinY, binY);
+    setIntegerParam(ADMaxSizeX, sizeX*binX);
+    setIntegerParam(ADMaxSizeY, sizeY*binY);
+    getIntegerParam(NDDataType, &itemp);
+    setIntegerParam(NDArraySize, (int)(sizeX * sizeY * pixelBytes((NDDataType_t)itemp)));
+}
+
+/** Writes the server mode and detector geometry to the configuration cache if they have changed. 
+  * The file is replaced atomically, so it is never left partially written. */
+void marCCD::saveConfigCache()
+{
+    char contents[MAX_MESSAGE_SIZE];
+    char tempFile[MAX_FILENAME_LEN];
+    int sizeX, sizeY, binX, binY, readoutMode, frameShift;
+    double stability;
+    FILE *fp;
+    const char *functionName = "saveConfigCache";
+
+    if (!this->configCacheFile) return;
+    getIntegerParam(NDArraySizeX, &sizeX);
+    getIntegerParam(NDArraySizeY, &sizeY);
+    getIntegerParam(ADBinX, &binX);
+    getIntegerParam(ADBinY, &binY);
+    getIntegerParam(marCCDReadoutMode, &readoutMode);
+    getIntegerParam(marCCDFrameShift, &frameShift);
+    getDoubleParam(marCCDStability, &stability);
+    epicsSnprintf(contents, sizeof(contents), 
+        "serverMode %d\nsizeX %d\nsizeY %d\nbinX %d\nbinY %d\nreadoutMode %d\nframeShift %d\nstability %g\n",
+        this->serverMode, sizeX, sizeY, binX, binY, readoutMode, frameShift, stability);
+    if (!strcmp(contents, this->configCache)) return;
+    epicsSnprintf(tempFile, sizeof(tempFile), "%s.tmp", this->configCacheFile);
+    fp = fopen(tempFile, "w");
+    if (!fp || (fputs(contents, fp) < 0) || fclose(fp) || rename(tempFile, this->configCacheFile)) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: error writing configuration cache %s, errno=%d\n",
+            driverName, functionName, this->configCacheFile, errno);
+        return;
+    }
+    strcpy(this->configCache, contents);
+}
+
+/** Allocates the raw buffer we use to readTiff files when the NDArrayPool is exhausted.
+  * It is reallocated if the maximum size of the detector or the size of the pixels has increased. */
+void marCCD::allocScratch()
+{
+    size_t dims[2];
+    int itemp;
+    NDDataType_t dataType;
+    
+    getIntegerParam(ADMaxSizeX, &itemp); dims[0] = itemp;
+    getIntegerParam(ADMaxSizeY, &itemp); dims[1] = itemp;
+    getIntegerParam(NDDataType, &itemp); dataType = (NDDataType_t)itemp;
+    if ((dims[0] == 0) || (dims[1] == 0)) return;
+    if (this->pData && (this->pData->dataSize >= dims[0] * dims[1] * pixelBytes(dataType))) return;
+    if (this->pData) this->pData->release();
+    this->pData = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+}
+
+static void connectTaskC(void *drvPvt)
+{
+    marCCD *pPvt = (marCCD *)drvPvt;
+    
+    marCCDThreadStarted();
+    pPvt->connectTask();
+}
+
+/** Called by asynManager when the server port connects or disconnects */
+static void connectExceptionC(asynUser *pasynUser, asynException exception)
+{
+    marCCD *pPvt = (marCCD *)pasynUser->userPvt;
+    
+    if (exception == asynExceptionConnect) epicsEventSignal(pPvt->connectEventId);
+}
+
+/** This thread reads the server mode and configuration whenever the server port connects, so that
+  * the IOC starts without waiting for the server, and recovers when the server is restarted.  
+  * While the server cannot be reached it retries with a delay that doubles after each attempt,
+  * and it retries at once when asyn reports that the port has connected. */
+void marCCD::connectTask()
+{
+    asynStatus status;
+    int isConnected;
+    int reconnects;
+    int everConnected = 0;
+    double delay = MARCCD_CONNECT_MIN_DELAY;
+    const char *functionName = "connectTask";
+
+    this->lock();
+    while (1) {
+        if (!this->connected) {
+            status = connectServer();
+            if (status == asynSuccess) {
+                this->connected = 1;
+                if (everConnected) {
+                    getIntegerParam(marCCDReconnects, &reconnects);
+                    setIntegerParam(marCCDReconnects, reconnects+1);
+                }
+                everConnected = 1;
+                delay = MARCCD_CONNECT_MIN_DELAY;
+                saveConfigCache();
+                allocScratch();
+                setIntegerParam(marCCDConnected, 1);
+                setStringParam(ADStatusMessage, "Connected to marccd server");
+                callParamCallbacks();
+                asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+                    "%s:%s: connected to marccd server, server mode=%d\n",
+                    driverName, functionName, this->serverMode);
+            } else {
+                setStringParam(ADStatusMessage, "Waiting for marccd server");
+                callParamCallbacks();
+                this->unlock();
+                epicsEventWaitWithTimeout(this->connectEventId, delay);
+                this->lock();
+                delay *= 2.;
+                if (delay > MARCCD_CONNECT_MAX_DELAY) delay = MARCCD_CONNECT_MAX_DELAY;
+                continue;
+            }
+        }
+        this->unlock();
+        epicsEventWait(this->connectEventId);
+        this->lock();
+        pasynManager->isConnected(this->pasynUserConnect, &isConnected);
+        if (!isConnected) {
+            this->connected = 0;
+            setIntegerParam(marCCDConnected, 0);
+            setStringParam(ADStatusMessage, "Lost connection to marccd server");
+            callParamCallbacks();
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: lost connection to marccd server\n",
+                driverName, functionName);
+        }
+    }
+}
+
 /** This function is called when the exposure time timer expires */
-extern "C" {static void timerCallbackC(void *drvPvt)
+static void timerCallbackC(void *drvPvt)
 {
     marCCD *pPvt = (marCCD *)drvPvt;
     
    epicsEventSignal(pPvt->stopEventId);
-}}
+}
+
+void marCCD::setShutter(int open)
+{
+    ADShutterMode_t shutterMode;
+    int itemp;
+    double delay;
+    double shutterOpenDelay, shutterCloseDelay;
+    
+    getIntegerParam(ADShutterMode, &itemp); shutterMode = (ADShutterMode_t)itemp;
+    getDoubleParam(ADShutterOpenDelay, &shutterOpenDelay);
+    getDoubleParam(ADShutterCloseDelay, &shutterCloseDelay);
+    
+    switch (shutterMode) {
+        case ADShutterModeDetector:
+            if (open) {
+                /* Open the shutter */
+                writeServer("shutter,1");
+                /* This delay is to get the exposure time correct.  
+                * It is equal to the opening time of the shutter minus the
+                * closing time.  If they are equal then no delay is needed, 
+                * except use 1msec so delay is not negative and commands are 
+                * not back-to-back */
+                delay = shutterOpenDelay - shutterCloseDelay;
+                if (delay < .001) delay=.001;
+                epicsThreadSleep(delay);
+            } else {
+                /* Close shutter */
+                writeServer("shutter,0");
+                epicsThreadSleep(shutterCloseDelay);
+            }
+            /* The marCCD does not provide a way to read the actual shutter status, so
+             * set it to agree with the control value */
+            setIntegerParam(ADShutterStatus, open);
+            callParamCallbacks();
+            break;
+        default:
+            ADDriver::setShutter(open);
+            break;
+    }
+}
+
+
+/** Waits for a time with the driver lock released, returning early if the acquisition is aborted.
+  * The waits for the server, the files and the NDArrayPool use this, so an abort is seen at once.  It waits on its own event and
+  * not on stopEventId, which also ends the exposure, so that a wait in another thread cannot take the
+  * end of an exposure from acquireFrame.
+  * \param[in] timeout The time to wait in seconds.
+  * \return asynError if the acquisition was aborted, before or during the wait. */
+asynStatus marCCD::waitAbortable(double timeout)
+{
+    if (this->abortRequested) return asynError;
+    this->unlock();
+    epicsEventWaitWithTimeout(this->abortEventId, timeout);
+    this->lock();
+    if (!this->abortRequested) return asynSuccess;
+    /* Pass the abort on to any other thread waiting on the event */
+    epicsEventSignal(this->abortEventId);
+    return asynError;
+}
+
+/** Waits for a time with the driver lock released, returning early if the acquisition is stopped or
+  * aborted.  It waits on stopEventId, which also ends the exposure, so it is only used by the acquisition
+  * thread, between exposures.
+  * \param[in] timeout The time to wait in seconds.
+  * \return asynError if the acquisition was stopped or aborted, before or during the wait. */
+asynStatus marCCD::waitStoppable(double timeout)
+{
+    int acquire;
+    int status;
+
+    getIntegerParam(ADAcquire, &acquire);
+    if (!acquire || this->abortRequested) return asynError;
+    this->unlock();
+    status = epicsEventWaitWithTimeout(this->stopEventId, timeout);
+    this->lock();
+    getIntegerParam(ADAcquire, &acquire);
+    return ((status == epicsEventWaitOK) || !acquire || this->abortRequested) ? asynError : asynSuccess;
+}
+
+/** Aborts the acquisition.  Every wait returns, the exposure ends, and the acquisition thread then
+  * calls finishAbort().  Called with the lock held. */
+void marCCD::requestAbort()
+{
+    this->abortRequested = 1;
+    this->abortTime = epicsMonotonicGet();
+    setIntegerParam(ADAcquire, 0);
+    epicsEventSignal(this->abortEventId);
+    epicsEventSignal(this->stopEventId);
+    this->pTimer->cancel();
+}
+
+/** Completes an acquisition that was aborted.  The server is told to abort, and we wait until it
+  * is idle and the image task has dropped the frames passed to it, so the next acquisition starts
+  * from a known state.  MAR_ABORT_LATENCY is set to the time since the abort.
+  * \param[in] useServer 0 if the frames came from a replay, which does not use the server. */
+void marCCD::finishAbort(int useServer)
+{
+    int state;
+    int idle;
+    double latency;
+    epicsUInt64 deadline;
+    static const char *functionName = "finishAbort";
+
+    setStringParam(ADStatusMessage, "Aborting");
+    callParamCallbacks();
+    if (useServer) writeServer("abort");
+    deadline = epicsMonotonicGet() + (epicsUInt64)(MARCCD_ABORT_TIMEOUT * 1.e9);
+    while (1) {
+        idle = (this->imageTaskQueued == 0);
+        if (idle && useServer) {
+            state = getState();
+            idle = !(state & ~STATE_MASK) && (TASK_STATE(state) != TASK_STATE_ABORTING) &&
+                   (TASK_STATE(state) < TASK_STATE_BUSY);
+        }
+        if (idle) break;
+        if (epicsMonotonicGet() > deadline) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: server or image task still busy %.1f s after abort\n",
+                driverName, functionName, MARCCD_ABORT_TIMEOUT);
+            break;
+        }
+        this->unlock();
+        epicsThreadSleep(MARCCD_POLL_DELAY);
+        this->lock();
+    }
+    latency = (epicsMonotonicGet() - this->abortTime) / 1.e6;
+    setDoubleParam(marCCDAbortLatency, latency);
+    setIntegerParam(ADStatus, ADStatusAborted);
+    setStringParam(ADStatusMessage, "Acquisition aborted");
+    callParamCallbacks();
+    this->abortRequested = 0;
+    epicsEventTryWait(this->abortEventId);
+    /* An abort also ends the job, and stops the queue */
+    if (this->pJobs->getCurrent()) {
+        finishJob(marCCDJobAborted);
+        setIntegerParam(marCCDJobRun, 0);
+        callParamCallbacks();
+    }
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s: abort took %.1f ms\n", driverName, functionName, latency);
+}
+
+/** Starts the next job of the queue, if the queue is running.  The settings of the job are applied
+  * to the parameters and Acquire is set, as if a client had done it.  The settings are applied while
+  * the server may still be writing the last frame of the previous job, but the header of the new
+  * job is only sent after that write is complete, so the frame keeps its header.
+  * \return 1 if a job was started. */
+int marCCD::startJob()
+{
+    int jobRun;
+    int replay;
+    int imageMode;
+    int state;
+    int i;
+    marCCDJob *pJob;
+    const marCCDJobSetting *pSetting;
+    const marCCDJobKey *pKey;
+    char message[MAX_MESSAGE_SIZE];
+    static const char *functionName = "startJob";
+
+    getIntegerParam(marCCDJobRun, &jobRun);
+    if (!jobRun || (this->pJobs->getNumQueued() == 0)) return 0;
+    getIntegerParam(marCCDReplay, &replay);
+    if (!this->connected && !replay) {
+        setIntegerParam(marCCDJobRun, 0);
+        setStringParam(marCCDJobMessage, "Queue stopped: not connected to marccd server");
+        callParamCallbacks();
+        return 0;
+    }
+    pJob = this->pJobs->start();
+    for (i=0; i<pJob->numSettings; i++) {
+        pSetting = &pJob->settings[i];
+        pKey = this->pJobs->getKey(pSetting->key);
+        switch (pKey->type) {
+            case marCCDJobInt:    setIntegerParam(pKey->param, pSetting->ival); break;
+            case marCCDJobDouble: setDoubleParam(pKey->param, pSetting->dval);  break;
+            case marCCDJobString: setStringParam(pKey->param, pSetting->sval);  break;
+        }
+    }
+    getIntegerParam(ADImageMode, &imageMode);
+    if (imageMode == ADImageSingle) pJob->numImages = 1;
+    else getIntegerParam(ADNumImages, &pJob->numImages);
+    epicsSnprintf(message, sizeof(message), "Job %d started", pJob->id);
+    setStringParam(marCCDJobMessage, message);
+    epicsEventTryWait(this->stopEventId);
+    epicsEventTryWait(this->abortEventId);
+    this->abortRequested = 0;
+    setIntegerParam(ADAcquire, 1);
+    jobStatus();
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s: job %d %s started\n", driverName, functionName, pJob->id, pJob->label);
+
+    /* Wait for the write of the last frame of the previous job */
+    if (!replay) {
+        state = getState();
+        while (TEST_TASK_STATUS(state, TASK_WRITE, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) ||
+               TASK_STATE(state) >= TASK_STATE_BUSY) {
+            if (waitAbortable(MARCCD_POLL_DELAY)) break;
+            state = getState();
+        }
+    }
+    return 1;
+}
+
+/** Ends the running job, stopping the queue if it did not collect all its images.
+  * \param[in] state marCCDJobDone, or marCCDJobAborted if acquisition was stopped. */
+void marCCD::finishJob(int state)
+{
+    marCCDJob *pJob = this->pJobs->getCurrent();
+    int imagesDone;
+    char message[MAX_MESSAGE_SIZE];
+
+    getIntegerParam(ADNumImagesCounter, &imagesDone);
+    if ((state == marCCDJobDone) && (imagesDone < pJob->numImages)) state = marCCDJobError;
+    if (state == marCCDJobDone) {
+        epicsSnprintf(message, sizeof(message), "Job %d done", pJob->id);
+    } else {
+        epicsSnprintf(message, sizeof(message), "Job %d %s after %d of %d images, queue stopped",
+                      pJob->id, state == marCCDJobError ? "failed" : "aborted", imagesDone, pJob->numImages);
+        setIntegerParam(marCCDJobRun, 0);
+    }
+    setStringParam(marCCDJobMessage, message);
+    setIntegerParam(marCCDJobState, state);
+    this->pJobs->finish(state, imagesDone);
+    jobStatus();
+}
 
-void marCCD::setShutter(int open)
+/** Updates the parameters that report the job queue; the caller does the callbacks */
+void marCCD::jobStatus()
 {
-    ADShutterMode_t shutterMode;
-    int itemp;
-    double delay;
-    double shutterOpenDelay, shutterCloseDelay;
-    
-    getIntegerParam(ADShutterMode, &itemp); shutterMode = (ADShutterMode_t)itemp;
-    getDoubleParam(ADShutterOpenDelay, &shutterOpenDelay);
-    getDoubleParam(ADShutterCloseDelay, &shutterCloseDelay);
-    
-    switch (shutterMode) {
-        case ADShutterModeDetector:
-            if (open) {
-                /* Open the shutter */
-                writeServer("shutter,1");
-                /* This delay is to get the exposure time correct.  
-                * It is equal to the opening time of the shutter minus the
-                * closing time.  If they are equal then no delay is needed, 
-                * except use 1msec so delay is not negative and commands are 
-                * not back-to-back */
-                delay = shutterOpenDelay - shutterCloseDelay;
-                if (delay < .001) delay=.001;
-                epicsThreadSleep(delay);
-            } else {
-                /* Close shutter */
-                writeServer("shutter,0");
-                epicsThreadSleep(shutterCloseDelay);
-            }
-            /* The marCCD does not provide a way to read the actual shutter status, so
-             * set it to agree with the control value */
-            setIntegerParam(ADShutterStatus, open);
-            callParamCallbacks();
-            break;
-        default:
-            ADDriver::setShutter(open);
-            break;
+    marCCDJob *pJob = this->pJobs->getCurrent();
+    char history[MARCCD_JOB_HISTORY * (MARCCD_JOB_LABEL_LEN + 40)];
+
+    setIntegerParam(marCCDJobsQueued, this->pJobs->getNumQueued());
+    setIntegerParam(marCCDJobsDone, this->pJobs->getNumDone());
+    if (pJob) {
+        setIntegerParam(marCCDJobId, pJob->id);
+        setStringParam(marCCDJobLabel, pJob->label);
+        setIntegerParam(marCCDJobState, pJob->state);
     }
+    this->pJobs->history(history, sizeof(history));
+    setStringParam(marCCDJobHistory, history);
 }
 
-
-void marCCD::acquireFrame(double exposureTime, int useShutter)
+asynStatus marCCD::acquireFrame(double exposureTime, int useShutter)
 {
     int status;
     epicsTimeStamp startTime, currentTime;
     double timeRemaining;
+    double startSent, exposureError, delta;
     int triggerMode;
     
     getIntegerParam(ADTriggerMode, &triggerMode);
@@ -754,37 +2835,43 @@ void marCCD::acquireFrame(double exposureTime, int useShutter)
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_ACQUIRE, TASK_STATUS_EXECUTING) || 
            TASK_STATE(status) >= 8) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
     }
 
     setStringParam(ADStatusMessage, "Starting exposure");
     writeServer("start");
+    startSent = marCCDTimer::now();
     callParamCallbacks();
    
     /* Wait for acquisition to actually start */
     status = getState();
     while (!TEST_TASK_STATUS(status, TASK_ACQUIRE, TASK_STATUS_EXECUTING) || 
            TASK_STATE(status) >= 8) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
     }
     
     /* Set the the start time for the TimeRemaining counter */
     epicsTimeGetCurrent(&startTime);
+    this->exposureStart = startTime;
+    setDoubleParam(marCCDStartLatency, (marCCDTimer::now() - startSent) * 1.e3);
     timeRemaining = exposureTime;
     if (useShutter) setShutter(1);
 
     /* Wait for the exposure time using epicsEventWaitWithTimeout, 
      * so we can abort. */
     /* If we are in external trigger mode don't use the timer at all, external software will
-     * start and stop the acquisition */
-    if (triggerMode == ADTriggerInternal) epicsTimerStartDelay(this->timerId, exposureTime);
+     * start and stop the acquisition.  The deadline is from when the start command was sent, so the
+     * exposure does not run long by the time taken to see it start and to open the shutter. */
+    if (triggerMode == ADTriggerInternal) this->pTimer->startAt(startSent + exposureTime);
+    marCCDTraceSpan span("exposure");
+    /* A stop ends the exposure and the frame is read out; an abort discards it */
     while(1) {
         this->unlock();
         status = epicsEventWaitWithTimeout(this->stopEventId, MARCCD_POLL_DELAY);
         this->lock();
-        if (status == epicsEventWaitOK) {
+        if ((status == epicsEventWaitOK) || this->abortRequested) {
             break;
         }
         epicsTimeGetCurrent(&currentTime);
@@ -792,28 +2879,62 @@ void marCCD::acquireFrame(double exposureTime, int useShutter)
             epicsTimeDiffInSeconds(&currentTime, &startTime);
         if (timeRemaining < 0.) timeRemaining = 0.;
         setDoubleParam(ADTimeRemaining, timeRemaining);
-        callParamCallbacks();
+        statusParamCallbacks(0);
+    }
+    epicsTimeGetCurrent(&this->exposureEnd);
+    /* An exposure that was stopped before the timer fired is not counted */
+    if ((triggerMode == ADTriggerInternal) && !this->abortRequested &&
+        (this->pTimer->getFired() > startSent)) {
+        /* How long the exposure actually was, compared to what was requested.  It is measured from
+         * when the start command was sent until the timer fired, not from when this thread saw
+         * either, so the wakeup of this thread and the lock handoff are not included. */
+        exposureError = this->pTimer->getFired() - startSent - exposureTime;
+        this->exposureCount++;
+        delta = exposureError - this->exposureErrorMean;
+        this->exposureErrorMean += delta / this->exposureCount;
+        this->exposureErrorM2 += delta * (exposureError - this->exposureErrorMean);
+        if (fabs(exposureError) > this->exposureErrorMax) this->exposureErrorMax = fabs(exposureError);
+        setDoubleParam(marCCDExposureError, exposureError * 1.e3);
+        setDoubleParam(marCCDExposureErrorMean, this->exposureErrorMean * 1.e3);
+        setDoubleParam(marCCDExposureErrorStd, sqrt(this->exposureErrorM2 / this->exposureCount) * 1.e3);
+        setDoubleParam(marCCDExposureErrorMax, this->exposureErrorMax * 1.e3);
+        setDoubleParam(marCCDTimerLateness, this->pTimer->getLateness() * 1.e6);
     }
     setDoubleParam(ADTimeRemaining, 0.0);
     callParamCallbacks();
     if (useShutter) setShutter(0);
-
+    return this->abortRequested ? asynError : asynSuccess;
 }
 
 asynStatus marCCD::readoutFrame(int bufferNumber, const char* fileName, int wait)
 {
     int status;
+    int sequence;
     
      /* Wait for the readout task to be done with the previous frame, if any */ 
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_READ, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
            TASK_STATE(status) >= TASK_STATE_BUSY) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
         if (TASK_STATE(status) == TASK_STATE_ERROR) return asynError;
     }
 
     if (fileName && strlen(fileName)!=0) {
+        /* The header goes just before the readout that writes the file, so the frames of a sweep are
+         * pipelined each with its own header.  The server puts the header it has when it writes the file
+         * into it, so in Overlap mode the previous frame must be written before its header is replaced. */
+        getIntegerParam(marCCDHeaderSequence, &sequence);
+        if (sequence) {
+            status = getState();
+            while (TEST_TASK_STATUS(status, TASK_CORRECT, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) ||
+                   TEST_TASK_STATUS(status, TASK_WRITE, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED)) {
+                if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
+                status = getState();
+                if (TASK_STATE(status) == TASK_STATE_ERROR) return asynError;
+            }
+        }
+        writeHeader();
         epicsSnprintf(this->toServer, sizeof(this->toServer), "readout,%d,%s", bufferNumber, fileName);
         setStringParam(NDFullFileName, fileName);
         callParamCallbacks();
@@ -825,7 +2946,7 @@ asynStatus marCCD::readoutFrame(int bufferNumber, const char* fileName, int wait
     /* Wait for the readout to start */
     status = getState();
     while (!TEST_TASK_STATUS(status, TASK_READ, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED)) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
         if (TASK_STATE(status) == TASK_STATE_ERROR) return asynError;
     }
@@ -833,7 +2954,7 @@ asynStatus marCCD::readoutFrame(int bufferNumber, const char* fileName, int wait
     /* Wait for the readout to complete */
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_READ, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED)) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
         if (TASK_STATE(status) == TASK_STATE_ERROR) return asynError;
     }
@@ -843,7 +2964,7 @@ asynStatus marCCD::readoutFrame(int bufferNumber, const char* fileName, int wait
     /* Wait for the correction complete */
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_CORRECT, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED)) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
         if (TASK_STATE(status) == TASK_STATE_ERROR) return asynError;
     }
@@ -853,14 +2974,14 @@ asynStatus marCCD::readoutFrame(int bufferNumber, const char* fileName, int wait
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_WRITE, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
            (TASK_STATE(status) >= TASK_STATE_BUSY)) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
         if (TASK_STATE(status) == TASK_STATE_ERROR) return asynError;
     }
     return asynSuccess;
 }
  
-void marCCD::saveFile(int correctedFlag, int wait)
+asynStatus marCCD::saveFile(int correctedFlag, int wait)
 {
     char fullFileName[MAX_FILENAME_LEN];
     int status;
@@ -869,7 +2990,7 @@ void marCCD::saveFile(int correctedFlag, int wait)
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_WRITE, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
            TASK_STATE(status) >= 8) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
     }
     writeHeader();
@@ -879,19 +3000,21 @@ void marCCD::saveFile(int correctedFlag, int wait)
     writeServer(this->toServer);
     setStringParam(NDFullFileName, fullFileName);
     callParamCallbacks();
-    if (!wait) return;
+    if (!wait) return asynSuccess;
     status = getState();
     while (TEST_TASK_STATUS(status, TASK_WRITE, TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
            TASK_STATE(status) >= 8) {
-        epicsThreadSleep(MARCCD_POLL_DELAY);
+        if (waitAbortable(MARCCD_POLL_DELAY)) return asynError;
         status = getState();
     }
+    return asynSuccess;
 }
 
 static void marCCDTaskC(void *drvPvt)
 {
     marCCD *pPvt = (marCCD *)drvPvt;
     
+    marCCDThreadStarted();
     pPvt->marCCDTask();
 }
 
@@ -901,6 +3024,7 @@ void marCCD::marCCDTask()
 {
     int imageMode;
     int acquire;
+    int replay;
     const char *functionName = "marCCDTask";
 
     this->lock();
@@ -909,19 +3033,58 @@ void marCCD::marCCDTask()
     while (1) {
         /* Is acquisition active? */
         getIntegerParam(ADAcquire, &acquire);
-        /* If we are not acquiring then wait for a semaphore that is given when acquisition is started */
+        /* If we are not acquiring then start the next job from the queue, or
+         * wait for a semaphore that is given when acquisition is started */
         if (!acquire) {
-            setStringParam(ADStatusMessage, "Waiting for acquire command");
-            callParamCallbacks();
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-                "%s:%s: waiting for acquire to start\n", driverName, functionName);
-            /* Release the lock while we wait for an event that says acquire has started, then lock again */
-            this->unlock();
-            epicsEventWait(this->startEventId);
-            this->lock();
+            if (this->pJobs->getCurrent()) finishJob(marCCDJobDone);
+            if (!startJob()) {
+                setStringParam(ADStatusMessage, "Waiting for acquire command");
+                /* Polling stops while idle, so publish the status that was held back */
+                statusParamCallbacks(1);
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
+                    "%s:%s: waiting for acquire to start\n", driverName, functionName);
+                /* Release the lock while we wait for an event that says acquire has started, then lock again */
+                this->unlock();
+                epicsEventWait(this->startEventId);
+                this->lock();
+                /* The event is also given when the job queue is started or a job is submitted */
+                getIntegerParam(ADAcquire, &acquire);
+                if (!acquire && !startJob()) continue;
+            }
             setIntegerParam(ADNumImagesCounter, 0);
+            setIntegerParam(marCCDPoolStalls, 0);
+            setDoubleParam (marCCDPoolStallTime, 0.);
+            setIntegerParam(marCCDPoolDrops, 0);
+            setIntegerParam(marCCDPoolPreviews, 0);
+            setIntegerParam(marCCDHitCount, 0);
+            setIntegerParam(marCCDVetoCount, 0);
+            setIntegerParam(marCCDShmFrames, 0);
+            setIntegerParam(marCCDShmDrops, 0);
+            this->exposureCount = 0;
+            this->exposureErrorMean = 0.;
+            this->exposureErrorM2 = 0.;
+            this->exposureErrorMax = 0.;
+            this->bytesRead = 0.;
+            this->bytesCached = 0.;
+            setDoubleParam (marCCDBytesRead, 0.);
+            setDoubleParam (marCCDCacheHit, 0.);
+            if (marCCDThreadGeneration() != this->threadGeneration) {
+                /* The threads have been moved.  Free the buffers, so the new ones are first written,
+                 * and so placed on its NUMA node, by this thread, which reads the files. */
+                this->threadGeneration = marCCDThreadGeneration();
+                if (this->pData) this->pData->release();
+                this->pData = NULL;
+                this->pNDArrayPool->emptyFreeList();
+                allocScratch();
+            }
             callParamCallbacks();
         }       
+        getIntegerParam(marCCDReplay, &replay);
+        if (replay) {
+            collectReplay();
+            if (this->abortRequested) finishAbort(0);
+            continue;
+        }
         getIntegerParam(ADImageMode, &imageMode);
         switch (imageMode) {
             case marCCDImageSingle:
@@ -934,6 +3097,7 @@ void marCCD::marCCDTask()
                 collectSeries();
                 break;
         }
+        if (this->abortRequested) finishAbort(1);
     }
 }
 
@@ -953,9 +3117,15 @@ void marCCD::collectNormal()
     int overlap, wait;
     int bufferNumber;
     int shutterMode, useShutter;
+    int dezingerMode;
+    int correctMode;
+    int iocDezinger = 0;
     double elapsedTime, delayTime;
+    epicsTimeStamp firstStart;
     //static const char *functionName = "collectNormal";
     char fullFileName[MAX_FILENAME_LEN];
+    char firstFileName[MAX_FILENAME_LEN];
+    char secondFileName[MAX_FILENAME_LEN];
 
     /* Get current values of some parameters */
     getIntegerParam(ADImageMode, &imageMode);
@@ -966,27 +3136,38 @@ void marCCD::collectNormal()
     getIntegerParam(marCCDOverlap, &overlap);
     getIntegerParam(ADShutterMode, &shutterMode);
     getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    getIntegerParam(marCCDCorrectMode, &correctMode);
     if (overlap) wait=0; else wait=1;
     if (shutterMode == ADShutterModeNone) useShutter=0; else useShutter=1;
-    if (autoSave) writeHeader();
+    /* The header is sent with the command that writes the file, for this frame of the acquisition */
+    getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+    this->headerFrame = numImagesCounter;
 
     epicsTimeGetCurrent(&this->acqStartTime);
+    firstStart = this->acqStartTime;
 
+    this->iocCorrect = 0;
     switch(frameType) {
         case marCCDFrameNormal:
         case marCCDFrameRaw:
             strcpy(fullFileName, "");
             if (autoSave) createFileName(MAX_FILENAME_LEN, fullFileName);
-            acquireFrame(acquireTime, useShutter);
+            status = acquireFrame(acquireTime, useShutter);
+            if (status) goto cleanup;
             if (frameType == marCCDFrameNormal) bufferNumber=0; else bufferNumber=3;
+            /* Read out the raw frame and correct it in the IOC, so the server correct step is skipped */
+            this->iocCorrect = (frameType == marCCDFrameNormal) && (correctMode == marCCDCorrectIOC);
+            if (this->iocCorrect) bufferNumber=3;
             status = readoutFrame(bufferNumber, fullFileName, wait);
             if (status) goto cleanup;
             break;
         case marCCDFrameBackground:
-            acquireFrame(.001, 0);
+            status = acquireFrame(.001, 0);
+            if (status) goto cleanup;
             status = readoutFrame(1, NULL, 1);
             if (status) goto cleanup;
-            acquireFrame(.001, 0);
+            status = acquireFrame(.001, 0);
+            if (status) goto cleanup;
             status = readoutFrame(2, NULL, 1);
             if (status) goto cleanup;
             writeServer("dezinger,1");
@@ -994,18 +3175,45 @@ void marCCD::collectNormal()
             while (TEST_TASK_STATUS(status, TASK_DEZINGER, 
                                     TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
                                     TASK_STATE(status) >= 8) {
-                epicsThreadSleep(MARCCD_POLL_DELAY);
+                if (waitAbortable(MARCCD_POLL_DELAY)) goto cleanup;
                 status = getState();
             }
             break;
         case marCCDFrameDoubleCorrelation:
-            acquireFrame(acquireTime/2., useShutter);
+            getIntegerParam(marCCDDezingerMode, &dezingerMode);
+            if (dezingerMode == marCCDDezingerIOC) {
+                /* The server corrects and writes each half to a temporary file, and the
+                 * IOC combines them, so the server dezinger and correct steps are skipped.
+                 * With CorrectMode=IOC the halves are raw and the IOC also corrects the result. */
+                this->iocCorrect = (correctMode == marCCDCorrectIOC);
+                bufferNumber = this->iocCorrect ? 3 : 0;
+                createFileName(MAX_FILENAME_LEN, fullFileName);
+                epicsSnprintf(firstFileName, sizeof(firstFileName), "%s.dz1", fullFileName);
+                epicsSnprintf(secondFileName, sizeof(secondFileName), "%s.dz2", fullFileName);
+                status = acquireFrame(acquireTime/2., useShutter);
+                if (status) goto cleanup;
+                firstStart = this->exposureStart;
+                status = readoutFrame(bufferNumber, firstFileName, 1);
+                if (status) goto cleanup;
+                getIntegerParam(ADAcquire, &acquire);
+                if (acquire == 0) goto cleanup;
+                status = acquireFrame(acquireTime/2., useShutter);
+                if (status) goto cleanup;
+                status = readoutFrame(bufferNumber, secondFileName, 1);
+                if (status) goto cleanup;
+                iocDezinger = 1;
+                break;
+            }
+            status = acquireFrame(acquireTime/2., useShutter);
+            if (status) goto cleanup;
+            firstStart = this->exposureStart;
             status = readoutFrame(2, NULL, 1);
             if (status) goto cleanup;
             /* If the user has aborted then acquire will be 0 */
             getIntegerParam(ADAcquire, &acquire);
             if (acquire == 0) goto cleanup;
-            acquireFrame(acquireTime/2., useShutter);
+            status = acquireFrame(acquireTime/2., useShutter);
+            if (status) goto cleanup;
             status = readoutFrame(0, NULL, 1);
             if (status) goto cleanup;
             writeServer("dezinger,0");
@@ -1013,7 +3221,7 @@ void marCCD::collectNormal()
             while (TEST_TASK_STATUS(status, TASK_DEZINGER, 
                                     TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
                                     TASK_STATE(status) >= 8) {
-                epicsThreadSleep(MARCCD_POLL_DELAY);
+                if (waitAbortable(MARCCD_POLL_DELAY)) goto cleanup;
                 status = getState();
             }
             writeServer("correct");
@@ -1021,24 +3229,50 @@ void marCCD::collectNormal()
             while (TEST_TASK_STATUS(status, TASK_CORRECT, 
                                     TASK_STATUS_EXECUTING | TASK_STATUS_QUEUED) || 
                                     TASK_STATE(status) >= 8) {
-                epicsThreadSleep(MARCCD_POLL_DELAY);
+                if (waitAbortable(MARCCD_POLL_DELAY)) goto cleanup;
                 status = getState();
             }
-            if (autoSave) saveFile(1, 1);
+            if (autoSave) {
+                status = saveFile(1, 1);
+                if (status) goto cleanup;
+            }
     }
 
+    /* The exposure of a double correlation frame starts with the first half */
+    this->frameStart = (frameType == marCCDFrameDoubleCorrelation) ? firstStart : this->exposureStart;
+    this->frameEnd = this->exposureEnd;
+    this->frameTimeFromFile = 0;
+
     getIntegerParam(NDArrayCounter, &imageCounter);
     imageCounter++;
     setIntegerParam(NDArrayCounter, imageCounter);
     getIntegerParam(ADNumImagesCounter, &numImagesCounter);
     numImagesCounter++;
     setIntegerParam(ADNumImagesCounter, numImagesCounter);
+    if (this->pMetrics) this->pMetrics->count(marCCDCounterFramesAcquired);
     /* Call the callbacks to update any changes */
     callParamCallbacks();
 
     /* If we saved a file above and arrayCallbacks is set then read the file back in */
-    if (autoSave && arrayCallbacks && (frameType != marCCDFrameBackground)) {
-        if (overlap) epicsEventSignal(this->imageEventId);
+    if (iocDezinger) {
+        /* Read and combine the two halves, then delete the temporary files */
+        strcpy(this->dezingerFile, firstFileName);
+        getImageData();
+        this->dezingerFile[0] = 0;
+        unlink(firstFileName);
+        unlink(secondFileName);
+    } else if (autoSave && arrayCallbacks && (frameType != marCCDFrameBackground)) {
+        if (overlap) {
+            /* When the queue is full the oldest frame is dropped; the task would only have skipped it */
+            if (this->imageQueueCount == MARCCD_IMAGE_QUEUE_SIZE) {
+                this->imageQueueHead = (this->imageQueueHead + 1) % MARCCD_IMAGE_QUEUE_SIZE;
+                this->imageQueueCount--;
+            }
+            getImageFrame(&this->imageQueue[(this->imageQueueHead + this->imageQueueCount) % MARCCD_IMAGE_QUEUE_SIZE]);
+            this->imageQueueCount++;
+            this->imageTaskQueued++;
+            epicsEventSignal(this->imageEventId);
+        }
         else getImageData();
     }
 
@@ -1059,9 +3293,7 @@ void marCCD::collectNormal()
         if (delayTime > 0.) {
             setIntegerParam(ADStatus, ADStatusWaiting);
             callParamCallbacks();
-            this->unlock();
-            status = epicsEventWaitWithTimeout(this->stopEventId, delayTime);
-            this->lock();
+            waitStoppable(delayTime);
         }
     }
 
@@ -1096,7 +3328,9 @@ void marCCD::collectSeries()
     char fileName[MAX_FILENAME_LEN];
     char baseFileName[MAX_FILENAME_LEN];
     char fullFileName[MAX_FILENAME_LEN];
+    char nextFileName[MAX_FILENAME_LEN];
     char fullFileTemplate[MAX_FILENAME_LEN];
+    int readahead;
     const char *fileSuffix = ".tif";
     int fileNumber;
     static const char *functionName = "collectSeries";
@@ -1122,6 +3356,8 @@ void marCCD::collectSeries()
     getIntegerParam(marCCDOverlap,    &overlap);
 
     if (shutterMode == ADShutterModeNone) useShutter=0; else useShutter=1;
+    /* The server corrects the frames in series mode */
+    this->iocCorrect = 0;
     
     if (frameType != marCCDFrameNormal) {
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
@@ -1148,6 +3384,8 @@ void marCCD::collectSeries()
         return;
     }
 
+    /* The server writes the files of a series, so they all have the header of the first frame */
+    this->headerFrame = 0;
     writeHeader();
 
     epicsTimeGetCurrent(&this->acqStartTime);
@@ -1199,10 +3437,28 @@ void marCCD::collectSeries()
                             baseFileName, i+seriesFileFirst);
         setStringParam(NDFullFileName, fullFileName);
         callParamCallbacks();
+        if (imageMode == marCCDImageSeriesTimed) {
+            /* The frames are at fixed times from the start of the series */
+            this->frameStart = this->acqStartTime;
+            epicsTimeAddSeconds(&this->frameStart, i * acquirePeriod);
+            this->frameEnd = this->frameStart;
+            epicsTimeAddSeconds(&this->frameEnd, acquireTime);
+            this->frameTimeFromFile = 0;
+        } else {
+            this->frameTimeFromFile = 1;
+        }
+        /* If the server is ahead of us the next file may already exist.  Start reading it into the
+         * page cache while this one is decoded. */
+        getIntegerParam(marCCDReadahead, &readahead);
+        if (readahead && (i+1 < numImages)) {
+            epicsSnprintf(nextFileName, sizeof(nextFileName), fullFileTemplate,
+                          baseFileName, i+1+seriesFileFirst);
+            marCCDTiffReadahead(nextFileName);
+        }
         status = getImageData();
         // If getImagedata() returns error then either it has timed out or the run has been aborted
         if (status) {
-            writeServer("abort");
+            if (!this->abortRequested) writeServer("abort");
             break;
         }
         getIntegerParam(NDArrayCounter, &imageCounter);
@@ -1211,6 +3467,7 @@ void marCCD::collectSeries()
         getIntegerParam(ADNumImagesCounter, &numImagesCounter);
         numImagesCounter++;
         setIntegerParam(ADNumImagesCounter, numImagesCounter);
+        if (this->pMetrics) this->pMetrics->count(marCCDCounterFramesAcquired);
         /* Call the callbacks to update any changes */
         callParamCallbacks();
     }
@@ -1218,6 +3475,7 @@ void marCCD::collectSeries()
 done:     
     /* Restore the TIFF timeout */
     setDoubleParam(marCCDTiffTimeout, tiffTimeout);
+    this->frameTimeFromFile = 0;
         
     if (useShutter) setShutter(0);
     if (autoIncrement) {
@@ -1229,6 +3487,175 @@ done:
     callParamCallbacks();
 }
 
+/** Selects the TIFF files in a replay directory */
+static int replayFilter(const struct dirent *pEntry)
+{
+    size_t len = strlen(pEntry->d_name);
+
+    return ((len > 4) && (strcmp(pEntry->d_name + len - 4, ".tif") == 0)) ||
+           ((len > 5) && (strcmp(pEntry->d_name + len - 5, ".tiff") == 0));
+}
+
+/** This function replays existing TIFF files through getImageData() without the server, to
+  * load test the plugin chain offline.  MAR_REPLAY_TEMPLATE is either a directory, whose .tif
+  * files are replayed in alphabetical order, or a printf template for the file number, starting
+  * at MAR_SERIES_FILE_FIRST and ending at the first file that does not exist.  Single mode replays
+  * one frame, Multiple mode NumImages frames and Continuous mode runs until stopped, going back to
+  * the first file at the end of the dataset; the series modes replay each file once.
+  * Frames are paced at MAR_REPLAY_RATE frames/s, or as fast as possible if it is 0. */
+void marCCD::collectReplay()
+{
+    char replayTemplate[MAX_FILENAME_LEN];
+    char fullFileName[MAX_FILENAME_LEN];
+    char nextFileName[MAX_FILENAME_LEN];
+    struct dirent **pEntries = NULL;
+    struct stat statBuff;
+    int numFiles = 0;
+    int fileFirst;
+    int imageMode;
+    int numImages;
+    int imageCounter;
+    int numImagesCounter;
+    int acquire;
+    int readahead;
+    int nx, ny;
+    int dataType;
+    int frame, file;
+    int backlog;
+    int status;
+    double rate, tiffTimeout, delay, elapsed;
+    double bytes = 0.;
+    epicsTimeStamp tStart, now;
+    static const char *functionName = "collectReplay";
+
+    getStringParam(marCCDReplayTemplate, sizeof(replayTemplate), replayTemplate);
+    getIntegerParam(marCCDSeriesFileFirst, &fileFirst);
+    getIntegerParam(ADImageMode, &imageMode);
+    getIntegerParam(ADNumImages, &numImages);
+    getDoubleParam(marCCDTiffTimeout, &tiffTimeout);
+
+    if ((stat(replayTemplate, &statBuff) == 0) && S_ISDIR(statBuff.st_mode)) {
+        numFiles = scandir(replayTemplate, &pEntries, replayFilter, alphasort);
+        if (numFiles < 0) numFiles = 0;
+    } else if (strchr(replayTemplate, '%')) {
+        /* Count the files of the series */
+        while (1) {
+            epicsSnprintf(fullFileName, sizeof(fullFileName), replayTemplate, fileFirst + numFiles);
+            if (stat(fullFileName, &statBuff) != 0) break;
+            numFiles++;
+        }
+    }
+    if (numFiles == 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: no files to replay for %s\n",
+            driverName, functionName, replayTemplate);
+        setStringParam(ADStatusMessage, "No files to replay");
+        goto done;
+    }
+    switch (imageMode) {
+        case marCCDImageSingle:     numImages = 1; break;
+        case marCCDImageMultiple:   break;
+        case marCCDImageContinuous: numImages = 0; break;
+        default:                    numImages = numFiles; break;
+    }
+
+    /* The files are old, so readTiff must not wait for new ones.  The server is not used. */
+    setDoubleParam(marCCDTiffTimeout, 0.);
+    this->replaying = 1;
+    this->iocCorrect = 0;
+    this->dezingerFile[0] = 0;
+    setDoubleParam(marCCDReplayFrameRate, 0.);
+    setDoubleParam(marCCDReplayDataRate, 0.);
+    setIntegerParam(ADStatus, ADStatusReadout);
+    callParamCallbacks();
+    epicsTimeGetCurrent(&tStart);
+
+    for (frame=0, file=0; (numImages == 0) || (frame < numImages); frame++, file++) {
+        if (file >= numFiles) file = 0;
+        getDoubleParam(marCCDReplayRate, &rate);
+        if (rate > 0.) {
+            epicsTimeGetCurrent(&now);
+            delay = frame / rate - epicsTimeDiffInSeconds(&now, &tStart);
+            if (delay > 0.) {
+                if (waitStoppable(delay)) break;
+            }
+        } else if (this->abortRequested) {
+            break;
+        }
+        getIntegerParam(ADAcquire, &acquire);
+        if (!acquire) break;
+
+        if (pEntries) {
+            epicsSnprintf(fullFileName, sizeof(fullFileName), "%s/%s", replayTemplate, pEntries[file]->d_name);
+        } else {
+            epicsSnprintf(fullFileName, sizeof(fullFileName), replayTemplate, fileFirst + file);
+        }
+        if (marCCDTiffGetSize(fullFileName, &nx, &ny)) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: cannot read TIFF file %s\n",
+                driverName, functionName, fullFileName);
+            break;
+        }
+        setIntegerParam(NDArraySizeX, nx);
+        setIntegerParam(NDArraySizeY, ny);
+        checkBadPixelMask(0);
+        getIntegerParam(NDDataType, &dataType);
+        setIntegerParam(NDArraySize, nx * ny * (int)pixelBytes((NDDataType_t)dataType));
+        setStringParam(NDFullFileName, fullFileName);
+        getIntegerParam(marCCDReadahead, &readahead);
+        if (readahead && (numFiles > 1)) {
+            if (pEntries) {
+                epicsSnprintf(nextFileName, sizeof(nextFileName), "%s/%s", replayTemplate, 
+                              pEntries[(file+1) % numFiles]->d_name);
+            } else {
+                epicsSnprintf(nextFileName, sizeof(nextFileName), replayTemplate, 
+                              fileFirst + (file+1) % numFiles);
+            }
+            marCCDTiffReadahead(nextFileName);
+        }
+        /* The time stamp of the frame is when it was replayed */
+        epicsTimeGetCurrent(&this->acqStartTime);
+        this->frameStart = this->acqStartTime;
+        this->frameEnd = this->acqStartTime;
+        status = getImageData();
+        if (status) break;
+        /* The pixel type may have been changed by the file */
+        getIntegerParam(NDDataType, &dataType);
+        bytes += (double)nx * ny * pixelBytes((NDDataType_t)dataType);
+
+        getIntegerParam(NDArrayCounter, &imageCounter);
+        imageCounter++;
+        setIntegerParam(NDArrayCounter, imageCounter);
+        getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+        numImagesCounter++;
+        setIntegerParam(ADNumImagesCounter, numImagesCounter);
+        epicsTimeGetCurrent(&now);
+        elapsed = epicsTimeDiffInSeconds(&now, &tStart);
+        if (elapsed > 0.) {
+            setDoubleParam(marCCDReplayFrameRate, (frame + 1) / elapsed);
+            setDoubleParam(marCCDReplayDataRate, bytes / elapsed / 1.e6);
+        }
+        /* The arrays that plugins have not released yet, not counting the ones the driver keeps */
+        backlog = this->pNDArrayPool->getNumBuffers() - this->pNDArrayPool->getNumFree() - 
+                  (this->pData ? 1 : 0);
+        setIntegerParam(marCCDReplayBacklog, backlog > 0 ? backlog : 0);
+        callParamCallbacks();
+    }
+
+    this->replaying = 0;
+    setDoubleParam(marCCDTiffTimeout, tiffTimeout);
+    setStringParam(ADStatusMessage, "Replay complete");
+
+done:
+    if (pEntries) {
+        for (file=0; file<numFiles; file++) free(pEntries[file]);
+        free(pEntries);
+    }
+    setIntegerParam(ADStatus, ADStatusIdle);
+    setIntegerParam(ADAcquire, 0);
+    callParamCallbacks();
+}
+
 
 /** Called when asyn clients call pasynInt32->write().
   * This function performs actions for some parameters, including ADAcquire, ADBinX, etc.
@@ -1240,6 +3667,9 @@ asynStatus marCCD::writeInt32(asynUser *pasynUser, epicsInt32 value)
     int function = pasynUser->reason;
     int state, binX, binY;
     int correctedFlag, frameType;
+    int dumpMode;
+    int replay;
+    int imageMode;
     asynStatus status = asynSuccess;
     int acquiring;
     const char *functionName = "writeInt32";
@@ -1248,22 +3678,54 @@ asynStatus marCCD::writeInt32(asynUser *pasynUser, epicsInt32 value)
     getIntegerParam(ADAcquire, &acquiring);
     status = setIntegerParam(function, value);
 
-    if (function == ADAcquire) {
+    getIntegerParam(marCCDReplay, &replay);
+    if ((function == ADAcquire) && value && !this->connected && !replay) {
+        setIntegerParam(ADAcquire, 0);
+        setStringParam(ADStatusMessage, "Not connected to marccd server");
+        status = asynError;
+    } else if ((function == ADAcquire) && (replay || this->replaying)) {
+        /* Replay does not use the server */
+        if (value && !acquiring) {
+            epicsEventTryWait(this->stopEventId);
+            epicsEventTryWait(this->abortEventId);
+            this->abortRequested = 0;
+            epicsEventSignal(this->startEventId);
+        }
+        if (!value && acquiring) {
+            epicsEventSignal(this->stopEventId);
+        }
+    } else if (function == ADAcquire) {
         state = getState();
         if (value && (!TEST_TASK_STATUS(state, TASK_ACQUIRE, TASK_STATUS_QUEUED | TASK_STATUS_EXECUTING))) {
             /* Kill any stale stop event */
             epicsEventTryWait(this->stopEventId);
+            epicsEventTryWait(this->abortEventId);
+            this->abortRequested = 0;
             /* Send an event to wake up the marCCD task.  */
             epicsEventSignal(this->startEventId);
         } 
         if (!value) {
             if (acquiring) {
-                /* Send signal to stop acquisition */
-                epicsEventSignal(this->stopEventId);
-                /* The acquisition was stopped before the time was complete, cancel any acquisition timer */
-                epicsTimerCancel(this->timerId);
+                getIntegerParam(ADImageMode, &imageMode);
+                if ((imageMode == marCCDImageSeriesTimed) || (imageMode == marCCDImageSeriesTriggered)) {
+                    /* The server collects the series by itself, so stopping it aborts it */
+                    requestAbort();
+                } else {
+                    /* Send signal to stop acquisition.  The exposure ends, and the frames that
+                     * have been exposed are read out, corrected and saved. */
+                    epicsEventSignal(this->stopEventId);
+                    /* The acquisition was stopped before the time was complete, cancel any acquisition timer */
+                    this->pTimer->cancel();
+                }
             }
         }
+    } else if ((function == marCCDBadPixelEnable) || (function == marCCDPoolPolicy)) {
+        checkBadPixelMask(1);
+    } else if (function == marCCDAbort) {
+        if (value) {
+            if (acquiring) requestAbort();
+            setIntegerParam(marCCDAbort, 0);
+        }
     } else if ((function == ADBinX) ||
                (function == ADBinY)) {
         /* Set binning */
@@ -1287,6 +3749,36 @@ asynStatus marCCD::writeInt32(asynUser *pasynUser, epicsInt32 value)
          getConfig();
     } else if (function == ADReadStatus) {
         if (value) getState();
+    } else if (function == marCCDNumThreads) {
+        if (value < 1) value = 1;
+        if (value > this->pWorkers->getNumThreads() + 1) value = this->pWorkers->getNumThreads() + 1;
+        setIntegerParam(marCCDNumThreads, value);
+    } else if ((function == marCCDStreamCodec) || (function == marCCDCompress)) {
+        if (!marCCDCodecAvailable(value)) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, 
+                "%s:%s: compression %d is not available in this build\n", 
+                driverName, functionName, value);
+            setIntegerParam(function, marCCDCodecNone);
+            status = asynError;
+        }
+    } else if (function == marCCDJobRun) {
+        /* Wake up the marCCD task to start the next job */
+        if (value && !acquiring) epicsEventSignal(this->startEventId);
+    } else if (function == marCCDJobClear) {
+        if (value) {
+            this->pJobs->clear();
+            setStringParam(marCCDJobMessage, "Queue cleared");
+            jobStatus();
+            setIntegerParam(marCCDJobClear, 0);
+        }
+    } else if (function == marCCDRingSize) {
+        status = ringResize(value);
+    } else if (function == marCCDRingDump) {
+        if (value) {
+            getIntegerParam(marCCDRingDumpMode, &dumpMode);
+            status = ringDump(dumpMode);
+            setIntegerParam(marCCDRingDump, 0);
+        }
     } else if (function == NDWriteFile) {
         getIntegerParam(ADFrameType, &frameType);
         if (frameType == marCCDFrameRaw) correctedFlag=0; else correctedFlag=1;
@@ -1346,6 +3838,133 @@ asynStatus marCCD::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
     return status;
 }
 
+/** Called when asyn clients call pasynOctet->write().
+  * This function loads the bad pixel mask when MAR_BAD_PIXEL_FILE is written, and the remap table 
+  * when MAR_REMAP_FILE is written.  
+  * For all parameters it sets the value in the parameter library and calls any registered callbacks.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Address of the string to write.
+  * \param[in] nChars Number of characters to write.
+  * \param[out] nActual Number of characters actually written. */
+asynStatus marCCD::writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual)
+{
+    int function = pasynUser->reason;
+    asynStatus status;
+    char fileName[MAX_FILENAME_LEN];
+    char message[MAX_MESSAGE_SIZE];
+    char jobText[4*MAX_MESSAGE_SIZE];
+    int acquiring, jobRun;
+    const char *functionName = "writeOctet";
+
+    /* The base class sets the value in the parameter library and does the callbacks */
+    status = ADDriver::writeOctet(pasynUser, value, nChars, nActual);
+
+    if (function == marCCDBadPixelFile) {
+        getStringParam(marCCDBadPixelFile, sizeof(fileName), fileName);
+        if (strlen(fileName) > 0) {
+            /* The mask may be in use by the frame processing */
+            epicsMutexLock(this->processMutex);
+            if (this->pCorrect->loadMask(fileName)) status = asynError;
+            epicsMutexUnlock(this->processMutex);
+        }
+        setIntegerParam(marCCDBadPixelCount, this->pCorrect->getNumBadPixels());
+        checkBadPixelMask(1);
+        callParamCallbacks();
+        if (status) 
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, 
+                  "%s:%s: error loading bad pixel file %s\n", 
+                  driverName, functionName, fileName);
+    } else if (function == marCCDRemapFile) {
+        getStringParam(marCCDRemapFile, sizeof(fileName), fileName);
+        if (strlen(fileName) > 0) {
+            /* The table may be in use by the frame processing */
+            epicsMutexLock(this->processMutex);
+            if (this->pRemap->load(fileName)) status = asynError;
+            epicsMutexUnlock(this->processMutex);
+        }
+        setIntegerParam(marCCDRemapEntries, (int)this->pRemap->getNumEntries());
+        callParamCallbacks();
+        if (status) 
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, 
+                  "%s:%s: error loading remap file %s\n", 
+                  driverName, functionName, fileName);
+    } else if ((function == marCCDJobSubmit) || (function == marCCDJobFile)) {
+        if (function == marCCDJobSubmit) {
+            getStringParam(marCCDJobSubmit, sizeof(jobText), jobText);
+            if (this->pJobs->submit(jobText, message, sizeof(message)) < 0) status = asynError;
+        } else {
+            getStringParam(marCCDJobFile, sizeof(fileName), fileName);
+            if (strlen(fileName) == 0) return status;
+            if (this->pJobs->load(fileName, message, sizeof(message)) < 0) status = asynError;
+        }
+        setStringParam(marCCDJobMessage, message);
+        jobStatus();
+        callParamCallbacks();
+        if (status) 
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, 
+                  "%s:%s: %s\n", driverName, functionName, message);
+        /* Wake up the marCCD task if the queue is running and idle */
+        getIntegerParam(ADAcquire, &acquiring);
+        getIntegerParam(marCCDJobRun, &jobRun);
+        if ((status == asynSuccess) && jobRun && !acquiring) epicsEventSignal(this->startEventId);
+    }
+    return status;
+}
+
+/** Called when asyn clients call pasynFloat64Array->write().  Sets the values of a header field for
+  * each frame of a sweep; writing 0 elements removes them.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value The values, for frames 0 to nElements-1.
+  * \param[in] nElements Number of elements to write. */
+asynStatus marCCD::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements)
+{
+    int function = pasynUser->reason;
+    int field;
+    double *pValues = NULL;
+    const char *functionName = "writeFloat64Array";
+
+    if      (function == marCCDSeqPhi)        field = marCCDSeqFieldPhi;
+    else if (function == marCCDSeqDistance)   field = marCCDSeqFieldDistance;
+    else if (function == marCCDSeqTwoTheta)   field = marCCDSeqFieldTwoTheta;
+    else if (function == marCCDSeqWavelength) field = marCCDSeqFieldWavelength;
+    else return ADDriver::writeFloat64Array(pasynUser, value, nElements);
+
+    if (nElements > 0) {
+        pValues = (double *)malloc(nElements * sizeof(double));
+        if (!pValues) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s: cannot allocate %lu values\n", driverName, functionName, (unsigned long)nElements);
+            return asynError;
+        }
+        memcpy(pValues, value, nElements * sizeof(double));
+    }
+    free(this->seqValues[field]);
+    this->seqValues[field] = pValues;
+    this->seqLength[field] = nElements;
+    doCallbacksFloat64Array(value, nElements, function, 0);
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+        "%s:%s: function=%d, %lu values\n", driverName, functionName, function, (unsigned long)nElements);
+    return asynSuccess;
+}
+
+/** Called when asyn clients call pasynFloat64Array->read().  Returns the values of a header field for
+  * each frame of a sweep. */
+asynStatus marCCD::readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn)
+{
+    int function = pasynUser->reason;
+    int field;
+
+    if      (function == marCCDSeqPhi)        field = marCCDSeqFieldPhi;
+    else if (function == marCCDSeqDistance)   field = marCCDSeqFieldDistance;
+    else if (function == marCCDSeqTwoTheta)   field = marCCDSeqFieldTwoTheta;
+    else if (function == marCCDSeqWavelength) field = marCCDSeqFieldWavelength;
+    else return ADDriver::readFloat64Array(pasynUser, value, nElements, nIn);
+
+    *nIn = (nElements < this->seqLength[field]) ? nElements : this->seqLength[field];
+    if (*nIn) memcpy(value, this->seqValues[field], *nIn * sizeof(double));
+    return asynSuccess;
+}
+
 asynStatus marCCD::readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], 
                             size_t nElements, size_t *nIn)
 {
@@ -1407,6 +4026,14 @@ asynStatus marCCD::readEnum(asynUser *pasynUser, char *strings[], int values[],
 }
 
 
+/** Locks the driver.  This is overridden so that the time spent waiting for the lock appears
+  * in the trace recorded with marCCDTraceEnable. */
+asynStatus marCCD::lock()
+{
+    marCCDTraceSpan span("lock");
+    return ADDriver::lock();
+}
+
 /** Report status of the driver.
   * Prints details about the driver if details>0.
   * It then calls the ADDriver::report() method.
@@ -1421,6 +4048,14 @@ void marCCD::report(FILE *fp, int details)
         getIntegerParam(ADSizeX, &nx);
         getIntegerParam(ADSizeY, &ny);
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
+        fprintf(fp, "  Server connected:  %s\n", this->connected ? "Yes" : "No");
+        if (this->configCacheFile) fprintf(fp, "  Config cache:      %s\n", this->configCacheFile);
+        fprintf(fp, "  Exposure timer:    %s, last lateness %.1f us\n", 
+            this->pTimer->getRealTime() ? "SCHED_FIFO" : "normal scheduler", this->pTimer->getLateness() * 1.e6);
+        if (this->pShmRing) this->pShmRing->report(fp);
+        if (this->pStream) this->pStream->report(fp);
+        if (this->pMetrics) this->pMetrics->report(fp);
+        marCCDThreadReport(fp);
     }
     /* Invoke the base class method */
     ADDriver::report(fp, details);
@@ -1428,12 +4063,77 @@ void marCCD::report(FILE *fp, int details)
 
 extern "C" int marCCDConfig(const char *portName, const char *serverPort, 
                             int maxBuffers, size_t maxMemory,
-                            int priority, int stackSize)
+                            int priority, int stackSize, const char *configCacheFile)
 {
-    new marCCD(portName, serverPort, maxBuffers, maxMemory, priority, stackSize);
+    new marCCD(portName, serverPort, maxBuffers, maxMemory, priority, stackSize, configCacheFile);
     return(asynSuccess);
 }
 
+/** Creates a shared memory ring that the frames read by a marCCD driver are published to.
+  * \param[in] portName The name of the marCCD asyn port driver.
+  * \param[in] shmName The name of the POSIX shared memory object, without the leading "/".
+  * \param[in] numSlots The number of frames in the ring.
+  * \param[in] maxSizeMB The size of each slot in MB; it must hold the largest frame.
+  * \param[in] policy 0 to overwrite the oldest frame when the ring is full, 1 to wait for the consumer. */
+extern "C" int marCCDShmRingConfig(const char *portName, const char *shmName, 
+                                   int numSlots, int maxSizeMB, int policy)
+{
+    marCCD *pmarCCD = dynamic_cast<marCCD *>(findAsynPortDriver(portName));
+    
+    if (!pmarCCD) {
+        printf("marCCDShmRingConfig: cannot find marCCD port %s\n", portName);
+        return(asynError);
+    }
+    return(pmarCCD->configShmRing(shmName, numSlots, maxSizeMB, policy));
+}
+
+/** Starts a TCP server that streams the frames read by a marCCD driver to its clients.
+  * \param[in] portName The name of the marCCD asyn port driver.
+  * \param[in] tcpPort The TCP port to listen on.
+  * \param[in] queueSize The maximum number of frames queued for each client; frames are dropped
+  *            for clients that fall further behind.
+  * \param[in] interfaceName The IP address to listen on; NULL or "" for 127.0.0.1, "0.0.0.0" for all interfaces. */
+extern "C" int marCCDStreamConfig(const char *portName, int tcpPort, int queueSize, const char *interfaceName)
+{
+    marCCD *pmarCCD = dynamic_cast<marCCD *>(findAsynPortDriver(portName));
+    
+    if (!pmarCCD) {
+        printf("marCCDStreamConfig: cannot find marCCD port %s\n", portName);
+        return(asynError);
+    }
+    return(pmarCCD->configStream(interfaceName, tcpPort, queueSize));
+}
+
+/** Runs the exposure timer thread with the SCHED_FIFO real-time scheduler.
+  * \param[in] portName The name of the marCCD port.
+  * \param[in] priority The SCHED_FIFO priority from 1 to 99, or 0 for the normal scheduler. */
+extern "C" int marCCDTimerConfig(const char *portName, int priority)
+{
+    marCCD *pmarCCD = dynamic_cast<marCCD *>(findAsynPortDriver(portName));
+    
+    if (!pmarCCD) {
+        printf("marCCDTimerConfig: cannot find marCCD port %s\n", portName);
+        return(asynError);
+    }
+    return(pmarCCD->configTimer(priority));
+}
+
+/** Starts an HTTP server with the counters and latency histograms of a marCCD driver in the
+  * Prometheus text format, at http://interfaceName:tcpPort/metrics.
+  * \param[in] portName The name of the marCCD port.
+  * \param[in] interfaceName The IP address to listen on, "" for 127.0.0.1 or "0.0.0.0" for all interfaces.
+  * \param[in] tcpPort The TCP port to listen on. */
+extern "C" int marCCDMetricsConfig(const char *portName, const char *interfaceName, int tcpPort)
+{
+    marCCD *pmarCCD = dynamic_cast<marCCD *>(findAsynPortDriver(portName));
+    
+    if (!pmarCCD) {
+        printf("marCCDMetricsConfig: cannot find marCCD port %s\n", portName);
+        return(asynError);
+    }
+    return(pmarCCD->configMetrics(interfaceName, tcpPort));
+}
+
 /** Constructor for marCCD driver; most parameters are simply passed to ADDriver::ADDriver.
   * After calling the base class constructor this method creates a thread to collect the detector data, 
   * and sets reasonable default values the parameters defined in this class, asynNDArrayDriver, and ADDriver.
@@ -1446,22 +4146,25 @@ extern "C" int marCCDConfig(const char *portName, const char *serverPort,
   *            allowed to allocate. Set this to -1 to allow an unlimited amount of memory.
   * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
   * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+  * \param[in] configCacheFile The name of a file where the server mode and detector geometry are saved
+  *            each time they are read from the server, and restored from at startup.  NULL or "" for none.
   */
 marCCD::marCCD(const char *portName, const char *serverPort,
                                 int maxBuffers, size_t maxMemory,
-                                int priority, int stackSize)
+                                int priority, int stackSize, const char *configCacheFile)
 
-    : ADDriver(portName, 1, NUM_MARCCD_PARAMS, maxBuffers, maxMemory,
-               asynEnumMask, asynEnumMask,             /* Implementing asynEnum beyond those set in ADDriver.cpp */
-               ASYN_CANBLOCK, 1, /* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=0, autoConnect=1 */
+    : ADDriver(portName, MARCCD_NUM_ADDR, NUM_MARCCD_PARAMS, maxBuffers, maxMemory,
+               asynEnumMask | asynFloat64ArrayMask,   /* Implementing asynEnum and asynFloat64Array beyond those set in ADDriver.cpp */
+               asynEnumMask | asynFloat64ArrayMask,
+               ASYN_CANBLOCK | ASYN_MULTIDEVICE, 1, /* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=1, autoConnect=1 */
                priority, stackSize),
-      pData(NULL)
+      serverMode(1), threadGeneration(0), pData(NULL), pasynUserConnect(NULL), connected(0), configCacheFile(NULL), 
+      ringFrames(NULL), ringAlloc(0), ringHead(0), ringCount(0), ringBytes(0), ringAdded(0)
 
 {
     int status = asynSuccess;
-    epicsTimerQueueId timerQ;
-    int itemp;
-    size_t dims[2];
+    int numWorkers;
+    int i;
     static const char *functionName = "marCCD";
 
     createParam(marCCDGateModeString,          asynParamInt32,   &marCCDGateMode);
@@ -1492,7 +4195,108 @@ marCCD::marCCD(const char *portName, const char *serverPort,
     createParam(marCCDWavelengthString,        asynParamFloat64, &marCCDWavelength);
     createParam(marCCDFileCommentsString,      asynParamOctet,   &marCCDFileComments);
     createParam(marCCDDatasetCommentsString,   asynParamOctet,   &marCCDDatasetComments);
+    createParam(marCCDStatusRateString,        asynParamFloat64, &marCCDStatusRate);
+    createParam(marCCDRingSizeString,          asynParamInt32,   &marCCDRingSize);
+    createParam(marCCDRingMaxMemoryString,     asynParamFloat64, &marCCDRingMaxMemory);
+    createParam(marCCDRingNumFramesString,     asynParamInt32,   &marCCDRingNumFrames);
+    createParam(marCCDRingDumpModeString,      asynParamInt32,   &marCCDRingDumpMode);
+    createParam(marCCDRingDumpString,          asynParamInt32,   &marCCDRingDump);
+    createParam(marCCDPoolPolicyString,        asynParamInt32,   &marCCDPoolPolicy);
+    createParam(marCCDPoolStallsString,        asynParamInt32,   &marCCDPoolStalls);
+    createParam(marCCDPoolStallTimeString,     asynParamFloat64, &marCCDPoolStallTime);
+    createParam(marCCDPoolDropsString,         asynParamInt32,   &marCCDPoolDrops);
+    createParam(marCCDPoolPreviewsString,      asynParamInt32,   &marCCDPoolPreviews);
+    createParam(marCCDNumThreadsString,        asynParamInt32,   &marCCDNumThreads);
+    createParam(marCCDPixelSizeString,         asynParamFloat64, &marCCDPixelSize);
+    createParam(marCCDRadialEnableString,      asynParamInt32,   &marCCDRadialEnable);
+    createParam(marCCDRadialNumBinsString,     asynParamInt32,   &marCCDRadialNumBins);
+    createParam(marCCDRadialQMaxString,        asynParamFloat64, &marCCDRadialQMax);
+    createParam(marCCDRadialTimeString,        asynParamFloat64, &marCCDRadialTime);
+    createParam(marCCDSpotEnableString,        asynParamInt32,   &marCCDSpotEnable);
+    createParam(marCCDSpotSigmaString,         asynParamFloat64, &marCCDSpotSigma);
+    createParam(marCCDSpotMinPixelsString,     asynParamInt32,   &marCCDSpotMinPixels);
+    createParam(marCCDSpotCountString,         asynParamInt32,   &marCCDSpotCount);
+    createParam(marCCDSpotTimeString,          asynParamFloat64, &marCCDSpotTime);
+    createParam(marCCDHitThresholdString,      asynParamInt32,   &marCCDHitThreshold);
+    createParam(marCCDHitCountString,          asynParamInt32,   &marCCDHitCount);
+    createParam(marCCDVetoModeString,          asynParamInt32,   &marCCDVetoMode);
+    createParam(marCCDVetoCountString,         asynParamInt32,   &marCCDVetoCount);
+    createParam(marCCDPreviewBinString,        asynParamInt32,   &marCCDPreviewBin);
+    createParam(marCCDPreviewRateString,       asynParamFloat64, &marCCDPreviewRate);
+    createParam(marCCDShmEnableString,         asynParamInt32,   &marCCDShmEnable);
+    createParam(marCCDShmBlockTimeoutString,   asynParamFloat64, &marCCDShmBlockTimeout);
+    createParam(marCCDShmFramesString,         asynParamInt32,   &marCCDShmFrames);
+    createParam(marCCDShmDropsString,          asynParamInt32,   &marCCDShmDrops);
+    createParam(marCCDStreamEnableString,      asynParamInt32,   &marCCDStreamEnable);
+    createParam(marCCDStreamCodecString,       asynParamInt32,   &marCCDStreamCodec);
+    createParam(marCCDStreamClientsString,     asynParamInt32,   &marCCDStreamClients);
+    createParam(marCCDStreamDropsString,       asynParamInt32,   &marCCDStreamDrops);
+    createParam(marCCDStreamRateString,        asynParamFloat64, &marCCDStreamRate);
+    createParam(marCCDBadPixelFileString,      asynParamOctet,   &marCCDBadPixelFile);
+    createParam(marCCDBadPixelEnableString,    asynParamInt32,   &marCCDBadPixelEnable);
+    createParam(marCCDBadPixelValueString,     asynParamInt32,   &marCCDBadPixelValue);
+    createParam(marCCDBadPixelCountString,     asynParamInt32,   &marCCDBadPixelCount);
+    createParam(marCCDDezingerModeString,      asynParamInt32,   &marCCDDezingerMode);
+    createParam(marCCDDezingerSigmaString,     asynParamFloat64, &marCCDDezingerSigma);
+    createParam(marCCDZingerCountString,       asynParamInt32,   &marCCDZingerCount);
+    createParam(marCCDCorrectTimeString,       asynParamFloat64, &marCCDCorrectTime);
+    createParam(marCCDCorrectModeString,       asynParamInt32,   &marCCDCorrectMode);
+    createParam(marCCDRemapFileString,         asynParamOctet,   &marCCDRemapFile);
+    createParam(marCCDRemapEntriesString,      asynParamInt32,   &marCCDRemapEntries);
+    createParam(marCCDConnectedString,         asynParamInt32,   &marCCDConnected);
+    createParam(marCCDReconnectsString,        asynParamInt32,   &marCCDReconnects);
+    createParam(marCCDReadModeString,          asynParamInt32,   &marCCDReadMode);
+    createParam(marCCDReadaheadString,         asynParamInt32,   &marCCDReadahead);
+    createParam(marCCDBytesReadString,         asynParamFloat64, &marCCDBytesRead);
+    createParam(marCCDCacheHitString,          asynParamFloat64, &marCCDCacheHit);
+    createParam(marCCDReplayString,            asynParamInt32,   &marCCDReplay);
+    createParam(marCCDReplayTemplateString,    asynParamOctet,   &marCCDReplayTemplate);
+    createParam(marCCDReplayRateString,        asynParamFloat64, &marCCDReplayRate);
+    createParam(marCCDReplayFrameRateString,   asynParamFloat64, &marCCDReplayFrameRate);
+    createParam(marCCDReplayDataRateString,    asynParamFloat64, &marCCDReplayDataRate);
+    createParam(marCCDReplayBacklogString,     asynParamInt32,   &marCCDReplayBacklog);
+    createParam(marCCDCallbackLatencyString,   asynParamFloat64, &marCCDCallbackLatency);
+    createParam(marCCDExposureErrorString,     asynParamFloat64, &marCCDExposureError);
+    createParam(marCCDExposureErrorMeanString, asynParamFloat64, &marCCDExposureErrorMean);
+    createParam(marCCDExposureErrorStdString,  asynParamFloat64, &marCCDExposureErrorStd);
+    createParam(marCCDExposureErrorMaxString,  asynParamFloat64, &marCCDExposureErrorMax);
+    createParam(marCCDTimerLatenessString,     asynParamFloat64, &marCCDTimerLateness);
+    createParam(marCCDStartLatencyString,      asynParamFloat64, &marCCDStartLatency);
+    createParam(marCCDCompressString,          asynParamInt32,   &marCCDCompress);
+    createParam(marCCDCompressRatioString,     asynParamFloat64, &marCCDCompressRatio);
+    createParam(marCCDCompressRateString,      asynParamFloat64, &marCCDCompressRate);
+    createParam(marCCDAbortString,             asynParamInt32,   &marCCDAbort);
+    createParam(marCCDAbortLatencyString,      asynParamFloat64, &marCCDAbortLatency);
+    createParam(marCCDJobSubmitString,         asynParamOctet,   &marCCDJobSubmit);
+    createParam(marCCDJobFileString,           asynParamOctet,   &marCCDJobFile);
+    createParam(marCCDJobRunString,            asynParamInt32,   &marCCDJobRun);
+    createParam(marCCDJobClearString,          asynParamInt32,   &marCCDJobClear);
+    createParam(marCCDJobsQueuedString,        asynParamInt32,   &marCCDJobsQueued);
+    createParam(marCCDJobsDoneString,          asynParamInt32,   &marCCDJobsDone);
+    createParam(marCCDJobIdString,             asynParamInt32,   &marCCDJobId);
+    createParam(marCCDJobLabelString,          asynParamOctet,   &marCCDJobLabel);
+    createParam(marCCDJobStateString,          asynParamInt32,   &marCCDJobState);
+    createParam(marCCDJobMessageString,        asynParamOctet,   &marCCDJobMessage);
+    createParam(marCCDJobHistoryString,        asynParamOctet,   &marCCDJobHistory);
+    createParam(marCCDHeaderSequenceString,    asynParamInt32,   &marCCDHeaderSequence);
+    createParam(marCCDHeaderFrameString,       asynParamInt32,   &marCCDHeaderFrame);
+    createParam(marCCDHeaderPhiString,         asynParamFloat64, &marCCDHeaderPhi);
+    createParam(marCCDSeqPhiString,            asynParamFloat64Array, &marCCDSeqPhi);
+    createParam(marCCDSeqDistanceString,       asynParamFloat64Array, &marCCDSeqDistance);
+    createParam(marCCDSeqTwoThetaString,       asynParamFloat64Array, &marCCDSeqTwoTheta);
+    createParam(marCCDSeqWavelengthString,     asynParamFloat64Array, &marCCDSeqWavelength);
     
+    this->publishedMarState = 0;
+    this->publishedADStatus = ADStatusIdle;
+    this->maskFrameOk = 0;
+    this->maskPreviewOk = 0;
+    this->maskCheckNx = 0;
+    this->maskCheckNy = 0;
+    epicsTimeGetCurrent(&this->statusCallbackTime);
+    setDoubleParam(marCCDStatusRate, 10.);
+    this->previewTime.secPastEpoch = 0;
+    this->previewTime.nsec = 0;
+
     /* Create the epicsEvents for signaling to the marCCD task when acquisition starts and stops */
     this->startEventId = epicsEventCreate(epicsEventEmpty);
     if (!this->startEventId) {
@@ -1512,10 +4316,98 @@ marCCD::marCCD(const char *portName, const char *serverPort,
             driverName, functionName);
         return;
     }
+    this->abortEventId = epicsEventCreate(epicsEventEmpty);
+    if (!this->abortEventId) {
+        printf("%s:%s epicsEventCreate failure for abort event\n", 
+            driverName, functionName);
+        return;
+    }
+    this->connectEventId = epicsEventCreate(epicsEventEmpty);
+    if (!this->connectEventId) {
+        printf("%s:%s epicsEventCreate failure for connect event\n", 
+            driverName, functionName);
+        return;
+    }
     
-    /* Create the epicsTimerQueue for exposure time handling */
-    timerQ = epicsTimerQueueAllocate(1, epicsThreadPriorityScanHigh);
-    this->timerId = epicsTimerQueueCreateTimer(timerQ, timerCallbackC, this);
+    /* Create the worker threads and the objects for processing frames */
+    this->processMutex = epicsMutexCreate();
+    if (!this->processMutex) {
+        printf("%s:%s epicsMutexCreate failure for process mutex\n", 
+            driverName, functionName);
+        return;
+    }
+    numWorkers = epicsThreadGetCPUs() - 1;
+    if (numWorkers > MAX_WORKER_THREADS - 1) numWorkers = MAX_WORKER_THREADS - 1;
+    this->pWorkers = new marCCDWorkers("marCCDWorker", numWorkers, epicsThreadPriorityMedium);
+    this->pRadial = new marCCDRadial();
+    this->pSpots = new marCCDSpotFinder();
+    this->pShmRing = NULL;
+    this->pStream = NULL;
+    this->pMetrics = NULL;
+    this->pCorrect = new marCCDCorrect();
+    this->dezingerFile[0] = 0;
+    this->pRemap = new marCCDRemap();
+
+    /* The keys of the acquisition jobs, and the parameters they set */
+    const marCCDJobKey jobKeys[] = {
+        {"mode",             ADImageMode,              marCCDJobInt,    imageModeStrings,   5},
+        {"trigger",          ADTriggerMode,            marCCDJobInt,    triggerModeStrings, 4},
+        {"frame_type",       ADFrameType,              marCCDJobInt,    frameTypeStrings,   4},
+        {"num_images",       ADNumImages,              marCCDJobInt,    NULL, 0},
+        {"acquire_time",     ADAcquireTime,            marCCDJobDouble, NULL, 0},
+        {"acquire_period",   ADAcquirePeriod,          marCCDJobDouble, NULL, 0},
+        {"file_path",        NDFilePath,               marCCDJobString, NULL, 0},
+        {"file_name",        NDFileName,               marCCDJobString, NULL, 0},
+        {"file_number",      NDFileNumber,             marCCDJobInt,    NULL, 0},
+        {"file_template",    NDFileTemplate,           marCCDJobString, NULL, 0},
+        {"auto_save",        NDAutoSave,               marCCDJobInt,    NULL, 0},
+        {"auto_increment",   NDAutoIncrement,          marCCDJobInt,    NULL, 0},
+        {"series_template",  marCCDSeriesFileTemplate, marCCDJobString, NULL, 0},
+        {"series_digits",    marCCDSeriesFileDigits,   marCCDJobInt,    NULL, 0},
+        {"series_first",     marCCDSeriesFileFirst,    marCCDJobInt,    NULL, 0},
+        {"overlap",          marCCDOverlap,            marCCDJobInt,    NULL, 0},
+        {"distance",         marCCDDetectorDistance,   marCCDJobDouble, NULL, 0},
+        {"beam_x",           marCCDBeamX,              marCCDJobDouble, NULL, 0},
+        {"beam_y",           marCCDBeamY,              marCCDJobDouble, NULL, 0},
+        {"start_phi",        marCCDStartPhi,           marCCDJobDouble, NULL, 0},
+        {"rotation_axis",    marCCDRotationAxis,       marCCDJobString, NULL, 0},
+        {"rotation_range",   marCCDRotationRange,      marCCDJobDouble, NULL, 0},
+        {"two_theta",        marCCDTwoTheta,           marCCDJobDouble, NULL, 0},
+        {"wavelength",       marCCDWavelength,         marCCDJobDouble, NULL, 0},
+        {"file_comments",    marCCDFileComments,       marCCDJobString, NULL, 0},
+        {"dataset_comments", marCCDDatasetComments,    marCCDJobString, NULL, 0},
+        {"header_sequence",  marCCDHeaderSequence,     marCCDJobInt,    NULL, 0},
+    };
+    this->pJobs = new marCCDJobQueue(jobKeys, (int)(sizeof(jobKeys)/sizeof(jobKeys[0])));
+    this->iocCorrect = 0;
+    this->bytesRead = 0.;
+    this->bytesCached = 0.;
+    this->replaying = 0;
+    this->frameTimeFromFile = 0;
+    epicsTimeGetCurrent(&this->exposureStart);
+    this->exposureEnd = this->exposureStart;
+    this->frameStart = this->exposureStart;
+    this->frameEnd = this->exposureStart;
+    this->fileTime = this->exposureStart;
+    this->abortRequested = 0;
+    this->abortTime = 0;
+    this->imageTaskQueued = 0;
+    this->imageQueueHead = 0;
+    this->imageQueueCount = 0;
+    this->headerFrame = 0;
+    for (i=0; i<marCCDNumSeqFields; i++) {
+        this->seqValues[i] = NULL;
+        this->seqLength[i] = 0;
+    }
+    if (configCacheFile && strlen(configCacheFile)) this->configCacheFile = epicsStrDup(configCacheFile);
+    this->configCache[0] = 0;
+
+    /* Create the timer for exposure time handling */
+    this->pTimer = new marCCDTimer("marCCDTimer", epicsThreadPriorityScanHigh, timerCallbackC, this);
+    this->exposureCount = 0;
+    this->exposureErrorMean = 0.;
+    this->exposureErrorM2 = 0.;
+    this->exposureErrorMax = 0.;
     
     
     /* Connect to server */
@@ -1527,30 +4419,30 @@ marCCD::marCCD(const char *portName, const char *serverPort,
           return;
     }
 
-    /* Get the server mode (1=marCCD, 2=High speed) */
-    status = getServerMode();
+    /* Get exceptions when the server port connects and disconnects; connectTask reads the 
+     * server mode and configuration each time it connects */
+    this->pasynUserConnect = pasynManager->createAsynUser(0, 0);
+    this->pasynUserConnect->userPvt = this;
+    status = pasynManager->connectDevice(this->pasynUserConnect, serverPort, 0);
+    if (status == asynSuccess) 
+        status = pasynManager->exceptionCallbackAdd(this->pasynUserConnect, connectExceptionC);
     if (status) {
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-            "%s:%s: error calling getServerMode for server port %s\n",
+            "%s:%s: error adding exception callback for server port %s\n",
             driverName, functionName, serverPort);
           return;
     }
-    
-    /* Compute the sensor size by reading the image size and the binning */
-    status = getConfig();
 
-    /* Read the current state of the server */
-    status = getState();
-    
-    /* Allocate the raw buffer we use to readTiff files.  Only do this once */
-    getIntegerParam(ADMaxSizeX, &itemp); dims[0] = itemp;
-    getIntegerParam(ADMaxSizeY, &itemp); dims[1] = itemp;
-    this->pData = this->pNDArrayPool->alloc(2, dims, NDInt16, 0, NULL);
+    /* Restore the geometry from the last connection, and allocate the raw buffer we use to readTiff 
+     * files when the NDArrayPool is exhausted.  The buffer is reallocated on connection if needed.
+     * Both use the data type, which is read from each TIFF file later. */
+    setIntegerParam(NDDataType, NDUInt16);
+    loadConfigCache();
+    allocScratch();
 
     /* Set some default values for parameters */
     status =  setStringParam (ADManufacturer, "MAR");
     status |= setStringParam (ADModel, "CCD");
-    status |= setIntegerParam(NDDataType,  NDInt16);
     status |= setIntegerParam(ADImageMode, ADImageSingle);
     status |= setIntegerParam(ADTriggerMode, ADTriggerInternal);
     status |= setDoubleParam (ADAcquireTime, 1.);
@@ -1559,6 +4451,93 @@ marCCD::marCCD(const char *portName, const char *serverPort,
     status |= setIntegerParam(marCCDOverlap, 0);
 
     status |= setDoubleParam (marCCDTiffTimeout, 20.);
+    status |= setIntegerParam(marCCDRingSize, 0);
+    status |= setDoubleParam (marCCDRingMaxMemory, 0.);
+    status |= setIntegerParam(marCCDRingNumFrames, 0);
+    status |= setIntegerParam(marCCDRingDumpMode, marCCDRingDumpCallbacks);
+    status |= setIntegerParam(marCCDRingDump, 0);
+    status |= setIntegerParam(marCCDPoolPolicy, marCCDPoolBlock);
+    status |= setIntegerParam(marCCDPoolStalls, 0);
+    status |= setDoubleParam (marCCDPoolStallTime, 0.);
+    status |= setIntegerParam(marCCDPoolDrops, 0);
+    status |= setIntegerParam(marCCDPoolPreviews, 0);
+    status |= setIntegerParam(marCCDNumThreads, this->pWorkers->getNumThreads() + 1);
+    status |= setDoubleParam (marCCDPixelSize, 0.);
+    status |= setIntegerParam(marCCDRadialEnable, 0);
+    status |= setIntegerParam(marCCDRadialNumBins, 1000);
+    status |= setDoubleParam (marCCDRadialQMax, 0.);
+    status |= setDoubleParam (marCCDRadialTime, 0.);
+    status |= setIntegerParam(marCCDSpotEnable, 0);
+    status |= setDoubleParam (marCCDSpotSigma, 6.);
+    status |= setIntegerParam(marCCDSpotMinPixels, 3);
+    status |= setIntegerParam(marCCDSpotCount, 0);
+    status |= setDoubleParam (marCCDSpotTime, 0.);
+    status |= setIntegerParam(marCCDHitThreshold, 10);
+    status |= setIntegerParam(marCCDHitCount, 0);
+    status |= setIntegerParam(marCCDVetoMode, marCCDVetoOff);
+    status |= setIntegerParam(marCCDVetoCount, 0);
+    status |= setIntegerParam(marCCDPreviewBin, 0);
+    status |= setDoubleParam (marCCDPreviewRate, 2.);
+    status |= setIntegerParam(marCCDShmEnable, 0);
+    status |= setDoubleParam (marCCDShmBlockTimeout, 1.0);
+    status |= setIntegerParam(marCCDShmFrames, 0);
+    status |= setIntegerParam(marCCDShmDrops, 0);
+    status |= setIntegerParam(marCCDStreamEnable, 0);
+    status |= setIntegerParam(marCCDStreamCodec, marCCDCodecNone);
+    status |= setIntegerParam(marCCDStreamClients, 0);
+    status |= setIntegerParam(marCCDStreamDrops, 0);
+    status |= setDoubleParam (marCCDStreamRate, 0.);
+    status |= setStringParam (marCCDBadPixelFile, "");
+    status |= setIntegerParam(marCCDBadPixelEnable, 0);
+    status |= setIntegerParam(marCCDBadPixelValue, 0);
+    status |= setIntegerParam(marCCDBadPixelCount, 0);
+    status |= setIntegerParam(marCCDDezingerMode, marCCDDezingerServer);
+    status |= setDoubleParam (marCCDDezingerSigma, 4.);
+    status |= setIntegerParam(marCCDZingerCount, 0);
+    status |= setDoubleParam (marCCDCorrectTime, 0.);
+    status |= setIntegerParam(marCCDCorrectMode, marCCDCorrectServer);
+    status |= setStringParam (marCCDRemapFile, "");
+    status |= setIntegerParam(marCCDRemapEntries, 0);
+    status |= setIntegerParam(marCCDConnected, 0);
+    /* The server mode determines the image mode choices, so it must be defined before iocInit */
+    status |= setIntegerParam(marCCDServerMode, this->serverMode);
+    status |= setIntegerParam(marCCDReconnects, 0);
+    status |= setIntegerParam(marCCDReadMode, marCCDReadNormal);
+    status |= setIntegerParam(marCCDReadahead, 0);
+    status |= setDoubleParam (marCCDBytesRead, 0.);
+    status |= setDoubleParam (marCCDCacheHit, 0.);
+    status |= setIntegerParam(marCCDReplay, 0);
+    status |= setStringParam (marCCDReplayTemplate, "");
+    status |= setDoubleParam (marCCDReplayRate, 0.);
+    status |= setDoubleParam (marCCDReplayFrameRate, 0.);
+    status |= setDoubleParam (marCCDReplayDataRate, 0.);
+    status |= setIntegerParam(marCCDReplayBacklog, 0);
+    status |= setDoubleParam (marCCDCallbackLatency, 0.);
+    status |= setDoubleParam (marCCDExposureError, 0.);
+    status |= setDoubleParam (marCCDExposureErrorMean, 0.);
+    status |= setDoubleParam (marCCDExposureErrorStd, 0.);
+    status |= setDoubleParam (marCCDExposureErrorMax, 0.);
+    status |= setDoubleParam (marCCDTimerLateness, 0.);
+    status |= setDoubleParam (marCCDStartLatency, 0.);
+    status |= setIntegerParam(marCCDCompress, marCCDCodecNone);
+    status |= setDoubleParam (marCCDCompressRatio, 0.);
+    status |= setDoubleParam (marCCDCompressRate, 0.);
+    status |= setIntegerParam(marCCDAbort, 0);
+    status |= setDoubleParam (marCCDAbortLatency, 0.);
+    status |= setStringParam (marCCDJobSubmit, "");
+    status |= setStringParam (marCCDJobFile, "");
+    status |= setIntegerParam(marCCDJobRun, 0);
+    status |= setIntegerParam(marCCDJobClear, 0);
+    status |= setIntegerParam(marCCDJobsQueued, 0);
+    status |= setIntegerParam(marCCDJobsDone, 0);
+    status |= setIntegerParam(marCCDJobId, 0);
+    status |= setStringParam (marCCDJobLabel, "");
+    status |= setIntegerParam(marCCDJobState, marCCDJobIdle);
+    status |= setStringParam (marCCDJobMessage, "");
+    status |= setStringParam (marCCDJobHistory, "");
+    status |= setIntegerParam(marCCDHeaderSequence, 0);
+    status |= setIntegerParam(marCCDHeaderFrame, 0);
+    status |= setDoubleParam (marCCDHeaderPhi, 0.);
        
     if (status) {
         printf("%s: unable to set camera parameters\n", functionName);
@@ -1576,6 +4555,17 @@ marCCD::marCCD(const char *portName, const char *serverPort,
             driverName, functionName);
         return;
     }
+    /* Create the thread that connects to the server */
+    status = (epicsThreadCreate("marCCDConnect",
+                                epicsThreadPriorityMedium,
+                                epicsThreadGetStackSize(epicsThreadStackMedium),
+                                (EPICSTHREADFUNC)connectTaskC,
+                                this) == NULL);
+    if (status) {
+        printf("%s:%s epicsThreadCreate failure for connect task\n", 
+            driverName, functionName);
+        return;
+    }
     /* Create the thread that reads the images */
     status = (epicsThreadCreate("marCCDImageTask",
                                 epicsThreadPriorityMedium,
@@ -1596,23 +4586,94 @@ static const iocshArg marCCDConfigArg2 = {"maxBuffers", iocshArgInt};
 static const iocshArg marCCDConfigArg3 = {"maxMemory", iocshArgInt};
 static const iocshArg marCCDConfigArg4 = {"priority", iocshArgInt};
 static const iocshArg marCCDConfigArg5 = {"stackSize", iocshArgInt};
+static const iocshArg marCCDConfigArg6 = {"configCacheFile", iocshArgString};
 static const iocshArg * const marCCDConfigArgs[] =  {&marCCDConfigArg0,
                                                      &marCCDConfigArg1,
                                                      &marCCDConfigArg2,
                                                      &marCCDConfigArg3,
                                                      &marCCDConfigArg4,
-                                                     &marCCDConfigArg5};
-static const iocshFuncDef configMARCCD = {"marCCDConfig", 6, marCCDConfigArgs};
+                                                     &marCCDConfigArg5,
+                                                     &marCCDConfigArg6};
+static const iocshFuncDef configMARCCD = {"marCCDConfig", 7, marCCDConfigArgs};
 static void configMARCCDCallFunc(const iocshArgBuf *args)
 {
     marCCDConfig(args[0].sval, args[1].sval, args[2].ival,
-                 args[3].ival, args[4].ival, args[5].ival);
+                 args[3].ival, args[4].ival, args[5].ival, args[6].sval);
+}
+
+static const iocshArg marCCDShmRingConfigArg0 = {"Port name", iocshArgString};
+static const iocshArg marCCDShmRingConfigArg1 = {"shared memory name", iocshArgString};
+static const iocshArg marCCDShmRingConfigArg2 = {"numSlots", iocshArgInt};
+static const iocshArg marCCDShmRingConfigArg3 = {"slot size (MB)", iocshArgInt};
+static const iocshArg marCCDShmRingConfigArg4 = {"policy (0=overwrite, 1=block)", iocshArgInt};
+static const iocshArg * const marCCDShmRingConfigArgs[] =  {&marCCDShmRingConfigArg0,
+                                                            &marCCDShmRingConfigArg1,
+                                                            &marCCDShmRingConfigArg2,
+                                                            &marCCDShmRingConfigArg3,
+                                                            &marCCDShmRingConfigArg4};
+static const iocshFuncDef configShmRing = {"marCCDShmRingConfig", 5, marCCDShmRingConfigArgs};
+static void configShmRingCallFunc(const iocshArgBuf *args)
+{
+    marCCDShmRingConfig(args[0].sval, args[1].sval, args[2].ival,
+                        args[3].ival, args[4].ival);
+}
+
+static const iocshArg marCCDStreamConfigArg0 = {"Port name", iocshArgString};
+static const iocshArg marCCDStreamConfigArg1 = {"TCP port", iocshArgInt};
+static const iocshArg marCCDStreamConfigArg2 = {"queueSize", iocshArgInt};
+static const iocshArg marCCDStreamConfigArg3 = {"Interface address", iocshArgString};
+static const iocshArg * const marCCDStreamConfigArgs[] =  {&marCCDStreamConfigArg0,
+                                                           &marCCDStreamConfigArg1,
+                                                           &marCCDStreamConfigArg2,
+                                                           &marCCDStreamConfigArg3};
+static const iocshFuncDef configStream = {"marCCDStreamConfig", 4, marCCDStreamConfigArgs};
+static void configStreamCallFunc(const iocshArgBuf *args)
+{
+    marCCDStreamConfig(args[0].sval, args[1].ival, args[2].ival, args[3].sval);
 }
 
+static const iocshArg marCCDTimerConfigArg0 = {"Port name", iocshArgString};
+static const iocshArg marCCDTimerConfigArg1 = {"SCHED_FIFO priority", iocshArgInt};
+static const iocshArg * const marCCDTimerConfigArgs[] =  {&marCCDTimerConfigArg0,
+                                                          &marCCDTimerConfigArg1};
+static const iocshFuncDef configTimer = {"marCCDTimerConfig", 2, marCCDTimerConfigArgs};
+static void configTimerCallFunc(const iocshArgBuf *args)
+{
+    marCCDTimerConfig(args[0].sval, args[1].ival);
+}
+
+static const iocshArg marCCDThreadConfigArg0 = {"Thread name or prefix*", iocshArgString};
+static const iocshArg marCCDThreadConfigArg1 = {"EPICS priority", iocshArgInt};
+static const iocshArg marCCDThreadConfigArg2 = {"CPU list", iocshArgString};
+static const iocshArg * const marCCDThreadConfigArgs[] =  {&marCCDThreadConfigArg0,
+                                                           &marCCDThreadConfigArg1,
+                                                           &marCCDThreadConfigArg2};
+static const iocshFuncDef configThread = {"marCCDThreadConfig", 3, marCCDThreadConfigArgs};
+static void configThreadCallFunc(const iocshArgBuf *args)
+{
+    marCCDThreadConfig(args[0].sval, args[1].ival, args[2].sval);
+}
+
+static const iocshArg marCCDMetricsConfigArg0 = {"Port name", iocshArgString};
+static const iocshArg marCCDMetricsConfigArg1 = {"Interface address", iocshArgString};
+static const iocshArg marCCDMetricsConfigArg2 = {"TCP port", iocshArgInt};
+static const iocshArg * const marCCDMetricsConfigArgs[] =  {&marCCDMetricsConfigArg0,
+                                                            &marCCDMetricsConfigArg1,
+                                                            &marCCDMetricsConfigArg2};
+static const iocshFuncDef configMetrics = {"marCCDMetricsConfig", 3, marCCDMetricsConfigArgs};
+static void configMetricsCallFunc(const iocshArgBuf *args)
+{
+    marCCDMetricsConfig(args[0].sval, args[1].sval, args[2].ival);
+}
 
 static void marCCD_ADRegister(void)
 {
     iocshRegister(&configMARCCD, configMARCCDCallFunc);
+    iocshRegister(&configShmRing, configShmRingCallFunc);
+    iocshRegister(&configStream, configStreamCallFunc);
+    iocshRegister(&configTimer, configTimerCallFunc);
+    iocshRegister(&configThread, configThreadCallFunc);
+    iocshRegister(&configMetrics, configMetricsCallFunc);
 }
 
 extern "C" {
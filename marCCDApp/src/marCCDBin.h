@@ -0,0 +1,87 @@
+/* marCCDBin.h
+ *
+ * Software binning of frames by averaging blocks of pixels.
+ * The kernels are specialized at compile time for the pixel type and for binning by 2, 4 and 8,
+ * so the inner loops have fixed trip counts and can be unrolled and vectorized by the compiler.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_BIN_H
+#define MARCCD_BIN_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+/** The type the pixels of a block are summed in, wide enough for a block of 8x8 pixels */
+template <typename T> struct marCCDBinSum          { typedef epicsUInt32 type; };
+template <>           struct marCCDBinSum<epicsUInt32>  { typedef epicsUInt64 type; };
+template <>           struct marCCDBinSum<epicsFloat32> { typedef double type; };
+
+/** Bins one band of BIN rows into one output row.  Pixels at the right edge that do not fill a 
+  * complete block are ignored. */
+template <typename T, int BIN>
+static inline void marCCDBinRow(const T *pIn, size_t nx, T *pOut)
+{
+    size_t outX = nx/BIN;
+    size_t ix;
+    int i, j;
+    typename marCCDBinSum<T>::type sum;
+    const T *pRow;
+
+    for (ix=0; ix<outX; ix++) {
+        sum = 0;
+        for (j=0; j<BIN; j++) {
+            pRow = pIn + j*nx + ix*BIN;
+            for (i=0; i<BIN; i++) sum += pRow[i];
+        }
+        pOut[ix] = (T)(sum / (BIN*BIN));
+    }
+}
+
+/** Bins one band of bin rows for any bin factor */
+template <typename T>
+static inline void marCCDBinRowAny(const T *pIn, size_t nx, int bin, T *pOut)
+{
+    size_t outX = nx/bin;
+    size_t ix;
+    int i, j;
+    typename marCCDBinSum<T>::type sum;
+    const T *pRow;
+
+    for (ix=0; ix<outX; ix++) {
+        sum = 0;
+        for (j=0; j<bin; j++) {
+            pRow = pIn + j*nx + ix*bin;
+            for (i=0; i<bin; i++) sum += pRow[i];
+        }
+        pOut[ix] = (T)(sum / (bin*bin));
+    }
+}
+
+/** Bins numOutRows bands of bin rows of a frame of epicsUInt16, epicsUInt32 or epicsFloat32 pixels.
+  * \param[in] pIn The first input row.
+  * \param[in] nx The number of pixels in an input row.
+  * \param[in] bin The bin factor in both directions.
+  * \param[out] pOut The first output row, which has nx/bin pixels.
+  * \param[in] numOutRows The number of output rows. */
+template <typename T>
+static inline void marCCDBinRows(const T *pIn, size_t nx, int bin, T *pOut, size_t numOutRows)
+{
+    size_t row;
+    size_t outX = nx/bin;
+
+    for (row=0; row<numOutRows; row++) {
+        switch (bin) {
+            case 2: marCCDBinRow<T, 2>(pIn, nx, pOut); break;
+            case 4: marCCDBinRow<T, 4>(pIn, nx, pOut); break;
+            case 8: marCCDBinRow<T, 8>(pIn, nx, pOut); break;
+            default: marCCDBinRowAny<T>(pIn, nx, bin, pOut); break;
+        }
+        pIn += bin*nx;
+        pOut += outX;
+    }
+}
+
+#endif
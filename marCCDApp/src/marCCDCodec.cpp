@@ -0,0 +1,225 @@
+/* marCCDCodec.cpp
+ *
+ * Compression of frames for the streaming server and for the arrays passed to the plugins.
+ * LZ4 is available when the driver is built with the LZ4 library (HAVE_LZ4), bitshuffle/LZ4
+ * with the bitshuffle library (HAVE_BITSHUFFLE) and Blosc with the Blosc library (HAVE_BLOSC).
+ *
+ * The compressed data has the format NDCodec and the HDF5 filters expect for each codec name, so
+ * the file plugins can write it as a compressed chunk without decompressing it.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsTypes.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_BITSHUFFLE
+#include <bitshuffle.h>
+#endif
+#ifdef HAVE_BLOSC
+#include <blosc.h>
+#endif
+
+#include "marCCDCodec.h"
+
+/** Size of the header of the bitshuffle/LZ4 data: the uncompressed size and the block size */
+#define BSLZ4_HEADER_SIZE 12
+
+/** Returns 1 if the codec was compiled into the driver, 0 if not. */
+int marCCDCodecAvailable(int codec)
+{
+    switch (codec) {
+        case marCCDCodecNone:
+            return 1;
+#ifdef HAVE_LZ4
+        case marCCDCodecLZ4:
+            return 1;
+#endif
+#ifdef HAVE_BITSHUFFLE
+        case marCCDCodecBSLZ4:
+            return 1;
+#endif
+#ifdef HAVE_BLOSC
+        case marCCDCodecBlosc:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/** Returns the name of the codec, as used for NDArray::codec.name; "" for no compression. */
+const char *marCCDCodecName(int codec)
+{
+    switch (codec) {
+        case marCCDCodecLZ4:   return "lz4";
+        case marCCDCodecBSLZ4: return "bslz4";
+        case marCCDCodecBlosc: return "blosc";
+        default:               return "";
+    }
+}
+
+/** Returns the largest compressed size for size bytes of input. */
+size_t marCCDCodecBound(int codec, size_t size, size_t elementSize)
+{
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case marCCDCodecLZ4:
+            return LZ4_compressBound((int)size);
+#endif
+#ifdef HAVE_BITSHUFFLE
+        case marCCDCodecBSLZ4:
+            return BSLZ4_HEADER_SIZE + bshuf_compress_lz4_bound(size / elementSize, elementSize, 0);
+#endif
+#ifdef HAVE_BLOSC
+        case marCCDCodecBlosc:
+            return size + BLOSC_MAX_OVERHEAD;
+#endif
+        default:
+            return size;
+    }
+}
+
+#ifdef HAVE_BITSHUFFLE
+/** A frame compressed with bitshuffle/LZ4 by several tasks.  The data is a sequence of blocks that
+  * are compressed independently, so each task compresses a range of whole blocks, and the ranges
+  * are joined in order.  The result is the same as compressing the frame in one call. */
+typedef struct {
+    const char *pIn;
+    size_t numElements;
+    size_t elementSize;
+    size_t blockSize;           /**< In elements */
+    size_t taskElements;        /**< Elements for each task, a multiple of blockSize */
+    char **pTaskOut;
+    size_t taskBound;
+    epicsInt64 *taskSize;
+} marCCDBSLZ4Job;
+
+static void bslz4TaskC(void *pvt, int task, int numTasks)
+{
+    marCCDBSLZ4Job *pJob = (marCCDBSLZ4Job *)pvt;
+    size_t first = pJob->taskElements * task;
+    size_t count;
+
+    if (first >= pJob->numElements) {
+        pJob->taskSize[task] = 0;
+        return;
+    }
+    count = pJob->numElements - first;
+    if (count > pJob->taskElements) count = pJob->taskElements;
+    pJob->taskSize[task] = bshuf_compress_lz4(pJob->pIn + first * pJob->elementSize, pJob->pTaskOut[task],
+                                              count, pJob->elementSize, pJob->blockSize);
+}
+
+static void writeUInt64BE(char *pOut, epicsUInt64 value)
+{
+    int i;
+
+    for (i=7; i>=0; i--, value >>= 8) pOut[i] = (char)(value & 0xff);
+}
+
+static void writeUInt32BE(char *pOut, epicsUInt32 value)
+{
+    int i;
+
+    for (i=3; i>=0; i--, value >>= 8) pOut[i] = (char)(value & 0xff);
+}
+
+/** Compresses with bitshuffle/LZ4, with the 12 byte header of the HDF5 bitshuffle filter */
+static size_t compressBSLZ4(const void *pIn, size_t size, size_t elementSize, char *pOut, size_t maxOut,
+                            marCCDWorkers *pWorkers, int numTasks)
+{
+    marCCDBSLZ4Job job;
+    char *pScratch = NULL;
+    size_t outSize = BSLZ4_HEADER_SIZE;
+    size_t numBlocks;
+    int i;
+
+    if (maxOut < marCCDCodecBound(marCCDCodecBSLZ4, size, elementSize)) return 0;
+    job.pIn = (const char *)pIn;
+    job.elementSize = elementSize;
+    job.numElements = size / elementSize;
+    job.blockSize = bshuf_default_block_size(elementSize);
+    numBlocks = (job.numElements + job.blockSize - 1) / job.blockSize;
+    if (!pWorkers || (numTasks < 1)) numTasks = 1;
+    if ((size_t)numTasks > numBlocks) numTasks = numBlocks ? (int)numBlocks : 1;
+    job.taskElements = ((numBlocks + numTasks - 1) / numTasks) * job.blockSize;
+    job.taskBound = bshuf_compress_lz4_bound(job.taskElements, elementSize, job.blockSize);
+    job.pTaskOut = (char **)calloc(numTasks, sizeof(char *));
+    job.taskSize = (epicsInt64 *)calloc(numTasks, sizeof(epicsInt64));
+    if (numTasks > 1) pScratch = (char *)malloc(job.taskBound * (numTasks - 1));
+    if (!job.pTaskOut || !job.taskSize || ((numTasks > 1) && !pScratch)) {
+        outSize = 0;
+        goto done;
+    }
+    /* The first task writes after the header, the others to the scratch buffer */
+    job.pTaskOut[0] = pOut + BSLZ4_HEADER_SIZE;
+    for (i=1; i<numTasks; i++) job.pTaskOut[i] = pScratch + job.taskBound * (i - 1);
+    if (numTasks > 1) pWorkers->run(bslz4TaskC, &job, numTasks);
+    else bslz4TaskC(&job, 0, 1);
+    for (i=0; i<numTasks; i++) {
+        if (job.taskSize[i] < 0) {
+            outSize = 0;
+            goto done;
+        }
+        if (i > 0) memcpy(pOut + outSize, job.pTaskOut[i], job.taskSize[i]);
+        outSize += job.taskSize[i];
+    }
+    writeUInt64BE(pOut, size);
+    writeUInt32BE(pOut + 8, (epicsUInt32)(job.blockSize * elementSize));
+
+done:
+    free(pScratch);
+    free(job.pTaskOut);
+    free(job.taskSize);
+    return outSize;
+}
+#endif
+
+/** Compresses a buffer.
+  * \param[in] codec The marCCDCodec_t.
+  * \param[in] pIn The data to compress.
+  * \param[in] size The size of the data in bytes.
+  * \param[in] elementSize The size of a pixel, for the shuffle of bitshuffle/LZ4 and Blosc.
+  * \param[out] pOut The compressed data.
+  * \param[in] maxOut The size of pOut, which should be at least marCCDCodecBound(codec, size, elementSize).
+  * \param[in] pWorkers The worker pool that compresses parts of the frame in parallel, or NULL.
+  * \param[in] numTasks The number of parts the frame is divided into.  Bitshuffle/LZ4 divides the frame
+  *            among the workers and Blosc uses numTasks threads of its own.  LZ4 data is a single block,
+  *            which is compressed by the calling thread.
+  * \return The compressed size, or 0 if the codec is not available or the data did not fit in pOut. */
+size_t marCCDCodecCompress(int codec, const void *pIn, size_t size, size_t elementSize, void *pOut, size_t maxOut,
+                           marCCDWorkers *pWorkers, int numTasks)
+{
+    switch (codec) {
+        case marCCDCodecNone:
+            if (size > maxOut) return 0;
+            memcpy(pOut, pIn, size);
+            return size;
+#ifdef HAVE_LZ4
+        case marCCDCodecLZ4: {
+            int outSize = LZ4_compress_default((const char *)pIn, (char *)pOut, (int)size, (int)maxOut);
+            return (outSize > 0) ? outSize : 0;
+        }
+#endif
+#ifdef HAVE_BITSHUFFLE
+        case marCCDCodecBSLZ4:
+            return compressBSLZ4(pIn, size, elementSize, (char *)pOut, maxOut, pWorkers, numTasks);
+#endif
+#ifdef HAVE_BLOSC
+        case marCCDCodecBlosc: {
+            int outSize = blosc_compress_ctx(MARCCD_BLOSC_LEVEL, MARCCD_BLOSC_SHUFFLE, elementSize, size, pIn, 
+                                             pOut, maxOut, "lz4", 0, (numTasks > 0) ? numTasks : 1);
+            return (outSize > 0) ? outSize : 0;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,36 @@
+/* marCCDCodec.h
+ *
+ * Compression of frames for the streaming server and for the arrays passed to the plugins.
+ * LZ4 is available when the driver is built with the LZ4 library (HAVE_LZ4), bitshuffle/LZ4
+ * with the bitshuffle library (HAVE_BITSHUFFLE) and Blosc with the Blosc library (HAVE_BLOSC).
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_CODEC_H
+#define MARCCD_CODEC_H
+
+#include <stddef.h>
+
+#include "marCCDWorkers.h"
+
+typedef enum {
+    marCCDCodecNone,
+    marCCDCodecLZ4,
+    marCCDCodecBSLZ4,
+    marCCDCodecBlosc
+} marCCDCodec_t;
+
+/** The Blosc settings used by marCCDCodecCompress, which are also put in NDArray::codec */
+#define MARCCD_BLOSC_LEVEL      5
+#define MARCCD_BLOSC_SHUFFLE    1   /**< Byte shuffle */
+#define MARCCD_BLOSC_COMPRESSOR 1   /**< LZ4, the NDCodec index of the compressor */
+
+int marCCDCodecAvailable(int codec);
+const char *marCCDCodecName(int codec);
+size_t marCCDCodecBound(int codec, size_t size, size_t elementSize);
+size_t marCCDCodecCompress(int codec, const void *pIn, size_t size, size_t elementSize, void *pOut, size_t maxOut,
+                           marCCDWorkers *pWorkers, int numTasks);
+
+#endif
@@ -0,0 +1,305 @@
+/* marCCDCorrect.cpp
+ *
+ * Corrections applied to frames in the IOC: replacing bad pixels from a mask file, 
+ * and combining the two halves of a double correlation exposure with a dezinger.
+ *
+ * The frames are divided into contiguous blocks of pixels that are processed by the worker threads.
+ * The kernels process 8 pixels at a time with SSE2 when it is available, without branches,
+ * and the scalar code is used for the remaining pixels and on other architectures.  The scalar
+ * code uses the same single precision arithmetic, so the results do not depend on the architecture.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <tiffio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "marCCDCorrect.h"
+
+static const char *driverName = "marCCDCorrect";
+
+marCCDCorrect::marCCDCorrect()
+    : mask(NULL), maskNx(0), maskNy(0), numBadPixels(0), binnedMask(NULL), binnedNx(0), binnedNy(0),
+      pData(NULL), pFirst(NULL), numPixels(0), value(0), sigma(0.f), taskCounts(NULL), maxTasks(0)
+{
+}
+
+marCCDCorrect::~marCCDCorrect()
+{
+    free(this->mask);
+    free(this->binnedMask);
+    free(this->taskCounts);
+}
+
+static void maskTaskC(void *pvt, int task, int numTasks)
+{
+    marCCDCorrect *pCorrect = (marCCDCorrect *)pvt;
+    
+    pCorrect->maskTask(task, numTasks);
+}
+
+static void dezingerTaskC(void *pvt, int task, int numTasks)
+{
+    marCCDCorrect *pCorrect = (marCCDCorrect *)pvt;
+    
+    pCorrect->dezingerTask(task, numTasks);
+}
+
+/** Loads the bad pixel mask from a TIFF file the size of the unbinned detector.  
+  * Pixels that are not 0 in the file are bad.  The file can have 8, 16 or 32 bits per pixel.
+  * \return 0 on success, -1 on error, in which case the previous mask is kept. */
+int marCCDCorrect::loadMask(const char *fileName)
+{
+    const char *functionName = "loadMask";
+    TIFF *tiff;
+    epicsUInt32 width, height, row, col;
+    epicsUInt16 bitsPerSample = 0, samplesPerPixel = 1;
+    tdata_t buffer;
+    epicsUInt16 *pNew;
+    int badPixels = 0;
+    int bad;
+
+    TIFFSetErrorHandler(NULL);
+    TIFFSetWarningHandler(NULL);
+    tiff = TIFFOpen(fileName, "r");
+    if (!tiff) {
+        printf("%s:%s: error opening bad pixel file %s\n", driverName, functionName, fileName);
+        return -1;
+    }
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+    if (((bitsPerSample != 8) && (bitsPerSample != 16) && (bitsPerSample != 32)) || (samplesPerPixel != 1)) {
+        printf("%s:%s: bad pixel file %s must have one 8, 16 or 32 bit sample per pixel\n", 
+            driverName, functionName, fileName);
+        TIFFClose(tiff);
+        return -1;
+    }
+    pNew = (epicsUInt16 *)malloc((size_t)width * height * sizeof(epicsUInt16));
+    buffer = _TIFFmalloc(TIFFScanlineSize(tiff));
+    if (!pNew || !buffer) {
+        printf("%s:%s: error allocating memory for bad pixel mask\n", driverName, functionName);
+        free(pNew);
+        if (buffer) _TIFFfree(buffer);
+        TIFFClose(tiff);
+        return -1;
+    }
+    for (row=0; row<height; row++) {
+        if (TIFFReadScanline(tiff, buffer, row, 0) < 0) {
+            printf("%s:%s: error reading bad pixel file %s\n", driverName, functionName, fileName);
+            free(pNew);
+            _TIFFfree(buffer);
+            TIFFClose(tiff);
+            return -1;
+        }
+        for (col=0; col<width; col++) {
+            switch (bitsPerSample) {
+                case 8:  bad = ((epicsUInt8 *)buffer)[col] != 0; break;
+                case 16: bad = ((epicsUInt16 *)buffer)[col] != 0; break;
+                default: bad = ((epicsUInt32 *)buffer)[col] != 0; break;
+            }
+            pNew[(size_t)row*width + col] = bad ? 0xFFFF : 0;
+            badPixels += bad;
+        }
+    }
+    _TIFFfree(buffer);
+    TIFFClose(tiff);
+    free(this->mask);
+    this->mask = pNew;
+    this->maskNx = width;
+    this->maskNy = height;
+    this->numBadPixels = badPixels;
+    /* Force the binned mask to be recomputed */
+    this->binnedNx = 0;
+    this->binnedNy = 0;
+    return 0;
+}
+
+int marCCDCorrect::getNumBadPixels()
+{
+    return this->numBadPixels;
+}
+
+/** Returns 1 if a mask is loaded and can be applied to frames of this size, i.e. the size is the
+  * size of the mask divided by an integer binning, 0 otherwise. */
+int marCCDCorrect::matchesMask(size_t nx, size_t ny)
+{
+    return this->mask && (nx > 0) && (ny > 0) && !(this->maskNx % nx) && !(this->maskNy % ny);
+}
+
+/** Makes the mask for a binned frame; a binned pixel is bad if any of its pixels are bad. 
+  * \return 0 on success, -1 if the frame size is not the mask size divided by an integer. */
+int marCCDCorrect::binMask(size_t nx, size_t ny)
+{
+    size_t binX, binY, ix, iy, i, j;
+    epicsUInt16 bad;
+    
+    if ((nx == this->binnedNx) && (ny == this->binnedNy)) return 0;
+    if ((nx == 0) || (ny == 0) || (this->maskNx % nx) || (this->maskNy % ny)) return -1;
+    binX = this->maskNx / nx;
+    binY = this->maskNy / ny;
+    free(this->binnedMask);
+    this->binnedMask = (epicsUInt16 *)malloc(nx * ny * sizeof(epicsUInt16));
+    if (!this->binnedMask) {
+        this->binnedNx = 0;
+        return -1;
+    }
+    for (iy=0; iy<ny; iy++) {
+        for (ix=0; ix<nx; ix++) {
+            bad = 0;
+            for (j=0; j<binY; j++) {
+                for (i=0; i<binX; i++) {
+                    bad |= this->mask[(iy*binY + j)*this->maskNx + ix*binX + i];
+                }
+            }
+            this->binnedMask[iy*nx + ix] = bad;
+        }
+    }
+    this->binnedNx = nx;
+    this->binnedNy = ny;
+    return 0;
+}
+
+/** Replaces the bad pixels in one block of the frame */
+void marCCDCorrect::maskTask(int task, int numTasks)
+{
+    size_t first = (this->numPixels * task) / numTasks;
+    size_t last = (this->numPixels * (task+1)) / numTasks;
+    epicsUInt16 *pData = this->pData;
+    const epicsUInt16 *pMask = this->binnedMask;
+    epicsUInt16 value = this->value;
+    size_t i = first;
+
+#ifdef __SSE2__
+    __m128i valueVec = _mm_set1_epi16((short)value);
+    for (; i + 8 <= last; i += 8) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(pData + i));
+        __m128i m  = _mm_loadu_si128((const __m128i *)(pMask + i));
+        __m128i out = _mm_or_si128(_mm_andnot_si128(m, in), _mm_and_si128(m, valueVec));
+        _mm_storeu_si128((__m128i *)(pData + i), out);
+    }
+#endif
+    for (; i < last; i++) {
+        pData[i] = (epicsUInt16)((pData[i] & ~pMask[i]) | (value & pMask[i]));
+    }
+}
+
+/** Replaces the bad pixels in a frame with a fixed value.
+  * \param[in,out] pData The frame.
+  * \param[in] nx The number of pixels in a row.
+  * \param[in] ny The number of rows.
+  * \param[in] value The value for bad pixels.
+  * \param[in] pWorkers The worker threads to use.
+  * \param[in] numTasks The number of blocks the frame is divided into.
+  * \return 0 on success, -1 if there is no mask or it does not match the frame size. */
+int marCCDCorrect::applyMask(epicsUInt16 *pData, size_t nx, size_t ny, epicsUInt16 value,
+                             marCCDWorkers *pWorkers, int numTasks)
+{
+    if (!this->mask || binMask(nx, ny)) return -1;
+    this->pData = pData;
+    this->numPixels = nx * ny;
+    this->value = value;
+    if (numTasks < 1) numTasks = 1;
+    pWorkers->run(maskTaskC, this, numTasks);
+    return 0;
+}
+
+/** Scalar dezinger of one pixel, returns 1 if it was a zinger */
+static inline int dezingerPixel(epicsUInt16 a, epicsUInt16 *pB, float sigma)
+{
+    epicsUInt16 b = *pB;
+    epicsUInt32 sum = (epicsUInt32)a + b;
+    epicsUInt16 minValue = (a < b) ? a : b;
+    epicsUInt16 diff = (a > b) ? a - b : b - a;
+    int zinger = (float)diff > sigma * sqrtf((float)(sum + 1));
+    epicsUInt32 out = zinger ? 2*(epicsUInt32)minValue : sum;
+    
+    *pB = (epicsUInt16)((out > 65535) ? 65535 : out);
+    return zinger;
+}
+
+/** Dezingers one block of the frame */
+void marCCDCorrect::dezingerTask(int task, int numTasks)
+{
+    size_t first = (this->numPixels * task) / numTasks;
+    size_t last = (this->numPixels * (task+1)) / numTasks;
+    const epicsUInt16 *pA = this->pFirst;
+    epicsUInt16 *pB = this->pData;
+    float sigma = this->sigma;
+    int zingers = 0;
+    size_t i = first;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi32(1);
+    __m128 sigmaVec = _mm_set1_ps(sigma);
+    for (; i + 8 <= last; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(pA + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(pB + i));
+        __m128i aMinusB = _mm_subs_epu16(a, b);
+        __m128i bMinusA = _mm_subs_epu16(b, a);
+        __m128i diff = _mm_or_si128(aMinusB, bMinusA);
+        __m128i minValue = _mm_sub_epi16(a, aMinusB);
+        __m128i sum = _mm_adds_epu16(a, b);
+        __m128i doubleMin = _mm_adds_epu16(minValue, minValue);
+        /* The threshold needs the unsaturated sum, so it is computed in 32 bits */
+        __m128i sumLo = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpacklo_epi16(b, zero)), one);
+        __m128i sumHi = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(a, zero), _mm_unpackhi_epi16(b, zero)), one);
+        __m128 threshLo = _mm_mul_ps(sigmaVec, _mm_sqrt_ps(_mm_cvtepi32_ps(sumLo)));
+        __m128 threshHi = _mm_mul_ps(sigmaVec, _mm_sqrt_ps(_mm_cvtepi32_ps(sumHi)));
+        __m128 diffLo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(diff, zero));
+        __m128 diffHi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(diff, zero));
+        __m128i zLo = _mm_castps_si128(_mm_cmpgt_ps(diffLo, threshLo));
+        __m128i zHi = _mm_castps_si128(_mm_cmpgt_ps(diffHi, threshHi));
+        __m128i zinger = _mm_packs_epi32(zLo, zHi);
+        __m128i out = _mm_or_si128(_mm_and_si128(zinger, doubleMin), _mm_andnot_si128(zinger, sum));
+        _mm_storeu_si128((__m128i *)(pB + i), out);
+        /* Each zinger sets 2 bits of the byte mask */
+        zingers += __builtin_popcount(_mm_movemask_epi8(zinger)) / 2;
+    }
+#endif
+    for (; i < last; i++) {
+        zingers += dezingerPixel(pA[i], &pB[i], sigma);
+    }
+    this->taskCounts[task] = zingers;
+}
+
+/** Combines the two halves of a double correlation exposure.  Where the two frames differ by more
+  * than sigma standard deviations, assuming Poisson statistics, the pixel is a zinger in one frame,
+  * and the result is twice the smaller value; otherwise it is the sum.  The result saturates at 65535.
+  * \param[in] pFirst The first frame.
+  * \param[in,out] pSecond The second frame, replaced by the result.
+  * \param[in] numPixels The number of pixels in each frame.
+  * \param[in] sigma The number of standard deviations for a zinger.
+  * \param[in] pWorkers The worker threads to use.
+  * \param[in] numTasks The number of blocks the frame is divided into.
+  * \return The number of zingers, or -1 if memory cannot be allocated. */
+int marCCDCorrect::dezinger(const epicsUInt16 *pFirst, epicsUInt16 *pSecond, size_t numPixels, double sigma,
+                            marCCDWorkers *pWorkers, int numTasks)
+{
+    int i, zingers = 0;
+    
+    if (numTasks < 1) numTasks = 1;
+    if (numTasks > this->maxTasks) {
+        free(this->taskCounts);
+        this->taskCounts = (int *)calloc(numTasks, sizeof(int));
+        this->maxTasks = this->taskCounts ? numTasks : 0;
+        if (!this->taskCounts) return -1;
+    }
+    this->pFirst = pFirst;
+    this->pData = pSecond;
+    this->numPixels = numPixels;
+    this->sigma = (float)sigma;
+    pWorkers->run(dezingerTaskC, this, numTasks);
+    for (i=0; i<numTasks; i++) zingers += this->taskCounts[i];
+    return zingers;
+}
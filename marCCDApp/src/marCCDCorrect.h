@@ -0,0 +1,51 @@
+/* marCCDCorrect.h
+ *
+ * Corrections applied to frames in the IOC: replacing bad pixels from a mask file, 
+ * and combining the two halves of a double correlation exposure with a dezinger.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_CORRECT_H
+#define MARCCD_CORRECT_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+#include "marCCDWorkers.h"
+
+class marCCDCorrect {
+public:
+    marCCDCorrect();
+    ~marCCDCorrect();
+    int loadMask(const char *fileName);
+    int getNumBadPixels();
+    int matchesMask(size_t nx, size_t ny);
+    int applyMask(epicsUInt16 *pData, size_t nx, size_t ny, epicsUInt16 value,
+                  marCCDWorkers *pWorkers, int numTasks);
+    int dezinger(const epicsUInt16 *pFirst, epicsUInt16 *pSecond, size_t numPixels, double sigma,
+                 marCCDWorkers *pWorkers, int numTasks);
+    void maskTask(int task, int numTasks);      /**< Should be private, but is called from C */
+    void dezingerTask(int task, int numTasks);  /**< Should be private, but is called from C */
+
+private:
+    int binMask(size_t nx, size_t ny);
+    epicsUInt16 *mask;          /**< 0xFFFF for bad pixels, 0 for good pixels, unbinned */
+    size_t maskNx;
+    size_t maskNy;
+    int numBadPixels;
+    epicsUInt16 *binnedMask;    /**< The mask for the current binning */
+    size_t binnedNx;
+    size_t binnedNy;
+    /* Arguments of the current operation, for the tasks */
+    epicsUInt16 *pData;
+    const epicsUInt16 *pFirst;
+    size_t numPixels;
+    epicsUInt16 value;
+    float sigma;
+    int *taskCounts;
+    int maxTasks;
+};
+
+#endif
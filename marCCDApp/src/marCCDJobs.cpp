@@ -0,0 +1,327 @@
+/* marCCDJobs.cpp
+ *
+ * Queue of acquisition jobs.  See marCCDJobs.h for the format of a job.
+ *
+ * The queue is not locked; the driver calls it with its lock held.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#include "marCCDJobs.h"
+
+static const char *stateNames[] = {"Idle", "Queued", "Running", "Done", "Aborted", "Error"};
+
+/** Constructor for the job queue.
+  * \param[in] keys The keys that jobs can set; the table is copied.
+  * \param[in] numKeys The number of keys. */
+marCCDJobQueue::marCCDJobQueue(const marCCDJobKey *keys, int numKeys)
+    : numKeys(numKeys), head(0), numQueued(0), pCurrent(NULL), doneHead(0), numDone(0), nextId(1)
+{
+    this->keys = (marCCDJobKey *)calloc(numKeys, sizeof(marCCDJobKey));
+    memcpy(this->keys, keys, numKeys * sizeof(marCCDJobKey));
+}
+
+marCCDJobQueue::~marCCDJobQueue()
+{
+    clear();
+    free(this->pCurrent);
+    free(this->keys);
+}
+
+/** Compares a value with the name of a choice, ignoring case, spaces and underscores */
+static int matchChoice(const char *value, const char *choice)
+{
+    while (1) {
+        while ((*value == ' ') || (*value == '_')) value++;
+        while ((*choice == ' ') || (*choice == '_')) choice++;
+        if (tolower((unsigned char)*value) != tolower((unsigned char)*choice)) return 0;
+        if (*value == 0) return 1;
+        value++;
+        choice++;
+    }
+}
+
+/** Converts the value of a setting.
+  * \return 0 on success, -1 if the value is not valid for the key. */
+int marCCDJobQueue::parseValue(const marCCDJobKey *pKey, const char *value, marCCDJobSetting *pSetting)
+{
+    char *pEnd;
+    long lval;
+    int i;
+
+    switch (pKey->type) {
+        case marCCDJobInt:
+            lval = strtol(value, &pEnd, 0);
+            if ((pEnd != value) && (*pEnd == 0)) {
+                if (pKey->choices && ((lval < 0) || (lval >= pKey->numChoices))) return -1;
+                pSetting->ival = (int)lval;
+                return 0;
+            }
+            for (i=0; pKey->choices && (i<pKey->numChoices); i++) {
+                if (matchChoice(value, pKey->choices[i])) {
+                    pSetting->ival = i;
+                    return 0;
+                }
+            }
+            return -1;
+        case marCCDJobDouble:
+            pSetting->dval = strtod(value, &pEnd);
+            return ((pEnd != value) && (*pEnd == 0)) ? 0 : -1;
+        case marCCDJobString:
+            if (strlen(value) >= sizeof(pSetting->sval)) return -1;
+            strcpy(pSetting->sval, value);
+            return 0;
+    }
+    return -1;
+}
+
+/** Parses the text of a job.
+  * \return 0 on success, -1 with the reason in message if the text is not a valid job. */
+int marCCDJobQueue::parse(const char *text, marCCDJob *pJob, char *message, size_t messageSize)
+{
+    const char *p = text;
+    char key[64];
+    char value[MARCCD_JOB_VALUE_LEN];
+    marCCDJobSetting *pSetting;
+    size_t len;
+    int k, i;
+
+    memset(pJob, 0, sizeof(*pJob));
+    while (1) {
+        while (isspace((unsigned char)*p)) p++;
+        if ((*p == 0) || (*p == '#')) break;
+        for (len=0; *p && (*p != '=') && !isspace((unsigned char)*p); p++) {
+            if (len < sizeof(key)-1) key[len++] = *p;
+        }
+        key[len] = 0;
+        if (*p != '=') {
+            epicsSnprintf(message, messageSize, "expected key=value at %s", key);
+            return -1;
+        }
+        p++;
+        len = 0;
+        if (*p == '"') {
+            for (p++; *p && (*p != '"'); p++) {
+                if (len < sizeof(value)-1) value[len++] = *p;
+            }
+            if (*p != '"') {
+                epicsSnprintf(message, messageSize, "missing \" in the value of %s", key);
+                return -1;
+            }
+            p++;
+        } else {
+            for (; *p && !isspace((unsigned char)*p); p++) {
+                if (len < sizeof(value)-1) value[len++] = *p;
+            }
+        }
+        value[len] = 0;
+        if (epicsStrCaseCmp(key, "label") == 0) {
+            strncpy(pJob->label, value, sizeof(pJob->label)-1);
+            continue;
+        }
+        for (k=0; k<this->numKeys; k++) {
+            if (epicsStrCaseCmp(key, this->keys[k].name) == 0) break;
+        }
+        if (k == this->numKeys) {
+            epicsSnprintf(message, messageSize, "unknown key %s", key);
+            return -1;
+        }
+        /* A key that is given again replaces the earlier value */
+        for (i=0; i<pJob->numSettings; i++) {
+            if (pJob->settings[i].key == k) break;
+        }
+        if (i == MARCCD_JOB_MAX_SETTINGS) {
+            epicsSnprintf(message, messageSize, "more than %d settings", MARCCD_JOB_MAX_SETTINGS);
+            return -1;
+        }
+        pSetting = &pJob->settings[i];
+        pSetting->key = k;
+        if (parseValue(&this->keys[k], value, pSetting)) {
+            epicsSnprintf(message, messageSize, "invalid value %s for %s", value, key);
+            return -1;
+        }
+        if (i == pJob->numSettings) pJob->numSettings++;
+    }
+    if ((pJob->numSettings == 0) && (pJob->label[0] == 0)) {
+        epicsSnprintf(message, messageSize, "empty job");
+        return -1;
+    }
+    return 0;
+}
+
+/** Checks a job and adds it to the end of the queue.
+  * \param[in] text The job.
+  * \param[out] message What was done, or why the job was rejected.
+  * \param[in] messageSize The size of message.
+  * \return The id of the job, or -1 if it was rejected. */
+int marCCDJobQueue::submit(const char *text, char *message, size_t messageSize)
+{
+    marCCDJob *pJob;
+    char reason[MARCCD_JOB_VALUE_LEN];
+
+    if (this->numQueued == MARCCD_JOB_MAX_QUEUED) {
+        epicsSnprintf(message, messageSize, "Job rejected: queue is full");
+        return -1;
+    }
+    pJob = (marCCDJob *)malloc(sizeof(marCCDJob));
+    if (!pJob || parse(text, pJob, reason, sizeof(reason))) {
+        if (!pJob) strcpy(reason, "out of memory");
+        epicsSnprintf(message, messageSize, "Job rejected: %s", reason);
+        free(pJob);
+        return -1;
+    }
+    pJob->id = this->nextId++;
+    pJob->state = marCCDJobQueued;
+    this->queue[(this->head + this->numQueued) % MARCCD_JOB_MAX_QUEUED] = pJob;
+    this->numQueued++;
+    epicsSnprintf(message, messageSize, "Job %d queued", pJob->id);
+    return pJob->id;
+}
+
+/** Reads a file with one job on each line and adds them to the end of the queue.  Empty lines
+  * and lines that start with # are skipped.  If any job is not valid none are queued.
+  * \param[in] fileName The name of the file.
+  * \param[out] message What was done, or why the file was rejected.
+  * \param[in] messageSize The size of message.
+  * \return The number of jobs queued, or -1 if the file was rejected. */
+int marCCDJobQueue::load(const char *fileName, char *message, size_t messageSize)
+{
+    FILE *fp;
+    char line[4*MARCCD_JOB_VALUE_LEN];
+    char reason[MARCCD_JOB_VALUE_LEN];
+    marCCDJob job;
+    const char *p;
+    int lineNumber = 0;
+    int numJobs = 0;
+    int firstId;
+    int status = 0;
+
+    fp = fopen(fileName, "r");
+    if (!fp) {
+        epicsSnprintf(message, messageSize, "Cannot open job file %s", fileName);
+        return -1;
+    }
+    /* Check all the jobs first */
+    while (fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        for (p=line; isspace((unsigned char)*p); p++);
+        if ((*p == 0) || (*p == '#')) continue;
+        if (parse(p, &job, reason, sizeof(reason))) {
+            epicsSnprintf(message, messageSize, "Job file rejected, line %d: %s", lineNumber, reason);
+            status = -1;
+            break;
+        }
+        numJobs++;
+    }
+    if ((status == 0) && (this->numQueued + numJobs > MARCCD_JOB_MAX_QUEUED)) {
+        epicsSnprintf(message, messageSize, "Job file rejected: %d jobs do not fit in the queue", numJobs);
+        status = -1;
+    }
+    if (status) {
+        fclose(fp);
+        return -1;
+    }
+    rewind(fp);
+    firstId = this->nextId;
+    while (fgets(line, sizeof(line), fp)) {
+        for (p=line; isspace((unsigned char)*p); p++);
+        if ((*p == 0) || (*p == '#')) continue;
+        if (submit(p, reason, sizeof(reason)) < 0) break;
+    }
+    fclose(fp);
+    epicsSnprintf(message, messageSize, "Jobs %d to %d queued from %s", firstId, this->nextId-1, fileName);
+    return numJobs;
+}
+
+/** Takes the next job from the queue and makes it the running job.
+  * \return The job, or NULL if the queue is empty.  The caller applies its settings. */
+marCCDJob *marCCDJobQueue::start()
+{
+    if (this->numQueued == 0) return NULL;
+    free(this->pCurrent);
+    this->pCurrent = this->queue[this->head];
+    this->head = (this->head + 1) % MARCCD_JOB_MAX_QUEUED;
+    this->numQueued--;
+    this->pCurrent->state = marCCDJobRunning;
+    return this->pCurrent;
+}
+
+/** Returns the running job, or NULL if none is running */
+marCCDJob *marCCDJobQueue::getCurrent()
+{
+    return this->pCurrent;
+}
+
+/** Returns an entry of the key table, for marCCDJobSetting.key */
+const marCCDJobKey *marCCDJobQueue::getKey(int key)
+{
+    return &this->keys[key];
+}
+
+/** Ends the running job and adds it to the history.
+  * \param[in] state marCCDJobDone, marCCDJobAborted or marCCDJobError.
+  * \param[in] imagesDone The number of images the job collected. */
+void marCCDJobQueue::finish(int state, int imagesDone)
+{
+    if (!this->pCurrent) return;
+    this->pCurrent->state = state;
+    this->pCurrent->imagesDone = imagesDone;
+    this->done[this->doneHead] = *this->pCurrent;
+    this->doneHead = (this->doneHead + 1) % MARCCD_JOB_HISTORY;
+    this->numDone++;
+    free(this->pCurrent);
+    this->pCurrent = NULL;
+}
+
+/** Removes the jobs that have not started from the queue */
+void marCCDJobQueue::clear()
+{
+    while (this->numQueued > 0) {
+        free(this->queue[this->head]);
+        this->head = (this->head + 1) % MARCCD_JOB_MAX_QUEUED;
+        this->numQueued--;
+    }
+}
+
+int marCCDJobQueue::getNumQueued()
+{
+    return this->numQueued;
+}
+
+/** Returns the number of jobs that have finished since the IOC started */
+int marCCDJobQueue::getNumDone()
+{
+    return this->numDone;
+}
+
+/** Formats the last jobs that finished, newest first, one per line: id, state, images done
+  * and requested, and label. */
+void marCCDJobQueue::history(char *buffer, size_t size)
+{
+    marCCDJob *pJob;
+    size_t len = 0;
+    int i, n;
+
+    buffer[0] = 0;
+    n = (this->numDone < MARCCD_JOB_HISTORY) ? this->numDone : MARCCD_JOB_HISTORY;
+    for (i=1; (i<=n) && (len < size); i++) {
+        pJob = &this->done[(this->doneHead - i + MARCCD_JOB_HISTORY) % MARCCD_JOB_HISTORY];
+        len += epicsSnprintf(buffer + len, size - len, "%d %s %d/%d %s\n",
+                             pJob->id, stateName(pJob->state), pJob->imagesDone, pJob->numImages, pJob->label);
+    }
+}
+
+const char *marCCDJobQueue::stateName(int state)
+{
+    if ((state < 0) || (state > marCCDJobError)) return "Unknown";
+    return stateNames[state];
+}
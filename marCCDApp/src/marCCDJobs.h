@@ -0,0 +1,96 @@
+/* marCCDJobs.h
+ *
+ * Queue of acquisition jobs.  A job is a line of text with key=value settings, e.g.
+ *   label=lysozyme_1 mode=multiple num_images=180 acquire_time=0.5 file_name=lyso start_phi=0 rotation_range=0.5
+ * Values that contain spaces are put in double quotes, and # starts a comment.  The keys and the
+ * parameters they set are supplied by the driver.  Jobs are checked when they are submitted, so a
+ * job that has been queued always starts.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_JOBS_H
+#define MARCCD_JOBS_H
+
+#include <stddef.h>
+
+#define MARCCD_JOB_MAX_SETTINGS 32
+#define MARCCD_JOB_MAX_QUEUED   256
+#define MARCCD_JOB_HISTORY      16
+#define MARCCD_JOB_VALUE_LEN    256
+#define MARCCD_JOB_LABEL_LEN    40
+
+typedef enum {
+    marCCDJobInt,
+    marCCDJobDouble,
+    marCCDJobString
+} marCCDJobType_t;
+
+typedef enum {
+    marCCDJobIdle,              /**< No job has run since the queue was started */
+    marCCDJobQueued,
+    marCCDJobRunning,
+    marCCDJobDone,
+    marCCDJobAborted,
+    marCCDJobError
+} marCCDJobState_t;
+
+/** A key that jobs can set */
+typedef struct {
+    const char *name;           /**< Name of the key in the job text */
+    int param;                  /**< Index of the parameter it sets in the driver */
+    int type;                   /**< marCCDJobType_t */
+    const char **choices;       /**< Names of the values of an enum parameter, or NULL */
+    int numChoices;
+} marCCDJobKey;
+
+typedef struct {
+    int key;                    /**< Index in the key table */
+    int ival;
+    double dval;
+    char sval[MARCCD_JOB_VALUE_LEN];
+} marCCDJobSetting;
+
+typedef struct {
+    int id;                     /**< Number of the job, counting from 1 when the IOC starts */
+    int state;                  /**< marCCDJobState_t */
+    char label[MARCCD_JOB_LABEL_LEN];
+    int imagesDone;
+    int numImages;
+    int numSettings;
+    marCCDJobSetting settings[MARCCD_JOB_MAX_SETTINGS];
+} marCCDJob;
+
+class marCCDJobQueue {
+public:
+    marCCDJobQueue(const marCCDJobKey *keys, int numKeys);
+    ~marCCDJobQueue();
+    int submit(const char *text, char *message, size_t messageSize);
+    int load(const char *fileName, char *message, size_t messageSize);
+    marCCDJob *start();
+    marCCDJob *getCurrent();
+    const marCCDJobKey *getKey(int key);
+    void finish(int state, int imagesDone);
+    void clear();
+    int getNumQueued();
+    int getNumDone();
+    void history(char *buffer, size_t size);
+    static const char *stateName(int state);
+
+private:
+    int parse(const char *text, marCCDJob *pJob, char *message, size_t messageSize);
+    int parseValue(const marCCDJobKey *pKey, const char *value, marCCDJobSetting *pSetting);
+    marCCDJobKey *keys;
+    int numKeys;
+    marCCDJob *queue[MARCCD_JOB_MAX_QUEUED];   /**< Circular, the next job is at head */
+    int head;
+    int numQueued;
+    marCCDJob *pCurrent;        /**< The running job, or NULL */
+    marCCDJob done[MARCCD_JOB_HISTORY];        /**< The last jobs that finished, the newest at doneHead-1 */
+    int doneHead;
+    int numDone;
+    int nextId;
+};
+
+#endif
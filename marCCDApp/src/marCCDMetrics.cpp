@@ -0,0 +1,295 @@
+/* marCCDMetrics.cpp
+ *
+ * Counters, gauges and latency histograms of the driver, served over HTTP in the Prometheus
+ * text format so they can be scraped into a time-series database.
+ *
+ * The driver updates the metrics with atomic operations, and the server thread reads them the same
+ * way, so a scrape never takes the driver lock or delays the acquisition.  The counters and the sums
+ * of the histograms are 64 bits, since a size_t of nanoseconds wraps after 4 seconds on a 32-bit host,
+ * and are updated under a spinlock because there are no 64-bit atomic operations in libCom.  The counts of a histogram
+ * are read one bucket at a time, so a scrape during a frame can see an observation in the count of
+ * one stage before the sum; the next scrape is consistent again.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <epicsAtomic.h>
+
+#include "marCCDMetrics.h"
+#include "marCCDThreads.h"
+
+static const char *driverName = "marCCDMetrics";
+
+/** The size of the buffer the metrics are formatted into */
+#define METRICS_BUFFER_SIZE 65536
+/** How long the server waits for the request of a client, in seconds */
+#define METRICS_REQUEST_TIMEOUT 2
+
+/** The upper bounds of the histogram buckets in seconds; the last bucket is +Inf */
+static const double bucketBounds[MARCCD_METRICS_BUCKETS-1] =
+    {.0005, .001, .002, .005, .01, .02, .05, .1, .2, .5, 1., 2., 5., 10.};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counterInfo[marCCDNumCounters] = {
+    {"marccd_frames_acquired_total",  "Frames acquired by the marccd server"},
+    {"marccd_frames_read_total",      "Frames read from the TIFF files"},
+    {"marccd_frames_dropped_total",   "Frames dropped because no NDArray was free"},
+    {"marccd_bytes_read_total",       "Bytes of TIFF files read"},
+    {"marccd_server_commands_total",  "Commands sent to the marccd server"},
+    {"marccd_server_round_trips_total", "Commands the marccd server replied to"},
+    {"marccd_get_state_polls_total",  "get_state commands sent to the marccd server"},
+    {"marccd_tiff_retries_total",     "Attempts to read a TIFF file that was not yet complete"},
+    {"marccd_tiff_timeouts_total",    "TIFF files that did not appear or could not be read within TiffTimeout"}
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} gaugeInfo[marCCDNumGauges] = {
+    {"marccd_pool_buffers",           "NDArrays allocated by the NDArrayPool"},
+    {"marccd_pool_free_buffers",      "NDArrays on the free list of the NDArrayPool"},
+    {"marccd_pool_max_buffers",       "Maximum number of NDArrays of the NDArrayPool"},
+    {"marccd_pool_bytes",             "Memory allocated by the NDArrayPool"},
+    {"marccd_pool_max_bytes",         "Maximum memory of the NDArrayPool"}
+};
+
+static const char *stageNames[marCCDNumStages] =
+    {"round_trip", "file_wait", "decode", "compress", "callbacks", "latency"};
+
+static void serverTaskC(void *drvPvt)
+{
+    marCCDMetrics *pMetrics = (marCCDMetrics *)drvPvt;
+
+    marCCDThreadStarted();
+    pMetrics->serverTask();
+}
+
+/** Constructor for the metrics.
+  * \param[in] portName The name of the asyn port, used as the port label of the metrics.
+  * \param[in] interfaceName The IP address to listen on; NULL or "" for 127.0.0.1, "0.0.0.0" for all interfaces.
+  * \param[in] tcpPort The TCP port to listen on. */
+marCCDMetrics::marCCDMetrics(const char *portName, const char *interfaceName, int tcpPort)
+    : tcpPort(tcpPort), listenSock(INVALID_SOCKET), scrapes(0)
+{
+    strncpy(this->portName, portName, sizeof(this->portName) - 1);
+    this->portName[sizeof(this->portName) - 1] = 0;
+    if (!interfaceName || !interfaceName[0]) interfaceName = "127.0.0.1";
+    strncpy(this->interfaceName, interfaceName, sizeof(this->interfaceName) - 1);
+    this->interfaceName[sizeof(this->interfaceName) - 1] = 0;
+    memset(this->counters, 0, sizeof(this->counters));
+    memset(this->gauges, 0, sizeof(this->gauges));
+    memset(this->buckets, 0, sizeof(this->buckets));
+    memset(this->sums, 0, sizeof(this->sums));
+    this->spin = epicsSpinMustCreate();
+}
+
+/** Opens the TCP port and starts the thread that serves the metrics.
+  * \return 0 on success, -1 on error. */
+int marCCDMetrics::start()
+{
+    osiSockAddr addr;
+    const char *functionName = "start";
+
+    if (!osiSockAttach()) {
+        printf("%s:%s: osiSockAttach failed\n", driverName, functionName);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    if (aToIPAddr(this->interfaceName, (unsigned short)this->tcpPort, &addr.ia) != 0) {
+        printf("%s:%s: invalid interface %s\n", driverName, functionName, this->interfaceName);
+        return -1;
+    }
+    this->listenSock = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+    if (this->listenSock == INVALID_SOCKET) {
+        printf("%s:%s: error creating socket, errno=%d %s\n",
+            driverName, functionName, errno, strerror(errno));
+        return -1;
+    }
+    epicsSocketEnableAddressReuseDuringTimeWaitState(this->listenSock);
+    if ((bind(this->listenSock, &addr.sa, sizeof(addr.ia)) != 0) ||
+        (listen(this->listenSock, 4) != 0)) {
+        printf("%s:%s: error listening on %s:%d, errno=%d %s\n",
+            driverName, functionName, this->interfaceName, this->tcpPort, errno, strerror(errno));
+        epicsSocketDestroy(this->listenSock);
+        this->listenSock = INVALID_SOCKET;
+        return -1;
+    }
+    if (!epicsThreadCreate("marCCDMetrics", epicsThreadPriorityLow,
+                           epicsThreadGetStackSize(epicsThreadStackMedium),
+                           serverTaskC, this)) {
+        printf("%s:%s: epicsThreadCreate failure\n", driverName, functionName);
+        return -1;
+    }
+    return 0;
+}
+
+/** Adds to a counter */
+void marCCDMetrics::count(int counter, size_t n)
+{
+    epicsSpinLock(this->spin);
+    this->counters[counter] += n;
+    epicsSpinUnlock(this->spin);
+}
+
+/** Records the time taken by a stage in its histogram */
+void marCCDMetrics::observe(int stage, double seconds)
+{
+    int i;
+
+    if (seconds < 0.) seconds = 0.;
+    for (i=0; i<MARCCD_METRICS_BUCKETS-1; i++) {
+        if (seconds <= bucketBounds[i]) break;
+    }
+    epicsAtomicIncrSizeT(&this->buckets[stage][i]);
+    epicsSpinLock(this->spin);
+    this->sums[stage] += (epicsUInt64)(seconds * 1.e9);
+    epicsSpinUnlock(this->spin);
+}
+
+void marCCDMetrics::setGauge(int gauge, size_t value)
+{
+    epicsAtomicSetSizeT(&this->gauges[gauge], value);
+}
+
+/** Formats the metrics in the Prometheus text format.
+  * \return The number of bytes written to the buffer. */
+size_t marCCDMetrics::format(char *buffer, size_t size)
+{
+    size_t len = 0;
+    size_t cumulative;
+    epicsUInt64 counters[marCCDNumCounters];
+    epicsUInt64 sums[marCCDNumStages];
+    int i, j;
+
+    epicsSpinLock(this->spin);
+    memcpy(counters, this->counters, sizeof(counters));
+    memcpy(sums, this->sums, sizeof(sums));
+    epicsSpinUnlock(this->spin);
+
+#define APPEND(...) if (len < size) len += epicsSnprintf(buffer + len, size - len, __VA_ARGS__)
+    for (i=0; i<marCCDNumCounters; i++) {
+        APPEND("# HELP %s %s.\n# TYPE %s counter\n%s{port=\"%s\"} %llu\n",
+               counterInfo[i].name, counterInfo[i].help, counterInfo[i].name, counterInfo[i].name,
+               this->portName, (unsigned long long)counters[i]);
+    }
+    for (i=0; i<marCCDNumGauges; i++) {
+        APPEND("# HELP %s %s.\n# TYPE %s gauge\n%s{port=\"%s\"} %lu\n",
+               gaugeInfo[i].name, gaugeInfo[i].help, gaugeInfo[i].name, gaugeInfo[i].name,
+               this->portName, (unsigned long)epicsAtomicGetSizeT(&this->gauges[i]));
+    }
+    APPEND("# HELP marccd_stage_seconds Time taken by each stage of reading a frame.\n"
+           "# TYPE marccd_stage_seconds histogram\n");
+    for (i=0; i<marCCDNumStages; i++) {
+        cumulative = 0;
+        for (j=0; j<MARCCD_METRICS_BUCKETS; j++) {
+            cumulative += epicsAtomicGetSizeT(&this->buckets[i][j]);
+            if (j < MARCCD_METRICS_BUCKETS-1) {
+                APPEND("marccd_stage_seconds_bucket{port=\"%s\",stage=\"%s\",le=\"%g\"} %lu\n",
+                       this->portName, stageNames[i], bucketBounds[j], (unsigned long)cumulative);
+            } else {
+                APPEND("marccd_stage_seconds_bucket{port=\"%s\",stage=\"%s\",le=\"+Inf\"} %lu\n",
+                       this->portName, stageNames[i], (unsigned long)cumulative);
+            }
+        }
+        APPEND("marccd_stage_seconds_sum{port=\"%s\",stage=\"%s\"} %.9f\n",
+               this->portName, stageNames[i], sums[i] / 1.e9);
+        APPEND("marccd_stage_seconds_count{port=\"%s\",stage=\"%s\"} %lu\n",
+               this->portName, stageNames[i], (unsigned long)cumulative);
+    }
+#undef APPEND
+    return (len < size) ? len : size - 1;
+}
+
+/** Sends all of a buffer to a socket.
+  * \return 0 on success, -1 if the connection was closed or there was an error. */
+static int sendAll(SOCKET sock, const char *pData, size_t size)
+{
+    ssize_t nSent;
+
+    while (size > 0) {
+        nSent = send(sock, pData, size, 0);
+        if (nSent <= 0) {
+            if ((nSent < 0) && (errno == EINTR)) continue;
+            return -1;
+        }
+        pData += nSent;
+        size -= nSent;
+    }
+    return 0;
+}
+
+/** Answers the HTTP requests of the clients one at a time.  GET /metrics returns the metrics,
+  * other paths return 404. */
+void marCCDMetrics::serverTask()
+{
+    SOCKET sock;
+    osiSockAddr addr;
+    osiSocklen_t addrSize;
+    struct timeval timeout;
+    char request[1024], header[256];
+    char *pBody;
+    size_t used, bodySize;
+    ssize_t n;
+    const char *functionName = "serverTask";
+
+    pBody = (char *)malloc(METRICS_BUFFER_SIZE);
+    if (!pBody) {
+        printf("%s:%s: cannot allocate the buffer\n", driverName, functionName);
+        return;
+    }
+    while (1) {
+        addrSize = sizeof(addr);
+        sock = epicsSocketAccept(this->listenSock, &addr.sa, &addrSize);
+        if (sock == INVALID_SOCKET) {
+            epicsThreadSleep(1.0);
+            continue;
+        }
+        /* A client that does not send its request must not stop the others */
+        timeout.tv_sec = METRICS_REQUEST_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+        used = 0;
+        request[0] = 0;
+        while (used < sizeof(request) - 1) {
+            n = recv(sock, request + used, sizeof(request) - 1 - used, 0);
+            if (n <= 0) break;
+            used += n;
+            request[used] = 0;
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+        if ((strncmp(request, "GET /metrics", 12) == 0) &&
+            ((request[12] == ' ') || (request[12] == '?'))) {
+            bodySize = format(pBody, METRICS_BUFFER_SIZE);
+            epicsSnprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %lu\r\n"
+                          "Connection: close\r\n\r\n", (unsigned long)bodySize);
+            if (sendAll(sock, header, strlen(header)) == 0) sendAll(sock, pBody, bodySize);
+            epicsAtomicIncrSizeT(&this->scrapes);
+        } else if (used > 0) {
+            epicsSnprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: 10\r\n"
+                          "Connection: close\r\n\r\nNot found\n");
+            sendAll(sock, header, strlen(header));
+        }
+        epicsSocketDestroy(sock);
+    }
+}
+
+void marCCDMetrics::report(FILE *fp)
+{
+    fprintf(fp, "  Metrics:           http://%s:%d/metrics, %lu scrapes\n",
+            this->interfaceName, this->tcpPort, (unsigned long)epicsAtomicGetSizeT(&this->scrapes));
+}
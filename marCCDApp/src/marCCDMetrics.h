@@ -0,0 +1,81 @@
+/* marCCDMetrics.h
+ *
+ * Counters, gauges and latency histograms of the driver, served over HTTP in the Prometheus
+ * text format so they can be scraped into a time-series database.
+ *
+ * The driver updates the metrics with atomic operations, or under a spinlock for the 64-bit totals,
+ * and the server thread reads them the same way, so a scrape never takes the driver lock or delays
+ * the acquisition.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_METRICS_H
+#define MARCCD_METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <epicsTypes.h>
+#include <epicsSpin.h>
+#include <osiSock.h>
+
+typedef enum {
+    marCCDCounterFramesAcquired,    /**< Frames the server acquired */
+    marCCDCounterFramesRead,        /**< Frames read from the TIFF files */
+    marCCDCounterFramesDropped,     /**< Frames dropped for lack of a free NDArray */
+    marCCDCounterBytesRead,         /**< Bytes of TIFF files read */
+    marCCDCounterCommands,          /**< Commands sent to the server */
+    marCCDCounterRoundTrips,        /**< Commands the server replied to */
+    marCCDCounterStatePolls,        /**< get_state commands */
+    marCCDCounterTiffRetries,       /**< Attempts to read a TIFF file that was not complete */
+    marCCDCounterTiffTimeouts,      /**< TIFF files that did not appear or could not be read in time */
+    marCCDNumCounters
+} marCCDCounter_t;
+
+typedef enum {
+    marCCDGaugePoolBuffers,         /**< NDArrays allocated by the NDArrayPool */
+    marCCDGaugePoolFreeBuffers,     /**< NDArrays on the free list */
+    marCCDGaugePoolMaxBuffers,
+    marCCDGaugePoolBytes,           /**< Memory allocated by the NDArrayPool */
+    marCCDGaugePoolMaxBytes,
+    marCCDNumGauges
+} marCCDGauge_t;
+
+typedef enum {
+    marCCDStageRoundTrip,           /**< Command to reply */
+    marCCDStageFileWait,            /**< Start of readTiff until the file appeared */
+    marCCDStageDecode,              /**< File appeared until the frame was decoded */
+    marCCDStageCompress,            /**< Compression of the frame for the plugins */
+    marCCDStageCallbacks,           /**< Array callbacks of the frame */
+    marCCDStageLatency,             /**< End of the exposure until the array callbacks */
+    marCCDNumStages
+} marCCDStage_t;
+
+#define MARCCD_METRICS_BUCKETS 15
+
+class marCCDMetrics {
+public:
+    marCCDMetrics(const char *portName, const char *interfaceName, int tcpPort);
+    int start();
+    void count(int counter, size_t n=1);
+    void observe(int stage, double seconds);
+    void setGauge(int gauge, size_t value);
+    void report(FILE *fp);
+    void serverTask();          /**< Should be private, but is called from C */
+
+private:
+    size_t format(char *buffer, size_t size);
+    char portName[64];
+    char interfaceName[64];
+    int tcpPort;
+    SOCKET listenSock;
+    size_t scrapes;
+    epicsSpinId spin;                                          /**< Guards counters and sums */
+    epicsUInt64 counters[marCCDNumCounters];                   /**< 64 bits, so bytes do not wrap on 32-bit hosts */
+    size_t gauges[marCCDNumGauges];
+    size_t buckets[marCCDNumStages][MARCCD_METRICS_BUCKETS];   /**< The last bucket is +Inf */
+    epicsUInt64 sums[marCCDNumStages];                         /**< Nanoseconds */
+};
+
+#endif
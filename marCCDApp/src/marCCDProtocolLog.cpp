@@ -0,0 +1,187 @@
+/* marCCDProtocolLog.cpp
+ *
+ * Recorder of the conversation between the driver and the marccd server.  Each command, each reply
+ * and the time each image file appeared are written with a monotonic timestamp to a binary log,
+ * which marCCDReplayServer plays back to the driver with the original timing.
+ *
+ * The records are written to a large stdio buffer under a mutex, so recording does not wait for
+ * the disk while the driver is talking to the server.  The buffer is written when it is full and
+ * when the log is stopped.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <iocsh.h>
+#include <epicsExport.h>
+
+#include "marCCDProtocolLog.h"
+
+/** Size of the stdio buffer of the log file */
+#define LOG_BUFFER_SIZE (1024*1024)
+
+int marCCDProtocolLogEnabled = 0;
+static epicsMutexId logMutex;
+static epicsThreadOnceId logOnce = EPICS_THREAD_ONCE_INIT;
+static FILE *logFile = NULL;
+static char *logBuffer = NULL;
+static epicsUInt64 logStartTime = 0;
+static size_t logRecords = 0;
+static size_t logBytes = 0;
+
+static void logInit(void *arg)
+{
+    logMutex = epicsMutexMustCreate();
+}
+
+/** Writes a record; called with logMutex held */
+static void writeRecord(int type, int status, epicsUInt64 time,
+                        const void *pData1, size_t size1, const void *pData2, size_t size2)
+{
+    marCCDProtocolRecord record;
+
+    if (!logFile) return;
+    memset(&record, 0, sizeof(record));
+    record.time = (time > logStartTime) ? time - logStartTime : 0;
+    record.type = (epicsUInt16)type;
+    record.status = (epicsInt16)status;
+    record.length = (epicsUInt32)(size1 + size2);
+    fwrite(&record, sizeof(record), 1, logFile);
+    if (size1) fwrite(pData1, 1, size1, logFile);
+    if (size2) fwrite(pData2, 1, size2, logFile);
+    logRecords++;
+    logBytes += sizeof(record) + size1 + size2;
+}
+
+/** Starts recording to a file, replacing it if it exists.  A log that is being recorded is stopped first.
+  * \param[in] fileName The name of the file.
+  * \return 0 on success, -1 if the file could not be created. */
+int marCCDProtocolLogStart(const char *fileName)
+{
+    marCCDProtocolLogHeader header;
+    epicsTimeStamp now;
+
+    if (!fileName || (strlen(fileName) == 0)) {
+        printf("marCCDProtocolLogStart: no file name specified\n");
+        return -1;
+    }
+    marCCDProtocolLogStop();
+    epicsThreadOnce(&logOnce, logInit, NULL);
+    epicsMutexLock(logMutex);
+    logFile = fopen(fileName, "wb");
+    if (!logFile) {
+        epicsMutexUnlock(logMutex);
+        printf("marCCDProtocolLogStart: cannot open file %s\n", fileName);
+        return -1;
+    }
+    logBuffer = (char *)malloc(LOG_BUFFER_SIZE);
+    if (logBuffer) setvbuf(logFile, logBuffer, _IOFBF, LOG_BUFFER_SIZE);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MARCCD_PROTOCOL_LOG_MAGIC, sizeof(header.magic));
+    epicsTimeGetCurrent(&now);
+    header.secPastEpoch = now.secPastEpoch;
+    header.nsec = now.nsec;
+    fwrite(&header, sizeof(header), 1, logFile);
+    logStartTime = epicsMonotonicGet();
+    logRecords = 0;
+    logBytes = sizeof(header);
+    marCCDProtocolLogEnabled = 1;
+    epicsMutexUnlock(logMutex);
+    return 0;
+}
+
+/** Stops recording and closes the log file.
+  * \return 0 on success, -1 if no log was being recorded or it could not be written. */
+int marCCDProtocolLogStop()
+{
+    int status;
+
+    epicsThreadOnce(&logOnce, logInit, NULL);
+    epicsMutexLock(logMutex);
+    marCCDProtocolLogEnabled = 0;
+    if (!logFile) {
+        epicsMutexUnlock(logMutex);
+        return -1;
+    }
+    status = fclose(logFile);
+    logFile = NULL;
+    free(logBuffer);
+    logBuffer = NULL;
+    epicsMutexUnlock(logMutex);
+    if (status) {
+        printf("marCCDProtocolLogStop: error writing the log\n");
+        return -1;
+    }
+    printf("marCCDProtocolLogStop: wrote %lu records, %lu bytes\n",
+           (unsigned long)logRecords, (unsigned long)logBytes);
+    return 0;
+}
+
+/** Records a command sent to the server or a reply from it.
+  * \param[in] type marCCDProtocolWrite or marCCDProtocolRead.
+  * \param[in] status The asynStatus of the write or read.
+  * \param[in] text The command or reply, without the terminator.
+  * \param[in] time The time the command was sent or the reply was received, from epicsMonotonicGet(). */
+void marCCDProtocolLogText(int type, int status, const char *text, epicsUInt64 time)
+{
+    if (!marCCDProtocolLogEnabled) return;
+    epicsMutexLock(logMutex);
+    writeRecord(type, status, time, text, text ? strlen(text) : 0, NULL, 0);
+    epicsMutexUnlock(logMutex);
+}
+
+/** Records an image file the driver found and read.
+  * \param[in] fileName The name of the file.
+  * \param[in] fileSize The size of the file in bytes.
+  * \param[in] nx, ny The size of the image.
+  * \param[in] bitsPerSample The number of bits per pixel.
+  * \param[in] rowsPerStrip The number of rows in each strip of the file.
+  * \param[in] time The time the file appeared, from epicsMonotonicGet(). */
+void marCCDProtocolLogFile(const char *fileName, size_t fileSize, int nx, int ny, int bitsPerSample,
+                           int rowsPerStrip, epicsUInt64 time)
+{
+    marCCDProtocolFileInfo info;
+
+    if (!marCCDProtocolLogEnabled) return;
+    memset(&info, 0, sizeof(info));
+    info.fileSize = fileSize;
+    info.nx = nx;
+    info.ny = ny;
+    info.bitsPerSample = bitsPerSample;
+    info.rowsPerStrip = rowsPerStrip;
+    epicsMutexLock(logMutex);
+    writeRecord(marCCDProtocolFile, 0, time, &info, sizeof(info), fileName, strlen(fileName));
+    epicsMutexUnlock(logMutex);
+}
+
+/* Code for iocsh registration */
+static const iocshArg marCCDProtocolLogStartArg0 = {"fileName", iocshArgString};
+static const iocshArg * const marCCDProtocolLogStartArgs[] = {&marCCDProtocolLogStartArg0};
+static const iocshFuncDef marCCDProtocolLogStartFuncDef = {"marCCDProtocolLogStart", 1, marCCDProtocolLogStartArgs};
+static void marCCDProtocolLogStartCallFunc(const iocshArgBuf *args)
+{
+    marCCDProtocolLogStart(args[0].sval);
+}
+
+static const iocshFuncDef marCCDProtocolLogStopFuncDef = {"marCCDProtocolLogStop", 0, NULL};
+static void marCCDProtocolLogStopCallFunc(const iocshArgBuf *args)
+{
+    marCCDProtocolLogStop();
+}
+
+static void marCCDProtocolLogRegister(void)
+{
+    iocshRegister(&marCCDProtocolLogStartFuncDef, marCCDProtocolLogStartCallFunc);
+    iocshRegister(&marCCDProtocolLogStopFuncDef, marCCDProtocolLogStopCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(marCCDProtocolLogRegister);
+}
@@ -0,0 +1,59 @@
+/* marCCDProtocolLog.h
+ *
+ * Recorder of the conversation between the driver and the marccd server.  Each command, each reply
+ * and the time each image file appeared are written with a monotonic timestamp to a binary log,
+ * which marCCDReplayServer plays back to the driver with the original timing.
+ *
+ * The log starts with a marCCDProtocolLogHeader, followed by records that are each a
+ * marCCDProtocolRecord and length bytes of data.  For command and reply records the data is the
+ * text without the terminator; for file records it is a marCCDProtocolFileInfo followed by the
+ * file name.  All fields are in the byte order of the IOC host.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_PROTOCOL_LOG_H
+#define MARCCD_PROTOCOL_LOG_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+#define MARCCD_PROTOCOL_LOG_MAGIC "MARPLOG1"
+
+typedef enum {
+    marCCDProtocolWrite,        /**< A command sent to the server */
+    marCCDProtocolRead,         /**< A reply from the server, or a read that failed */
+    marCCDProtocolFile          /**< An image file the driver found */
+} marCCDProtocolType_t;
+
+typedef struct {
+    char magic[8];              /**< MARCCD_PROTOCOL_LOG_MAGIC, without the terminating 0 */
+    epicsUInt32 secPastEpoch;   /**< Time the log was started, as an EPICS time stamp */
+    epicsUInt32 nsec;
+} marCCDProtocolLogHeader;
+
+typedef struct {
+    epicsUInt64 time;           /**< Nanoseconds since the log was started, on the monotonic clock */
+    epicsUInt16 type;           /**< marCCDProtocolType_t */
+    epicsInt16 status;          /**< asynStatus of the write or read */
+    epicsUInt32 length;         /**< Number of bytes of data that follow */
+} marCCDProtocolRecord;
+
+typedef struct {
+    epicsUInt64 fileSize;
+    epicsInt32 nx;
+    epicsInt32 ny;
+    epicsInt32 bitsPerSample;
+    epicsInt32 rowsPerStrip;
+} marCCDProtocolFileInfo;
+
+extern int marCCDProtocolLogEnabled;
+
+int marCCDProtocolLogStart(const char *fileName);
+int marCCDProtocolLogStop();
+void marCCDProtocolLogText(int type, int status, const char *text, epicsUInt64 time);
+void marCCDProtocolLogFile(const char *fileName, size_t fileSize, int nx, int ny, int bitsPerSample,
+                           int rowsPerStrip, epicsUInt64 time);
+
+#endif
@@ -0,0 +1,156 @@
+/* marCCDRadial.cpp
+ *
+ * Azimuthal integration of frames into a 1-D profile I(q), using a pixel to bin lookup table
+ * computed from the detector geometry.
+ *
+ * The lookup table holds the q bin of each pixel, and is only recomputed when the geometry changes.
+ * The frame is divided into bands of rows, each band is accumulated into its own set of bin sums
+ * by a worker thread, and the sums are then combined.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+ 
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "marCCDRadial.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+marCCDRadial::marCCDRadial()
+    : binIndex(NULL), binCounts(NULL), partialSums(NULL), partialTasks(0), qMax(0.), pFrame(NULL)
+{
+    memset(&this->geometry, 0, sizeof(this->geometry));
+}
+
+marCCDRadial::~marCCDRadial()
+{
+    free(this->binIndex);
+    free(this->binCounts);
+    free(this->partialSums);
+}
+
+/** Returns q in inverse Angstroms of a point at a distance r in mm from the beam position */
+static double computeQ(double r, const marCCDRadialGeometry *pGeometry)
+{
+    double twoTheta = atan2(r, pGeometry->distance);
+    
+    return 4. * M_PI * sin(twoTheta/2.) / pGeometry->wavelength;
+}
+
+/** Computes the lookup table for a new geometry.  Nothing is done if the geometry has not changed.
+  * The q range is from 0 to the q of the frame corner furthest from the beam. 
+  * \return 0 on success, -1 if the geometry is invalid or memory cannot be allocated. */
+int marCCDRadial::configure(const marCCDRadialGeometry *pGeometry)
+{
+    const marCCDRadialGeometry *g = pGeometry;
+    size_t ix, iy;
+    double dx, dy, r, rMax, q;
+    int bin;
+    epicsInt32 *pIndex;
+    
+    if (this->binIndex && 
+        (g->nx == this->geometry.nx) && (g->ny == this->geometry.ny) &&
+        (g->pixelSize == this->geometry.pixelSize) &&
+        (g->beamX == this->geometry.beamX) && (g->beamY == this->geometry.beamY) &&
+        (g->distance == this->geometry.distance) && (g->wavelength == this->geometry.wavelength) &&
+        (g->numBins == this->geometry.numBins)) return 0;
+    free(this->binIndex);   this->binIndex = NULL;
+    free(this->binCounts);  this->binCounts = NULL;
+    free(this->partialSums); this->partialSums = NULL;
+    this->partialTasks = 0;
+    memset(&this->geometry, 0, sizeof(this->geometry));
+    if ((g->nx == 0) || (g->ny == 0) || (g->numBins <= 0) || (g->pixelSize <= 0.) ||
+        (g->distance <= 0.) || (g->wavelength <= 0.)) return -1;
+    this->binIndex = (epicsInt32 *)malloc(g->nx * g->ny * sizeof(epicsInt32));
+    this->binCounts = (epicsInt32 *)calloc(g->numBins, sizeof(epicsInt32));
+    if (!this->binIndex || !this->binCounts) return -1;
+
+    /* The largest radius is at one of the corners */
+    rMax = 0.;
+    for (iy=0; iy<2; iy++) {
+        for (ix=0; ix<2; ix++) {
+            dx = ix*g->nx*g->pixelSize - g->beamX;
+            dy = iy*g->ny*g->pixelSize - g->beamY;
+            r = sqrt(dx*dx + dy*dy);
+            if (r > rMax) rMax = r;
+        }
+    }
+    this->qMax = computeQ(rMax, g);
+    
+    pIndex = this->binIndex;
+    for (iy=0; iy<g->ny; iy++) {
+        dy = (iy + 0.5)*g->pixelSize - g->beamY;
+        for (ix=0; ix<g->nx; ix++) {
+            dx = (ix + 0.5)*g->pixelSize - g->beamX;
+            q = computeQ(sqrt(dx*dx + dy*dy), g);
+            bin = (int)(q / this->qMax * g->numBins);
+            if (bin >= g->numBins) bin = g->numBins - 1;
+            *pIndex++ = bin;
+            this->binCounts[bin]++;
+        }
+    }
+    this->geometry = *g;
+    return 0;
+}
+
+double marCCDRadial::getQMax()
+{
+    return this->qMax;
+}
+
+static void integrateTaskC(void *pvt, int task, int numTasks)
+{
+    marCCDRadial *pRadial = (marCCDRadial *)pvt;
+    
+    pRadial->integrateTask(task, numTasks);
+}
+
+/** Accumulates one band of rows into the sums for this task */
+void marCCDRadial::integrateTask(int task, int numTasks)
+{
+    size_t ny = this->geometry.ny;
+    size_t first = (ny * task) / numTasks * this->geometry.nx;
+    size_t last = (ny * (task+1)) / numTasks * this->geometry.nx;
+    const epicsInt32 *pIndex = this->binIndex;
+    const epicsUInt16 *pIn = this->pFrame;
+    double *pSums = this->partialSums + (size_t)task * this->geometry.numBins;
+    size_t i;
+    
+    memset(pSums, 0, this->geometry.numBins * sizeof(double));
+    for (i=first; i<last; i++) {
+        pSums[pIndex[i]] += pIn[i];
+    }
+}
+
+/** Integrates a frame.  configure() must have been called successfully for the frame geometry.
+  * \param[in] pFrame The frame, nx*ny pixels.
+  * \param[out] pProfile The mean intensity in each of the numBins bins.  Bins with no pixels are 0.
+  * \param[in] pWorkers The worker threads to use.
+  * \param[in] numTasks The number of bands the frame is divided into. */
+void marCCDRadial::integrate(const epicsUInt16 *pFrame, double *pProfile, marCCDWorkers *pWorkers, int numTasks)
+{
+    int numBins = this->geometry.numBins;
+    int task, bin;
+    double sum;
+    
+    if (numTasks < 1) numTasks = 1;
+    if ((size_t)numTasks > this->geometry.ny) numTasks = (int)this->geometry.ny;
+    if (numTasks > this->partialTasks) {
+        free(this->partialSums);
+        this->partialSums = (double *)malloc((size_t)numTasks * numBins * sizeof(double));
+        this->partialTasks = this->partialSums ? numTasks : 0;
+        if (!this->partialSums) return;
+    }
+    this->pFrame = pFrame;
+    pWorkers->run(integrateTaskC, this, numTasks);
+    for (bin=0; bin<numBins; bin++) {
+        sum = 0.;
+        for (task=0; task<numTasks; task++) sum += this->partialSums[(size_t)task*numBins + bin];
+        pProfile[bin] = this->binCounts[bin] ? sum / this->binCounts[bin] : 0.;
+    }
+}
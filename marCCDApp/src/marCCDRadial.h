@@ -0,0 +1,48 @@
+/* marCCDRadial.h
+ *
+ * Azimuthal integration of frames into a 1-D profile I(q), using a pixel to bin lookup table
+ * computed from the detector geometry.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_RADIAL_H
+#define MARCCD_RADIAL_H
+
+#include <epicsTypes.h>
+
+#include "marCCDWorkers.h"
+
+/** Detector geometry used to compute the lookup table */
+typedef struct {
+    size_t nx;              /**< Frame size in pixels */
+    size_t ny;
+    double pixelSize;       /**< Size of a pixel in the frame, including binning, in mm */
+    double beamX;           /**< Beam position on the detector in mm */
+    double beamY;
+    double distance;        /**< Sample to detector distance in mm */
+    double wavelength;      /**< Wavelength in Angstroms */
+    int numBins;            /**< Number of q bins */
+} marCCDRadialGeometry;
+
+class marCCDRadial {
+public:
+    marCCDRadial();
+    ~marCCDRadial();
+    int configure(const marCCDRadialGeometry *pGeometry);
+    void integrate(const epicsUInt16 *pFrame, double *pProfile, marCCDWorkers *pWorkers, int numTasks);
+    double getQMax();
+    void integrateTask(int task, int numTasks); /**< Should be private, but is called from C */
+
+private:
+    marCCDRadialGeometry geometry;
+    epicsInt32 *binIndex;   /**< q bin of each pixel, -1 if the pixel is not used */
+    epicsInt32 *binCounts;  /**< Number of pixels in each bin */
+    double *partialSums;    /**< Sum for each bin, for each task */
+    int partialTasks;
+    double qMax;
+    const epicsUInt16 *pFrame;
+};
+
+#endif
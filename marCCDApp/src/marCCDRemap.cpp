@@ -0,0 +1,177 @@
+/* marCCDRemap.cpp
+ *
+ * Geometric distortion and flat field correction of raw frames in the IOC.  See marCCDRemap.h
+ * for the format of the remap table file.
+ *
+ * The table is memory mapped read only, so it is loaded from the page cache once and shared by
+ * all the IOCs on the host.  It is checked when it is loaded, so the kernel does no bounds checks.
+ * The corrected frame is divided into contiguous blocks of pixels that are processed by the worker
+ * threads.  Each block reads its part of the table sequentially, and the raw pixels near the same
+ * region of the frame, so the kernel is limited by memory bandwidth and not by arithmetic.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "marCCDRemap.h"
+
+static const char *driverName = "marCCDRemap";
+
+marCCDRemap::marCCDRemap()
+    : pMap(NULL), mapSize(0), nx(0), ny(0), numEntries(0), rowStart(NULL), index(NULL), weight(NULL),
+      pRaw(NULL), pOut(NULL)
+{
+}
+
+marCCDRemap::~marCCDRemap()
+{
+    unload();
+}
+
+static void remapTaskC(void *pvt, int task, int numTasks)
+{
+    marCCDRemap *pRemap = (marCCDRemap *)pvt;
+
+    pRemap->remapTask(task, numTasks);
+}
+
+void marCCDRemap::unload()
+{
+    if (this->pMap) munmap(this->pMap, this->mapSize);
+    this->pMap = NULL;
+    this->mapSize = 0;
+    this->nx = 0;
+    this->ny = 0;
+    this->numEntries = 0;
+}
+
+/** Memory maps a remap table file and checks that it is consistent.
+  * \param[in] fileName The name of the file.
+  * \return 0 on success, -1 on error, in which case the previous table is kept. */
+int marCCDRemap::load(const char *fileName)
+{
+    const char *functionName = "load";
+    marCCDRemapHeader header;
+    struct stat statBuff;
+    size_t numPixels, expectedSize, i;
+    const epicsUInt32 *pRowStart, *pIndex;
+    void *pNew;
+    int fd;
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        printf("%s:%s: error opening remap file %s, errno=%d\n", driverName, functionName, fileName, errno);
+        return -1;
+    }
+    if ((fstat(fd, &statBuff) != 0) || (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) ||
+        memcmp(header.magic, MARCCD_REMAP_MAGIC, sizeof(header.magic)) ||
+        (header.version != MARCCD_REMAP_VERSION)) {
+        printf("%s:%s: %s is not a version %d remap file\n",
+            driverName, functionName, fileName, MARCCD_REMAP_VERSION);
+        close(fd);
+        return -1;
+    }
+    numPixels = (size_t)header.nx * header.ny;
+    expectedSize = sizeof(header) + (numPixels + 1) * sizeof(epicsUInt32) +
+                   (size_t)header.numEntries * (sizeof(epicsUInt32) + sizeof(float));
+    if ((numPixels == 0) || ((size_t)statBuff.st_size != expectedSize)) {
+        printf("%s:%s: remap file %s has size %ld, expected %lu\n",
+            driverName, functionName, fileName, (long)statBuff.st_size, (unsigned long)expectedSize);
+        close(fd);
+        return -1;
+    }
+    pNew = mmap(NULL, expectedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pNew == MAP_FAILED) {
+        printf("%s:%s: error mapping remap file %s, errno=%d\n", driverName, functionName, fileName, errno);
+        return -1;
+    }
+    madvise(pNew, expectedSize, MADV_WILLNEED);
+    pRowStart = (const epicsUInt32 *)((const char *)pNew + sizeof(header));
+    pIndex = pRowStart + numPixels + 1;
+    for (i=0; i<numPixels; i++) {
+        if (pRowStart[i] > pRowStart[i+1]) break;
+    }
+    if ((i < numPixels) || (pRowStart[0] != 0) || (pRowStart[numPixels] != header.numEntries)) {
+        printf("%s:%s: remap file %s has invalid row starts\n", driverName, functionName, fileName);
+        munmap(pNew, expectedSize);
+        return -1;
+    }
+    for (i=0; i<header.numEntries; i++) {
+        if (pIndex[i] >= numPixels) break;
+    }
+    if (i < header.numEntries) {
+        printf("%s:%s: remap file %s entry %lu has invalid pixel %u\n",
+            driverName, functionName, fileName, (unsigned long)i, pIndex[i]);
+        munmap(pNew, expectedSize);
+        return -1;
+    }
+    unload();
+    this->pMap = pNew;
+    this->mapSize = expectedSize;
+    this->nx = header.nx;
+    this->ny = header.ny;
+    this->numEntries = header.numEntries;
+    this->rowStart = pRowStart;
+    this->index = pIndex;
+    this->weight = (const float *)(pIndex + header.numEntries);
+    return 0;
+}
+
+size_t marCCDRemap::getNumEntries()
+{
+    return this->numEntries;
+}
+
+/** Corrects one block of the frame */
+void marCCDRemap::remapTask(int task, int numTasks)
+{
+    size_t numPixels = this->nx * this->ny;
+    size_t first = (numPixels * task) / numTasks;
+    size_t last = (numPixels * (task+1)) / numTasks;
+    const epicsUInt32 *rowStart = this->rowStart;
+    const epicsUInt32 *index = this->index;
+    const float *weight = this->weight;
+    const epicsUInt16 *pRaw = this->pRaw;
+    epicsUInt16 *pOut = this->pOut;
+    epicsUInt32 entry, end;
+    float sum;
+    size_t i;
+
+    entry = rowStart[first];
+    for (i=first; i<last; i++) {
+        end = rowStart[i+1];
+        sum = 0.5f;
+        for (; entry<end; entry++) {
+            sum += weight[entry] * pRaw[index[entry]];
+        }
+        pOut[i] = (sum <= 0.f) ? 0 : (sum >= 65535.f) ? 65535 : (epicsUInt16)sum;
+    }
+}
+
+/** Corrects a raw frame with the remap table.
+  * \param[in] pRaw The raw frame.
+  * \param[out] pOut The corrected frame; it must not be the same as pRaw.
+  * \param[in] nx The number of pixels in a row.
+  * \param[in] ny The number of rows.
+  * \param[in] pWorkers The worker threads to use.
+  * \param[in] numTasks The number of blocks the frame is divided into.
+  * \return 0 on success, -1 if there is no table or it does not match the frame size. */
+int marCCDRemap::apply(const epicsUInt16 *pRaw, epicsUInt16 *pOut, size_t nx, size_t ny,
+                       marCCDWorkers *pWorkers, int numTasks)
+{
+    if (!this->pMap || (nx != this->nx) || (ny != this->ny)) return -1;
+    this->pRaw = pRaw;
+    this->pOut = pOut;
+    if (numTasks < 1) numTasks = 1;
+    pWorkers->run(remapTaskC, this, numTasks);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/* marCCDRemap.h
+ *
+ * Geometric distortion and flat field correction of raw frames in the IOC, with a sparse
+ * pixel remap table that is computed offline and memory mapped from a file.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_REMAP_H
+#define MARCCD_REMAP_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+#include "marCCDWorkers.h"
+
+#define MARCCD_REMAP_MAGIC   "MARREMAP"
+#define MARCCD_REMAP_VERSION 1
+
+/** Header of a remap table file.  Each corrected pixel is a weighted sum of raw pixels, and the
+  * weights include the flat field.  The header is followed by these arrays, in the byte order
+  * of the IOC:
+  *   epicsUInt32 rowStart[nx*ny+1]  The first entry of each corrected pixel; rowStart[nx*ny] is numEntries
+  *   epicsUInt32 index[numEntries]  The raw pixel of each entry, row*nx + column
+  *   float weight[numEntries]       The weight of each entry
+  * The raw and corrected frames are both nx by ny pixels. */
+typedef struct {
+    char magic[8];              /**< MARCCD_REMAP_MAGIC, not nil terminated */
+    epicsUInt32 version;        /**< MARCCD_REMAP_VERSION */
+    epicsUInt32 nx;             /**< Pixels in a row */
+    epicsUInt32 ny;             /**< Number of rows */
+    epicsUInt32 numEntries;     /**< Total number of entries */
+    epicsUInt32 reserved[2];
+} marCCDRemapHeader;
+
+class marCCDRemap {
+public:
+    marCCDRemap();
+    ~marCCDRemap();
+    int load(const char *fileName);
+    size_t getNumEntries();
+    int apply(const epicsUInt16 *pRaw, epicsUInt16 *pOut, size_t nx, size_t ny,
+              marCCDWorkers *pWorkers, int numTasks);
+    void remapTask(int task, int numTasks);     /**< Should be private, but is called from C */
+
+private:
+    void unload();
+    void *pMap;                 /**< The memory mapped file */
+    size_t mapSize;
+    size_t nx;
+    size_t ny;
+    size_t numEntries;
+    const epicsUInt32 *rowStart;
+    const epicsUInt32 *index;
+    const float *weight;
+    /* Arguments of the current operation, for the tasks */
+    const epicsUInt16 *pRaw;
+    epicsUInt16 *pOut;
+};
+
+#endif
@@ -0,0 +1,550 @@
+/* marCCDReplayServer.cpp
+ *
+ * Plays back a log recorded with marCCDProtocolLogStart to the driver, taking the place of the
+ * marccd server, so that the timing of an acquisition at a beamline can be reproduced on another
+ * machine and compared before and after a change to the driver.
+ *
+ * Usage: marCCDReplayServer [-p port] [-s speed] [-d directory] [-v] logFile
+ *   -p  TCP port to listen on, default 2222
+ *   -s  Speed of the replay; 2 plays the log twice as fast, default 1
+ *   -d  Directory for the image files whose names are not in the commands, default the recorded directory
+ *   -v  Print each command and reply
+ *
+ * The log is divided into steps, one for each command other than get_state.  Each command from the
+ * driver is matched with the next step of the log with the same command name, and its reply is sent
+ * with the recorded delay.  get_state is answered with the state the server reported at the same
+ * time after the command of the current step, so the driver sees the detector busy for as long as it
+ * was, however often it polls.  Each image file is written with marCCDTiffWriteSynthetic with the
+ * recorded size and pixel type, under a temporary name, and renamed at the time it appeared to the
+ * driver after the command that named it.  When the command named the file it is written under the
+ * name in the command from the driver, otherwise under the recorded name, in the -d directory if given.
+ * A file appears no earlier than the driver noticed it, which is up to its 10 ms polling interval
+ * after the server wrote it.
+ *
+ * The server accepts one connection at a time, and continues the log where it left off when the
+ * driver reconnects.  It exits when the driver disconnects after the last step.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsStdio.h>
+#include <osiSock.h>
+
+#include "marCCDProtocolLog.h"
+#include "marCCDTiff.h"
+
+#define DEFAULT_PORT 2222
+#define MAX_COMMAND 1024
+/** How many steps ahead a command is looked for before it is treated as not in the log */
+#define MAX_LOOKAHEAD 32
+/** How many steps back a file record is matched with the command that named it */
+#define MAX_LOOKBACK 64
+
+/** A get_state exchange */
+typedef struct {
+    double offset;              /**< Time of the request after the command of the step, in seconds */
+    double latency;             /**< Time from the request to the reply */
+    int status;                 /**< asynStatus of the read; there was no reply unless it is 0 */
+    char *reply;
+} replayState;
+
+/** An image file */
+typedef struct {
+    double offset;              /**< Time the file appeared after the command of the step, in seconds */
+    int field;                  /**< Field of the command that is the file name, or -1 */
+    marCCDProtocolFileInfo info;
+    char *name;
+} replayFile;
+
+/** A command and what the server did until the next one */
+typedef struct {
+    char *command;              /**< NULL for the step before the first command */
+    double time;                /**< Time of the command in the log, in seconds */
+    int hasReply;
+    double replyLatency;
+    int replyStatus;
+    char *reply;
+    replayState *states;
+    int numStates;
+    int maxStates;
+    replayFile *files;
+    int numFiles;
+    int maxFiles;
+} replayStep;
+
+/** A file waiting to be written and renamed */
+typedef struct replayPending {
+    struct replayPending *pNext;
+    double deadline;            /**< Monotonic time to rename it at */
+    char name[MAX_COMMAND];
+    marCCDProtocolFileInfo info;
+    unsigned int seed;
+} replayPending;
+
+static replayStep *steps;
+static int numSteps;
+static int maxSteps;
+static double speed = 1.;
+static const char *directory;
+static int verbose;
+
+static epicsMutexId pendingMutex;
+static epicsEventId pendingEvent;
+static replayPending *pendingHead, *pendingTail;
+static int numPending;          /**< Files queued and not yet renamed */
+static int filesWritten;
+static double maxLateness;
+
+/** Returns the monotonic time in seconds */
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.e9;
+}
+
+/** Makes room for one more element in an array */
+static void *grow(void *pArray, int num, int *pMax, size_t size)
+{
+    if (num < *pMax) return pArray;
+    *pMax = *pMax ? 2 * *pMax : 16;
+    pArray = realloc(pArray, *pMax * size);
+    if (!pArray) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return pArray;
+}
+
+/** Returns the length of the command name, the text before the first ',' */
+static size_t verbLength(const char *command)
+{
+    const char *p = strchr(command, ',');
+
+    return p ? (size_t)(p - command) : strlen(command);
+}
+
+static int sameVerb(const char *command1, const char *command2)
+{
+    size_t len = verbLength(command1);
+
+    return (len == verbLength(command2)) && (strncmp(command1, command2, len) == 0);
+}
+
+/** Copies field n of a comma separated command.
+  * \return 0 on success, -1 if the command has fewer fields. */
+static int getField(const char *command, int n, char *field, size_t size)
+{
+    const char *pEnd;
+    size_t len;
+
+    for (; n > 0; n--) {
+        command = strchr(command, ',');
+        if (!command) return -1;
+        command++;
+    }
+    pEnd = strchr(command, ',');
+    len = pEnd ? (size_t)(pEnd - command) : strlen(command);
+    if (len >= size) len = size - 1;
+    memcpy(field, command, len);
+    field[len] = 0;
+    return 0;
+}
+
+/** Returns the field of a command that is a file name, or -1 */
+static int findField(const char *command, const char *name)
+{
+    char field[MAX_COMMAND];
+    int n;
+
+    for (n=0; getField(command, n, field, sizeof(field)) == 0; n++) {
+        if (strcmp(field, name) == 0) return n;
+    }
+    return -1;
+}
+
+static replayStep *addStep(char *command, double time)
+{
+    replayStep *pStep;
+
+    steps = (replayStep *)grow(steps, numSteps, &maxSteps, sizeof(replayStep));
+    pStep = &steps[numSteps++];
+    memset(pStep, 0, sizeof(*pStep));
+    pStep->command = command;
+    pStep->time = time;
+    return pStep;
+}
+
+/** Reads a log into steps.
+  * \return 0 on success, -1 on error. */
+static int readLog(const char *fileName)
+{
+    marCCDProtocolLogHeader header;
+    marCCDProtocolRecord record;
+    replayStep *pStep;
+    replayState *pState;
+    replayFile *pFile;
+    FILE *fp;
+    char *pData;
+    double time, writeTime = 0.;
+    int stateRequested = 0, commandSent = 0;
+    int i, numRecords = 0;
+
+    fp = fopen(fileName, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    if ((fread(&header, sizeof(header), 1, fp) != 1) ||
+        (memcmp(header.magic, MARCCD_PROTOCOL_LOG_MAGIC, sizeof(header.magic)) != 0)) {
+        fprintf(stderr, "%s is not a marCCD protocol log\n", fileName);
+        fclose(fp);
+        return -1;
+    }
+    pStep = addStep(NULL, 0.);
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        pData = (char *)malloc(record.length + 1);
+        if (!pData || (fread(pData, 1, record.length, fp) != record.length)) {
+            fprintf(stderr, "%s is truncated after %d records\n", fileName, numRecords);
+            free(pData);
+            break;
+        }
+        pData[record.length] = 0;
+        numRecords++;
+        time = record.time / 1.e9;
+        switch (record.type) {
+            case marCCDProtocolWrite:
+                writeTime = time;
+                stateRequested = (strcmp(pData, "get_state") == 0);
+                commandSent = !stateRequested;
+                if (stateRequested) {
+                    free(pData);
+                } else {
+                    pStep = addStep(pData, time);
+                }
+                break;
+            case marCCDProtocolRead:
+                if (stateRequested) {
+                    pStep->states = (replayState *)grow(pStep->states, pStep->numStates, &pStep->maxStates,
+                                                       sizeof(replayState));
+                    pState = &pStep->states[pStep->numStates++];
+                    pState->offset = writeTime - pStep->time;
+                    pState->latency = time - writeTime;
+                    pState->status = record.status;
+                    pState->reply = pData;
+                } else if (commandSent) {
+                    pStep->hasReply = 1;
+                    pStep->replyLatency = time - writeTime;
+                    pStep->replyStatus = record.status;
+                    pStep->reply = pData;
+                } else {
+                    free(pData);
+                }
+                stateRequested = 0;
+                commandSent = 0;
+                break;
+            case marCCDProtocolFile:
+                if (record.length <= sizeof(marCCDProtocolFileInfo)) {
+                    free(pData);
+                    break;
+                }
+                /* The file belongs to the command that named it, which may be a few steps back */
+                for (i=numSteps-1; (i > 0) && (i >= numSteps - MAX_LOOKBACK); i--) {
+                    if (strstr(steps[i].command, pData + sizeof(marCCDProtocolFileInfo))) break;
+                }
+                if ((i <= 0) || (i < numSteps - MAX_LOOKBACK)) i = numSteps - 1;
+                steps[i].files = (replayFile *)grow(steps[i].files, steps[i].numFiles, &steps[i].maxFiles,
+                                                    sizeof(replayFile));
+                pFile = &steps[i].files[steps[i].numFiles++];
+                memcpy(&pFile->info, pData, sizeof(pFile->info));
+                pFile->name = strdup(pData + sizeof(marCCDProtocolFileInfo));
+                pFile->offset = time - steps[i].time;
+                pFile->field = steps[i].command ? findField(steps[i].command, pFile->name) : -1;
+                free(pData);
+                break;
+            default:
+                free(pData);
+                break;
+        }
+    }
+    fclose(fp);
+    printf("%s: %d records, %d commands, %.1f seconds\n", fileName, numRecords, numSteps - 1,
+           (numSteps > 1) ? steps[numSteps-1].time : 0.);
+    return 0;
+}
+
+/** Writes the files queued by the main thread, each under a temporary name, and renames them at their deadline */
+static void fileTask(void *arg)
+{
+    replayPending *pPending;
+    char tempName[MAX_COMMAND + 16];
+    double delay, lateness;
+    int bits;
+
+    while (1) {
+        epicsMutexLock(pendingMutex);
+        pPending = pendingHead;
+        if (pPending) {
+            pendingHead = pPending->pNext;
+            if (!pendingHead) pendingTail = NULL;
+        }
+        epicsMutexUnlock(pendingMutex);
+        if (!pPending) {
+            epicsEventWait(pendingEvent);
+            continue;
+        }
+        epicsSnprintf(tempName, sizeof(tempName), "%s.replay", pPending->name);
+        bits = (pPending->info.bitsPerSample == 32) ? 32 : 16;
+        if (marCCDTiffWriteSynthetic(tempName, pPending->info.nx, pPending->info.ny, bits,
+                                     pPending->info.rowsPerStrip, pPending->seed)) {
+            fprintf(stderr, "error writing %s\n", tempName);
+            epicsMutexLock(pendingMutex);
+            numPending--;
+            epicsMutexUnlock(pendingMutex);
+            free(pPending);
+            continue;
+        }
+        delay = pPending->deadline - now();
+        if (delay > 0.) epicsThreadSleep(delay);
+        if (rename(tempName, pPending->name) != 0) {
+            fprintf(stderr, "error renaming %s: %s\n", tempName, strerror(errno));
+            lateness = 0.;
+        } else {
+            lateness = now() - pPending->deadline;
+            if (verbose) printf("  file %s, %.1f ms late\n", pPending->name, lateness * 1000.);
+        }
+        epicsMutexLock(pendingMutex);
+        filesWritten++;
+        if (lateness > maxLateness) maxLateness = lateness;
+        numPending--;
+        epicsMutexUnlock(pendingMutex);
+        free(pPending);
+    }
+}
+
+/** Queues the files of a step, named as in the command from the driver */
+static void queueFiles(const replayStep *pStep, const char *command, double stepStart)
+{
+    replayPending *pPending;
+    const replayFile *pFile;
+    const char *baseName;
+    static unsigned int seed;
+    int i;
+
+    for (i=0; i<pStep->numFiles; i++) {
+        pFile = &pStep->files[i];
+        pPending = (replayPending *)calloc(1, sizeof(replayPending));
+        if (!pPending) return;
+        pPending->deadline = stepStart + pFile->offset / speed;
+        pPending->info = pFile->info;
+        pPending->seed = ++seed;
+        if ((pFile->field < 0) || getField(command, pFile->field, pPending->name, sizeof(pPending->name))) {
+            baseName = strrchr(pFile->name, '/');
+            baseName = baseName ? baseName + 1 : pFile->name;
+            if (directory) epicsSnprintf(pPending->name, sizeof(pPending->name), "%s/%s", directory, baseName);
+            else epicsSnprintf(pPending->name, sizeof(pPending->name), "%s", pFile->name);
+        }
+        epicsMutexLock(pendingMutex);
+        if (pendingTail) pendingTail->pNext = pPending;
+        else pendingHead = pPending;
+        pendingTail = pPending;
+        numPending++;
+        epicsMutexUnlock(pendingMutex);
+        epicsEventSignal(pendingEvent);
+    }
+}
+
+/** Sends a reply after its recorded delay.  Replies to reads that failed are not sent.
+  * \return 0 on success, -1 if the connection was closed. */
+static int sendReply(SOCKET sock, const char *reply, int status, double latency)
+{
+    char buffer[MAX_COMMAND + 2];
+    size_t len, sent = 0;
+    ssize_t n;
+
+    if (latency > 0.) epicsThreadSleep(latency / speed);
+    if (status != 0) return 0;
+    if (verbose) printf("  reply %s\n", reply);
+    len = epicsSnprintf(buffer, sizeof(buffer), "%s\n", reply);
+    if (len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+    while (sent < len) {
+        n = send(sock, buffer + sent, len - sent, 0);
+        if (n <= 0) {
+            if ((n < 0) && (errno == EINTR)) continue;
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/** Returns the get_state exchange for a time after the command of a step */
+static const replayState *findState(int step, double elapsed)
+{
+    const replayStep *pStep = &steps[step];
+    int i;
+
+    for (i=pStep->numStates-1; i>=0; i--) {
+        if (pStep->states[i].offset <= elapsed) return &pStep->states[i];
+    }
+    /* Before the first request of the step the state is the one the server reported first after the command */
+    if (pStep->numStates > 0) return &pStep->states[0];
+    for (step--; step >= 0; step--) {
+        if (steps[step].numStates > 0) return &steps[step].states[steps[step].numStates-1];
+    }
+    return NULL;
+}
+
+/** Replays the log to one connection.
+  * \param[in,out] pCurrent The current step, which is kept when the driver reconnects. */
+static void serve(SOCKET sock, int *pCurrent)
+{
+    char buffer[4 * MAX_COMMAND];
+    char *command, *pEnd;
+    size_t used = 0;
+    ssize_t n;
+    double stepStart = now();
+    const replayState *pState;
+    int numCommands = 0, numUnmatched = 0;
+    int i, status = 0;
+
+    while (status == 0) {
+        n = recv(sock, buffer + used, sizeof(buffer) - used - 1, 0);
+        if (n <= 0) {
+            if ((n < 0) && (errno == EINTR)) continue;
+            break;
+        }
+        used += n;
+        buffer[used] = 0;
+        command = buffer;
+        while ((status == 0) && (pEnd = strchr(command, '\n'))) {
+            *pEnd = 0;
+            if ((pEnd > command) && (pEnd[-1] == '\r')) pEnd[-1] = 0;
+            numCommands++;
+            if (verbose) printf("%.3f %s\n", now() - stepStart, command);
+            if (strcmp(command, "get_state") == 0) {
+                pState = findState(*pCurrent, (now() - stepStart) * speed);
+                if (pState) status = sendReply(sock, pState->reply, pState->status, pState->latency);
+                else status = sendReply(sock, "0", 0, 0.);
+            } else {
+                for (i=*pCurrent+1; (i < numSteps) && (i <= *pCurrent + MAX_LOOKAHEAD); i++) {
+                    if (sameVerb(steps[i].command, command)) break;
+                }
+                if ((i < numSteps) && (i <= *pCurrent + MAX_LOOKAHEAD)) {
+                    *pCurrent = i;
+                    stepStart = now();
+                    queueFiles(&steps[i], command, stepStart);
+                    if (steps[i].hasReply) {
+                        status = sendReply(sock, steps[i].reply, steps[i].replyStatus, steps[i].replyLatency);
+                    }
+                } else {
+                    /* Not in the log here; answer as the server did to the same command elsewhere */
+                    numUnmatched++;
+                    printf("command %s is not in the log after step %d\n", command, *pCurrent);
+                    for (i=1; i<numSteps; i++) {
+                        if (sameVerb(steps[i].command, command) && steps[i].hasReply) {
+                            status = sendReply(sock, steps[i].reply, steps[i].replyStatus, 0.);
+                            break;
+                        }
+                    }
+                }
+            }
+            command = pEnd + 1;
+        }
+        used -= command - buffer;
+        memmove(buffer, command, used);
+        if (used >= sizeof(buffer) - 1) used = 0;
+    }
+    epicsMutexLock(pendingMutex);
+    printf("connection closed at step %d of %d: %d commands, %d not in the log, %d files, "
+           "files up to %.1f ms late\n", *pCurrent, numSteps - 1, numCommands, numUnmatched,
+           filesWritten, maxLateness * 1000.);
+    epicsMutexUnlock(pendingMutex);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-s speed] [-d directory] [-v] logFile\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int port = DEFAULT_PORT;
+    int opt, current = 0, waiting;
+    SOCKET listenSock, sock;
+    osiSockAddr addr;
+    osiSocklen_t addrSize;
+
+    while ((opt = getopt(argc, argv, "p:s:d:v")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            case 'd': directory = optarg; break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if ((optind != argc - 1) || (port <= 0) || (speed <= 0.)) usage(argv[0]);
+    if (readLog(argv[optind])) return 1;
+    pendingMutex = epicsMutexMustCreate();
+    pendingEvent = epicsEventMustCreate(epicsEventEmpty);
+    if (!epicsThreadCreate("replayFiles", epicsThreadPriorityMedium,
+                           epicsThreadGetStackSize(epicsThreadStackMedium), fileTask, NULL)) {
+        fprintf(stderr, "cannot create the file thread\n");
+        return 1;
+    }
+    if (!osiSockAttach()) {
+        fprintf(stderr, "osiSockAttach failed\n");
+        return 1;
+    }
+    listenSock = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+    if (listenSock == INVALID_SOCKET) {
+        fprintf(stderr, "error creating socket: %s\n", strerror(errno));
+        return 1;
+    }
+    epicsSocketEnableAddressReuseDuringTimeWaitState(listenSock);
+    memset(&addr, 0, sizeof(addr));
+    addr.ia.sin_family = AF_INET;
+    addr.ia.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.ia.sin_port = htons((unsigned short)port);
+    if ((bind(listenSock, &addr.sa, sizeof(addr.ia)) != 0) || (listen(listenSock, 1) != 0)) {
+        fprintf(stderr, "error listening on TCP port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    printf("listening on TCP port %d\n", port);
+    while (current < numSteps - 1) {
+        addrSize = sizeof(addr);
+        sock = epicsSocketAccept(listenSock, &addr.sa, &addrSize);
+        if (sock == INVALID_SOCKET) {
+            fprintf(stderr, "error accepting connection: %s\n", strerror(errno));
+            epicsThreadSleep(1.0);
+            continue;
+        }
+        serve(sock, &current);
+        epicsSocketDestroy(sock);
+    }
+    /* Let the last files appear */
+    while (1) {
+        epicsMutexLock(pendingMutex);
+        waiting = numPending;
+        epicsMutexUnlock(pendingMutex);
+        if (!waiting) break;
+        epicsThreadSleep(0.1);
+    }
+    epicsSocketDestroy(listenSock);
+    return 0;
+}
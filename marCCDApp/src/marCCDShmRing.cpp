@@ -0,0 +1,158 @@
+/* marCCDShmRing.cpp
+ *
+ * Publishes frames into a POSIX shared memory ring, so that analysis programs on the same
+ * host can read them without reading the TIFF files.  See marCCDShmRing.h for the layout.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <epicsString.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+
+#include "marCCDShmRing.h"
+
+#define PAGE_ROUND(size) (((size) + MARCCD_SHM_SLOT_HEADER_SIZE - 1) & ~(size_t)(MARCCD_SHM_SLOT_HEADER_SIZE - 1))
+
+static const char *driverName = "marCCDShmRing";
+
+/** Constructor for the shared memory ring; open() creates the shared memory object.
+  * \param[in] name The name of the shared memory object, without the leading "/".
+  * \param[in] numSlots The number of frames in the ring.
+  * \param[in] maxDataSize The maximum size in bytes of the pixel data of a frame.
+  * \param[in] policy What to do when the ring is full, marCCDShmOverwrite or marCCDShmBlock. */
+marCCDShmRing::marCCDShmRing(const char *name, int numSlots, size_t maxDataSize, int policy)
+    : numSlots(numSlots), maxDataSize(maxDataSize), policy(policy), pHeader(NULL), sequence(0)
+{
+    this->name = (char *)malloc(strlen(name) + 2);
+    sprintf(this->name, "/%s", name);
+    this->slotStride = MARCCD_SHM_SLOT_HEADER_SIZE + PAGE_ROUND(maxDataSize);
+    this->mapSize = MARCCD_SHM_SLOT_HEADER_SIZE + numSlots * this->slotStride;
+}
+
+marCCDShmRing::~marCCDShmRing()
+{
+    if (this->pHeader) {
+        munmap(this->pHeader, this->mapSize);
+        shm_unlink(this->name);
+    }
+    free(this->name);
+}
+
+/** Creates the shared memory object, replacing any existing object with the same name.
+  * \return 0 on success, -1 on error. */
+int marCCDShmRing::open()
+{
+    const char *functionName = "open";
+    int fd;
+    void *pMap;
+    
+    if ((this->numSlots < 1) || (this->maxDataSize == 0)) {
+        printf("%s:%s: invalid numSlots=%d or maxDataSize=%lu\n", 
+            driverName, functionName, this->numSlots, (unsigned long)this->maxDataSize);
+        return -1;
+    }
+    /* Consumers that still have an old object mapped keep the old object */
+    shm_unlink(this->name);
+    fd = shm_open(this->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        printf("%s:%s: error creating shared memory %s, errno=%d %s\n", 
+            driverName, functionName, this->name, errno, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, this->mapSize) != 0) {
+        printf("%s:%s: error setting size of shared memory %s to %lu, errno=%d %s\n", 
+            driverName, functionName, this->name, (unsigned long)this->mapSize, errno, strerror(errno));
+        close(fd);
+        shm_unlink(this->name);
+        return -1;
+    }
+    pMap = mmap(NULL, this->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pMap == MAP_FAILED) {
+        printf("%s:%s: error mapping shared memory %s, errno=%d %s\n", 
+            driverName, functionName, this->name, errno, strerror(errno));
+        shm_unlink(this->name);
+        return -1;
+    }
+    this->pHeader = (marCCDShmHeader *)pMap;
+    this->pHeader->version = MARCCD_SHM_VERSION;
+    this->pHeader->numSlots = this->numSlots;
+    this->pHeader->policy = this->policy;
+    this->pHeader->headerSize = MARCCD_SHM_SLOT_HEADER_SIZE;
+    this->pHeader->slotStride = this->slotStride;
+    this->pHeader->maxDataSize = this->maxDataSize;
+    this->pHeader->writeSequence = 0;
+    this->pHeader->readSequence = 0;
+    /* Consumers check the magic number last, so it is written last */
+    epicsAtomicWriteMemoryBarrier();
+    this->pHeader->magic = MARCCD_SHM_MAGIC;
+    return 0;
+}
+
+/** Returns 1 if the next frame can be published, or 0 if the policy is marCCDShmBlock and the
+  * consumer has not finished with the frame in its slot.  The caller waits until it returns 1. */
+int marCCDShmRing::slotFree()
+{
+    if (!this->pHeader || (this->policy != marCCDShmBlock)) return 1;
+    return (epicsUInt32)(this->sequence + 1 - this->pHeader->readSequence) <= (epicsUInt32)this->numSlots;
+}
+
+/** Copies a frame into the next slot of the ring.  This does not wait; with the policy marCCDShmBlock
+  * the caller waits for slotFree first.
+  * \param[in] pArray The frame.
+  * \param[in] pGeometry The geometry to store with the frame.
+  * \return 0 if the frame was published, 1 if the ring was full, -1 if the frame is too large for a slot. */
+int marCCDShmRing::publish(NDArray *pArray, const marCCDShmGeometry *pGeometry)
+{
+    NDArrayInfo_t arrayInfo;
+    marCCDShmSlot *pSlot;
+    epicsUInt32 n;
+
+    if (!this->pHeader) return -1;
+    pArray->getInfo(&arrayInfo);
+    if ((arrayInfo.totalBytes > this->maxDataSize) || (pArray->ndims > 2)) return -1;
+    n = this->sequence + 1;
+    if (this->policy == marCCDShmBlock) {
+        if (!slotFree()) return 1;
+        epicsAtomicReadMemoryBarrier();
+    }
+    pSlot = (marCCDShmSlot *)((char *)this->pHeader + MARCCD_SHM_SLOT_HEADER_SIZE + 
+                              ((n-1) % this->numSlots) * this->slotStride);
+    pSlot->sequence = 2*n - 1;
+    epicsAtomicWriteMemoryBarrier();
+    pSlot->dataType = pArray->dataType;
+    pSlot->ndims = pArray->ndims;
+    pSlot->uniqueId = pArray->uniqueId;
+    pSlot->dims[0] = pArray->dims[0].size;
+    pSlot->dims[1] = (pArray->ndims > 1) ? pArray->dims[1].size : 1;
+    pSlot->dataSize = arrayInfo.totalBytes;
+    pSlot->timeStamp = pArray->timeStamp;
+    pSlot->epicsTSSec = pArray->epicsTS.secPastEpoch;
+    pSlot->epicsTSNsec = pArray->epicsTS.nsec;
+    pSlot->geometry = *pGeometry;
+    memcpy((char *)pSlot + MARCCD_SHM_SLOT_HEADER_SIZE, pArray->pData, arrayInfo.totalBytes);
+    epicsAtomicWriteMemoryBarrier();
+    pSlot->sequence = 2*n;
+    this->pHeader->writeSequence = n;
+    this->sequence = n;
+    return 0;
+}
+
+void marCCDShmRing::report(FILE *fp)
+{
+    fprintf(fp, "  Shared memory ring: %s, %d slots of %lu bytes, policy %s, %u frames published\n",
+        this->name, this->numSlots, (unsigned long)this->maxDataSize,
+        (this->policy == marCCDShmBlock) ? "block" : "overwrite", this->sequence);
+}
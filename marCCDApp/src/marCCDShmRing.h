@@ -0,0 +1,95 @@
+/* marCCDShmRing.h
+ *
+ * Publishes frames into a POSIX shared memory ring, so that analysis programs on the same
+ * host can read them without reading the TIFF files.
+ *
+ * The shared memory object /<name> contains a marCCDShmHeader, followed by numSlots slots every
+ * slotStride bytes starting at headerSize.  Each slot is a marCCDShmSlot followed by the pixel data
+ * at offset MARCCD_SHM_SLOT_HEADER_SIZE.  Frame n (counting from 1) is written to slot (n-1)%numSlots.
+ * While it is written the slot sequence is 2n-1, and when it is complete the slot sequence is 2n
+ * and writeSequence is n.  A consumer reading frame n checks that the slot sequence is 2n before
+ * and after copying the frame; if it changed, the frame was overwritten while it was read.
+ * With the policy marCCDShmBlock a consumer sets readSequence to the last frame it has finished with,
+ * and the publisher does not overwrite frames after that; it waits with slotFree until the consumer
+ * catches up.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_SHM_RING_H
+#define MARCCD_SHM_RING_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+#define MARCCD_SHM_MAGIC   0x4d415243 /* "MARC" */
+#define MARCCD_SHM_VERSION 1
+/** Size of the slot header; the pixel data in each slot are page aligned */
+#define MARCCD_SHM_SLOT_HEADER_SIZE 4096
+
+typedef enum {
+    marCCDShmOverwrite,     /**< The oldest frame is overwritten when the ring is full */
+    marCCDShmBlock          /**< The publisher waits for the consumer when the ring is full */
+} marCCDShmPolicy_t;
+
+/** Experiment geometry copied into each slot */
+typedef struct {
+    double distance;        /**< Detector distance in mm */
+    double beamX;           /**< Beam position on the detector in mm; divide by pixelSize for pixels */
+    double beamY;
+    double wavelength;      /**< Wavelength in Angstroms */
+    double pixelSize;       /**< Pixel size in mm, including binning */
+    double startPhi;        /**< Phi at the start of the frame in degrees */
+    double rotationRange;   /**< Rotation during the frame in degrees */
+    double twoTheta;        /**< Detector two-theta in degrees */
+} marCCDShmGeometry;
+
+typedef struct {
+    epicsUInt32 magic;
+    epicsUInt32 version;
+    epicsUInt32 numSlots;
+    epicsUInt32 policy;                 /**< marCCDShmPolicy_t */
+    epicsUInt64 headerSize;             /**< Offset of the first slot */
+    epicsUInt64 slotStride;             /**< Offset between slots */
+    epicsUInt64 maxDataSize;            /**< Maximum size of the pixel data in a slot */
+    volatile epicsUInt32 writeSequence; /**< Last frame that was completely written */
+    volatile epicsUInt32 readSequence;  /**< Last frame the consumer has finished with, set by the consumer */
+} marCCDShmHeader;
+
+typedef struct {
+    volatile epicsUInt32 sequence;      /**< 2n-1 while frame n is written, 2n when it is complete */
+    epicsUInt32 dataType;               /**< NDDataType_t */
+    epicsUInt32 ndims;
+    epicsInt32 uniqueId;
+    epicsUInt64 dims[2];
+    epicsUInt64 dataSize;
+    double timeStamp;
+    epicsUInt32 epicsTSSec;
+    epicsUInt32 epicsTSNsec;
+    marCCDShmGeometry geometry;
+} marCCDShmSlot;
+
+class marCCDShmRing {
+public:
+    marCCDShmRing(const char *name, int numSlots, size_t maxDataSize, int policy);
+    ~marCCDShmRing();
+    int open();
+    int slotFree();
+    int publish(NDArray *pArray, const marCCDShmGeometry *pGeometry);
+    void report(FILE *fp);
+
+private:
+    char *name;
+    int numSlots;
+    size_t maxDataSize;
+    int policy;
+    size_t slotStride;
+    size_t mapSize;
+    marCCDShmHeader *pHeader;
+    epicsUInt32 sequence;
+};
+
+#endif
@@ -0,0 +1,190 @@
+/* marCCDSpots.cpp
+ *
+ * Bragg spot finding on frames, used to veto blank frames.
+ *
+ * The frame is divided into tiles of MARCCD_SPOT_TILE_SIZE x MARCCD_SPOT_TILE_SIZE pixels.  The mean 
+ * and standard deviation of each tile is the local background, and pixels more than sigma standard 
+ * deviations above the mean are strong pixels.  The rows of tiles are divided among the worker threads.
+ * The inner loops over the pixels have no branches, so the compiler can vectorize them.
+ * Spots are groups of at least minPixels strong pixels that are connected to each other, 
+ * including diagonally.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+ 
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "marCCDSpots.h"
+
+/** Pixels more than this many standard deviations above the mean are excluded from the background */
+#define CLIP_SIGMA 3.
+
+marCCDSpotFinder::marCCDSpotFinder()
+    : pFrame(NULL), nx(0), ny(0), sigma(0.), mask(NULL), maskSize(0), stack(NULL), stackSize(0)
+{
+}
+
+marCCDSpotFinder::~marCCDSpotFinder()
+{
+    free(this->mask);
+    free(this->stack);
+}
+
+static void thresholdTaskC(void *pvt, int task, int numTasks)
+{
+    marCCDSpotFinder *pSpots = (marCCDSpotFinder *)pvt;
+    
+    pSpots->thresholdTask(task, numTasks);
+}
+
+/** Computes the local background of the tiles in one band of tile rows, and marks the strong pixels */
+void marCCDSpotFinder::thresholdTask(int task, int numTasks)
+{
+    size_t numTileRows = (this->ny + MARCCD_SPOT_TILE_SIZE - 1) / MARCCD_SPOT_TILE_SIZE;
+    size_t firstRow = (numTileRows * task) / numTasks * MARCCD_SPOT_TILE_SIZE;
+    size_t lastRow = (numTileRows * (task+1)) / numTasks * MARCCD_SPOT_TILE_SIZE;
+    size_t x0, y0, x, y, tileX, tileY;
+    epicsUInt64 sum, sumSq;
+    epicsUInt32 value, keep, count;
+    double mean, variance, threshold;
+    epicsUInt16 thresh;
+    const epicsUInt16 *pIn;
+    epicsUInt8 *pMask;
+    
+    if (lastRow > this->ny) lastRow = this->ny;
+    for (y0=firstRow; y0<lastRow; y0+=MARCCD_SPOT_TILE_SIZE) {
+        tileY = lastRow - y0;
+        if (tileY > MARCCD_SPOT_TILE_SIZE) tileY = MARCCD_SPOT_TILE_SIZE;
+        for (x0=0; x0<this->nx; x0+=MARCCD_SPOT_TILE_SIZE) {
+            tileX = this->nx - x0;
+            if (tileX > MARCCD_SPOT_TILE_SIZE) tileX = MARCCD_SPOT_TILE_SIZE;
+            sum = 0;
+            sumSq = 0;
+            for (y=0; y<tileY; y++) {
+                pIn = this->pFrame + (y0+y)*this->nx + x0;
+                for (x=0; x<tileX; x++) {
+                    value = pIn[x];
+                    sum += value;
+                    sumSq += value*value;
+                }
+            }
+            mean = (double)sum / (tileX*tileY);
+            variance = (double)sumSq / (tileX*tileY) - mean*mean;
+            if (variance < 0.) variance = 0.;
+            /* Second pass without the pixels more than CLIP_SIGMA above the mean, 
+             * so the spots themselves do not raise the background */
+            threshold = mean + CLIP_SIGMA * sqrt(variance);
+            thresh = (threshold >= 65535.) ? 65535 : (epicsUInt16)threshold;
+            sum = 0;
+            sumSq = 0;
+            count = 0;
+            for (y=0; y<tileY; y++) {
+                pIn = this->pFrame + (y0+y)*this->nx + x0;
+                for (x=0; x<tileX; x++) {
+                    keep = pIn[x] <= thresh;
+                    value = pIn[x] * keep;
+                    sum += value;
+                    sumSq += value*value;
+                    count += keep;
+                }
+            }
+            if (count > 0) {
+                mean = (double)sum / count;
+                variance = (double)sumSq / count - mean*mean;
+            }
+            if (variance < 1.) variance = 1.;
+            threshold = mean + this->sigma * sqrt(variance);
+            thresh = (threshold >= 65535.) ? 65535 : (epicsUInt16)threshold;
+            for (y=0; y<tileY; y++) {
+                pIn = this->pFrame + (y0+y)*this->nx + x0;
+                pMask = this->mask + (y0+y)*this->nx + x0;
+                for (x=0; x<tileX; x++) {
+                    pMask[x] = pIn[x] > thresh;
+                }
+            }
+        }
+    }
+}
+
+/** Counts the groups of connected strong pixels with at least minPixels pixels.  The mask is cleared. */
+int marCCDSpotFinder::countSpots(int minPixels)
+{
+    size_t numPixels = this->nx * this->ny;
+    size_t i, n, pixel, x, y;
+    int dx, dy;
+    size_t xn, yn;
+    int spotPixels;
+    int numSpots = 0;
+    
+    for (i=0; i<numPixels; i++) {
+        if (!this->mask[i]) continue;
+        /* Flood fill from this pixel, clearing the mask as we go */
+        this->mask[i] = 0;
+        this->stack[0] = (epicsUInt32)i;
+        n = 1;
+        spotPixels = 0;
+        while (n > 0) {
+            pixel = this->stack[--n];
+            spotPixels++;
+            x = pixel % this->nx;
+            y = pixel / this->nx;
+            for (dy=-1; dy<=1; dy++) {
+                yn = y + dy;
+                if (yn >= this->ny) continue;
+                for (dx=-1; dx<=1; dx++) {
+                    xn = x + dx;
+                    if (xn >= this->nx) continue;
+                    if (!this->mask[yn*this->nx + xn]) continue;
+                    this->mask[yn*this->nx + xn] = 0;
+                    if (n >= this->stackSize) {
+                        epicsUInt32 *pNew = (epicsUInt32 *)realloc(this->stack, 2*this->stackSize*sizeof(epicsUInt32));
+                        if (!pNew) continue;
+                        this->stack = pNew;
+                        this->stackSize *= 2;
+                    }
+                    this->stack[n++] = (epicsUInt32)(yn*this->nx + xn);
+                }
+            }
+        }
+        if (spotPixels >= minPixels) numSpots++;
+    }
+    return numSpots;
+}
+
+/** Finds the spots in a frame.
+  * \param[in] pFrame The frame, nx*ny pixels.
+  * \param[in] nx Number of pixels in a row.
+  * \param[in] ny Number of rows.
+  * \param[in] sigma The number of standard deviations above the local background for strong pixels.
+  * \param[in] minPixels The minimum number of connected strong pixels in a spot.
+  * \param[in] pWorkers The worker threads to use.
+  * \param[in] numTasks The number of bands of tiles the frame is divided into.
+  * \return The number of spots, or -1 if memory cannot be allocated. */
+int marCCDSpotFinder::find(const epicsUInt16 *pFrame, size_t nx, size_t ny, double sigma, int minPixels,
+                           marCCDWorkers *pWorkers, int numTasks)
+{
+    size_t numTileRows = (ny + MARCCD_SPOT_TILE_SIZE - 1) / MARCCD_SPOT_TILE_SIZE;
+    
+    if (nx*ny > this->maskSize) {
+        free(this->mask);
+        this->mask = (epicsUInt8 *)malloc(nx*ny);
+        this->maskSize = this->mask ? nx*ny : 0;
+        if (!this->mask) return -1;
+    }
+    if (!this->stack) {
+        this->stackSize = 1024;
+        this->stack = (epicsUInt32 *)malloc(this->stackSize*sizeof(epicsUInt32));
+        if (!this->stack) return -1;
+    }
+    this->pFrame = pFrame;
+    this->nx = nx;
+    this->ny = ny;
+    this->sigma = sigma;
+    if (numTasks < 1) numTasks = 1;
+    if ((size_t)numTasks > numTileRows) numTasks = (int)numTileRows;
+    pWorkers->run(thresholdTaskC, this, numTasks);
+    return countSpots(minPixels);
+}
@@ -0,0 +1,39 @@
+/* marCCDSpots.h
+ *
+ * Bragg spot finding on frames, used to veto blank frames.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_SPOTS_H
+#define MARCCD_SPOTS_H
+
+#include <epicsTypes.h>
+
+#include "marCCDWorkers.h"
+
+/** Size of the tiles in which the local background is computed */
+#define MARCCD_SPOT_TILE_SIZE 32
+
+class marCCDSpotFinder {
+public:
+    marCCDSpotFinder();
+    ~marCCDSpotFinder();
+    int find(const epicsUInt16 *pFrame, size_t nx, size_t ny, double sigma, int minPixels,
+             marCCDWorkers *pWorkers, int numTasks);
+    void thresholdTask(int task, int numTasks); /**< Should be private, but is called from C */
+
+private:
+    int countSpots(int minPixels);
+    const epicsUInt16 *pFrame;
+    size_t nx;
+    size_t ny;
+    double sigma;
+    epicsUInt8 *mask;       /**< 1 for pixels above the threshold */
+    size_t maskSize;
+    epicsUInt32 *stack;     /**< Pixels to visit when finding connected pixels */
+    size_t stackSize;
+};
+
+#endif
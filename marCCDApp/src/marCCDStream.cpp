@@ -0,0 +1,349 @@
+/* marCCDStream.cpp
+ *
+ * TCP server that streams frames to subscribed clients.  See marCCDStream.h for the protocol.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <epicsAtomic.h>
+
+#include "marCCDStream.h"
+#include "marCCDCodec.h"
+#include "marCCDThreads.h"
+
+#define CLIENT_FREE    0
+#define CLIENT_ACTIVE  1
+#define CLIENT_CLOSING 2
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static const char *driverName = "marCCDStream";
+
+static void listenTaskC(void *pvt)
+{
+    marCCDStream *pStream = (marCCDStream *)pvt;
+    
+    marCCDThreadStarted();
+    pStream->listenTask();
+}
+
+static void clientTaskC(void *pvt)
+{
+    marCCDStreamClient *pClient = (marCCDStreamClient *)pvt;
+    
+    marCCDThreadStarted();
+    pClient->pStream->clientTask(pClient);
+    marCCDThreadExiting();
+}
+
+/** Constructor for the streaming server; start() opens the TCP port.
+  * \param[in] interfaceName The IP address to listen on; NULL or "" for 127.0.0.1, "0.0.0.0" for all interfaces.
+  * \param[in] tcpPort The TCP port to listen on.
+  * \param[in] queueSize The maximum number of frames queued for each client. */
+marCCDStream::marCCDStream(const char *interfaceName, int tcpPort, int queueSize)
+    : tcpPort(tcpPort), queueSize(queueSize), listenSock(INVALID_SOCKET), drops(0), bytesSent(0.)
+{
+    int i;
+    
+    if (!interfaceName || !interfaceName[0]) interfaceName = "127.0.0.1";
+    strncpy(this->interfaceName, interfaceName, sizeof(this->interfaceName) - 1);
+    this->interfaceName[sizeof(this->interfaceName) - 1] = 0;
+    if (this->queueSize < 1) this->queueSize = 1;
+    this->lock = epicsMutexMustCreate();
+    for (i=0; i<MARCCD_STREAM_MAX_CLIENTS; i++) {
+        this->clients[i].pStream = this;
+        this->clients[i].sock = INVALID_SOCKET;
+        this->clients[i].active = CLIENT_FREE;
+        this->clients[i].queue = NULL;
+        this->clients[i].name[0] = 0;
+    }
+}
+
+/** Opens the TCP port and starts the thread that accepts connections.
+  * \return 0 on success, -1 on error. */
+int marCCDStream::start()
+{
+    osiSockAddr addr;
+    const char *functionName = "start";
+
+    if (!osiSockAttach()) {
+        printf("%s:%s: osiSockAttach failed\n", driverName, functionName);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    if (aToIPAddr(this->interfaceName, (unsigned short)this->tcpPort, &addr.ia) != 0) {
+        printf("%s:%s: invalid interface %s\n", driverName, functionName, this->interfaceName);
+        return -1;
+    }
+    this->listenSock = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+    if (this->listenSock == INVALID_SOCKET) {
+        printf("%s:%s: error creating socket, errno=%d %s\n", 
+            driverName, functionName, errno, strerror(errno));
+        return -1;
+    }
+    epicsSocketEnableAddressReuseDuringTimeWaitState(this->listenSock);
+    if (bind(this->listenSock, &addr.sa, sizeof(addr.ia)) != 0) {
+        printf("%s:%s: error binding to %s:%d, errno=%d %s\n", 
+            driverName, functionName, this->interfaceName, this->tcpPort, errno, strerror(errno));
+        epicsSocketDestroy(this->listenSock);
+        this->listenSock = INVALID_SOCKET;
+        return -1;
+    }
+    if (listen(this->listenSock, MARCCD_STREAM_MAX_CLIENTS) != 0) {
+        printf("%s:%s: error listening on %s:%d, errno=%d %s\n", 
+            driverName, functionName, this->interfaceName, this->tcpPort, errno, strerror(errno));
+        epicsSocketDestroy(this->listenSock);
+        this->listenSock = INVALID_SOCKET;
+        return -1;
+    }
+    if (!epicsThreadCreate("marCCDStream", epicsThreadPriorityMedium,
+                           epicsThreadGetStackSize(epicsThreadStackMedium),
+                           listenTaskC, this)) {
+        printf("%s:%s: epicsThreadCreate failure\n", driverName, functionName);
+        return -1;
+    }
+    return 0;
+}
+
+/** Accepts connections from clients and starts a thread to send the frames to each one */
+void marCCDStream::listenTask()
+{
+    SOCKET sock;
+    osiSockAddr addr;
+    osiSocklen_t addrSize;
+    marCCDStreamClient *pClient;
+    char threadName[32];
+    int i;
+    const char *functionName = "listenTask";
+
+    while (1) {
+        addrSize = sizeof(addr);
+        sock = epicsSocketAccept(this->listenSock, &addr.sa, &addrSize);
+        if (sock == INVALID_SOCKET) {
+            printf("%s:%s: error accepting connection, errno=%d %s\n", 
+                driverName, functionName, errno, strerror(errno));
+            epicsThreadSleep(1.0);
+            continue;
+        }
+        pClient = NULL;
+        epicsMutexLock(this->lock);
+        for (i=0; i<MARCCD_STREAM_MAX_CLIENTS; i++) {
+            if (this->clients[i].active == CLIENT_FREE) {
+                pClient = &this->clients[i];
+                break;
+            }
+        }
+        epicsMutexUnlock(this->lock);
+        if (!pClient) {
+            printf("%s:%s: too many clients, connection refused\n", driverName, functionName);
+            epicsSocketDestroy(sock);
+            continue;
+        }
+        sockAddrToDottedIP(&addr.sa, pClient->name, sizeof(pClient->name));
+        pClient->sock = sock;
+        pClient->queue = epicsMessageQueueCreate(this->queueSize, sizeof(marCCDStreamPacket *));
+        epicsSnprintf(threadName, sizeof(threadName), "marCCDStream%d", i);
+        epicsMutexLock(this->lock);
+        pClient->active = CLIENT_ACTIVE;
+        epicsMutexUnlock(this->lock);
+        if (!epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                               epicsThreadGetStackSize(epicsThreadStackMedium),
+                               clientTaskC, pClient)) {
+            printf("%s:%s: epicsThreadCreate failure\n", driverName, functionName);
+            epicsMutexLock(this->lock);
+            pClient->active = CLIENT_FREE;
+            epicsMutexUnlock(this->lock);
+            epicsMessageQueueDestroy(pClient->queue);
+            epicsSocketDestroy(sock);
+        }
+    }
+}
+
+/** Sends all of a buffer to a socket.
+  * \return 0 on success, -1 if the connection was closed or there was an error. */
+int marCCDStream::sendAll(SOCKET sock, const char *pData, size_t size)
+{
+    ssize_t nSent;
+    
+    while (size > 0) {
+        nSent = send(sock, pData, size, SEND_FLAGS);
+        if (nSent <= 0) {
+            if ((nSent < 0) && (errno == EINTR)) continue;
+            return -1;
+        }
+        pData += nSent;
+        size -= nSent;
+    }
+    return 0;
+}
+
+/** Sends the queued frames to one client until the connection is closed */
+void marCCDStream::clientTask(marCCDStreamClient *pClient)
+{
+    marCCDStreamPacket *pPacket;
+    const char *pPayload;
+    size_t packetSize;
+    int status;
+    
+    while (1) {
+        epicsMessageQueueReceive(pClient->queue, &pPacket, sizeof(pPacket));
+        pPayload = pPacket->pCompressed ? pPacket->pCompressed : (const char *)pPacket->pArray->pData;
+        status = sendAll(pClient->sock, (const char *)&pPacket->header, sizeof(pPacket->header));
+        if (status == 0) status = sendAll(pClient->sock, pPayload, (size_t)pPacket->header.payloadSize);
+        packetSize = sizeof(pPacket->header) + (size_t)pPacket->header.payloadSize;
+        releasePacket(pPacket);
+        if (status) break;
+        epicsMutexLock(this->lock);
+        this->bytesSent += packetSize;
+        epicsMutexUnlock(this->lock);
+    }
+    /* The client disconnected; stop queueing frames, then free the ones already queued */
+    epicsMutexLock(this->lock);
+    pClient->active = CLIENT_CLOSING;
+    epicsMutexUnlock(this->lock);
+    while (epicsMessageQueueTryReceive(pClient->queue, &pPacket, sizeof(pPacket)) >= 0) {
+        releasePacket(pPacket);
+    }
+    epicsMessageQueueDestroy(pClient->queue);
+    pClient->queue = NULL;
+    epicsSocketDestroy(pClient->sock);
+    pClient->sock = INVALID_SOCKET;
+    epicsMutexLock(this->lock);
+    pClient->active = CLIENT_FREE;
+    epicsMutexUnlock(this->lock);
+}
+
+void marCCDStream::releasePacket(marCCDStreamPacket *pPacket)
+{
+    if (epicsAtomicDecrIntT(&pPacket->refCount) > 0) return;
+    if (pPacket->pArray) pPacket->pArray->release();
+    free(pPacket->pCompressed);
+    free(pPacket);
+}
+
+/** Queues a frame for all connected clients.  Clients whose queue is full do not get the frame.
+  * \param[in] pArray The frame.
+  * \param[in] codec The marCCDCodec_t to compress the pixel data with.
+  * \return The number of clients the frame was queued for. */
+int marCCDStream::publish(NDArray *pArray, int codec)
+{
+    marCCDStreamPacket *pPacket;
+    NDArrayInfo_t arrayInfo;
+    size_t maxSize, compressedSize=0;
+    int numQueued = 0;
+    int i;
+
+    if (getNumClients() == 0) return 0;
+    pArray->getInfo(&arrayInfo);
+    pPacket = (marCCDStreamPacket *)calloc(1, sizeof(marCCDStreamPacket));
+    if (!pPacket) return 0;
+    if ((codec != marCCDCodecNone) && marCCDCodecAvailable(codec)) {
+        maxSize = marCCDCodecBound(codec, arrayInfo.totalBytes, arrayInfo.bytesPerElement);
+        pPacket->pCompressed = (char *)malloc(maxSize);
+        if (pPacket->pCompressed) {
+            compressedSize = marCCDCodecCompress(codec, pArray->pData, arrayInfo.totalBytes, 
+                                                 arrayInfo.bytesPerElement, pPacket->pCompressed, maxSize,
+                                                 NULL, 1);
+        }
+    }
+    if (compressedSize == 0) {
+        /* Send the frame itself without copying it */
+        free(pPacket->pCompressed);
+        pPacket->pCompressed = NULL;
+        codec = marCCDCodecNone;
+        pArray->reserve();
+        pPacket->pArray = pArray;
+    }
+    pPacket->header.magic = MARCCD_STREAM_MAGIC;
+    pPacket->header.version = MARCCD_STREAM_VERSION;
+    pPacket->header.headerSize = sizeof(marCCDStreamHeader);
+    pPacket->header.dataType = pArray->dataType;
+    pPacket->header.ndims = pArray->ndims;
+    pPacket->header.codec = codec;
+    pPacket->header.dims[0] = pArray->dims[0].size;
+    pPacket->header.dims[1] = (pArray->ndims > 1) ? pArray->dims[1].size : 1;
+    pPacket->header.uniqueId = pArray->uniqueId;
+    pPacket->header.epicsTSSec = pArray->epicsTS.secPastEpoch;
+    pPacket->header.epicsTSNsec = pArray->epicsTS.nsec;
+    pPacket->header.timeStamp = pArray->timeStamp;
+    pPacket->header.uncompressedSize = arrayInfo.totalBytes;
+    pPacket->header.payloadSize = pPacket->pCompressed ? compressedSize : arrayInfo.totalBytes;
+    
+    /* This function holds one reference until all clients have been given the packet */
+    pPacket->refCount = 1;
+    epicsMutexLock(this->lock);
+    for (i=0; i<MARCCD_STREAM_MAX_CLIENTS; i++) {
+        if (this->clients[i].active != CLIENT_ACTIVE) continue;
+        epicsAtomicIncrIntT(&pPacket->refCount);
+        if (epicsMessageQueueTrySend(this->clients[i].queue, &pPacket, sizeof(pPacket)) != 0) {
+            epicsAtomicDecrIntT(&pPacket->refCount);
+            this->drops++;
+        } else {
+            numQueued++;
+        }
+    }
+    epicsMutexUnlock(this->lock);
+    releasePacket(pPacket);
+    return numQueued;
+}
+
+int marCCDStream::getNumClients()
+{
+    int i, numClients = 0;
+    
+    epicsMutexLock(this->lock);
+    for (i=0; i<MARCCD_STREAM_MAX_CLIENTS; i++) {
+        if (this->clients[i].active == CLIENT_ACTIVE) numClients++;
+    }
+    epicsMutexUnlock(this->lock);
+    return numClients;
+}
+
+/** Returns the number of frames that were not sent to a client because its queue was full */
+epicsUInt32 marCCDStream::getDrops()
+{
+    epicsUInt32 value;
+    
+    epicsMutexLock(this->lock);
+    value = this->drops;
+    epicsMutexUnlock(this->lock);
+    return value;
+}
+
+/** Returns the total number of bytes sent to all clients */
+double marCCDStream::getBytesSent()
+{
+    double value;
+    
+    epicsMutexLock(this->lock);
+    value = this->bytesSent;
+    epicsMutexUnlock(this->lock);
+    return value;
+}
+
+void marCCDStream::report(FILE *fp)
+{
+    int i;
+    
+    fprintf(fp, "  Streaming server: %s:%d, queue size %d, %u frames dropped, %.0f bytes sent\n",
+        this->interfaceName, this->tcpPort, this->queueSize, getDrops(), getBytesSent());
+    epicsMutexLock(this->lock);
+    for (i=0; i<MARCCD_STREAM_MAX_CLIENTS; i++) {
+        if (this->clients[i].active != CLIENT_ACTIVE) continue;
+        fprintf(fp, "    client %s, %d frames queued\n", 
+            this->clients[i].name, epicsMessageQueuePending(this->clients[i].queue));
+    }
+    epicsMutexUnlock(this->lock);
+}
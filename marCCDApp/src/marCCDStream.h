@@ -0,0 +1,92 @@
+/* marCCDStream.h
+ *
+ * TCP server that streams frames to subscribed clients.
+ *
+ * Each client that connects receives every frame published after it connects, as a 
+ * marCCDStreamHeader followed by payloadSize bytes of pixel data, raw or compressed with 
+ * the codec in the header.  All fields are in the byte order of the IOC host.  
+ * Each client has a bounded queue of frames; when a client does not keep up and its queue 
+ * is full, frames are dropped for that client only.  The server listens on 127.0.0.1 unless
+ * another interface is given, since the frames are sent to any client without authentication.
+ * marCCDStreamReader is a client for testing.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_STREAM_H
+#define MARCCD_STREAM_H
+
+#include <stdio.h>
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <epicsMessageQueue.h>
+#include <osiSock.h>
+
+#include "NDArray.h"
+
+#define MARCCD_STREAM_MAGIC   0x5352414d /* "MARS" */
+#define MARCCD_STREAM_VERSION 1
+#define MARCCD_STREAM_MAX_CLIENTS 8
+
+typedef struct {
+    epicsUInt32 magic;
+    epicsUInt32 version;
+    epicsUInt32 headerSize;         /**< sizeof(marCCDStreamHeader) */
+    epicsUInt32 dataType;           /**< NDDataType_t */
+    epicsUInt32 ndims;
+    epicsUInt32 codec;              /**< marCCDCodec_t */
+    epicsUInt64 dims[2];
+    epicsInt32 uniqueId;
+    epicsUInt32 epicsTSSec;
+    epicsUInt32 epicsTSNsec;
+    epicsUInt32 reserved;
+    double timeStamp;
+    epicsUInt64 uncompressedSize;   /**< Size of the pixel data in bytes */
+    epicsUInt64 payloadSize;        /**< Number of bytes following the header */
+} marCCDStreamHeader;
+
+/** A frame queued for sending to one or more clients */
+typedef struct {
+    marCCDStreamHeader header;
+    NDArray *pArray;                /**< Reserved frame sent when the payload is not compressed */
+    char *pCompressed;              /**< Compressed payload, or NULL */
+    int refCount;
+} marCCDStreamPacket;
+
+class marCCDStream;
+
+typedef struct {
+    marCCDStream *pStream;
+    SOCKET sock;
+    int active;
+    epicsMessageQueueId queue;
+    char name[64];
+} marCCDStreamClient;
+
+class marCCDStream {
+public:
+    marCCDStream(const char *interfaceName, int tcpPort, int queueSize);
+    int start();
+    int publish(NDArray *pArray, int codec);
+    int getNumClients();
+    epicsUInt32 getDrops();
+    double getBytesSent();
+    void report(FILE *fp);
+    void listenTask();                          /**< Should be private, but is called from C */
+    void clientTask(marCCDStreamClient *pClient); /**< Should be private, but is called from C */
+
+private:
+    void releasePacket(marCCDStreamPacket *pPacket);
+    int sendAll(SOCKET sock, const char *pData, size_t size);
+    char interfaceName[64];
+    int tcpPort;
+    int queueSize;
+    SOCKET listenSock;
+    epicsMutexId lock;
+    marCCDStreamClient clients[MARCCD_STREAM_MAX_CLIENTS];
+    epicsUInt32 drops;
+    double bytesSent;
+};
+
+#endif
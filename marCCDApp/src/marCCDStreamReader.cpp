@@ -0,0 +1,205 @@
+/* marCCDStreamReader.cpp
+ *
+ * Client of the streaming server started with marCCDStreamConfig, for testing the server and
+ * measuring its throughput.  It connects, reads frames and checks each header, and prints a summary.
+ *
+ * Usage: marCCDStreamReader [-a address] [-p port] [-n frames] [-v]
+ *   -a  Address of the IOC, default 127.0.0.1
+ *   -p  TCP port of the server, default 5700
+ *   -n  Number of frames to read, default 0 reads until the server closes the connection
+ *   -v  Print the header of each frame
+ *
+ * A frame fails the check if the magic number, version or header size is wrong, if an uncompressed
+ * payload does not have the size given by the dimensions and data type, or if the payload is larger
+ * than allowed.  Gaps in uniqueId are counted; they are the frames the server dropped for this client
+ * because it did not keep up, or that were vetoed.  The exit status is 1 if any frame failed the check
+ * or the connection could not be made.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <osiSock.h>
+
+#include "marCCDStream.h"
+
+#define DEFAULT_PORT 5700
+/** Largest payload that is accepted, to catch a corrupt header before allocating it */
+#define MAX_PAYLOAD ((epicsUInt64)1 << 32)
+
+static int verbose = 0;
+
+/** Reads exactly size bytes.
+  * \return 0 on success, 1 if the connection was closed before any byte was read, -1 on error or a short read. */
+static int recvAll(SOCKET sock, char *pData, size_t size)
+{
+    ssize_t nRead;
+    size_t total = 0;
+
+    while (total < size) {
+        nRead = recv(sock, pData + total, size - total, 0);
+        if (nRead < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (nRead == 0) return (total == 0) ? 1 : -1;
+        total += nRead;
+    }
+    return 0;
+}
+
+/** Returns the size of a pixel of an NDDataType_t, or 0 if the type is not one the driver sends */
+static size_t elementSize(epicsUInt32 dataType)
+{
+    switch (dataType) {
+        case NDUInt16:  return sizeof(epicsUInt16);
+        case NDUInt32:  return sizeof(epicsUInt32);
+        case NDFloat32: return sizeof(epicsFloat32);
+        default:        return 0;
+    }
+}
+
+/** Checks a header.
+  * \return NULL if it is valid, or the reason it is not. */
+static const char *checkHeader(const marCCDStreamHeader *pHeader)
+{
+    epicsUInt64 expected;
+
+    if (pHeader->magic != MARCCD_STREAM_MAGIC) return "bad magic number";
+    if (pHeader->version != MARCCD_STREAM_VERSION) return "unsupported version";
+    if (pHeader->headerSize != sizeof(marCCDStreamHeader)) return "bad header size";
+    if ((pHeader->ndims < 1) || (pHeader->ndims > 2)) return "bad number of dimensions";
+    if (elementSize(pHeader->dataType) == 0) return "bad data type";
+    expected = pHeader->dims[0] * pHeader->dims[1] * elementSize(pHeader->dataType);
+    if (pHeader->uncompressedSize != expected) return "uncompressed size does not match the dimensions";
+    if (pHeader->payloadSize > MAX_PAYLOAD) return "payload too large";
+    if ((pHeader->codec == 0) && (pHeader->payloadSize != expected)) return "payload size does not match the dimensions";
+    return NULL;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-n frames] [-v]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *address = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    int maxFrames = 0;
+    int opt, status;
+    int numFrames = 0, numBad = 0, numCompressed = 0;
+    epicsInt32 lastId = 0;
+    long gaps = 0;
+    double bytes = 0., uncompressedBytes = 0., elapsed;
+    const char *reason;
+    char *pPayload = NULL;
+    size_t payloadAlloc = 0;
+    marCCDStreamHeader header;
+    osiSockAddr addr;
+    SOCKET sock;
+    epicsTimeStamp tStart, tEnd;
+
+    while ((opt = getopt(argc, argv, "a:p:n:v")) != -1) {
+        switch (opt) {
+            case 'a': address = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': maxFrames = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if ((optind != argc) || (port <= 0) || (maxFrames < 0)) usage(argv[0]);
+    if (!osiSockAttach()) {
+        fprintf(stderr, "osiSockAttach failed\n");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    if (aToIPAddr(address, (unsigned short)port, &addr.ia) != 0) {
+        fprintf(stderr, "invalid address %s\n", address);
+        return 1;
+    }
+    sock = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        fprintf(stderr, "error creating socket: %s\n", strerror(errno));
+        return 1;
+    }
+    if (connect(sock, &addr.sa, sizeof(addr.ia)) != 0) {
+        fprintf(stderr, "error connecting to %s:%d: %s\n", address, port, strerror(errno));
+        epicsSocketDestroy(sock);
+        return 1;
+    }
+    printf("connected to %s:%d\n", address, port);
+
+    while ((maxFrames == 0) || (numFrames < maxFrames)) {
+        status = recvAll(sock, (char *)&header, sizeof(header));
+        if (status == 1) break;
+        if (status) {
+            fprintf(stderr, "connection closed in a frame header\n");
+            numBad++;
+            break;
+        }
+        reason = checkHeader(&header);
+        if (reason) {
+            /* The stream cannot be resynchronized without a valid payload size */
+            fprintf(stderr, "frame %d: %s\n", numFrames + 1, reason);
+            numBad++;
+            break;
+        }
+        if (header.payloadSize > payloadAlloc) {
+            free(pPayload);
+            payloadAlloc = (size_t)header.payloadSize;
+            pPayload = (char *)malloc(payloadAlloc);
+            if (!pPayload) {
+                fprintf(stderr, "cannot allocate %lu bytes\n", (unsigned long)payloadAlloc);
+                numBad++;
+                break;
+            }
+        }
+        if (recvAll(sock, pPayload, (size_t)header.payloadSize)) {
+            fprintf(stderr, "connection closed in the pixel data of frame %d\n", header.uniqueId);
+            numBad++;
+            break;
+        }
+        /* The rates are measured from the end of the first frame, so they do not include the time
+         * before acquisition started */
+        epicsTimeGetCurrent(&tEnd);
+        if (numFrames == 0) {
+            tStart = tEnd;
+        } else {
+            bytes += sizeof(header) + header.payloadSize;
+            uncompressedBytes += header.uncompressedSize;
+        }
+        if ((numFrames > 0) && (header.uniqueId > lastId + 1)) gaps += header.uniqueId - lastId - 1;
+        lastId = header.uniqueId;
+        if (header.codec != 0) numCompressed++;
+        numFrames++;
+        if (verbose) {
+            printf("frame %d: uniqueId=%d %lux%lu dataType=%u codec=%u payload=%lu bytes timeStamp=%.6f\n",
+                numFrames, header.uniqueId, (unsigned long)header.dims[0], (unsigned long)header.dims[1],
+                header.dataType, header.codec, (unsigned long)header.payloadSize, header.timeStamp);
+        }
+    }
+    epicsSocketDestroy(sock);
+    free(pPayload);
+
+    printf("%d frames, %d compressed, %ld uniqueId gaps, %d failed the check\n",
+        numFrames, numCompressed, gaps, numBad);
+    if (numFrames > 1) {
+        elapsed = epicsTimeDiffInSeconds(&tEnd, &tStart);
+        if (elapsed > 0.) {
+            printf("%.1f frames/s, %.1f MB/s received, %.1f MB/s of pixels\n",
+                (numFrames - 1) / elapsed, bytes / elapsed / 1.e6, uncompressedBytes / elapsed / 1.e6);
+        }
+    }
+    return (numBad > 0) ? 1 : 0;
+}
@@ -0,0 +1,332 @@
+/* marCCDThreads.cpp
+ *
+ * Registry of the driver threads, so their priority and CPU affinity can be set from the
+ * IOC shell and reported.
+ *
+ * Each thread calls marCCDThreadStarted when it starts, which applies the rules that match its name.
+ * Rules added later are applied to the threads that are already running.  The CPU affinity also
+ * decides where the frame buffers live: Linux puts a page on the NUMA node of the thread that first
+ * writes it, and the reader thread is the first to write each new NDArray, so the driver empties
+ * the free list of its NDArrayPool when the placement changes.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsStdio.h>
+
+#include "marCCDThreads.h"
+
+static const char *driverName = "marCCDThreads";
+
+#define MAX_THREADS 64
+#define MAX_RULES   32
+#define MAX_CPUS    1024
+
+typedef struct {
+    char name[32];
+    epicsThreadId threadId;
+    pthread_t pthreadId;
+    long tid;                   /**< Linux thread id, for /proc */
+    int active;
+} marCCDThreadEntry;
+
+typedef struct {
+    char pattern[32];           /**< Thread name, or a prefix followed by '*' */
+    int priority;               /**< EPICS priority, or -1 to leave it unchanged */
+    int numCpus;                /**< Number of CPUs in cpus, 0 to leave the affinity unchanged */
+    short cpus[MAX_CPUS];
+} marCCDThreadRule;
+
+static epicsMutexId registryMutex;
+static epicsThreadOnceId registryOnce = EPICS_THREAD_ONCE_INIT;
+static marCCDThreadEntry threads[MAX_THREADS];
+static marCCDThreadRule rules[MAX_RULES];
+static int numRules;
+static int generation;
+
+static void registryInit(void *arg)
+{
+    registryMutex = epicsMutexMustCreate();
+}
+
+static int ruleMatches(const marCCDThreadRule *pRule, const char *name)
+{
+    size_t len = strlen(pRule->pattern);
+
+    if ((len > 0) && (pRule->pattern[len-1] == '*')) return strncmp(pRule->pattern, name, len-1) == 0;
+    return strcmp(pRule->pattern, name) == 0;
+}
+
+/** Applies a rule to a thread; called with registryMutex held */
+static void applyRule(const marCCDThreadRule *pRule, marCCDThreadEntry *pThread)
+{
+    static const char *functionName = "applyRule";
+
+    if (pRule->priority >= 0) epicsThreadSetPriority(pThread->threadId, pRule->priority);
+#ifdef CPU_SET
+    if (pRule->numCpus > 0) {
+        cpu_set_t cpuSet;
+        int i, status;
+
+        CPU_ZERO(&cpuSet);
+        for (i=0; i<pRule->numCpus; i++) CPU_SET(pRule->cpus[i], &cpuSet);
+        status = pthread_setaffinity_np(pThread->pthreadId, sizeof(cpuSet), &cpuSet);
+        if (status) {
+            printf("%s:%s: error setting CPU affinity of %s, errno=%d\n",
+                driverName, functionName, pThread->name, status);
+        }
+    }
+#else
+    if (pRule->numCpus > 0) {
+        printf("%s:%s: CPU affinity is not supported on this OS, %s is not pinned\n",
+            driverName, functionName, pThread->name);
+    }
+#endif
+}
+
+/** Adds the calling thread to the registry and applies the rules that match its name.
+  * It must be called from the thread function of each driver thread. */
+void marCCDThreadStarted()
+{
+    marCCDThreadEntry *pThread = NULL;
+    int i;
+
+    epicsThreadOnce(&registryOnce, registryInit, NULL);
+    epicsMutexLock(registryMutex);
+    for (i=0; i<MAX_THREADS; i++) {
+        if (!threads[i].active) {
+            pThread = &threads[i];
+            break;
+        }
+    }
+    if (pThread) {
+        strncpy(pThread->name, epicsThreadGetNameSelf(), sizeof(pThread->name) - 1);
+        pThread->name[sizeof(pThread->name) - 1] = 0;
+        pThread->threadId = epicsThreadGetIdSelf();
+        pThread->pthreadId = pthread_self();
+#ifdef SYS_gettid
+        pThread->tid = syscall(SYS_gettid);
+#else
+        pThread->tid = 0;
+#endif
+        pThread->active = 1;
+        for (i=0; i<numRules; i++) {
+            if (ruleMatches(&rules[i], pThread->name)) applyRule(&rules[i], pThread);
+        }
+    }
+    epicsMutexUnlock(registryMutex);
+}
+
+/** Removes the calling thread from the registry; it must be called before a thread function returns */
+void marCCDThreadExiting()
+{
+    epicsThreadId threadId = epicsThreadGetIdSelf();
+    int i;
+
+    epicsThreadOnce(&registryOnce, registryInit, NULL);
+    epicsMutexLock(registryMutex);
+    for (i=0; i<MAX_THREADS; i++) {
+        if (threads[i].active && (threads[i].threadId == threadId)) threads[i].active = 0;
+    }
+    epicsMutexUnlock(registryMutex);
+}
+
+/** Parses a list of CPUs like "0-7,16-23".
+  * \return The number of CPUs, or -1 if the list is not valid. */
+static int parseCpuList(const char *cpuList, short *cpus)
+{
+    const char *p = cpuList;
+    char *pEnd;
+    long first, last, cpu;
+    int numCpus = 0;
+
+    while (*p) {
+        first = strtol(p, &pEnd, 10);
+        if ((pEnd == p) || (first < 0) || (first >= MAX_CPUS)) return -1;
+        last = first;
+        p = pEnd;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &pEnd, 10);
+            if ((pEnd == p) || (last < first) || (last >= MAX_CPUS)) return -1;
+            p = pEnd;
+        }
+        for (cpu=first; (cpu<=last) && (numCpus < MAX_CPUS); cpu++) cpus[numCpus++] = (short)cpu;
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return numCpus;
+}
+
+/** Sets the priority and CPU affinity of the driver threads.  The rule applies to the running
+  * threads and to the threads started later.  When several rules match a thread, they are applied
+  * in the order they were added.
+  * \param[in] pattern The name of the thread, or a prefix followed by '*', e.g. "marCCDWorker*".
+  * \param[in] priority The EPICS priority from 0 to 99, or -1 to leave it unchanged.
+  * \param[in] cpuList The CPUs the thread may run on, e.g. "0-7,16-23", or "" to leave it unchanged.
+  * \return 0 on success, -1 if the arguments are not valid. */
+int marCCDThreadConfig(const char *pattern, int priority, const char *cpuList)
+{
+    marCCDThreadRule *pRule;
+    int i, numMatched = 0;
+    static const char *functionName = "marCCDThreadConfig";
+
+    if (!pattern || !pattern[0] || (strlen(pattern) >= sizeof(pRule->pattern)) ||
+        (priority < -1) || (priority > epicsThreadPriorityMax)) {
+        printf("%s:%s: invalid thread name or priority\n", driverName, functionName);
+        return -1;
+    }
+    epicsThreadOnce(&registryOnce, registryInit, NULL);
+    epicsMutexLock(registryMutex);
+    if (numRules >= MAX_RULES) {
+        epicsMutexUnlock(registryMutex);
+        printf("%s:%s: too many rules\n", driverName, functionName);
+        return -1;
+    }
+    pRule = &rules[numRules];
+    strcpy(pRule->pattern, pattern);
+    pRule->priority = priority;
+    pRule->numCpus = parseCpuList(cpuList ? cpuList : "", pRule->cpus);
+    if (pRule->numCpus < 0) {
+        epicsMutexUnlock(registryMutex);
+        printf("%s:%s: invalid CPU list \"%s\"\n", driverName, functionName, cpuList);
+        return -1;
+    }
+    numRules++;
+    for (i=0; i<MAX_THREADS; i++) {
+        if (threads[i].active && ruleMatches(pRule, threads[i].name)) {
+            applyRule(pRule, &threads[i]);
+            numMatched++;
+        }
+    }
+    generation++;
+    epicsMutexUnlock(registryMutex);
+    if (numMatched == 0) {
+        printf("%s:%s: no running thread matches %s, the rule applies to threads started later\n",
+            driverName, functionName, pattern);
+    }
+    return 0;
+}
+
+/** Returns a number that changes each time a rule is added, so the driver knows when the
+  * placement of its threads has changed */
+int marCCDThreadGeneration()
+{
+    int value;
+
+    epicsThreadOnce(&registryOnce, registryInit, NULL);
+    epicsMutexLock(registryMutex);
+    value = generation;
+    epicsMutexUnlock(registryMutex);
+    return value;
+}
+
+#ifdef __linux__
+/** Returns the CPU a thread last ran on, from /proc, or -1 */
+static int lastCpu(long tid)
+{
+    char fileName[64], buffer[1024];
+    char *p;
+    FILE *fp;
+    size_t len;
+    int field, cpu = -1;
+
+    epicsSnprintf(fileName, sizeof(fileName), "/proc/self/task/%ld/stat", tid);
+    fp = fopen(fileName, "r");
+    if (!fp) return -1;
+    len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    fclose(fp);
+    buffer[len] = 0;
+    /* The name in field 2 can contain spaces; it ends with the last ')'.  The CPU is field 39. */
+    p = strrchr(buffer, ')');
+    if (!p) return -1;
+    for (field=2; p && (field < 39); field++) p = strchr(p + 1, ' ');
+    if (p) cpu = atoi(p + 1);
+    return cpu;
+}
+
+/** Returns the NUMA node of a CPU, from /sys, or -1 */
+static int cpuNode(int cpu)
+{
+    char dirName[64];
+    DIR *pDir;
+    struct dirent *pEntry;
+    int node = -1;
+
+    epicsSnprintf(dirName, sizeof(dirName), "/sys/devices/system/cpu/cpu%d", cpu);
+    pDir = opendir(dirName);
+    if (!pDir) return -1;
+    while ((pEntry = readdir(pDir))) {
+        if ((strncmp(pEntry->d_name, "node", 4) == 0) && (pEntry->d_name[4] >= '0') && (pEntry->d_name[4] <= '9')) {
+            node = atoi(pEntry->d_name + 4);
+            break;
+        }
+    }
+    closedir(pDir);
+    return node;
+}
+#endif
+
+/** Prints the priority, CPU affinity and the CPU and NUMA node last used by each thread */
+void marCCDThreadReport(FILE *fp)
+{
+    marCCDThreadEntry *pThread;
+    char cpus[128];
+    int i;
+
+    epicsThreadOnce(&registryOnce, registryInit, NULL);
+    epicsMutexLock(registryMutex);
+    fprintf(fp, "  Threads:\n");
+    for (i=0; i<MAX_THREADS; i++) {
+        pThread = &threads[i];
+        if (!pThread->active) continue;
+        strcpy(cpus, "all");
+#ifdef CPU_SET
+        {
+            cpu_set_t cpuSet;
+            int cpu, first = -1, numCpus = 0, len = 0;
+
+            if ((pthread_getaffinity_np(pThread->pthreadId, sizeof(cpuSet), &cpuSet) == 0) &&
+                (CPU_COUNT(&cpuSet) < sysconf(_SC_NPROCESSORS_CONF))) {
+                /* Print the CPUs as ranges */
+                for (cpu=0; cpu<=CPU_SETSIZE; cpu++) {
+                    if ((cpu < CPU_SETSIZE) && CPU_ISSET(cpu, &cpuSet)) {
+                        if (first < 0) first = cpu;
+                        continue;
+                    }
+                    if (first < 0) continue;
+                    if (len < (int)sizeof(cpus)) {
+                        len += epicsSnprintf(cpus + len, sizeof(cpus) - len, (cpu-1 > first) ? "%s%d-%d" : "%s%d",
+                                             numCpus ? "," : "", first, cpu-1);
+                    }
+                    numCpus++;
+                    first = -1;
+                }
+            }
+        }
+#endif
+        fprintf(fp, "    %-20s priority %2u  CPUs %s", pThread->name, epicsThreadGetPriority(pThread->threadId), cpus);
+#ifdef __linux__
+        {
+            int cpu = lastCpu(pThread->tid);
+            if (cpu >= 0) fprintf(fp, "  last ran on CPU %d, node %d", cpu, cpuNode(cpu));
+        }
+#endif
+        fprintf(fp, "\n");
+    }
+    epicsMutexUnlock(registryMutex);
+}
@@ -0,0 +1,21 @@
+/* marCCDThreads.h
+ *
+ * Registry of the driver threads, so their priority and CPU affinity can be set from the
+ * IOC shell and reported.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_THREADS_H
+#define MARCCD_THREADS_H
+
+#include <stdio.h>
+
+void marCCDThreadStarted();
+void marCCDThreadExiting();
+int marCCDThreadConfig(const char *pattern, int priority, const char *cpuList);
+int marCCDThreadGeneration();
+void marCCDThreadReport(FILE *fp);
+
+#endif
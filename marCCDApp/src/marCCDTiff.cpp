@@ -0,0 +1,355 @@
+/* marCCDTiff.cpp
+ *
+ * Decoding of the TIFF files written by the marccd server, shared by the driver and the
+ * marCCDTiffBench benchmark, and a writer of synthetic files with the same layout.
+ * Files can be read with O_DIRECT into memory and decoded from there, so they do not fill
+ * the page cache.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <epicsTypes.h>
+
+#include "marCCDTiff.h"
+
+/** Decodes the strips of an open TIFF file into a buffer, in order.
+  * \param[in] tiff The TIFF file.
+  * \param[out] pData The buffer.
+  * \param[in] dataSize The size of the buffer in bytes; decoding stops when it is full.
+  * \param[in] func If not NULL, called after each strip is decoded.
+  * \param[in] pvt Passed to func.
+  * \return The number of bytes decoded, or -1 if a strip could not be read, which is usually
+  *         because the file has not been completely written yet. */
+ssize_t marCCDTiffReadStrips(TIFF *tiff, void *pData, size_t dataSize,
+                             marCCDTiffStripFunc func, void *pvt)
+{
+    char *buffer = (char *)pData;
+    size_t totalSize = 0;
+    tsize_t size;
+    int numStrips, strip;
+
+    numStrips = TIFFNumberOfStrips(tiff);
+    for (strip=0; (strip < numStrips) && (totalSize < dataSize); strip++) {
+        size = TIFFReadEncodedStrip(tiff, strip, buffer, dataSize-totalSize);
+        if (size == -1) return -1;
+        buffer += size;
+        totalSize += size;
+        if (func) func(pvt, totalSize);
+    }
+    return totalSize;
+}
+
+/** A TIFF file in memory, for marCCDTiffOpenMemory */
+typedef struct {
+    const char *pData;
+    toff_t size;
+    toff_t offset;
+} marCCDTiffMemory;
+
+static tsize_t memoryRead(thandle_t handle, tdata_t pBuffer, tsize_t size)
+{
+    marCCDTiffMemory *pMemory = (marCCDTiffMemory *)handle;
+
+    if (pMemory->offset >= pMemory->size) return 0;
+    if ((toff_t)size > pMemory->size - pMemory->offset) size = (tsize_t)(pMemory->size - pMemory->offset);
+    memcpy(pBuffer, pMemory->pData + pMemory->offset, size);
+    pMemory->offset += size;
+    return size;
+}
+
+static tsize_t memoryWrite(thandle_t handle, tdata_t pBuffer, tsize_t size)
+{
+    return 0;
+}
+
+static toff_t memorySeek(thandle_t handle, toff_t offset, int whence)
+{
+    marCCDTiffMemory *pMemory = (marCCDTiffMemory *)handle;
+
+    switch (whence) {
+        case SEEK_SET: pMemory->offset = offset; break;
+        case SEEK_CUR: pMemory->offset += offset; break;
+        case SEEK_END: pMemory->offset = pMemory->size + offset; break;
+        default: return (toff_t)-1;
+    }
+    return pMemory->offset;
+}
+
+static int memoryClose(thandle_t handle)
+{
+    free(handle);
+    return 0;
+}
+
+static toff_t memorySize(thandle_t handle)
+{
+    return ((marCCDTiffMemory *)handle)->size;
+}
+
+static int memoryMap(thandle_t handle, tdata_t *ppBase, toff_t *pSize)
+{
+    marCCDTiffMemory *pMemory = (marCCDTiffMemory *)handle;
+
+    *ppBase = (tdata_t)pMemory->pData;
+    *pSize = pMemory->size;
+    return 1;
+}
+
+static void memoryUnmap(thandle_t handle, tdata_t pBase, toff_t size)
+{
+}
+
+/** Opens a TIFF file that has been read into memory.  The strips are decoded straight from the
+  * memory, which must not be freed until the file is closed.
+  * \param[in] name The name of the file, for error messages.
+  * \param[in] pData The contents of the file.
+  * \param[in] size The size of the file in bytes.
+  * \return The TIFF file, or NULL if it is not valid. */
+TIFF *marCCDTiffOpenMemory(const char *name, const void *pData, size_t size)
+{
+    marCCDTiffMemory *pMemory;
+    TIFF *tiff;
+
+    pMemory = (marCCDTiffMemory *)malloc(sizeof(*pMemory));
+    if (!pMemory) return NULL;
+    pMemory->pData = (const char *)pData;
+    pMemory->size = size;
+    pMemory->offset = 0;
+    tiff = TIFFClientOpen(name, "rc", (thandle_t)pMemory, memoryRead, memoryWrite, memorySeek,
+                          memoryClose, memorySize, memoryMap, memoryUnmap);
+    if (!tiff) free(pMemory);
+    return tiff;
+}
+
+/** Reads a complete file with O_DIRECT, so it does not go through the page cache.  If the file
+  * system does not support O_DIRECT the file is read normally and then dropped from the page cache.
+  * \param[in] fileName The name of the file.
+  * \param[out] pBuffer The buffer, which must be aligned to MARCCD_TIFF_DIRECT_ALIGN.
+  * \param[in] bufferSize The size of the buffer, which must be a multiple of MARCCD_TIFF_DIRECT_ALIGN.
+  * \return The size of the file, or -1 on error or if the file is larger than the buffer. */
+ssize_t marCCDTiffReadDirect(const char *fileName, void *pBuffer, size_t bufferSize)
+{
+    struct stat statBuff;
+    ssize_t size, totalSize = 0;
+    int direct = 1;
+    int fd;
+
+#ifdef O_DIRECT
+    fd = open(fileName, O_RDONLY | O_DIRECT);
+    if ((fd < 0) && (errno == EINVAL)) {
+        direct = 0;
+        fd = open(fileName, O_RDONLY);
+    }
+#else
+    direct = 0;
+    fd = open(fileName, O_RDONLY);
+#endif
+    if (fd < 0) return -1;
+    if ((fstat(fd, &statBuff) != 0) || ((size_t)statBuff.st_size > bufferSize)) {
+        close(fd);
+        return -1;
+    }
+    /* With O_DIRECT each read must be a multiple of the alignment; the last one is short at the end of the file */
+    while ((size_t)totalSize < bufferSize) {
+        size = read(fd, (char *)pBuffer + totalSize, bufferSize - totalSize);
+        if (size < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        if (size == 0) break;
+        totalSize += size;
+        if (direct && (totalSize % MARCCD_TIFF_DIRECT_ALIGN)) break;
+    }
+    close(fd);
+    if (!direct) marCCDTiffDropCache(fileName);
+    return totalSize;
+}
+
+/** Returns how much of a file is in the page cache.
+  * \param[in] fd The open file.
+  * \param[in] fileSize The size of the file in bytes.
+  * \return The number of bytes of the file that are in the page cache. */
+size_t marCCDTiffCachedBytes(int fd, size_t fileSize)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t numPages = (fileSize + pageSize - 1) / pageSize;
+    size_t cached = 0, i;
+    unsigned char *pVec;
+    void *pMap;
+
+    if (fileSize == 0) return 0;
+    pMap = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (pMap == MAP_FAILED) return 0;
+    pVec = (unsigned char *)malloc(numPages);
+    /* The vector is char * on macOS and unsigned char * on Linux */
+#ifdef __APPLE__
+    if (pVec && (mincore(pMap, fileSize, (char *)pVec) == 0)) {
+#else
+    if (pVec && (mincore(pMap, fileSize, pVec) == 0)) {
+#endif
+        for (i=0; i<numPages; i++) {
+            if (pVec[i] & 1) cached += pageSize;
+        }
+        if (cached > fileSize) cached = fileSize;
+    }
+    free(pVec);
+    munmap(pMap, fileSize);
+    return cached;
+}
+
+/** Asks the kernel to start reading a file into the page cache in the background.
+  * \param[in] fileName The name of the file.
+  * \return 0 on success, -1 if the file does not exist yet. */
+int marCCDTiffReadahead(const char *fileName)
+{
+    int fd;
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) return -1;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+    return 0;
+}
+
+/** Asks the kernel to drop a file from the page cache.  Pages that are mapped are not dropped.
+  * \param[in] fileName The name of the file.
+  * \return 0 on success, -1 if the file does not exist. */
+int marCCDTiffDropCache(const char *fileName)
+{
+    int fd;
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) return -1;
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+    return 0;
+}
+
+/** Reads the image size from the header of a TIFF file.
+  * \param[in] fileName The name of the file.
+  * \param[out] pNx The number of pixels in a row.
+  * \param[out] pNy The number of rows.
+  * \return 0 on success, -1 if the file cannot be opened or is not a TIFF file. */
+int marCCDTiffGetSize(const char *fileName, int *pNx, int *pNy)
+{
+    TIFF *tiff;
+    epicsUInt32 nx=0, ny=0;
+
+    tiff = TIFFOpen(fileName, "rc");
+    if (!tiff) return -1;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &nx);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &ny);
+    TIFFClose(tiff);
+    if ((nx == 0) || (ny == 0)) return -1;
+    *pNx = nx;
+    *pNy = ny;
+    return 0;
+}
+
+/** Random number generator for the synthetic frames, so they do not depend on the C library */
+static epicsUInt32 nextRandom(epicsUInt32 *pState)
+{
+    epicsUInt32 x = *pState;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pState = x;
+    return x;
+}
+
+/** Writes a synthetic frame like those from the marccd server: uncompressed, with a background
+  * that falls off from the center, noise, and a few hundred spots.  32-bit frames are like those of
+  * the HDR readout mode, with spots brighter than 16 bits.
+  * \param[in] fileName The name of the file.
+  * \param[in] nx The number of pixels in a row.
+  * \param[in] ny The number of rows.
+  * \param[in] bitsPerSample 16 or 32, for unsigned pixels.
+  * \param[in] rowsPerStrip The number of rows in each strip, or 0 for the libtiff default of about 8 kB.
+  * \param[in] seed The seed for the noise and the spot positions.
+  * \return 0 on success, -1 on error. */
+int marCCDTiffWriteSynthetic(const char *fileName, int nx, int ny, int bitsPerSample, int rowsPerStrip, 
+                             unsigned int seed)
+{
+    TIFF *tiff;
+    epicsUInt32 *pData;
+    epicsUInt16 *pData16;
+    epicsUInt32 state = seed ? seed : 1;
+    epicsUInt32 maxSpot = (bitsPerSample == 32) ? 4000000 : 60000;
+    size_t pixelSize = bitsPerSample / 8;
+    size_t n;
+    double dx, dy, r2Max;
+    int i, j, k, x, y, value;
+    int numSpots = 300;
+    int status = 0;
+
+    if ((bitsPerSample != 16) && (bitsPerSample != 32)) return -1;
+    pData = (epicsUInt32 *)malloc((size_t)nx * ny * sizeof(epicsUInt32));
+    if (!pData) return -1;
+    r2Max = (double)nx*nx/4. + (double)ny*ny/4.;
+    for (j=0; j<ny; j++) {
+        for (i=0; i<nx; i++) {
+            dx = i - nx/2.;
+            dy = j - ny/2.;
+            value = (int)(100. + 400.*(1. - (dx*dx + dy*dy)/r2Max)) + (int)(nextRandom(&state) % 32);
+            pData[(size_t)j*nx + i] = value;
+        }
+    }
+    for (k=0; k<numSpots; k++) {
+        x = 2 + (int)(nextRandom(&state) % (nx - 4));
+        y = 2 + (int)(nextRandom(&state) % (ny - 4));
+        value = 1000 + (int)(nextRandom(&state) % maxSpot);
+        for (j=-2; j<=2; j++) {
+            for (i=-2; i<=2; i++) {
+                pData[(size_t)(y+j)*nx + x+i] = value / (1 + i*i + j*j);
+            }
+        }
+    }
+    if (bitsPerSample == 16) {
+        /* Pack the pixels to 16 bits in place */
+        pData16 = (epicsUInt16 *)pData;
+        for (n=0; n<(size_t)nx*ny; n++) pData16[n] = (epicsUInt16)pData[n];
+    }
+
+    tiff = TIFFOpen(fileName, "w");
+    if (!tiff) {
+        free(pData);
+        return -1;
+    }
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, (epicsUInt32)nx);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, (epicsUInt32)ny);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, bitsPerSample);
+    TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+    if (rowsPerStrip <= 0) rowsPerStrip = TIFFDefaultStripSize(tiff, 0);
+    if (rowsPerStrip > ny) rowsPerStrip = ny;
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, (epicsUInt32)rowsPerStrip);
+    for (j=0, k=0; j<ny; j+=rowsPerStrip, k++) {
+        if (TIFFWriteEncodedStrip(tiff, k, (char *)pData + (size_t)j*nx*pixelSize,
+                                  (tsize_t)(((j + rowsPerStrip > ny) ? ny - j : rowsPerStrip) *
+                                  (size_t)nx * pixelSize)) < 0) {
+            status = -1;
+            break;
+        }
+    }
+    TIFFClose(tiff);
+    free(pData);
+    return status;
+}
@@ -0,0 +1,38 @@
+/* marCCDTiff.h
+ *
+ * Decoding of the TIFF files written by the marccd server, shared by the driver and the
+ * marCCDTiffBench benchmark, and a writer of synthetic files with the same layout.
+ * Files can be read with O_DIRECT into memory and decoded from there, so they do not fill
+ * the page cache.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_TIFF_H
+#define MARCCD_TIFF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <tiffio.h>
+
+/** The alignment of the buffer, file offset and size for marCCDTiffReadDirect */
+#define MARCCD_TIFF_DIRECT_ALIGN 4096
+
+/** Function called after each strip is decoded.
+  * \param[in] pvt The pointer passed to marCCDTiffReadStrips.
+  * \param[in] totalSize The number of bytes decoded so far. */
+typedef void (*marCCDTiffStripFunc)(void *pvt, size_t totalSize);
+
+ssize_t marCCDTiffReadStrips(TIFF *tiff, void *pData, size_t dataSize,
+                             marCCDTiffStripFunc func, void *pvt);
+TIFF *marCCDTiffOpenMemory(const char *name, const void *pData, size_t size);
+ssize_t marCCDTiffReadDirect(const char *fileName, void *pBuffer, size_t bufferSize);
+size_t marCCDTiffCachedBytes(int fd, size_t fileSize);
+int marCCDTiffReadahead(const char *fileName);
+int marCCDTiffDropCache(const char *fileName);
+int marCCDTiffGetSize(const char *fileName, int *pNx, int *pNy);
+int marCCDTiffWriteSynthetic(const char *fileName, int nx, int ny, int bitsPerSample, int rowsPerStrip, 
+                             unsigned int seed);
+
+#endif
@@ -0,0 +1,431 @@
+/* marCCDTiffBench.cpp
+ *
+ * Benchmark of the TIFF readback path of the marCCD driver.  It writes synthetic 16 or 32-bit frames with
+ * the layout of the marccd server files to a local directory, and times reading them with the
+ * driver's libtiff decode and with alternative readers, with a cold and a warm page cache.
+ *
+ * Usage: marCCDTiffBench [-d directory] [-s sizes] [-n frames] [-p passes] [-r rowsPerStrip]
+ *                        [-t threads] [-b bits] [-k]
+ *   -d  Directory for the files, default "."
+ *   -s  Comma separated frame sizes, default 1024,2048,4096,8192
+ *   -n  Number of files of each size, default 8
+ *   -p  Number of times each file is read by each reader and cache state, default 3
+ *   -r  Rows per strip, default 0 for the libtiff default of about 8 kB per strip
+ *   -t  Number of threads for the parallel strip reader, default the number of CPUs
+ *   -b  Bits per pixel, 16 or 32 for frames like those of the HDR readout mode, default 16
+ *   -k  Keep the files when done
+ *
+ * The readers are:
+ *   libtiff   The driver path: open and fstat the file, then TIFFOpen and marCCDTiffReadStrips
+ *   pread     libtiff for the directory, then one pread per strip into the frame
+ *   mmap      libtiff for the directory, then copy the strips from a read-only mapping of the file
+ *   direct    libtiff for the directory, then O_DIRECT reads of the whole image into an aligned
+ *             buffer and a copy of the strips.  Not all file systems support O_DIRECT.
+ *   parallel  libtiff for the directory, then the strips are divided among threads that pread them
+ * For a cold cache the pages of each file are dropped with posix_fadvise(POSIX_FADV_DONTNEED) before
+ * it is read, which does not need root.  The frames read by each reader are compared with the libtiff
+ * frame.  For each size, reader and cache state it prints the throughput in GB/s and the percentiles
+ * of the time to read one frame.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tiffio.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+
+#include "marCCDTiff.h"
+#include "marCCDWorkers.h"
+
+#define MAX_SIZES 16
+#define DIRECT_ALIGN 4096
+
+typedef enum {
+    readerLibtiff,
+    readerPread,
+    readerMmap,
+    readerDirect,
+    readerParallel,
+    numReaders
+} benchReader_t;
+
+static const char *readerNames[numReaders] = {"libtiff", "pread", "mmap", "direct", "parallel"};
+
+/** The strips of a file, from its TIFF directory */
+typedef struct {
+    int numStrips;
+    int maxStrips;
+    toff_t *offsets;
+    toff_t *byteCounts;
+    size_t *destOffsets;    /**< Offset of each strip in the frame */
+    size_t imageSize;
+} benchLayout;
+
+/** Arguments of the parallel strip reader tasks */
+typedef struct {
+    int fd;
+    const benchLayout *pLayout;
+    char *pData;
+    int error;
+} benchParallel;
+
+static marCCDWorkers *pWorkers;
+static int numThreads;
+static char *pDirect;
+static size_t directSize;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.e9;
+}
+
+/** Reads the strip layout of a file with libtiff.  \return 0 on success, -1 on error. */
+static int readLayout(const char *fileName, benchLayout *pLayout)
+{
+    TIFF *tiff;
+    toff_t *offsets, *byteCounts;
+    int i, status = -1;
+
+    /* "m" disables libtiff's own mapping of the file, so only the directory is read */
+    tiff = TIFFOpen(fileName, "rm");
+    if (!tiff) return -1;
+    pLayout->numStrips = TIFFNumberOfStrips(tiff);
+    if (pLayout->numStrips > pLayout->maxStrips) {
+        free(pLayout->offsets);
+        free(pLayout->byteCounts);
+        free(pLayout->destOffsets);
+        pLayout->offsets = (toff_t *)malloc(pLayout->numStrips * sizeof(toff_t));
+        pLayout->byteCounts = (toff_t *)malloc(pLayout->numStrips * sizeof(toff_t));
+        pLayout->destOffsets = (size_t *)malloc(pLayout->numStrips * sizeof(size_t));
+        pLayout->maxStrips = pLayout->numStrips;
+    }
+    if (TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets) &&
+        TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &byteCounts)) {
+        pLayout->imageSize = 0;
+        for (i=0; i<pLayout->numStrips; i++) {
+            pLayout->offsets[i] = offsets[i];
+            pLayout->byteCounts[i] = byteCounts[i];
+            pLayout->destOffsets[i] = pLayout->imageSize;
+            pLayout->imageSize += byteCounts[i];
+        }
+        status = 0;
+    }
+    TIFFClose(tiff);
+    return status;
+}
+
+static int readLibtiff(const char *fileName, char *pData, size_t dataSize)
+{
+    TIFF *tiff;
+    struct stat statBuff;
+    ssize_t size;
+    int fd;
+
+    /* readTiff opens the file and checks its modification time before decoding it */
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    fstat(fd, &statBuff);
+    close(fd);
+    tiff = TIFFOpen(fileName, "rc");
+    if (!tiff) return -1;
+    size = marCCDTiffReadStrips(tiff, pData, dataSize, NULL, NULL);
+    TIFFClose(tiff);
+    return (size == (ssize_t)dataSize) ? 0 : -1;
+}
+
+static int readPread(const char *fileName, char *pData, size_t dataSize, benchLayout *pLayout)
+{
+    int fd, i;
+
+    if (readLayout(fileName, pLayout) || (pLayout->imageSize != dataSize)) return -1;
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    for (i=0; i<pLayout->numStrips; i++) {
+        if (pread(fd, pData + pLayout->destOffsets[i], pLayout->byteCounts[i], pLayout->offsets[i]) !=
+            (ssize_t)pLayout->byteCounts[i]) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int readMmap(const char *fileName, char *pData, size_t dataSize, benchLayout *pLayout)
+{
+    struct stat statBuff;
+    char *pMap;
+    int fd, i;
+
+    if (readLayout(fileName, pLayout) || (pLayout->imageSize != dataSize)) return -1;
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    fstat(fd, &statBuff);
+    pMap = (char *)mmap(NULL, statBuff.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pMap == MAP_FAILED) return -1;
+    madvise(pMap, statBuff.st_size, MADV_SEQUENTIAL);
+    for (i=0; i<pLayout->numStrips; i++) {
+        memcpy(pData + pLayout->destOffsets[i], pMap + pLayout->offsets[i], pLayout->byteCounts[i]);
+    }
+    munmap(pMap, statBuff.st_size);
+    return 0;
+}
+
+static int readDirect(const char *fileName, char *pData, size_t dataSize, benchLayout *pLayout)
+{
+    size_t first, last, size;
+    ssize_t nRead;
+    int fd, i;
+
+    if (readLayout(fileName, pLayout) || (pLayout->imageSize != dataSize)) return -1;
+    /* Read the aligned span from the first strip to the end of the last strip */
+    first = pLayout->offsets[0];
+    last = 0;
+    for (i=0; i<pLayout->numStrips; i++) {
+        if (pLayout->offsets[i] < first) first = pLayout->offsets[i];
+        if (pLayout->offsets[i] + pLayout->byteCounts[i] > last) last = pLayout->offsets[i] + pLayout->byteCounts[i];
+    }
+    first &= ~(size_t)(DIRECT_ALIGN - 1);
+    size = (last - first + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    if (size > directSize) {
+        free(pDirect);
+        pDirect = NULL;
+        directSize = 0;
+        if (posix_memalign((void **)&pDirect, DIRECT_ALIGN, size)) return -1;
+        directSize = size;
+    }
+    fd = open(fileName, O_RDONLY | O_DIRECT, 0);
+    if (fd < 0) return -1;
+    /* The read is short at the end of the file */
+    nRead = pread(fd, pDirect, size, first);
+    close(fd);
+    if ((nRead < 0) || ((size_t)nRead < last - first)) return -1;
+    for (i=0; i<pLayout->numStrips; i++) {
+        memcpy(pData + pLayout->destOffsets[i], pDirect + (pLayout->offsets[i] - first), pLayout->byteCounts[i]);
+    }
+    return 0;
+}
+
+static void parallelTaskC(void *pvt, int task, int numTasks)
+{
+    benchParallel *pParallel = (benchParallel *)pvt;
+    const benchLayout *pLayout = pParallel->pLayout;
+    int first = (pLayout->numStrips * task) / numTasks;
+    int last = (pLayout->numStrips * (task+1)) / numTasks;
+    int i;
+
+    for (i=first; i<last; i++) {
+        if (pread(pParallel->fd, pParallel->pData + pLayout->destOffsets[i], pLayout->byteCounts[i],
+                  pLayout->offsets[i]) != (ssize_t)pLayout->byteCounts[i]) pParallel->error = 1;
+    }
+}
+
+static int readParallel(const char *fileName, char *pData, size_t dataSize, benchLayout *pLayout)
+{
+    benchParallel parallel;
+
+    if (readLayout(fileName, pLayout) || (pLayout->imageSize != dataSize)) return -1;
+    parallel.fd = open(fileName, O_RDONLY, 0);
+    if (parallel.fd < 0) return -1;
+    parallel.pLayout = pLayout;
+    parallel.pData = pData;
+    parallel.error = 0;
+    pWorkers->run(parallelTaskC, &parallel, numThreads);
+    close(parallel.fd);
+    return parallel.error ? -1 : 0;
+}
+
+static int readFrame(int reader, const char *fileName, char *pData, size_t dataSize, benchLayout *pLayout)
+{
+    switch (reader) {
+        case readerLibtiff:  return readLibtiff(fileName, pData, dataSize);
+        case readerPread:    return readPread(fileName, pData, dataSize, pLayout);
+        case readerMmap:     return readMmap(fileName, pData, dataSize, pLayout);
+        case readerDirect:   return readDirect(fileName, pData, dataSize, pLayout);
+        case readerParallel: return readParallel(fileName, pData, dataSize, pLayout);
+    }
+    return -1;
+}
+
+/** Drops the pages of a file from the page cache */
+static void dropCache(const char *fileName)
+{
+    int fd = open(fileName, O_RDONLY, 0);
+
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static epicsUInt64 checksum(const char *pData, size_t dataSize)
+{
+    const epicsUInt64 *p = (const epicsUInt64 *)pData;
+    epicsUInt64 sum = 0;
+    size_t i;
+
+    for (i=0; i<dataSize/sizeof(epicsUInt64); i++) sum = sum*31 + p[i];
+    return sum;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+    int i = (int)(p/100. * (n - 1) + 0.5);
+
+    return sorted[i];
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-d directory] [-s sizes] [-n frames] [-p passes] [-r rowsPerStrip] "
+                    "[-t threads] [-b bits] [-k]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *directory = ".";
+    char sizeList[256] = "1024,2048,4096,8192";
+    int sizes[MAX_SIZES];
+    int numSizes = 0;
+    int numFrames = 8;
+    int numPasses = 3;
+    int rowsPerStrip = 0;
+    int bitsPerSample = 16;
+    int keep = 0;
+    int opt, s, i, reader, cold, pass, n, failed;
+    char *token, *pSave;
+    char fileName[1024];
+    char *pData;
+    size_t dataSize;
+    epicsUInt64 *sums;
+    double *latency;
+    double tStart, total;
+    benchLayout layout;
+
+    numThreads = epicsThreadGetCPUs();
+    while ((opt = getopt(argc, argv, "d:s:n:p:r:t:b:k")) != -1) {
+        switch (opt) {
+            case 'd': directory = optarg; break;
+            case 's': strncpy(sizeList, optarg, sizeof(sizeList)-1); break;
+            case 'n': numFrames = atoi(optarg); break;
+            case 'p': numPasses = atoi(optarg); break;
+            case 'r': rowsPerStrip = atoi(optarg); break;
+            case 't': numThreads = atoi(optarg); break;
+            case 'b': bitsPerSample = atoi(optarg); break;
+            case 'k': keep = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    for (token = strtok_r(sizeList, ",", &pSave); token && (numSizes < MAX_SIZES);
+         token = strtok_r(NULL, ",", &pSave)) {
+        sizes[numSizes++] = atoi(token);
+    }
+    if ((numSizes == 0) || (numFrames < 1) || (numPasses < 1) || (numThreads < 1) ||
+        ((bitsPerSample != 16) && (bitsPerSample != 32))) usage(argv[0]);
+    TIFFSetErrorHandler(NULL);
+    TIFFSetWarningHandler(NULL);
+    pWorkers = new marCCDWorkers("benchWorker", numThreads - 1, epicsThreadPriorityMedium);
+    memset(&layout, 0, sizeof(layout));
+    sums = (epicsUInt64 *)malloc(numFrames * sizeof(epicsUInt64));
+    latency = (double *)malloc(numFrames * numPasses * sizeof(double));
+
+    printf("%6s %-9s %-5s %8s %9s %9s %9s %9s\n",
+           "size", "reader", "cache", "GB/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (s=0; s<numSizes; s++) {
+        dataSize = (size_t)sizes[s] * sizes[s] * (bitsPerSample / 8);
+        pData = (char *)malloc(dataSize);
+        if (!pData) {
+            fprintf(stderr, "cannot allocate %lu bytes for size %d\n", (unsigned long)dataSize, sizes[s]);
+            return 1;
+        }
+        /* Write the files, flush them to disk so their pages can be dropped, and compute the reference
+         * checksums with the driver path */
+        for (i=0; i<numFrames; i++) {
+            epicsSnprintf(fileName, sizeof(fileName), "%s/marCCDTiffBench_%d_%d.tif", directory, sizes[s], i);
+            if (marCCDTiffWriteSynthetic(fileName, sizes[s], sizes[s], bitsPerSample, rowsPerStrip, i+1)) {
+                fprintf(stderr, "error writing %s\n", fileName);
+                return 1;
+            }
+            n = open(fileName, O_RDONLY, 0);
+            if (n >= 0) {
+                fsync(n);
+                close(n);
+            }
+            if (readLibtiff(fileName, pData, dataSize)) {
+                fprintf(stderr, "error reading %s\n", fileName);
+                return 1;
+            }
+            sums[i] = checksum(pData, dataSize);
+        }
+        for (reader=0; reader<numReaders; reader++) {
+            for (cold=1; cold>=0; cold--) {
+                n = 0;
+                failed = 0;
+                total = 0.;
+                for (pass=0; pass<numPasses; pass++) {
+                    for (i=0; i<numFrames; i++) {
+                        epicsSnprintf(fileName, sizeof(fileName), "%s/marCCDTiffBench_%d_%d.tif",
+                                      directory, sizes[s], i);
+                        if (cold) dropCache(fileName);
+                        memset(pData, 0, dataSize);
+                        tStart = now();
+                        if (readFrame(reader, fileName, pData, dataSize, &layout)) {
+                            failed = 1;
+                            break;
+                        }
+                        latency[n] = now() - tStart;
+                        total += latency[n++];
+                        if (checksum(pData, dataSize) != sums[i]) {
+                            printf("%6d %-9s %-5s frame %d does not match the libtiff frame\n",
+                                   sizes[s], readerNames[reader], cold ? "cold" : "warm", i);
+                        }
+                    }
+                    if (failed) break;
+                }
+                if (failed) {
+                    printf("%6d %-9s %-5s not supported: %s\n",
+                           sizes[s], readerNames[reader], cold ? "cold" : "warm", strerror(errno));
+                    continue;
+                }
+                qsort(latency, n, sizeof(double), compareDouble);
+                printf("%6d %-9s %-5s %8.2f %9.2f %9.2f %9.2f %9.2f\n",
+                       sizes[s], readerNames[reader], cold ? "cold" : "warm",
+                       (double)dataSize * n / total / 1.e9,
+                       percentile(latency, n, 50.)*1000., percentile(latency, n, 90.)*1000.,
+                       percentile(latency, n, 99.)*1000., latency[n-1]*1000.);
+                fflush(stdout);
+            }
+        }
+        if (!keep) {
+            for (i=0; i<numFrames; i++) {
+                epicsSnprintf(fileName, sizeof(fileName), "%s/marCCDTiffBench_%d_%d.tif", directory, sizes[s], i);
+                unlink(fileName);
+            }
+        }
+        free(pData);
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/* marCCDTimer.cpp
+ *
+ * Exposure timer that ends at an absolute deadline on the monotonic clock, on its own thread.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "marCCDTimer.h"
+#include "marCCDThreads.h"
+
+static const char *driverName = "marCCDTimer";
+
+/** The thread sleeps with clock_nanosleep for the last part of the interval, and waits on the
+  * event until then */
+#define MARCCD_TIMER_FINAL_SLEEP .02
+
+static void timerTaskC(void *drvPvt)
+{
+    marCCDTimer *pTimer = (marCCDTimer *)drvPvt;
+
+    marCCDThreadStarted();
+    pTimer->timerTask();
+}
+
+/** Constructor for the timer.
+  * \param[in] name The name of the thread.
+  * \param[in] priority The EPICS priority of the thread.
+  * \param[in] func The function called when the deadline is reached.
+  * \param[in] pvt Passed to func. */
+marCCDTimer::marCCDTimer(const char *name, unsigned int priority, marCCDTimerFunc func, void *pvt)
+    : func(func), pvt(pvt), deadline(0.), armed(0), lateness(0.), fired(0.), requestedPriority(-1), realTimePriority(0)
+{
+    static const char *functionName = "marCCDTimer";
+
+    this->mutex = epicsMutexMustCreate();
+    this->wakeEventId = epicsEventMustCreate(epicsEventEmpty);
+    this->threadId = epicsThreadCreate(name, priority, epicsThreadGetStackSize(epicsThreadStackSmall),
+                                       (EPICSTHREADFUNC)timerTaskC, this);
+    if (!this->threadId) {
+        printf("%s:%s epicsThreadCreate failure for %s\n", driverName, functionName, name);
+    }
+}
+
+/** Returns the monotonic time in seconds */
+double marCCDTimer::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.e9;
+}
+
+/** Starts the timer, replacing any deadline that has not been reached.
+  * \param[in] delay The time from now until func is called, in seconds. */
+void marCCDTimer::start(double delay)
+{
+    startAt(now() + delay);
+}
+
+/** Starts the timer with an absolute deadline, replacing any deadline that has not been reached.
+  * A deadline that has already passed fires at once.
+  * \param[in] deadline The monotonic time, as returned by now(), at which func is called. */
+void marCCDTimer::startAt(double deadline)
+{
+    epicsMutexLock(this->mutex);
+    this->deadline = deadline;
+    this->armed = 1;
+    epicsMutexUnlock(this->mutex);
+    epicsEventSignal(this->wakeEventId);
+}
+
+/** Cancels the timer if it has not fired */
+void marCCDTimer::cancel()
+{
+    epicsMutexLock(this->mutex);
+    this->armed = 0;
+    epicsMutexUnlock(this->mutex);
+    epicsEventSignal(this->wakeEventId);
+}
+
+/** Runs the timer thread with the SCHED_FIFO real-time scheduler.  This needs the CAP_SYS_NICE
+  * capability or an rtprio limit; getRealTime() returns 0 if it could not be set.
+  * \param[in] priority The SCHED_FIFO priority, or 0 to return to the normal scheduler. */
+void marCCDTimer::setRealTime(int priority)
+{
+    epicsMutexLock(this->mutex);
+    this->requestedPriority = (priority > 0) ? priority : 0;
+    epicsMutexUnlock(this->mutex);
+    epicsEventSignal(this->wakeEventId);
+}
+
+int marCCDTimer::getRealTime()
+{
+    return this->realTimePriority;
+}
+
+/** Returns how late the last deadline was reached, in seconds */
+double marCCDTimer::getLateness()
+{
+    double lateness;
+
+    epicsMutexLock(this->mutex);
+    lateness = this->lateness;
+    epicsMutexUnlock(this->mutex);
+    return lateness;
+}
+
+/** Returns the monotonic time in seconds at which the last deadline was reached, before the
+  * function was called */
+double marCCDTimer::getFired()
+{
+    double fired;
+
+    epicsMutexLock(this->mutex);
+    fired = this->fired;
+    epicsMutexUnlock(this->mutex);
+    return fired;
+}
+
+epicsThreadId marCCDTimer::getThreadId()
+{
+    return this->threadId;
+}
+
+void marCCDTimer::timerTask()
+{
+    struct sched_param param;
+    double target, remaining, fired;
+    int priority;
+    static const char *functionName = "timerTask";
+
+    epicsMutexLock(this->mutex);
+    while (1) {
+        if (this->requestedPriority >= 0) {
+            /* Change the scheduler from the thread itself, so we do not need its pthread_t */
+            priority = this->requestedPriority;
+            this->requestedPriority = -1;
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = priority;
+            errno = pthread_setschedparam(pthread_self(), priority ? SCHED_FIFO : SCHED_OTHER, &param);
+            if (errno) {
+                printf("%s:%s: cannot set SCHED_FIFO priority %d, errno=%d\n",
+                    driverName, functionName, priority, errno);
+                this->realTimePriority = 0;
+            } else {
+                this->realTimePriority = priority;
+            }
+        }
+        if (!this->armed) {
+            epicsMutexUnlock(this->mutex);
+            epicsEventWait(this->wakeEventId);
+            epicsMutexLock(this->mutex);
+            continue;
+        }
+        target = this->deadline;
+        remaining = target - now();
+        if (remaining > MARCCD_TIMER_FINAL_SLEEP) {
+            epicsMutexUnlock(this->mutex);
+            epicsEventWaitWithTimeout(this->wakeEventId, remaining - MARCCD_TIMER_FINAL_SLEEP/2.);
+            epicsMutexLock(this->mutex);
+            continue;
+        }
+        epicsMutexUnlock(this->mutex);
+        if (remaining > 0.) {
+#ifdef TIMER_ABSTIME
+            struct timespec ts;
+            ts.tv_sec = (time_t)target;
+            ts.tv_nsec = (long)((target - ts.tv_sec) * 1.e9);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+            epicsThreadSleep(remaining);
+#endif
+        }
+        fired = now();
+        epicsMutexLock(this->mutex);
+        /* The timer may have been cancelled or restarted while we slept */
+        if (!this->armed || (this->deadline != target)) continue;
+        this->armed = 0;
+        this->lateness = fired - target;
+        this->fired = fired;
+        epicsMutexUnlock(this->mutex);
+        this->func(this->pvt);
+        epicsMutexLock(this->mutex);
+    }
+}
@@ -0,0 +1,53 @@
+/* marCCDTimer.h
+ *
+ * Exposure timer that ends at an absolute deadline on the monotonic clock, on its own thread.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_TIMER_H
+#define MARCCD_TIMER_H
+
+#include <time.h>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+/** Function called by the timer thread when the deadline is reached */
+typedef void (*marCCDTimerFunc)(void *pvt);
+
+/** A one-shot timer.  The thread waits on an event until shortly before the deadline, so that
+  * start() and cancel() take effect at once, and then sleeps until the deadline itself with
+  * clock_nanosleep(TIMER_ABSTIME), so the wakeup does not depend on the scheduler tick or on
+  * when the timer thread last ran. */
+class marCCDTimer {
+public:
+    marCCDTimer(const char *name, unsigned int priority, marCCDTimerFunc func, void *pvt);
+    void start(double delay);
+    void startAt(double deadline);
+    void cancel();
+    void setRealTime(int priority);
+    int getRealTime();
+    double getLateness();
+    double getFired();
+    epicsThreadId getThreadId();
+    static double now();
+    void timerTask();           /**< Should be private, but is called from C */
+
+private:
+    marCCDTimerFunc func;
+    void *pvt;
+    epicsMutexId mutex;
+    epicsEventId wakeEventId;
+    epicsThreadId threadId;
+    double deadline;            /**< Monotonic time in seconds */
+    int armed;
+    double lateness;            /**< How late the last deadline was reached, in seconds */
+    double fired;               /**< Monotonic time the last deadline was reached, before func was called */
+    int requestedPriority;      /**< SCHED_FIFO priority to apply, 0 for the normal scheduler, -1 if applied */
+    int realTimePriority;       /**< SCHED_FIFO priority in effect, 0 if none */
+};
+
+#endif
@@ -0,0 +1,251 @@
+/* marCCDTrace.cpp
+ *
+ * Records timestamped spans of driver activity in an in-memory buffer, which can be dumped
+ * in Chrome trace (JSON) format for viewing with chrome://tracing or Perfetto.
+ *
+ * Recording is lock-free: each span claims a slot in a fixed-size buffer with an atomic increment.
+ * When the buffer is full further spans are counted but not recorded.  Recorders are counted while
+ * they use the buffer, and the buffer is only freed or read when none are.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+ 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsAtomic.h>
+#include <epicsString.h>
+#include <iocsh.h>
+#include <epicsExport.h>
+
+#include "marCCDTrace.h"
+
+typedef struct {
+    int valid;
+    const char *name;
+    char threadName[MARCCD_TRACE_THREAD_NAME_LEN];
+    size_t threadId;
+    epicsUInt64 start;
+    epicsUInt64 end;
+    char detail[MARCCD_TRACE_DETAIL_LEN];
+} marCCDTraceEvent;
+
+int marCCDTraceEnabled = 0;
+static marCCDTraceEvent *traceEvents = NULL;
+static int traceMaxEvents = 0;
+static int traceNumEvents = 0;
+static epicsUInt64 traceStartTime = 0;
+static int traceRecorders = 0;          /**< Number of threads in marCCDTraceRecord */
+static epicsMutexId traceMutex = NULL;  /**< Serializes marCCDTraceEnable and marCCDTraceDump */
+static epicsThreadOnceId traceOnceId = EPICS_THREAD_ONCE_INIT;
+
+static void traceInit(void *arg)
+{
+    traceMutex = epicsMutexMustCreate();
+}
+
+/** Stops recording and waits until no thread is using the buffer.
+  * \return Whether tracing was enabled. */
+static int tracePause()
+{
+    int enabled = epicsAtomicCmpAndSwapIntT(&marCCDTraceEnabled, 1, 0);
+
+    while (epicsAtomicGetIntT(&traceRecorders) > 0) epicsThreadSleep(0.001);
+    return enabled;
+}
+
+/** Enables tracing with a buffer of maxEvents spans, discarding any spans already recorded.
+  * maxEvents=0 disables tracing.  This can be called while the driver threads are recording. */
+void marCCDTraceEnable(int maxEvents)
+{
+    epicsThreadOnce(&traceOnceId, traceInit, NULL);
+    epicsMutexLock(traceMutex);
+    tracePause();
+    free(traceEvents);
+    traceEvents = NULL;
+    traceMaxEvents = 0;
+    epicsAtomicSetIntT(&traceNumEvents, 0);
+    if (maxEvents > 0) {
+        traceEvents = (marCCDTraceEvent *)calloc(maxEvents, sizeof(marCCDTraceEvent));
+        if (traceEvents) {
+            traceMaxEvents = maxEvents;
+            traceStartTime = epicsMonotonicGet();
+            epicsAtomicSetIntT(&marCCDTraceEnabled, 1);
+        } else {
+            printf("marCCDTraceEnable: cannot allocate %d events\n", maxEvents);
+        }
+    }
+    epicsMutexUnlock(traceMutex);
+}
+
+/** Records a span.  start and end are times from epicsMonotonicGet() */
+void marCCDTraceRecord(const char *name, const char *detail, epicsUInt64 start, epicsUInt64 end)
+{
+    marCCDTraceEvent *pEvent;
+    int index;
+    
+    if (!marCCDTraceEnabled) return;
+    /* The buffer is not freed while traceRecorders is non-zero, so check again after counting this thread */
+    epicsAtomicIncrIntT(&traceRecorders);
+    if (!epicsAtomicGetIntT(&marCCDTraceEnabled)) {
+        epicsAtomicDecrIntT(&traceRecorders);
+        return;
+    }
+    index = epicsAtomicIncrIntT(&traceNumEvents) - 1;
+    if (index >= traceMaxEvents) {
+        epicsAtomicDecrIntT(&traceRecorders);
+        return;
+    }
+    pEvent = &traceEvents[index];
+    pEvent->name = name;
+    /* The name is copied, since the thread may have exited when the spans are dumped */
+    strncpy(pEvent->threadName, epicsThreadGetNameSelf(), sizeof(pEvent->threadName)-1);
+    pEvent->threadName[sizeof(pEvent->threadName)-1] = 0;
+    pEvent->threadId = (size_t)epicsThreadGetIdSelf();
+    pEvent->start = start;
+    pEvent->end = end;
+    pEvent->detail[0] = 0;
+    if (detail) {
+        strncpy(pEvent->detail, detail, sizeof(pEvent->detail)-1);
+        pEvent->detail[sizeof(pEvent->detail)-1] = 0;
+    }
+    epicsAtomicSetIntT(&pEvent->valid, 1);
+    epicsAtomicDecrIntT(&traceRecorders);
+}
+
+marCCDTraceSpan::marCCDTraceSpan(const char *name, const char *detail)
+    : name(name), detail(detail), start(0)
+{
+    if (marCCDTraceEnabled) start = epicsMonotonicGet();
+}
+
+marCCDTraceSpan::~marCCDTraceSpan()
+{
+    if (marCCDTraceEnabled && start) marCCDTraceRecord(name, detail, start, epicsMonotonicGet());
+}
+
+/** Sets the detail string of the span.  The string is copied when the span ends, so it must remain 
+  * valid until then. */
+void marCCDTraceSpan::setDetail(const char *detail)
+{
+    this->detail = detail;
+}
+
+/** Writes a string as a JSON string literal */
+static void writeJSONString(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; str && *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if ((c == '"') || (c == '\\')) fprintf(fp, "\\%c", c);
+        else if (c < 0x20) fprintf(fp, "\\u%4.4x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/** Writes the recorded spans to a file in Chrome trace JSON format.  Tracing is paused while the
+  * file is written.
+  * \param[in] fileName The name of the file. */
+int marCCDTraceDump(const char *fileName)
+{
+    FILE *fp;
+    int numEvents, i, j;
+    int enabled;
+    int first = 1;
+    marCCDTraceEvent *pEvent;
+    
+    if (!fileName || (strlen(fileName) == 0)) {
+        printf("marCCDTraceDump: no file name specified\n");
+        return -1;
+    }
+    epicsThreadOnce(&traceOnceId, traceInit, NULL);
+    epicsMutexLock(traceMutex);
+    if (!traceEvents) {
+        printf("marCCDTraceDump: tracing has not been enabled with marCCDTraceEnable\n");
+        epicsMutexUnlock(traceMutex);
+        return -1;
+    }
+    fp = fopen(fileName, "w");
+    if (!fp) {
+        printf("marCCDTraceDump: cannot open file %s\n", fileName);
+        epicsMutexUnlock(traceMutex);
+        return -1;
+    }
+    enabled = tracePause();
+    numEvents = epicsAtomicGetIntT(&traceNumEvents);
+    if (numEvents > traceMaxEvents) {
+        printf("marCCDTraceDump: buffer full, %d spans were not recorded\n", numEvents - traceMaxEvents);
+        numEvents = traceMaxEvents;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    /* Thread name metadata, once for each thread */
+    for (i=0; i<numEvents; i++) {
+        pEvent = &traceEvents[i];
+        if (!epicsAtomicGetIntT(&pEvent->valid)) continue;
+        for (j=0; j<i; j++) {
+            if (traceEvents[j].valid && (traceEvents[j].threadId == pEvent->threadId)) break;
+        }
+        if (j < i) continue;
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":",
+                first ? "" : ",\n", (unsigned long)pEvent->threadId);
+        writeJSONString(fp, pEvent->threadName);
+        fprintf(fp, "}}");
+        first = 0;
+    }
+    for (i=0; i<numEvents; i++) {
+        pEvent = &traceEvents[i];
+        if (!epicsAtomicGetIntT(&pEvent->valid)) continue;
+        fprintf(fp, "%s{\"name\":", first ? "" : ",\n");
+        writeJSONString(fp, pEvent->name);
+        fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f",
+                (unsigned long)pEvent->threadId,
+                (pEvent->start - traceStartTime) / 1000.,
+                (pEvent->end - pEvent->start) / 1000.);
+        if (pEvent->detail[0]) {
+            fprintf(fp, ",\"args\":{\"detail\":");
+            writeJSONString(fp, pEvent->detail);
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "}");
+        first = 0;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("marCCDTraceDump: wrote %d spans to %s\n", numEvents, fileName);
+    if (enabled) epicsAtomicSetIntT(&marCCDTraceEnabled, 1);
+    epicsMutexUnlock(traceMutex);
+    return 0;
+}
+
+/* Code for iocsh registration */
+static const iocshArg marCCDTraceEnableArg0 = {"maxEvents", iocshArgInt};
+static const iocshArg * const marCCDTraceEnableArgs[] = {&marCCDTraceEnableArg0};
+static const iocshFuncDef marCCDTraceEnableFuncDef = {"marCCDTraceEnable", 1, marCCDTraceEnableArgs};
+static void marCCDTraceEnableCallFunc(const iocshArgBuf *args)
+{
+    marCCDTraceEnable(args[0].ival);
+}
+
+static const iocshArg marCCDTraceDumpArg0 = {"fileName", iocshArgString};
+static const iocshArg * const marCCDTraceDumpArgs[] = {&marCCDTraceDumpArg0};
+static const iocshFuncDef marCCDTraceDumpFuncDef = {"marCCDTraceDump", 1, marCCDTraceDumpArgs};
+static void marCCDTraceDumpCallFunc(const iocshArgBuf *args)
+{
+    marCCDTraceDump(args[0].sval);
+}
+
+static void marCCDTraceRegister(void)
+{
+    iocshRegister(&marCCDTraceEnableFuncDef, marCCDTraceEnableCallFunc);
+    iocshRegister(&marCCDTraceDumpFuncDef, marCCDTraceDumpCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(marCCDTraceRegister);
+}
@@ -0,0 +1,39 @@
+/* marCCDTrace.h
+ *
+ * Records timestamped spans of driver activity in an in-memory buffer, which can be dumped
+ * in Chrome trace (JSON) format for viewing with chrome://tracing or Perfetto.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_TRACE_H
+#define MARCCD_TRACE_H
+
+#include <epicsTypes.h>
+
+/** Maximum length of the detail string stored with each span */
+#define MARCCD_TRACE_DETAIL_LEN 64
+/** Maximum length of the thread name stored with each span */
+#define MARCCD_TRACE_THREAD_NAME_LEN 32
+
+extern int marCCDTraceEnabled;
+
+void marCCDTraceEnable(int maxEvents);
+int marCCDTraceDump(const char *fileName);
+void marCCDTraceRecord(const char *name, const char *detail, epicsUInt64 start, epicsUInt64 end);
+
+/** Records a span from construction to destruction, if tracing is enabled.
+  * The name must be a string constant; the detail string is copied. */
+class marCCDTraceSpan {
+public:
+    marCCDTraceSpan(const char *name, const char *detail=0);
+    ~marCCDTraceSpan();
+    void setDetail(const char *detail);
+private:
+    const char *name;
+    const char *detail;
+    epicsUInt64 start;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/* marCCDWorkers.cpp
+ *
+ * A pool of worker threads used to process each frame in parallel.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+ 
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+#include <epicsStdio.h>
+
+#include "marCCDWorkers.h"
+#include "marCCDThreads.h"
+
+static const char *driverName = "marCCDWorkers";
+
+static void workerTaskC(void *drvPvt)
+{
+    marCCDWorker *pWorker = (marCCDWorker *)drvPvt;
+    
+    marCCDThreadStarted();
+    pWorker->pWorkers->workerTask(pWorker);
+}
+
+/** Constructor for the worker pool.
+  * \param[in] name Base name of the threads; the threads are called name_0, name_1, etc.
+  * \param[in] numThreads Number of threads to create.  With numThreads=0 all tasks run in the thread
+  *            that calls run().
+  * \param[in] priority Priority of the threads.
+  */
+marCCDWorkers::marCCDWorkers(const char *name, int numThreads, unsigned int priority)
+    : numThreads(0), workers(NULL), func(NULL), pvt(NULL), numTasks(0), nextTask(0), activeWorkers(0)
+{
+    char threadName[64];
+    int i;
+    static const char *functionName = "marCCDWorkers";
+
+    this->runMutex = epicsMutexMustCreate();
+    this->doneEventId = epicsEventMustCreate(epicsEventEmpty);
+    if (numThreads <= 0) return;
+    this->workers = (marCCDWorker *)calloc(numThreads, sizeof(marCCDWorker));
+    for (i=0; i<numThreads; i++) {
+        this->workers[i].pWorkers = this;
+        this->workers[i].startEventId = epicsEventMustCreate(epicsEventEmpty);
+        epicsSnprintf(threadName, sizeof(threadName), "%s_%d", name, i);
+        if (epicsThreadCreate(threadName, priority,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)workerTaskC, &this->workers[i]) == NULL) {
+            printf("%s:%s epicsThreadCreate failure for %s\n", 
+                driverName, functionName, threadName);
+            break;
+        }
+        this->numThreads++;
+    }
+}
+
+int marCCDWorkers::getNumThreads()
+{
+    return this->numThreads;
+}
+
+/** Executes tasks until there are none left */
+void marCCDWorkers::doTasks()
+{
+    int task;
+    
+    while ((task = epicsAtomicIncrIntT(&this->nextTask) - 1) < this->numTasks) {
+        this->func(this->pvt, task, this->numTasks);
+    }
+}
+
+void marCCDWorkers::workerTask(marCCDWorker *pWorker)
+{
+    while (1) {
+        epicsEventWait(pWorker->startEventId);
+        doTasks();
+        if (epicsAtomicDecrIntT(&this->activeWorkers) == 0) epicsEventSignal(this->doneEventId);
+    }
+}
+
+/** Calls func(pvt, task, numTasks) for task=0 to numTasks-1, using the worker threads and the 
+  * calling thread, and returns when all of the calls have completed. */
+void marCCDWorkers::run(marCCDWorkFunc func, void *pvt, int numTasks)
+{
+    int numWake, i;
+    
+    if (numTasks <= 0) return;
+    epicsMutexLock(this->runMutex);
+    this->func = func;
+    this->pvt = pvt;
+    this->numTasks = numTasks;
+    epicsAtomicSetIntT(&this->nextTask, 0);
+    numWake = numTasks - 1;
+    if (numWake > this->numThreads) numWake = this->numThreads;
+    epicsAtomicSetIntT(&this->activeWorkers, numWake);
+    for (i=0; i<numWake; i++) epicsEventSignal(this->workers[i].startEventId);
+    doTasks();
+    if (numWake > 0) epicsEventWait(this->doneEventId);
+    epicsMutexUnlock(this->runMutex);
+}
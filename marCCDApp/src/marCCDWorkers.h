@@ -0,0 +1,48 @@
+/* marCCDWorkers.h
+ *
+ * A pool of worker threads used to process each frame in parallel.
+ *
+ * Created:  Oct. 18, 2026
+ *
+ */
+
+#ifndef MARCCD_WORKERS_H
+#define MARCCD_WORKERS_H
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+
+/** Function executed by the workers.  It is called once for each task index from 0 to numTasks-1. */
+typedef void (*marCCDWorkFunc)(void *pvt, int task, int numTasks);
+
+class marCCDWorkers;
+
+typedef struct {
+    marCCDWorkers *pWorkers;
+    epicsEventId startEventId;
+} marCCDWorker;
+
+/** Runs a function for a number of tasks in parallel on a fixed pool of threads.
+  * The thread calling run() also executes tasks, and run() returns when all tasks are complete.
+  * Calls to run() from different threads are serialized. */
+class marCCDWorkers {
+public:
+    marCCDWorkers(const char *name, int numThreads, unsigned int priority);
+    void run(marCCDWorkFunc func, void *pvt, int numTasks);
+    int getNumThreads();
+    void workerTask(marCCDWorker *pWorker); /**< Should be private, but is called from C */
+
+private:
+    void doTasks();
+    int numThreads;
+    marCCDWorker *workers;
+    epicsMutexId runMutex;
+    epicsEventId doneEventId;
+    marCCDWorkFunc func;
+    void *pvt;
+    int numTasks;
+    int nextTask;
+    int activeWorkers;
+};
+
+#endif